@@ -16,4 +16,15 @@ for device in devices:
 device=devices[0]
 
 # change servo 0 position
-device.setTarget(0, 5000)
\ No newline at end of file
+device.setTarget(0, 5000)
+# the same from a coroutine, without blocking the event loop
+import asyncio
+
+async def sweep(device):
+    for target in (4000, 8000, 6000):
+        await device.setTargetAsync(0, target)
+        await asyncio.sleep(0.5)
+    status = await device.getServoStatusAsync()
+    print(f"servo 0 position: {status[0].position}")
+
+asyncio.run(sweep(device))
@@ -1,17 +1,209 @@
 #include <maestro/Device.h>
 #include <maestro/Program.h>
+#include <pybind11/numpy.h>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
 namespace py = pybind11;
 
 using namespace Maestro;
 
+/// Threads running the USB transfers of the asynchronous methods.  The calls
+/// on a device always run on the same thread, in order, while different
+/// devices are spread over the threads.
+class IoThreads {
+   public:
+    static IoThreads& instance() {
+        // Never destroyed: the threads may still be waiting when the interpreter exits.
+        static IoThreads* threads = new IoThreads(std::max(2u, std::thread::hardware_concurrency()));
+        return *threads;
+    }
+
+    void post(const void* key, std::function<void()> task) {
+        Worker& worker = *m_workers[(reinterpret_cast<uintptr_t>(key) >> 4) % m_workers.size()];
+        {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            worker.tasks.push_back(std::move(task));
+        }
+        worker.ready.notify_one();
+    }
+
+   private:
+    struct Worker {
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    explicit IoThreads(unsigned count) {
+        for (unsigned i = 0; i < count; i++) {
+            m_workers.emplace_back(new Worker());
+            Worker* worker = m_workers.back().get();
+            std::thread([worker]() {
+                while (true) {
+                    std::unique_lock<std::mutex> lock(worker->mutex);
+                    worker->ready.wait(lock, [worker]() { return !worker->tasks.empty(); });
+                    std::function<void()> task = std::move(worker->tasks.front());
+                    worker->tasks.pop_front();
+                    lock.unlock();
+                    task();
+                }
+            }).detach();
+        }
+    }
+
+    std::vector<std::unique_ptr<Worker>> m_workers;
+};
+
+/// The lock of each opened device, taken by every call doing USB transfers,
+/// blocking or asynchronous, so that the calls on a device and its copies
+/// never interleave.  Found by Device::getIdentity().
+std::mutex& getDeviceLock(const Device& device) {
+    static std::mutex* registryMutex = new std::mutex();
+    // Never destroyed, like the I/O threads.  A lock per device ever opened:
+    // an identity reused by a later device just shares its lock.
+    static auto* locks = new std::unordered_map<const void*, std::unique_ptr<std::mutex>>();
+    std::lock_guard<std::mutex> lock(*registryMutex);
+    std::unique_ptr<std::mutex>& deviceLock = (*locks)[device.getIdentity()];
+    if (!deviceLock) {
+        deviceLock.reset(new std::mutex());
+    }
+    return *deviceLock;
+}
+
+/// Wraps a blocking method: the GIL is released, then the lock of the device
+/// taken, while it runs.
+template <typename Result, typename... Args>
+std::function<Result(Device&, Args...)> blocking(Result (Device::*method)(Args...)) {
+    return [method](Device& device, Args... args) -> Result {
+        py::gil_scoped_release release;
+        std::lock_guard<std::mutex> lock(getDeviceLock(device));
+        return (device.*method)(args...);
+    };
+}
+
+/// Runs a call and keeps its result until it can be converted to Python,
+/// with the GIL held.
+template <typename Result>
+struct AsyncCall {
+    static std::function<py::object()> run(const std::function<Result(Device&)>& call, Device& device) {
+        const Result result = call(device);
+        return [result]() { return py::cast(result); };
+    }
+};
+
+template <>
+struct AsyncCall<void> {
+    static std::function<py::object()> run(const std::function<void(Device&)>& call, Device& device) {
+        call(device);
+        return []() { return py::object(py::none()); };
+    }
+};
+
+// Called on the event loop, where the future may have been cancelled in the meantime.
+void setFutureResult(py::object future, py::object value) {
+    if (!future.attr("done")().cast<bool>()) {
+        future.attr("set_result")(value);
+    }
+}
+
+void setFutureException(py::object future, py::str message) {
+    if (!future.attr("done")().cast<bool>()) {
+        future.attr("set_exception")(py::reinterpret_borrow<py::object>(PyExc_RuntimeError)(message));
+    }
+}
+
+/// Starts \a call on the I/O thread of the opened device, shared by the copies
+/// of \a device, and returns an asyncio
+/// future, completed on the running event loop with the result of the call.
+template <typename Result>
+py::object callAsync(Device& device, std::function<Result(Device&)> call) {
+    py::object loop = py::module::import("asyncio").attr("get_running_loop")();
+    py::object future = loop.attr("create_future")();
+
+    // Python objects may only be copied and released with the GIL held, so
+    // they go to the I/O thread in heap allocations owned by the task.
+    py::object* loopReference = new py::object(loop);
+    py::object* futureReference = new py::object(future);
+    const Device deviceCopy = device;
+    IoThreads::instance().post(device.getIdentity(), [deviceCopy, call, loopReference, futureReference]() {
+        Device target = deviceCopy;
+        std::function<py::object()> value;
+        std::string error;
+        try {
+            std::lock_guard<std::mutex> lock(getDeviceLock(target));
+            value = AsyncCall<Result>::run(call, target);
+        } catch (const std::string& message) {
+            error = message;
+        } catch (const char* message) {
+            error = message;
+        } catch (const std::exception& exception) {
+            error = exception.what();
+        }
+        if (!Py_IsInitialized()) {
+            return;
+        }
+        py::gil_scoped_acquire gil;
+        std::unique_ptr<py::object> loopOwner(loopReference);
+        std::unique_ptr<py::object> futureOwner(futureReference);
+        py::object argument;
+        if (error.empty()) {
+            try {
+                argument = value();
+            } catch (const py::cast_error& exception) {
+                error = exception.what();
+            }
+        }
+        try {
+            if (error.empty()) {
+                loopOwner->attr("call_soon_threadsafe")(py::cpp_function(&setFutureResult), *futureOwner, argument);
+            } else {
+                loopOwner->attr("call_soon_threadsafe")(py::cpp_function(&setFutureException), *futureOwner, py::str(error));
+            }
+        } catch (const py::error_already_set&) {
+            // The event loop was closed before the call completed.
+        }
+    });
+    return future;
+}
+
 // clang-format off
 PYBIND11_MODULE(maestro, m)
 {
     m.attr("__version__") = "0.1.0";
-    m.def("getConnectedDevices", &Device::getConnectedDevices);
+
+    // Packed like the transfer buffer, so that a status array is read in place.
+    PYBIND11_NUMPY_DTYPE(Device::ServoStatus, position, target, speed, acceleration);
+
+    // The library reports errors by throwing strings.
+    py::register_exception_translator([](std::exception_ptr exception) {
+        try {
+            if (exception) {
+                std::rethrow_exception(exception);
+            }
+        } catch (const std::string& message) {
+            PyErr_SetString(PyExc_RuntimeError, message.c_str());
+        } catch (const char* message) {
+            PyErr_SetString(PyExc_RuntimeError, message);
+        }
+    });
+
+    // Every method doing USB transfers releases the GIL while they run, and
+    // the methods of a device also take its lock (see blocking()).
+    using release_gil = py::call_guard<py::gil_scoped_release>;
+
+    m.def("getConnectedDevices", &Device::getConnectedDevices, release_gil());
 
     py::class_<Device> device(m, "Device");
 
@@ -73,31 +265,138 @@ PYBIND11_MODULE(maestro, m)
 
     device.def("getName", &Device::getName)
           .def("getNumChannels", &Device::getNumChannels)
-          .def("setTarget", &Device::setTarget, py::arg("channelNumber"), py::arg("target"))
-          .def("setSpeed", &Device::setSpeed, py::arg("channelNumber"), py::arg("target"))
-          .def("setAcceleration", &Device::setAcceleration, py::arg("channelNumber"), py::arg("target"))
-          .def("getServoStatus", &Device::getServoStatus)
-          .def("restoreDefaultConfiguration", &Device::restoreDefaultConfiguration)
-          .def("getDeviceSettings", &Device::getDeviceSettings)
-          .def("setDeviceSettings", &Device::setDeviceSettings, py::arg("settings"))
-          .def("getChannelSettings", &Device::getChannelSettings)
-          .def("setChannelSettings", &Device::setChannelSettings, py::arg("channelNumber"), py::arg("settings"))
-          .def("eraseScript", &Device::eraseScript)
-          .def("restartScriptAtSubroutine", &Device::restartScriptAtSubroutine, py::arg("subroutineNumber"))
-          .def("restartScriptAtSubroutineWithParameter", &Device::restartScriptAtSubroutineWithParameter, py::arg("subroutineNumber"), py::arg("parameter"))
-          .def("restartScript", &Device::restartScript)
-          .def("setScriptDone", &Device::setScriptDone, py::arg("value"))
-          .def("startBootloader", &Device::startBootloader)
-          .def("reinitialize", &Device::reinitialize)
-          .def("clearErrors", &Device::clearErrors)
-          .def("writeScript", &Device::writeScript, py::arg("bytecode"))
-          .def("setPWM", &Device::setPWM, py::arg("dutyCycle"), py::arg("period"))
-          .def("disablePWM", &Device::disablePWM)
+          .def("setTarget", blocking(&Device::setTarget), py::arg("channelNumber"), py::arg("target"))
+          .def("setSpeed", blocking(&Device::setSpeed), py::arg("channelNumber"), py::arg("target"))
+          .def("setAcceleration", blocking(&Device::setAcceleration), py::arg("channelNumber"), py::arg("target"))
+          .def("getServoStatus", blocking(static_cast<std::vector<Device::ServoStatus> (Device::*)()>(&Device::getServoStatus)))
+          // A structured array with the fields of ServoStatus, e.g.
+          // status["position"] is a uint16 view of the positions.  Passing
+          // the array of a previous call reuses it instead of allocating one.
+          .def("getServoStatusArray", [](Device &d, py::object out) {
+                  py::array_t<Device::ServoStatus> status;
+                  if (out.is_none()) {
+                      status = py::array_t<Device::ServoStatus>(d.getNumChannels());
+                  } else {
+                      if (py::isinstance<py::array_t<Device::ServoStatus>>(out)) {
+                          status = py::reinterpret_borrow<py::array_t<Device::ServoStatus>>(out);
+                      }
+                      if (status.size() != d.getNumChannels() || !(status.flags() & py::array::c_style) || !status.writeable()) {
+                          throw py::value_error("out must be a writable contiguous array of " + std::to_string(d.getNumChannels()) +
+                                                " servo statuses");
+                      }
+                  }
+                  Device::ServoStatus *data = status.mutable_data();
+                  {
+                      py::gil_scoped_release release;
+                      std::lock_guard<std::mutex> lock(getDeviceLock(d));
+                      d.getServoStatus(data);
+                  }
+                  return status;
+              }, py::arg("out") = py::none())
+          .def("setTargets", [](Device &d, py::array_t<uint16_t, py::array::c_style | py::array::forcecast> targets, uint8_t firstChannel) {
+                  if (targets.ndim() != 1) {
+                      throw py::value_error("targets must be a one-dimensional array");
+                  }
+                  const uint16_t *data = targets.data();
+                  const size_t count = size_t(targets.size());
+                  py::gil_scoped_release release;
+                  std::lock_guard<std::mutex> lock(getDeviceLock(d));
+                  d.setTargets(firstChannel, data, count);
+              }, py::arg("targets"), py::arg("firstChannel") = 0)
+          .def("restoreDefaultConfiguration", blocking(&Device::restoreDefaultConfiguration))
+          .def("getDeviceSettings", blocking(&Device::getDeviceSettings))
+          .def("setDeviceSettings", blocking(&Device::setDeviceSettings), py::arg("settings"))
+          .def("getChannelSettings", blocking(&Device::getChannelSettings))
+          .def("setChannelSettings", blocking(&Device::setChannelSettings), py::arg("channelNumber"), py::arg("settings"))
+          .def("eraseScript", blocking(&Device::eraseScript))
+          .def("restartScriptAtSubroutine", blocking(&Device::restartScriptAtSubroutine), py::arg("subroutineNumber"))
+          .def("restartScriptAtSubroutineWithParameter", blocking(&Device::restartScriptAtSubroutineWithParameter), py::arg("subroutineNumber"), py::arg("parameter"))
+          .def("restartScript", blocking(&Device::restartScript))
+          .def("setScriptDone", blocking(&Device::setScriptDone), py::arg("value"))
+          .def("startBootloader", blocking(&Device::startBootloader))
+          .def("reinitialize", blocking(&Device::reinitialize))
+          .def("clearErrors", blocking(&Device::clearErrors))
+          // Any object with a buffer of bytes: bytes, bytearray, memoryview or a uint8 array.
+          .def("writeScript", [](Device &d, py::buffer bytecode) {
+                  const py::buffer_info buffer = bytecode.request();
+                  if (buffer.itemsize != 1 || buffer.ndim != 1 || buffer.strides[0] != 1) {
+                      throw py::value_error("bytecode must be a contiguous buffer of bytes");
+                  }
+                  const uint8_t *data = static_cast<const uint8_t *>(buffer.ptr);
+                  py::gil_scoped_release release;
+                  std::lock_guard<std::mutex> lock(getDeviceLock(d));
+                  d.writeScript(data, size_t(buffer.size));
+              }, py::arg("bytecode"))
+          .def("writeScript", blocking(static_cast<void (Device::*)(const std::vector<uint8_t> &)>(&Device::writeScript)), py::arg("bytecode"))
+          .def("setPWM", blocking(&Device::setPWM), py::arg("dutyCycle"), py::arg("period"))
+          .def("disablePWM", blocking(&Device::disablePWM))
+          ;
+
+    // Asynchronous versions, to be awaited in a coroutine: the transfers run
+    // on an I/O thread of the module and the event loop is never blocked.
+    device.def("setTargetAsync", [](Device &d, uint8_t channelNumber, uint16_t target) {
+                  return callAsync<void>(d, [=](Device &device) { device.setTarget(channelNumber, target); });
+              }, py::arg("channelNumber"), py::arg("target"))
+          .def("setSpeedAsync", [](Device &d, uint8_t channelNumber, uint16_t speed) {
+                  return callAsync<void>(d, [=](Device &device) { device.setSpeed(channelNumber, speed); });
+              }, py::arg("channelNumber"), py::arg("target"))
+          .def("setAccelerationAsync", [](Device &d, uint8_t channelNumber, uint16_t acceleration) {
+                  return callAsync<void>(d, [=](Device &device) { device.setAcceleration(channelNumber, acceleration); });
+              }, py::arg("channelNumber"), py::arg("target"))
+          .def("getServoStatusAsync", [](Device &d) {
+                  return callAsync<std::vector<Device::ServoStatus>>(d, [](Device &device) { return device.getServoStatus(); });
+              })
+          .def("getDeviceSettingsAsync", [](Device &d) {
+                  return callAsync<Device::DeviceSettings>(d, [](Device &device) { return device.getDeviceSettings(); });
+              })
+          .def("setDeviceSettingsAsync", [](Device &d, const Device::DeviceSettings &settings) {
+                  return callAsync<void>(d, [=](Device &device) { device.setDeviceSettings(settings); });
+              }, py::arg("settings"))
+          .def("getChannelSettingsAsync", [](Device &d, uint8_t channelNumber) {
+                  return callAsync<Device::ChannelSettings>(d, [=](Device &device) { return device.getChannelSettings(channelNumber); });
+              }, py::arg("channelNumber"))
+          .def("setChannelSettingsAsync", [](Device &d, uint8_t channelNumber, const Device::ChannelSettings &settings) {
+                  return callAsync<void>(d, [=](Device &device) { device.setChannelSettings(channelNumber, settings); });
+              }, py::arg("channelNumber"), py::arg("settings"))
+          .def("eraseScriptAsync", [](Device &d) {
+                  return callAsync<void>(d, [](Device &device) { device.eraseScript(); });
+              })
+          .def("restartScriptAtSubroutineAsync", [](Device &d, uint8_t subroutineNumber) {
+                  return callAsync<void>(d, [=](Device &device) { device.restartScriptAtSubroutine(subroutineNumber); });
+              }, py::arg("subroutineNumber"))
+          .def("restartScriptAtSubroutineWithParameterAsync", [](Device &d, uint8_t subroutineNumber, uint16_t parameter) {
+                  return callAsync<void>(d, [=](Device &device) { device.restartScriptAtSubroutineWithParameter(subroutineNumber, parameter); });
+              }, py::arg("subroutineNumber"), py::arg("parameter"))
+          .def("restartScriptAsync", [](Device &d) {
+                  return callAsync<void>(d, [](Device &device) { device.restartScript(); });
+              })
+          .def("setScriptDoneAsync", [](Device &d, uint8_t value) {
+                  return callAsync<void>(d, [=](Device &device) { device.setScriptDone(value); });
+              }, py::arg("value"))
+          .def("clearErrorsAsync", [](Device &d) {
+                  return callAsync<void>(d, [](Device &device) { device.clearErrors(); });
+              })
+          .def("writeScriptAsync", [](Device &d, const std::vector<uint8_t> &bytecode) {
+                  return callAsync<void>(d, [=](Device &device) { device.writeScript(bytecode); });
+              }, py::arg("bytecode"))
+          .def("setPWMAsync", [](Device &d, uint16_t dutyCycle, uint16_t period) {
+                  return callAsync<void>(d, [=](Device &device) { device.setPWM(dutyCycle, period); });
+              }, py::arg("dutyCycle"), py::arg("period"))
+          .def("disablePWMAsync", [](Device &d) {
+                  return callAsync<void>(d, [](Device &device) { device.disablePWM(); });
+              })
           ;
 
     py::class_<Program>(m, "Program")
           .def(py::init<const std::string &, bool>(), py::arg("script"), py::arg("isMiniMaestro"))
           .def("getByteList", &Program::getByteList)
+          .def("getBytes", [](const Program &program) {
+                  // Generated into a buffer kept by the thread, then copied once into the bytes object.
+                  thread_local std::vector<uint8_t> bytecode;
+                  bytecode.clear();
+                  program.appendByteList(bytecode);
+                  return py::bytes(reinterpret_cast<const char *>(bytecode.data()), bytecode.size());
+              })
           .def("getCRC",  &Program::getCRC)
-          .def("toString", &Program::toString);
+          .def("toString", static_cast<std::string (Program::*)() const>(&Program::toString));
 }
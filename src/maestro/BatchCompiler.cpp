@@ -0,0 +1,268 @@
+#include "BatchCompiler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <thread>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "Program.h"
+
+namespace Maestro {
+/// First bytes of a cache file; the digit changes with the file layout.
+const char CACHE_MAGIC[4] = {'M', 'S', 'C', '2'};
+/// Larger lengths can only come from a damaged file.
+const uint32_t MAX_CACHED_LENGTH = 1u << 24;
+
+BatchCompiler::BatchCompiler(const std::string& cacheDirectory, unsigned threadCount) : m_cacheDirectory(cacheDirectory), m_threadCount(threadCount) {
+    if (m_threadCount == 0) {
+        m_threadCount = std::max(1u, std::thread::hardware_concurrency());
+    }
+}
+
+uint64_t BatchCompiler::hash(const std::string& script, bool isMiniMaestro) {
+    uint64_t hash = 14695981039346656037ull;
+    for (int i = 0; i < 4; i++) {
+        hash = (hash ^ ((Program::CODE_VERSION >> (8 * i)) & 0xFF)) * 1099511628211ull;
+    }
+    for (char c : script) {
+        hash = (hash ^ uint8_t(c)) * 1099511628211ull;
+    }
+    return (hash ^ (isMiniMaestro ? 1u : 0u)) * 1099511628211ull;
+}
+
+BatchCompiler::Result BatchCompiler::compile(const std::string& script, bool isMiniMaestro) {
+    return compile(std::vector<std::string>(1, script), isMiniMaestro).front();
+}
+
+std::vector<BatchCompiler::Result> BatchCompiler::compile(const std::vector<std::string>& scripts, bool isMiniMaestro) {
+    std::vector<Result> results(scripts.size());
+
+    // Identical scripts of the batch are compiled once.
+    std::vector<uint64_t> keys(scripts.size());
+    std::vector<size_t> unique;
+    std::vector<size_t> firstIndex(scripts.size());
+    std::unordered_map<uint64_t, std::vector<size_t>> seen;
+    for (size_t i = 0; i < scripts.size(); i++) {
+        keys[i] = hash(scripts[i], isMiniMaestro);
+        std::vector<size_t>& candidates = seen[keys[i]];
+        const auto same = std::find_if(candidates.begin(), candidates.end(), [&](size_t j) { return scripts[j] == scripts[i]; });
+        if (same != candidates.end()) {
+            firstIndex[i] = *same;
+        } else {
+            firstIndex[i] = i;
+            candidates.push_back(i);
+            unique.push_back(i);
+        }
+    }
+
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t n = next++; n < unique.size(); n = next++) {
+            const size_t i = unique[n];
+            if (!find(keys[i], scripts[i], isMiniMaestro, results[i])) {
+                results[i] = compileScript(scripts[i], isMiniMaestro);
+                store(keys[i], scripts[i], isMiniMaestro, results[i]);
+            }
+        }
+    };
+    const unsigned threadCount = unsigned(std::min<size_t>(m_threadCount, unique.size()));
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < threadCount; i++) {
+        threads.push_back(std::thread(worker));
+    }
+    worker();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    for (size_t i = 0; i < scripts.size(); i++) {
+        if (firstIndex[i] != i) {
+            results[i] = results[firstIndex[i]];
+            results[i].cached = true;
+        }
+    }
+    return results;
+}
+
+BatchCompiler::Result BatchCompiler::compileScript(const std::string& script, bool isMiniMaestro) {
+    Result result;
+    try {
+        const Program program(script, isMiniMaestro);
+        result.byteList = program.getByteList();
+        result.subroutineTable = program.getSubroutineTable();
+        result.crc = program.getCRC();
+    } catch (const std::string& error) {
+        result.error = error;
+    } catch (const char* error) {
+        result.error = error;
+    }
+    return result;
+}
+
+void BatchCompiler::clearMemoryCache() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_cache.clear();
+}
+
+size_t BatchCompiler::getCacheHits() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_cacheHits;
+}
+
+size_t BatchCompiler::getCacheMisses() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_cacheMisses;
+}
+
+bool BatchCompiler::find(uint64_t key, const std::string& script, bool isMiniMaestro, Result& result) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const auto entry = m_cache.find(key);
+        if (entry != m_cache.end() && entry->second.script == script && entry->second.isMiniMaestro == isMiniMaestro) {
+            result = entry->second.result;
+            result.cached = true;
+            m_cacheHits++;
+            return true;
+        }
+    }
+
+    Entry entry;
+    if (!m_cacheDirectory.empty() && readFile(getCachePath(key), entry) && entry.script == script && entry.isMiniMaestro == isMiniMaestro) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        result = entry.result;
+        result.cached = true;
+        m_cache[key] = std::move(entry);
+        m_cacheHits++;
+        return true;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_cacheMisses++;
+    return false;
+}
+
+void BatchCompiler::store(uint64_t key, const std::string& script, bool isMiniMaestro, const Result& result) {
+    Entry entry;
+    entry.script = script;
+    entry.isMiniMaestro = isMiniMaestro;
+    entry.result = result;
+    if (!m_cacheDirectory.empty()) {
+        writeFile(getCachePath(key), entry);
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_cache[key] = std::move(entry);
+}
+
+std::string BatchCompiler::getCachePath(uint64_t key) const {
+    std::ostringstream path;
+    path << m_cacheDirectory << "/" << std::hex << std::setw(16) << std::setfill('0') << key << ".msc";
+    return path.str();
+}
+
+// Cache file layout, little-endian:
+//   magic[4], Program::CODE_VERSION u32, isMiniMaestro u8, crc u16, subroutine table 128 x u16,
+//   script length u32, bytecode length u32, error length u32,
+//   script, bytecode, error.
+
+void writeUint(std::ostream& stream, uint32_t value, int size) {
+    for (int i = 0; i < size; i++) {
+        stream.put(char((value >> (8 * i)) & 0xFF));
+    }
+}
+
+uint32_t readUint(std::istream& stream, int size) {
+    uint32_t value = 0;
+    for (int i = 0; i < size; i++) {
+        value |= uint32_t(uint8_t(stream.get())) << (8 * i);
+    }
+    return value;
+}
+
+bool BatchCompiler::readFile(const std::string& path, Entry& entry) const {
+    std::ifstream file(path, std::ios::binary);
+    char magic[sizeof(CACHE_MAGIC)];
+    if (!file.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), CACHE_MAGIC)) {
+        return false;
+    }
+    if (readUint(file, 4) != Program::CODE_VERSION) {
+        return false;
+    }
+    entry.isMiniMaestro = readUint(file, 1) != 0;
+    entry.result.crc = uint16_t(readUint(file, 2));
+    for (uint16_t& address : entry.result.subroutineTable) {
+        address = uint16_t(readUint(file, 2));
+    }
+    const uint32_t scriptLength = readUint(file, 4);
+    const uint32_t byteListLength = readUint(file, 4);
+    const uint32_t errorLength = readUint(file, 4);
+    if (!file || scriptLength > MAX_CACHED_LENGTH || byteListLength > MAX_CACHED_LENGTH || errorLength > MAX_CACHED_LENGTH) {
+        return false;
+    }
+    entry.script.resize(scriptLength);
+    entry.result.byteList.resize(byteListLength);
+    entry.result.error.resize(errorLength);
+    file.read(&entry.script[0], scriptLength);
+    file.read(reinterpret_cast<char*>(entry.result.byteList.data()), byteListLength);
+    file.read(&entry.result.error[0], errorLength);
+    if (!file || file.peek() != std::ifstream::traits_type::eof()) {
+        return false;
+    }
+    // A damaged program is a cache miss too.
+    return !entry.result.error.empty() ||
+           Program::computeCRC(entry.result.subroutineTable, entry.result.byteList.data(), entry.result.byteList.size()) == entry.result.crc;
+}
+
+void BatchCompiler::writeFile(const std::string& path, const Entry& entry) const {
+    // Written under another name then renamed, so that other threads and
+    // processes never read half a file.  The name is unique to the process
+    // and the thread, and random, so that no two writers share it.
+#ifdef _WIN32
+    const int processId = _getpid();
+#else
+    const int processId = int(getpid());
+#endif
+    thread_local std::mt19937_64 random(std::random_device{}());
+    std::ostringstream temporaryPath;
+    temporaryPath << path << "." << processId << "." << std::hash<std::thread::id>()(std::this_thread::get_id()) << "." << std::hex << random()
+                  << ".tmp";
+    {
+        std::ofstream file(temporaryPath.str(), std::ios::binary | std::ios::trunc);
+        file.write(CACHE_MAGIC, sizeof(CACHE_MAGIC));
+        writeUint(file, Program::CODE_VERSION, 4);
+        writeUint(file, entry.isMiniMaestro ? 1 : 0, 1);
+        writeUint(file, entry.result.crc, 2);
+        for (uint16_t address : entry.result.subroutineTable) {
+            writeUint(file, address, 2);
+        }
+        writeUint(file, uint32_t(entry.script.size()), 4);
+        writeUint(file, uint32_t(entry.result.byteList.size()), 4);
+        writeUint(file, uint32_t(entry.result.error.size()), 4);
+        file << entry.script;
+        file.write(reinterpret_cast<const char*>(entry.result.byteList.data()), std::streamsize(entry.result.byteList.size()));
+        file << entry.result.error;
+        if (!file.flush()) {
+            file.close();
+            std::remove(temporaryPath.str().c_str());
+            return;
+        }
+    }
+    // The cache is only an optimization: failing to fill it is not an error.
+    if (std::rename(temporaryPath.str().c_str(), path.c_str()) != 0) {
+        std::remove(path.c_str());
+        if (std::rename(temporaryPath.str().c_str(), path.c_str()) != 0) {
+            std::remove(temporaryPath.str().c_str());
+        }
+    }
+}
+}  // namespace Maestro
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace Maestro {
+
+/// Compiles many scripts at once, e.g. the scripts of every robot at deploy
+/// time.
+///
+/// Scripts are compiled in parallel, and the results are cached by a hash of
+/// the source text, the target (Micro or Mini Maestro) and the version of the
+/// code generator (Program::CODE_VERSION).  The cache is kept in memory and,
+/// when a directory is given, on disk so that it survives across runs.  A
+/// cached entry also stores its source, so a hash collision is a cache miss
+/// rather than a wrong program, and its CRC, so a damaged file is a cache
+/// miss too.
+class BatchCompiler {
+   public:
+    struct Result {
+        std::vector<uint8_t> byteList;
+        std::array<uint16_t, 128> subroutineTable{};
+        uint16_t crc = 0;
+        /// Compile error; the other fields are empty when it is set.
+        std::string error;
+        /// True if the result came from the cache.
+        bool cached = false;
+    };
+
+    /**
+     * @param cacheDirectory Existing directory used to store compiled programs,
+     * or an empty string to only cache in memory.
+     * @param threadCount Number of threads, or 0 to use one per core.
+     */
+    explicit BatchCompiler(const std::string& cacheDirectory = std::string(), unsigned threadCount = 0);
+
+    /// Compiles every script for the same target.  Results are in the order of \a scripts.
+    std::vector<Result> compile(const std::vector<std::string>& scripts, bool isMiniMaestro);
+    Result compile(const std::string& script, bool isMiniMaestro);
+
+    /// Empties the memory cache.  Files in the cache directory are kept.
+    void clearMemoryCache();
+
+    size_t getCacheHits() const;
+    size_t getCacheMisses() const;
+
+    /// 64-bit FNV-1a hash of Program::CODE_VERSION, the script and its target, which names the cache entries.
+    static uint64_t hash(const std::string& script, bool isMiniMaestro);
+
+   private:
+    struct Entry {
+        std::string script;
+        bool isMiniMaestro;
+        Result result;
+    };
+
+    bool find(uint64_t key, const std::string& script, bool isMiniMaestro, Result& result);
+    void store(uint64_t key, const std::string& script, bool isMiniMaestro, const Result& result);
+    std::string getCachePath(uint64_t key) const;
+    bool readFile(const std::string& path, Entry& entry) const;
+    void writeFile(const std::string& path, const Entry& entry) const;
+    static Result compileScript(const std::string& script, bool isMiniMaestro);
+
+    std::string m_cacheDirectory;
+    unsigned m_threadCount;
+    mutable std::mutex m_mutex;
+    std::unordered_map<uint64_t, Entry> m_cache;
+    size_t m_cacheHits = 0;
+    size_t m_cacheMisses = 0;
+};
+}  // namespace Maestro
@@ -0,0 +1,745 @@
+#include "Broker.h"
+
+#include "CommandQueue.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <new>
+#include <sstream>
+#include <thread>
+
+namespace Maestro {
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "The atomics shared between processes must be lock-free.");
+
+const uint32_t BROKER_MAGIC = 0x4d414553;
+const uint32_t BROKER_VERSION = 1;
+const size_t BROKER_MAX_DEVICES = 16;
+const size_t BROKER_MAX_CHANNELS = COMMAND_MAX_VALUES;
+/// Commands queued per device.  A power of two, so that the positions can wrap.
+const uint32_t BROKER_RING_SIZE = 256;
+/// A process that has not finished writing a command or the status within this
+/// time is taken for dead: a push() or a memcpy() takes microseconds.
+const std::chrono::seconds BROKER_WRITE_TIMEOUT(1);
+/// A client that does not read its answers is dropped once this much waits for it.
+const size_t BROKER_MAX_PENDING_OUTPUT = 65536;
+
+/// A device in the shared memory.
+struct BrokerSlot {
+    char name[32];
+    char location[32];
+    uint16_t productID;
+    uint16_t channelCount;
+
+    /// Odd while the broker writes the status.
+    alignas(64) std::atomic<uint32_t> statusSequence;
+    Device::ServoStatus status[BROKER_MAX_CHANNELS];
+    std::atomic<uint32_t> errorCount;
+
+    /// Posted by the clients after each command.
+    sem_t doorbell;
+    MpscRing<Command, BROKER_RING_SIZE> commands;
+};
+
+struct BrokerSegment {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t deviceCount;
+    BrokerSlot devices[BROKER_MAX_DEVICES];
+};
+
+void publishStatus(BrokerSlot& slot, const Device::ServoStatus* status, size_t count) {
+    const uint32_t sequence = slot.statusSequence.load(std::memory_order_relaxed);
+    slot.statusSequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(slot.status, status, count * sizeof(Device::ServoStatus));
+    slot.statusSequence.store(sequence + 2, std::memory_order_release);
+}
+
+/// Copies the status of \a slot, and returns its sequence number.  Throws if
+/// the broker died while publishing it, which leaves the sequence odd.
+uint32_t readStatus(const BrokerSlot& slot, Device::ServoStatus* status, size_t count) {
+    const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + BROKER_WRITE_TIMEOUT;
+    for (;;) {
+        const uint32_t sequence = slot.statusSequence.load(std::memory_order_acquire);
+        if ((sequence & 1) == 0) {
+            memcpy(status, slot.status, count * sizeof(Device::ServoStatus));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.statusSequence.load(std::memory_order_relaxed) == sequence) {
+                return sequence / 2;
+            }
+        }
+        if (std::chrono::steady_clock::now() >= deadline) {
+            throw std::string("The broker stopped while publishing the status of the servos.");
+        }
+        std::this_thread::yield();
+    }
+}
+
+/// Waits at most \a timeout for \a doorbell to be posted.
+void waitForDoorbell(sem_t* doorbell, std::chrono::steady_clock::duration timeout) {
+    if (timeout <= std::chrono::steady_clock::duration::zero()) {
+        return;
+    }
+    timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    const long long nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(timeout).count() + deadline.tv_nsec;
+    deadline.tv_sec += time_t(nanoseconds / 1000000000);
+    deadline.tv_nsec = long(nanoseconds % 1000000000);
+    while (sem_timedwait(doorbell, &deadline) != 0 && errno == EINTR) {
+    }
+}
+
+void copyString(char* destination, size_t size, const std::string& source) {
+    strncpy(destination, source.c_str(), size - 1);
+    destination[size - 1] = '\0';
+}
+
+/// The user of the process at the other end of \a socket, or -1.
+uid_t getPeerUser(int socket) {
+    ucred credentials;
+    socklen_t size = sizeof(credentials);
+    if (getsockopt(socket, SOL_SOCKET, SO_PEERCRED, &credentials, &size) != 0) {
+        return uid_t(-1);
+    }
+    return credentials.uid;
+}
+
+/// True if a process accepts connections on the Unix socket \a path.
+bool isListening(const sockaddr_un& address) {
+    const int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe < 0) {
+        return false;
+    }
+    const bool listening = connect(probe, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0;
+    close(probe);
+    return listening;
+}
+
+/// Creates the directory \a path if needed, and checks that it is only open to the user.
+void makePrivateDirectory(const std::string& path) {
+    if (mkdir(path.c_str(), 0700) != 0 && errno != EEXIST) {
+        throw "Cannot create the directory " + path + ": " + strerror(errno) + ".";
+    }
+    // Not stat(): a link planted by another user is refused.
+    struct stat information;
+    if (lstat(path.c_str(), &information) != 0) {
+        throw "Cannot read the directory " + path + ": " + strerror(errno) + ".";
+    }
+    if (!S_ISDIR(information.st_mode) || information.st_uid != geteuid() || (information.st_mode & 077) != 0) {
+        throw "The directory " + path + " must belong to the user and be closed to the others.";
+    }
+}
+
+std::string Broker::getDefaultSocketPath() {
+    const char* runtimeDirectory = getenv("XDG_RUNTIME_DIR");
+    if (runtimeDirectory != nullptr && runtimeDirectory[0] == '/') {
+        return std::string(runtimeDirectory) + "/maestrod/maestrod.sock";
+    }
+    return "/tmp/maestrod-" + std::to_string(geteuid()) + "/maestrod.sock";
+}
+
+std::string Broker::getDefaultSharedMemoryName() { return "/maestrod-" + std::to_string(geteuid()); }
+
+struct Broker::Worker {
+    explicit Worker(const Device& device) : device(device) {}
+
+    Device device;
+    BrokerSlot* slot = nullptr;
+    std::mutex mutex;
+    /// Requests of the Unix socket, run by the thread of the device.
+    std::deque<std::function<void()>> requests;
+    std::thread thread;
+    /// The position of the next command while it is claimed by a client but not written, and since when.
+    bool stuck = false;
+    uint32_t stuckPosition = 0;
+    std::chrono::steady_clock::time_point stuckSince;
+};
+
+Broker::Broker(const std::vector<Device>& devices, const std::string& sharedMemoryName, const std::string& socketPath)
+    : m_sharedMemoryName(sharedMemoryName), m_socketPath(socketPath), m_stopping(false) {
+    if (devices.size() > BROKER_MAX_DEVICES) {
+        throw "A broker serves at most " + std::to_string(BROKER_MAX_DEVICES) + " devices.";
+    }
+    sockaddr_un address = {};
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+        throw "The socket path " + socketPath + " is too long.";
+    }
+    const size_t slash = socketPath.rfind('/');
+    if (slash == std::string::npos || slash == 0) {
+        throw "The socket path " + socketPath + " must be absolute, in a directory of its own.";
+    }
+    makePrivateDirectory(socketPath.substr(0, slash));
+    address.sun_family = AF_UNIX;
+    copyString(address.sun_path, sizeof(address.sun_path), socketPath);
+    // Only the names of a broker that did not exit cleanly are replaced: nobody answers on its socket.
+    if (isListening(address)) {
+        throw "A broker is already running on " + socketPath + ".";
+    }
+
+    try {
+        shm_unlink(sharedMemoryName.c_str());
+        const int memory = shm_open(sharedMemoryName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (memory < 0) {
+            throw "Cannot create the shared memory " + sharedMemoryName + ": " + strerror(errno) + ".";
+        }
+        void* mapping = MAP_FAILED;
+        if (ftruncate(memory, sizeof(BrokerSegment)) == 0) {
+            mapping = mmap(nullptr, sizeof(BrokerSegment), PROT_READ | PROT_WRITE, MAP_SHARED, memory, 0);
+        }
+        close(memory);
+        if (mapping == MAP_FAILED) {
+            shm_unlink(sharedMemoryName.c_str());
+            throw "Cannot map the shared memory " + sharedMemoryName + ": " + strerror(errno) + ".";
+        }
+        m_segment = new (mapping) BrokerSegment();
+
+        for (size_t i = 0; i < devices.size(); i++) {
+            BrokerSlot& slot = m_segment->devices[i];
+            copyString(slot.name, sizeof(slot.name), devices[i].getName());
+            copyString(slot.location, sizeof(slot.location), devices[i].getLocation());
+            slot.productID = devices[i].getProductID();
+            slot.channelCount = uint16_t(devices[i].getNumChannels());
+            sem_init(&slot.doorbell, 1, 0);
+            m_workers.emplace_back(new Worker(devices[i]));
+            m_workers.back()->slot = &slot;
+        }
+        m_segment->version = BROKER_VERSION;
+        m_segment->deviceCount = uint32_t(devices.size());
+        m_segment->magic = BROKER_MAGIC;
+
+        // Non-blocking, so that neither stop() in a signal handler nor a thread of a device waits for the control thread.
+        if (pipe2(m_wakePipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+            throw std::string("Cannot create a pipe: ") + strerror(errno) + ".";
+        }
+        unlink(socketPath.c_str());
+        m_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (m_socket < 0 || bind(m_socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || chmod(socketPath.c_str(), 0600) != 0 ||
+            listen(m_socket, 16) != 0) {
+            throw "Cannot listen on " + socketPath + ": " + strerror(errno) + ".";
+        }
+    } catch (...) {
+        release();
+        throw;
+    }
+}
+
+Broker::~Broker() {
+    stop();
+    for (std::unique_ptr<Worker>& worker : m_workers) {
+        if (worker->thread.joinable()) {
+            worker->thread.join();
+        }
+    }
+    release();
+}
+
+void Broker::release() {
+    if (m_socket >= 0) {
+        close(m_socket);
+        unlink(m_socketPath.c_str());
+        m_socket = -1;
+    }
+    for (int& end : m_wakePipe) {
+        if (end >= 0) {
+            close(end);
+            end = -1;
+        }
+    }
+    if (m_segment != nullptr) {
+        for (std::unique_ptr<Worker>& worker : m_workers) {
+            sem_destroy(&worker->slot->doorbell);
+        }
+        m_segment->~BrokerSegment();
+        munmap(m_segment, sizeof(BrokerSegment));
+        shm_unlink(m_sharedMemoryName.c_str());
+        m_segment = nullptr;
+    }
+}
+
+void Broker::run() {
+    m_stopping = false;
+    for (std::unique_ptr<Worker>& worker : m_workers) {
+        worker->thread = std::thread(&Broker::serveDevice, this, std::ref(*worker));
+    }
+    serveControl();
+    for (std::unique_ptr<Worker>& worker : m_workers) {
+        sem_post(&worker->slot->doorbell);
+        worker->thread.join();
+    }
+}
+
+void Broker::stop() {
+    m_stopping = true;
+    wake();
+    for (std::unique_ptr<Worker>& worker : m_workers) {
+        sem_post(&worker->slot->doorbell);
+    }
+}
+
+/// Makes the control thread look at m_stopping and m_answers.  Async-signal-safe.
+void Broker::wake() {
+    if (m_wakePipe[1] >= 0) {
+        const ssize_t written = write(m_wakePipe[1], "", 1);
+        (void)written;
+    }
+}
+
+void Broker::serveDevice(Worker& worker) {
+    BrokerSlot& slot = *worker.slot;
+    std::vector<Device::ServoStatus> status(worker.device.getNumChannels());
+    std::chrono::steady_clock::time_point nextPoll = std::chrono::steady_clock::now();
+    while (!m_stopping) {
+        // The posts are counted before the commands are taken, so that none is missed.
+        while (sem_trywait(&slot.doorbell) == 0) {
+        }
+        Command command;
+        while (slot.commands.pop(command)) {
+            try {
+                execute(worker.device, command);
+            } catch (const std::string&) {
+                slot.errorCount++;
+            } catch (const char*) {
+                slot.errorCount++;
+            }
+        }
+        // A client killed in push() leaves the next command claimed but never
+        // written, which would block the ring for good.
+        const uint32_t position = slot.commands.getDequeuePosition();
+        if (slot.commands.getEnqueuePosition() == position) {
+            worker.stuck = false;
+        } else if (!worker.stuck || worker.stuckPosition != position) {
+            worker.stuck = true;
+            worker.stuckPosition = position;
+            worker.stuckSince = std::chrono::steady_clock::now();
+        } else if (std::chrono::steady_clock::now() - worker.stuckSince >= BROKER_WRITE_TIMEOUT) {
+            if (slot.commands.skip()) {
+                slot.errorCount++;
+            }
+            worker.stuck = false;
+        }
+
+        std::deque<std::function<void()>> requests;
+        {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            requests.swap(worker.requests);
+        }
+        for (std::function<void()>& request : requests) {
+            request();
+        }
+
+        const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (now >= nextPoll) {
+            try {
+                worker.device.getServoStatus(status.data());
+                publishStatus(slot, status.data(), status.size());
+            } catch (const std::string&) {
+                slot.errorCount++;
+            } catch (const char*) {
+                slot.errorCount++;
+            }
+            // A late poll does not make the next ones early.
+            nextPoll = std::max(nextPoll + m_pollInterval, now);
+        }
+        waitForDoorbell(&slot.doorbell, nextPoll - std::chrono::steady_clock::now());
+    }
+}
+
+void Broker::serveControl() {
+    // The client sockets are non-blocking: the answers wait in the output of
+    // their client until it reads them, and a slow client delays nobody.
+    struct Client {
+        uint64_t id;
+        int socket;
+        std::string input;
+        std::string output;
+        /// Its request is run by the thread of a device: the next ones wait, so that the answers keep their order.
+        bool waiting;
+    };
+    std::vector<Client> clients;
+    uint64_t nextClient = 0;
+
+    auto answerInput = [this](Client& client) {
+        size_t end;
+        while (!client.waiting && (end = client.input.find('\n')) != std::string::npos) {
+            const std::string reply = answer(client.id, client.input.substr(0, end));
+            client.input.erase(0, end + 1);
+            if (reply.empty()) {
+                client.waiting = true;
+            } else {
+                client.output += reply + "\n";
+            }
+        }
+    };
+    // Sends what the client can take now.  False if it is gone, or reads too slowly.
+    auto flush = [](Client& client) {
+        while (!client.output.empty()) {
+            const ssize_t sent = send(client.socket, client.output.data(), client.output.size(), MSG_NOSIGNAL);
+            if (sent > 0) {
+                client.output.erase(0, size_t(sent));
+            } else if (sent < 0 && errno == EINTR) {
+                continue;
+            } else {
+                return sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && client.output.size() <= BROKER_MAX_PENDING_OUTPUT;
+            }
+        }
+        return true;
+    };
+
+    while (!m_stopping) {
+        std::vector<pollfd> descriptors = {{m_wakePipe[0], POLLIN, 0}, {m_socket, POLLIN, 0}};
+        for (const Client& client : clients) {
+            descriptors.push_back({client.socket, short(client.output.empty() ? POLLIN : POLLIN | POLLOUT), 0});
+        }
+        if (poll(descriptors.data(), descriptors.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        if (descriptors[0].revents & POLLIN) {
+            char buffer[64];
+            while (read(m_wakePipe[0], buffer, sizeof(buffer)) > 0) {
+            }
+            std::deque<Answer> answers;
+            {
+                std::lock_guard<std::mutex> lock(m_answersMutex);
+                answers.swap(m_answers);
+            }
+            for (const Answer& answer : answers) {
+                // The client may have gone meanwhile.
+                for (Client& client : clients) {
+                    if (client.id == answer.client) {
+                        client.output += answer.text + "\n";
+                        client.waiting = false;
+                        answerInput(client);
+                        break;
+                    }
+                }
+            }
+        }
+
+        for (size_t i = clients.size(); i-- > 0;) {
+            Client& client = clients[i];
+            bool gone = false;
+            if (descriptors[2 + i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                char buffer[256];
+                const ssize_t size = read(client.socket, buffer, sizeof(buffer));
+                if (size > 0) {
+                    client.input.append(buffer, size_t(size));
+                    answerInput(client);
+                }
+                gone = size == 0 || (size < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) || client.input.size() > 4096;
+            }
+            // The answers of the devices were queued above, whatever the events of the client.
+            if (gone || !flush(client)) {
+                close(client.socket);
+                clients.erase(clients.begin() + i);
+            }
+        }
+        if (descriptors[1].revents & POLLIN) {
+            const int client = accept4(m_socket, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if (client >= 0) {
+                // The directory of the socket already keeps the other users out: this does not rely on it.
+                if (getPeerUser(client) == geteuid()) {
+                    clients.push_back({nextClient++, client, std::string(), std::string(), false});
+                } else {
+                    close(client);
+                }
+            }
+        }
+    }
+    for (const Client& client : clients) {
+        close(client.socket);
+    }
+}
+
+/// The control protocol: one request per line, answered by "OK ..." or "ERROR <message>".
+/// Returns the answer, or an empty string if the request was queued for the
+/// thread of its device, which answers through m_answers.
+std::string Broker::answer(uint64_t client, const std::string& request) {
+    std::istringstream input(request);
+    std::string command;
+    size_t index = 0;
+    input >> command;
+    if (command == "HELLO") {
+        return "OK " + std::to_string(BROKER_VERSION) + " " + m_sharedMemoryName;
+    }
+    if (!(input >> index) || index >= m_workers.size()) {
+        return "ERROR Unknown request.";
+    }
+
+    // The device is only used by its thread, and the control thread does not
+    // wait for it: a slow device does not delay the requests for the others.
+    Worker& worker = *m_workers[index];
+    auto runOnDevice = [&](std::function<std::string(Device &)> call) -> std::string {
+        {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            Device* device = &worker.device;
+            worker.requests.push_back([this, client, device, call] {
+                Answer answer = {client, std::string()};
+                try {
+                    answer.text = "OK " + call(*device);
+                } catch (const std::string& e) {
+                    answer.text = "ERROR " + e;
+                } catch (const char* e) {
+                    answer.text = std::string("ERROR ") + e;
+                }
+                {
+                    std::lock_guard<std::mutex> lock(m_answersMutex);
+                    m_answers.push_back(answer);
+                }
+                wake();
+            });
+        }
+        sem_post(&worker.slot->doorbell);
+        return std::string();
+    };
+
+    if (command == "SETTINGS") {
+        unsigned channel = 0;
+        if (!(input >> channel)) {
+            return "ERROR Missing channel.";
+        }
+        return runOnDevice([channel](Device& device) {
+            const Device::ChannelSettings settings = device.getChannelSettings(uint8_t(channel));
+            std::ostringstream output;
+            output << int(settings.mode) << " " << int(settings.homeMode) << " " << settings.home << " " << settings.minimum << " " << settings.maximum
+                   << " " << settings.neutral << " " << settings.range << " " << settings.speed << " " << int(settings.acceleration);
+            return output.str();
+        });
+    }
+    if (command == "SCRIPT") {
+        return runOnDevice([](Device& device) {
+            const Device::ScriptStatus status = device.getScriptStatus();
+            std::ostringstream output;
+            output << status.programCounter << " " << status.errors << " " << int(status.scriptDone) << " " << status.stack.size();
+            for (int16_t value : status.stack) {
+                output << " " << value;
+            }
+            output << " " << status.callStack.size();
+            for (uint16_t address : status.callStack) {
+                output << " " << address;
+            }
+            return output.str();
+        });
+    }
+    if (command == "CRC") {
+        return runOnDevice([](Device& device) { return std::to_string(device.getScriptCRC()); });
+    }
+    return "ERROR Unknown request.";
+}
+
+/// The socket and the shared memory of a broker, shared by its RemoteDevices.
+class RemoteDevice::Connection {
+   public:
+    explicit Connection(const std::string& socketPath) {
+        sockaddr_un address = {};
+        if (socketPath.size() >= sizeof(address.sun_path)) {
+            throw "The socket path " + socketPath + " is too long.";
+        }
+        address.sun_family = AF_UNIX;
+        copyString(address.sun_path, sizeof(address.sun_path), socketPath);
+        m_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (m_socket < 0 || connect(m_socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+            const std::string error = strerror(errno);
+            if (m_socket >= 0) {
+                close(m_socket);
+            }
+            throw "Cannot connect to the broker at " + socketPath + ": " + error + ".";
+        }
+
+        try {
+            // Someone else's socket would feed this process a shared memory of their own.
+            if (getPeerUser(m_socket) != geteuid()) {
+                throw "The broker at " + socketPath + " is run by another user.";
+            }
+            std::istringstream hello(request("HELLO"));
+            uint32_t version = 0;
+            std::string name;
+            hello >> version >> name;
+            if (version != BROKER_VERSION) {
+                throw "The broker speaks version " + std::to_string(version) + " of the protocol, not " + std::to_string(BROKER_VERSION) + ".";
+            }
+            const int memory = shm_open(name.c_str(), O_RDWR, 0);
+            if (memory < 0) {
+                throw "Cannot open the shared memory " + name + ": " + strerror(errno) + ".";
+            }
+            struct stat information;
+            void* mapping = MAP_FAILED;
+            if (fstat(memory, &information) == 0 && information.st_uid == geteuid() && size_t(information.st_size) >= sizeof(BrokerSegment)) {
+                mapping = mmap(nullptr, sizeof(BrokerSegment), PROT_READ | PROT_WRITE, MAP_SHARED, memory, 0);
+            }
+            close(memory);
+            if (mapping == MAP_FAILED) {
+                throw "Cannot map the shared memory " + name + ".";
+            }
+            segment = static_cast<BrokerSegment*>(mapping);
+            if (segment->magic != BROKER_MAGIC) {
+                munmap(segment, sizeof(BrokerSegment));
+                throw name + " is not the shared memory of a broker.";
+            }
+        } catch (...) {
+            close(m_socket);
+            throw;
+        }
+    }
+
+    ~Connection() {
+        munmap(segment, sizeof(BrokerSegment));
+        close(m_socket);
+    }
+
+    /// Sends \a line, and returns the answer without "OK ".  Throws the message of an error.
+    std::string request(const std::string& line) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const std::string message = line + "\n";
+        if (::send(m_socket, message.data(), message.size(), MSG_NOSIGNAL) != ssize_t(message.size())) {
+            throw std::string("The broker has closed the connection.");
+        }
+        size_t end;
+        while ((end = m_input.find('\n')) == std::string::npos) {
+            char buffer[256];
+            const ssize_t size = read(m_socket, buffer, sizeof(buffer));
+            if (size <= 0) {
+                throw std::string("The broker has closed the connection.");
+            }
+            m_input.append(buffer, size_t(size));
+        }
+        const std::string reply = m_input.substr(0, end);
+        m_input.erase(0, end + 1);
+        if (reply.compare(0, 3, "OK ") != 0) {
+            throw (reply.compare(0, 6, "ERROR ") == 0) ? reply.substr(6) : "Unexpected answer of the broker: " + reply;
+        }
+        return reply.substr(3);
+    }
+
+    BrokerSegment* segment = nullptr;
+
+   private:
+    int m_socket = -1;
+    std::mutex m_mutex;
+    std::string m_input;
+};
+
+std::vector<RemoteDevice> RemoteDevice::getConnectedDevices(const std::string& socketPath) {
+    std::shared_ptr<Connection> connection = std::make_shared<Connection>(socketPath);
+    std::vector<RemoteDevice> devices;
+    for (size_t i = 0; i < std::min<size_t>(connection->segment->deviceCount, BROKER_MAX_DEVICES); i++) {
+        devices.push_back(RemoteDevice(connection, i));
+    }
+    return devices;
+}
+
+RemoteDevice::RemoteDevice(const std::shared_ptr<Connection>& connection, size_t index)
+    : m_connection(connection), m_index(index), m_slot(&connection->segment->devices[index]) {
+    m_name.assign(m_slot->name, strnlen(m_slot->name, sizeof(m_slot->name)));
+    m_location.assign(m_slot->location, strnlen(m_slot->location, sizeof(m_slot->location)));
+    m_productID = m_slot->productID;
+    m_channelcnt = std::min<int>(m_slot->channelCount, BROKER_MAX_CHANNELS);
+}
+
+void RemoteDevice::send(uint8_t type, uint8_t channel, const uint16_t* values, size_t count) {
+    Command command = {type, channel, uint8_t(count), {}};
+    std::copy(values, values + count, command.values);
+    if (!m_slot->commands.push(command)) {
+        throw "The command queue of " + m_location + " is full, or the broker gave up on the command because it was queued too slowly.";
+    }
+    sem_post(&m_slot->doorbell);
+}
+
+void RemoteDevice::setTarget(uint8_t servo, uint16_t value) { send(COMMAND_SET_TARGET, servo, &value, 1); }
+
+void RemoteDevice::setTargets(uint8_t firstChannel, const uint16_t* targets, size_t count) {
+    if (firstChannel + count > size_t(m_channelcnt)) {
+        throw "Cannot set " + std::to_string(count) + " targets from channel " + std::to_string(firstChannel) + " on a device with " +
+            std::to_string(m_channelcnt) + " channels.";
+    }
+    send(COMMAND_SET_TARGETS, firstChannel, targets, count);
+}
+
+void RemoteDevice::setTargets(uint8_t firstChannel, const std::vector<uint16_t>& targets) { setTargets(firstChannel, targets.data(), targets.size()); }
+
+void RemoteDevice::setSpeed(uint8_t servo, uint16_t value) { send(COMMAND_SET_SPEED, servo, &value, 1); }
+
+void RemoteDevice::setAcceleration(uint8_t servo, uint16_t value) { send(COMMAND_SET_ACCELERATION, servo, &value, 1); }
+
+void RemoteDevice::clearErrors() { send(COMMAND_CLEAR_ERRORS, 0, nullptr, 0); }
+
+void RemoteDevice::restartScript() { send(COMMAND_RESTART_SCRIPT, 0, nullptr, 0); }
+
+void RemoteDevice::restartScriptAtSubroutine(uint8_t subroutine) { send(COMMAND_RESTART_SCRIPT_AT_SUBROUTINE, subroutine, nullptr, 0); }
+
+void RemoteDevice::restartScriptAtSubroutineWithParameter(uint8_t subroutine, uint16_t parameter) {
+    send(COMMAND_RESTART_SCRIPT_AT_SUBROUTINE_WITH_PARAMETER, subroutine, &parameter, 1);
+}
+
+void RemoteDevice::setScriptDone(uint8_t value) {
+    const uint16_t done = value;
+    send(COMMAND_SET_SCRIPT_DONE, 0, &done, 1);
+}
+
+void RemoteDevice::setPWM(uint16_t dutyCycle, uint16_t period) {
+    const uint16_t values[2] = {dutyCycle, period};
+    send(COMMAND_SET_PWM, 0, values, 2);
+}
+
+std::vector<Device::ServoStatus> RemoteDevice::getServoStatus() const {
+    std::vector<Device::ServoStatus> status(m_channelcnt);
+    getServoStatus(status.data());
+    return status;
+}
+
+void RemoteDevice::getServoStatus(Device::ServoStatus* status) const { readStatus(*m_slot, status, m_channelcnt); }
+
+uint32_t RemoteDevice::getStatusSequence() const { return m_slot->statusSequence.load(std::memory_order_acquire) / 2; }
+
+uint32_t RemoteDevice::getErrorCount() const { return m_slot->errorCount.load(std::memory_order_relaxed); }
+
+Device::ChannelSettings RemoteDevice::getChannelSettings(uint8_t channel) {
+    std::istringstream reply(m_connection->request("SETTINGS " + std::to_string(m_index) + " " + std::to_string(channel)));
+    int mode = 0;
+    int homeMode = 0;
+    unsigned acceleration = 0;
+    Device::ChannelSettings settings;
+    reply >> mode >> homeMode >> settings.home >> settings.minimum >> settings.maximum >> settings.neutral >> settings.range >> settings.speed >> acceleration;
+    settings.mode = Device::ChannelMode(mode);
+    settings.homeMode = Device::HomeMode(homeMode);
+    settings.acceleration = uint8_t(acceleration);
+    return settings;
+}
+
+Device::ScriptStatus RemoteDevice::getScriptStatus() {
+    std::istringstream reply(m_connection->request("SCRIPT " + std::to_string(m_index)));
+    Device::ScriptStatus status;
+    int scriptDone = 0;
+    size_t count = 0;
+    reply >> status.programCounter >> status.errors >> scriptDone >> count;
+    status.scriptDone = scriptDone != 0;
+    status.stack.resize(count);
+    for (int16_t& value : status.stack) {
+        reply >> value;
+    }
+    reply >> count;
+    status.callStack.resize(count);
+    for (uint16_t& address : status.callStack) {
+        reply >> address;
+    }
+    return status;
+}
+
+uint16_t RemoteDevice::getScriptCRC() { return uint16_t(std::stoul(m_connection->request("CRC " + std::to_string(m_index)))); }
+}  // namespace Maestro
@@ -0,0 +1,162 @@
+#pragma once
+
+#include "Device.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace Maestro {
+struct BrokerSegment;
+struct BrokerSlot;
+
+/**
+ * @brief Shares Maestros with the other processes of the machine: the core of maestrod.
+ *
+ * Only one process can use a Maestro at a time.  The broker owns the
+ * devices, and the other processes use them through RemoteDevice:
+ *
+ * - The status of the servos of every device is read every poll interval,
+ *   and published in POSIX shared memory, guarded by a sequence counter
+ *   (seqlock), so that any number of readers get consistent snapshots
+ *   without a system call.
+ * - Commands are sent through a lock-free ring per device in the same
+ *   shared memory, and a semaphore wakes up the thread of the device.
+ *   Clients never wait for USB.
+ * - The requests that return something else than the status, e.g. the
+ *   channel settings, go through a Unix socket, which also tells the
+ *   clients the name of the shared memory.
+ *
+ * Every device has its own thread, so a slow device does not delay the
+ * others, nor the requests for the other devices.  Linux only.
+ *
+ * The devices are only shared with the processes of the same user: the
+ * socket lives in a directory closed to the other users, the shared memory
+ * is only readable by its owner, and the broker checks the credentials of
+ * every client.
+ */
+class Broker {
+   public:
+    /// maestrod/maestrod.sock in $XDG_RUNTIME_DIR, or in /tmp/maestrod-<uid> without it.
+    static std::string getDefaultSocketPath();
+    /// "/maestrod-<uid>", so that the brokers of different users do not collide.
+    static std::string getDefaultSharedMemoryName();
+
+    /// Publishes \a devices (at most 16) in the shared memory \a sharedMemoryName,
+    /// e.g. "/maestrod", and listens on the Unix socket \a socketPath.  The
+    /// directory of the socket is created if needed, and must belong to the
+    /// user and be closed to the others.  Throws if a broker already answers
+    /// on \a socketPath; the names left by a broker that did not exit cleanly
+    /// are replaced.
+    Broker(const std::vector<Device>& devices, const std::string& sharedMemoryName = getDefaultSharedMemoryName(),
+           const std::string& socketPath = getDefaultSocketPath());
+    ~Broker();
+
+    Broker(const Broker&) = delete;
+    Broker& operator=(const Broker&) = delete;
+
+    /// How often the status of the servos is read.
+    void setPollInterval(std::chrono::milliseconds interval) { m_pollInterval = interval; }
+
+    /// Serves the clients until stop() is called.
+    void run();
+
+    /// Makes run() return.  Async-signal-safe.
+    void stop();
+
+   private:
+    struct Worker;
+
+    /// The answer of a request run by the thread of a device.
+    struct Answer {
+        uint64_t client;
+        std::string text;
+    };
+
+    void release();
+    void serveDevice(Worker& worker);
+    void serveControl();
+    std::string answer(uint64_t client, const std::string& request);
+    void wake();
+
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::string m_sharedMemoryName;
+    std::string m_socketPath;
+    BrokerSegment* m_segment = nullptr;
+    int m_socket = -1;
+    /// Written by stop(), and by the threads of the devices when they answer a request.
+    int m_wakePipe[2] = {-1, -1};
+    std::mutex m_answersMutex;
+    std::deque<Answer> m_answers;
+    std::atomic<bool> m_stopping;
+    std::chrono::milliseconds m_pollInterval = std::chrono::milliseconds(10);
+};
+
+/**
+ * @brief A Maestro owned by a Broker (maestrod), used from another process.
+ *
+ * The calls mirror those of Device.  The commands are queued for the thread
+ * of the device in the broker, and return at once: they throw only if the
+ * queue is full, or if this process stalled so long in the middle of queuing
+ * that the broker gave up on the command.  getServoStatus() reads the last snapshot published by the
+ * broker, and the other queries go through the Unix socket of the broker.
+ */
+class RemoteDevice {
+   public:
+    /// Connects to the broker listening on \a socketPath and returns its devices.
+    /// Throws if the broker is run by another user.
+    static std::vector<RemoteDevice> getConnectedDevices(const std::string& socketPath = Broker::getDefaultSocketPath());
+
+    const std::string& getName() const { return m_name; }
+    int getNumChannels() const { return m_channelcnt; }
+    uint16_t getProductID() const { return m_productID; }
+    const std::string& getLocation() const { return m_location; }
+
+    void setTarget(uint8_t channelNumber, uint16_t target);
+    void setTargets(uint8_t firstChannel, const uint16_t* targets, size_t count);
+    void setTargets(uint8_t firstChannel, const std::vector<uint16_t>& targets);
+    void setSpeed(uint8_t channelNumber, uint16_t speed);
+    void setAcceleration(uint8_t channelNumber, uint16_t acceleration);
+    void clearErrors();
+    void restartScript();
+    void restartScriptAtSubroutine(uint8_t subroutineNumber);
+    void restartScriptAtSubroutineWithParameter(uint8_t subroutineNumber, uint16_t parameter);
+    void setScriptDone(uint8_t value);
+    void setPWM(uint16_t dutyCycle, uint16_t period);
+
+    /// The last status published by the broker.  Throws if the broker stopped while publishing it.
+    std::vector<Device::ServoStatus> getServoStatus() const;
+    /// Same as above, into \a status, which must hold getNumChannels() entries.
+    void getServoStatus(Device::ServoStatus* status) const;
+
+    /// Incremented each time the broker publishes the status.
+    uint32_t getStatusSequence() const;
+
+    /// The number of commands and status reads that failed in the broker, and of
+    /// the commands it gave up on because their client never finished queuing them.
+    uint32_t getErrorCount() const;
+
+    Device::ChannelSettings getChannelSettings(uint8_t channel);
+    Device::ScriptStatus getScriptStatus();
+    uint16_t getScriptCRC();
+
+   private:
+    class Connection;
+    RemoteDevice(const std::shared_ptr<Connection>& connection, size_t index);
+
+    void send(uint8_t type, uint8_t channel, const uint16_t* values, size_t count);
+
+    std::shared_ptr<Connection> m_connection;
+    size_t m_index;
+    BrokerSlot* m_slot;
+    std::string m_name;
+    std::string m_location;
+    uint16_t m_productID;
+    int m_channelcnt;
+};
+}  // namespace Maestro
@@ -0,0 +1,42 @@
+#include "CommandQueue.h"
+
+#include <string>
+
+namespace Maestro {
+void execute(Device& device, const Command& command) {
+    switch (command.type) {
+        case COMMAND_SET_TARGET:
+            device.setTarget(command.channel, command.values[0]);
+            break;
+        case COMMAND_SET_TARGETS:
+            device.setTargets(command.channel, command.values, command.count);
+            break;
+        case COMMAND_SET_SPEED:
+            device.setSpeed(command.channel, command.values[0]);
+            break;
+        case COMMAND_SET_ACCELERATION:
+            device.setAcceleration(command.channel, command.values[0]);
+            break;
+        case COMMAND_CLEAR_ERRORS:
+            device.clearErrors();
+            break;
+        case COMMAND_RESTART_SCRIPT:
+            device.restartScript();
+            break;
+        case COMMAND_RESTART_SCRIPT_AT_SUBROUTINE:
+            device.restartScriptAtSubroutine(command.channel);
+            break;
+        case COMMAND_RESTART_SCRIPT_AT_SUBROUTINE_WITH_PARAMETER:
+            device.restartScriptAtSubroutineWithParameter(command.channel, command.values[0]);
+            break;
+        case COMMAND_SET_SCRIPT_DONE:
+            device.setScriptDone(uint8_t(command.values[0]));
+            break;
+        case COMMAND_SET_PWM:
+            device.setPWM(command.values[0], command.values[1]);
+            break;
+        default:
+            throw "Unknown command " + std::to_string(command.type) + ".";
+    }
+}
+}  // namespace Maestro
@@ -0,0 +1,140 @@
+#pragma once
+
+#include "Device.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace Maestro {
+/// The most values carried by a Command: a target per channel of the largest Maestro.
+const size_t COMMAND_MAX_VALUES = 24;
+
+enum CommandType : uint8_t {
+    COMMAND_SET_TARGET = 1,
+    COMMAND_SET_TARGETS,
+    COMMAND_SET_SPEED,
+    COMMAND_SET_ACCELERATION,
+    COMMAND_CLEAR_ERRORS,
+    COMMAND_RESTART_SCRIPT,
+    COMMAND_RESTART_SCRIPT_AT_SUBROUTINE,
+    COMMAND_RESTART_SCRIPT_AT_SUBROUTINE_WITH_PARAMETER,
+    COMMAND_SET_SCRIPT_DONE,
+    COMMAND_SET_PWM,
+};
+
+/// A call of Device returning nothing, queued for the thread owning the device.
+struct Command {
+    uint8_t type;
+    /// The channel, or the subroutine.
+    uint8_t channel;
+    uint8_t count;
+    uint16_t values[COMMAND_MAX_VALUES];
+};
+
+/// Makes the call of Device described by \a command.
+void execute(Device& device, const Command& command);
+
+/**
+ * @brief A bounded multi-producer single-consumer queue (Dmitry Vyukov's).
+ *
+ * Each cell has a sequence number telling whether it is free for the
+ * position of a producer, or holds the value the consumer expects: the
+ * producers only contend on a compare-and-swap of the enqueue position, and
+ * never wait for each other or for the consumer.  The ring has no pointer of
+ * its own, so that a ring of plain values can live in shared memory.  \a Size
+ * is a power of two, so that the positions can wrap.
+ */
+template <typename T, uint32_t Size>
+class MpscRing {
+    static_assert(Size != 0 && (Size & (Size - 1)) == 0, "The size of a ring must be a power of two.");
+
+   public:
+    MpscRing() {
+        m_enqueuePosition.value.store(0, std::memory_order_relaxed);
+        m_dequeuePosition.value.store(0, std::memory_order_relaxed);
+        for (uint32_t i = 0; i < Size; i++) {
+            m_cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    MpscRing(const MpscRing&) = delete;
+    MpscRing& operator=(const MpscRing&) = delete;
+
+    /// Returns false if the ring is full, or if the consumer gave up on the value with skip().  Any thread.
+    bool push(const T& value) {
+        uint32_t position = m_enqueuePosition.value.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = m_cells[position % Size];
+            const int32_t difference = int32_t(cell.sequence.load(std::memory_order_acquire) - position);
+            if (difference == 0) {
+                if (m_enqueuePosition.value.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    cell.value = value;
+                    // Fails if the consumer has skipped the cell meanwhile: the value is lost.
+                    uint32_t expected = position;
+                    return cell.sequence.compare_exchange_strong(expected, position + 1, std::memory_order_release, std::memory_order_relaxed);
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = m_enqueuePosition.value.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /// Returns false if the ring is empty, or if its next value is still being written.  Consumer only.
+    bool pop(T& value) {
+        const uint32_t position = m_dequeuePosition.value.load(std::memory_order_relaxed);
+        Cell& cell = m_cells[position % Size];
+        if (int32_t(cell.sequence.load(std::memory_order_acquire) - (position + 1)) < 0) {
+            return false;
+        }
+        value = cell.value;
+        cell.sequence.store(position + Size, std::memory_order_release);
+        m_dequeuePosition.value.store(position + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    /// Gives up on the next value, claimed by a producer that has not written it,
+    /// e.g. because it was killed in push(): the consumer would wait for it forever
+    /// otherwise.  Returns false if there is no such value.  Consumer only.
+    ///
+    /// A producer resuming after skip() gets false, but may still have written
+    /// the cell: only skip a value after a timeout much longer than a push().
+    bool skip() {
+        const uint32_t position = m_dequeuePosition.value.load(std::memory_order_relaxed);
+        if (getEnqueuePosition() == position) {
+            return false;
+        }
+        uint32_t expected = position;
+        if (!m_cells[position % Size].sequence.compare_exchange_strong(expected, position + Size, std::memory_order_acq_rel)) {
+            return false;
+        }
+        m_dequeuePosition.value.store(position + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    /// The position the next push() takes.  The values are popped in the order of their positions.
+    uint32_t getEnqueuePosition() const { return m_enqueuePosition.value.load(std::memory_order_acquire); }
+    /// The position of the value the next pop() returns.  Consumer only.
+    uint32_t getDequeuePosition() const { return m_dequeuePosition.value.load(std::memory_order_relaxed); }
+
+   private:
+    struct Cell {
+        std::atomic<uint32_t> sequence;
+        T value;
+    };
+
+    /// The positions are a cache line apart, so that the producers and the
+    /// consumer do not invalidate each other's line.  Padding rather than
+    /// alignas(64), which operator new does not honor before C++17.
+    struct Position {
+        std::atomic<uint32_t> value;
+        char padding[64 - sizeof(std::atomic<uint32_t>)];
+    };
+
+    Position m_enqueuePosition;
+    Position m_dequeuePosition;
+    Cell m_cells[Size];
+};
+}  // namespace Maestro
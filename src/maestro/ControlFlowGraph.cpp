@@ -0,0 +1,136 @@
+#include "ControlFlowGraph.h"
+
+#include <algorithm>
+
+#include "Opcode.h"
+
+namespace Maestro {
+ControlFlowGraph::ControlFlowGraph(const std::vector<uint8_t>& bytecode, const std::array<uint16_t, 128>& subroutineTable)
+    : m_bytecode(bytecode), m_instructionAt(bytecode.size(), -1), m_blockAt(bytecode.size(), -1) {
+    // Decode the instructions, which are laid out one after the other.
+    size_t address = 0;
+    while (address < m_bytecode.size()) {
+        DecodedInstruction instruction;
+        if (!decode(m_bytecode, address, subroutineTable, instruction)) {
+            m_problems.push_back(std::make_pair(instruction.address, std::string("The last instruction is truncated.")));
+            break;
+        }
+        m_instructionAt[address] = int(m_instructions.size());
+        m_instructions.push_back(instruction);
+        address += instruction.length;
+    }
+
+    // Blocks start at the beginning of the script, at subroutine entries, at
+    // jump targets and after instructions that change the flow.
+    std::vector<bool> leaders(m_instructions.size() + 1, false);
+    leaders[0] = true;
+    auto markLeader = [&](const DecodedInstruction& from, uint16_t target) {
+        const int index = getInstructionAt(target);
+        if (index < 0) {
+            m_problems.push_back(std::make_pair(from.address, "Invalid target address " + std::to_string(target) + "."));
+            return;
+        }
+        leaders[index] = true;
+    };
+    for (size_t i = 0; i < m_instructions.size(); i++) {
+        const DecodedInstruction& instruction = m_instructions[i];
+        const Opcode opcode = Opcode(instruction.opcode);
+        if (opcode == Opcode::JUMP || opcode == Opcode::JUMP_Z || isCall(instruction)) {
+            markLeader(instruction, instruction.operand);
+        }
+        if (opcode == Opcode::JUMP || opcode == Opcode::JUMP_Z || endsFlow(instruction)) {
+            leaders[i + 1] = true;
+        }
+    }
+
+    for (size_t i = 0; i < m_instructions.size(); i++) {
+        if (leaders[i]) {
+            if (!m_blocks.empty()) {
+                m_blocks.back().end = i;
+            }
+            m_blockAt[m_instructions[i].address] = int(m_blocks.size());
+            m_blocks.push_back(BasicBlock{m_instructions[i].address, i, m_instructions.size(), {}});
+        }
+    }
+
+    for (size_t b = 0; b < m_blocks.size(); b++) {
+        BasicBlock& block = m_blocks[b];
+        const DecodedInstruction& last = m_instructions[block.end - 1];
+        const Opcode opcode = Opcode(last.opcode);
+        if (opcode == Opcode::JUMP || opcode == Opcode::JUMP_Z) {
+            const int target = getBlockAt(last.operand);
+            if (target >= 0) {
+                block.successors.push_back(size_t(target));
+            }
+        }
+        if (!endsFlow(last) && b + 1 < m_blocks.size()) {
+            block.successors.push_back(b + 1);
+        }
+    }
+}
+
+bool ControlFlowGraph::decode(const std::vector<uint8_t>& bytecode, size_t address, const std::array<uint16_t, 128>& subroutineTable,
+                              DecodedInstruction& instruction) {
+    instruction.address = uint16_t(address);
+    instruction.opcode = bytecode[address];
+    instruction.operand = 0;
+
+    const OperandType operandType = getOpcodeInfo(instruction.opcode).operandType;
+    const size_t remaining = bytecode.size() - address;
+    instruction.length = uint16_t(getFixedLength(operandType));
+    if (instruction.length > remaining) {
+        return false;
+    }
+    switch (operandType) {
+        case OperandType::NONE:
+            if (instruction.opcode >= 128) {
+                instruction.operand = subroutineTable[instruction.opcode - 128];
+            }
+            break;
+        case OperandType::BYTE:
+        case OperandType::WORD:
+            instruction.operand = 1;
+            break;
+        case OperandType::ADDRESS:
+            instruction.operand = uint16_t(bytecode[address + 1] | (bytecode[address + 2] << 8));
+            break;
+        case OperandType::BYTE_LIST:
+        case OperandType::WORD_LIST:
+            instruction.length = uint16_t(instruction.length + bytecode[address + 1]);
+            instruction.operand = (operandType == OperandType::WORD_LIST) ? bytecode[address + 1] / 2 : bytecode[address + 1];
+            break;
+    }
+    return instruction.length <= remaining;
+}
+
+int ControlFlowGraph::getInstructionAt(uint16_t address) const { return (address < m_instructionAt.size()) ? m_instructionAt[address] : -1; }
+
+int ControlFlowGraph::getBlockAt(uint16_t address) const { return (address < m_blockAt.size()) ? m_blockAt[address] : -1; }
+
+bool ControlFlowGraph::isCall(const DecodedInstruction& instruction) {
+    return instruction.opcode >= 128 || Opcode(instruction.opcode) == Opcode::CALL;
+}
+
+bool ControlFlowGraph::isLiteral(const DecodedInstruction& instruction) {
+    switch (Opcode(instruction.opcode)) {
+        case Opcode::LITERAL:
+        case Opcode::LITERAL8:
+        case Opcode::LITERAL_N:
+        case Opcode::LITERAL8_N:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool ControlFlowGraph::endsFlow(const DecodedInstruction& instruction) {
+    switch (Opcode(instruction.opcode)) {
+        case Opcode::QUIT:
+        case Opcode::RETURN:
+        case Opcode::JUMP:
+            return true;
+        default:
+            return false;
+    }
+}
+}  // namespace Maestro
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Maestro {
+
+/// Basic blocks and control flow edges of a compiled script.
+class ControlFlowGraph {
+   public:
+    /// One instruction decoded from the bytecode.
+    struct DecodedInstruction {
+        uint16_t address;
+        uint8_t opcode;
+        /// Size in bytes, operands included.
+        uint16_t length;
+        /// Jump or CALL target, subroutine address for the one-byte call
+        /// opcodes, or number of values pushed by a literal instruction.
+        uint16_t operand;
+    };
+
+    /// A run of instructions that is only entered at its first instruction.
+    /// Subroutine calls do not end a block.
+    struct BasicBlock {
+        uint16_t address;
+        /// Index of the first instruction and one past the last one.
+        size_t begin;
+        size_t end;
+        std::vector<size_t> successors;
+    };
+
+    ControlFlowGraph(const std::vector<uint8_t>& bytecode, const std::array<uint16_t, 128>& subroutineTable);
+
+    const std::vector<uint8_t>& getBytecode() const { return m_bytecode; }
+    const std::vector<DecodedInstruction>& getInstructions() const { return m_instructions; }
+    const std::vector<BasicBlock>& getBlocks() const { return m_blocks; }
+
+    /// Index of the instruction starting at \a address, or -1 if no instruction starts there.
+    int getInstructionAt(uint16_t address) const;
+
+    /// Index of the block starting at \a address, or -1 if no block starts there.
+    int getBlockAt(uint16_t address) const;
+
+    /// Problems found while decoding: truncated instructions and jumps to
+    /// addresses that are not the start of an instruction.
+    const std::vector<std::pair<uint16_t, std::string>>& getProblems() const { return m_problems; }
+
+    /**
+     * @brief Decodes the instruction starting at \a address, using the operand
+     * layout from OPCODE_INFO.
+     *
+     * @return False if the instruction is truncated by the end of the bytecode.
+     */
+    static bool decode(const std::vector<uint8_t>& bytecode, size_t address, const std::array<uint16_t, 128>& subroutineTable,
+                       DecodedInstruction& instruction);
+
+    static bool isCall(const DecodedInstruction& instruction);
+    static bool isLiteral(const DecodedInstruction& instruction);
+    /// True if execution never continues with the next instruction.
+    static bool endsFlow(const DecodedInstruction& instruction);
+
+   private:
+    std::vector<uint8_t> m_bytecode;
+    std::vector<DecodedInstruction> m_instructions;
+    std::vector<int> m_instructionAt;
+    std::vector<BasicBlock> m_blocks;
+    std::vector<int> m_blockAt;
+    std::vector<std::pair<uint16_t, std::string>> m_problems;
+};
+}  // namespace Maestro
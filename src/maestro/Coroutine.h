@@ -0,0 +1,342 @@
+#pragma once
+
+#include "Device.h"
+
+#if !defined(__cpp_impl_coroutine)
+#error "maestro/Coroutine.h needs a C++20 compiler with coroutines."
+#endif
+
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <list>
+#include <map>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace Maestro {
+class Executor;
+
+/// The part of the promise of a Task that does not depend on its result.
+class TaskPromiseBase {
+   public:
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+            const std::coroutine_handle<> continuation = handle.promise().m_continuation;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { m_exception = std::current_exception(); }
+
+    /// The coroutine awaiting the task, resumed when it returns.
+    std::coroutine_handle<> m_continuation;
+    std::exception_ptr m_exception;
+};
+
+template <typename T>
+class TaskPromise : public TaskPromiseBase {
+   public:
+    void return_value(T value) { m_value = std::move(value); }
+    T getResult() {
+        if (m_exception) {
+            std::rethrow_exception(m_exception);
+        }
+        return std::move(*m_value);
+    }
+
+   private:
+    std::optional<T> m_value;
+};
+
+template <>
+class TaskPromise<void> : public TaskPromiseBase {
+   public:
+    void return_void() {}
+    void getResult() {
+        if (m_exception) {
+            std::rethrow_exception(m_exception);
+        }
+    }
+};
+
+/**
+ * @brief A coroutine returning \a T.
+ *
+ * It starts when it is awaited, and resumes its awaiter when it returns, or
+ * when it is given to Executor::spawn().  An exception escaping it is thrown
+ * to its awaiter.
+ */
+template <typename T = void>
+class Task {
+   public:
+    struct promise_type : TaskPromise<T> {
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+    };
+
+    Task(Task &&other) noexcept : m_handle(std::exchange(other.m_handle, nullptr)) {}
+    Task &operator=(Task &&other) noexcept {
+        std::swap(m_handle, other.m_handle);
+        return *this;
+    }
+    ~Task() {
+        if (m_handle) {
+            m_handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+        m_handle.promise().m_continuation = awaiter;
+        return m_handle;
+    }
+    T await_resume() { return m_handle.promise().getResult(); }
+
+   private:
+    friend class Executor;
+    explicit Task(std::coroutine_handle<promise_type> handle) : m_handle(handle) {}
+
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+/**
+ * @brief Runs coroutines on the thread calling run().
+ *
+ * The coroutines awaiting a request of an AsyncDevice are resumed by the
+ * completion of the request, from Device::handleEvents(): thousands of
+ * motion sequences on many devices run on one thread, without a thread per
+ * device.  Since Device::handleEvents() completes the requests of every
+ * device, a program makes its requests from a single Executor.
+ */
+class Executor {
+   public:
+    /// Starts \a task on the next run().
+    void spawn(Task<void> task) {
+        m_tasks.push_back(std::move(task));
+        schedule(m_tasks.back().m_handle);
+    }
+
+    /// Resumes \a handle on the next iteration of run().  Only called from the thread of run().
+    void schedule(std::coroutine_handle<> handle) { m_ready.push_back(handle); }
+
+    /// Awaitable suspending the coroutine for \a delay.
+    auto sleepFor(std::chrono::milliseconds delay) { return Sleep{*this, std::chrono::steady_clock::now() + delay}; }
+
+    /**
+     * @brief Runs until every spawned task has returned.
+     *
+     * An exception escaping a spawned task is thrown by run(), and the other
+     * tasks are resumed by the next call.
+     */
+    void run() {
+        while (!m_tasks.empty()) {
+            while (!m_ready.empty()) {
+                const std::coroutine_handle<> handle = m_ready.front();
+                m_ready.pop_front();
+                handle.resume();
+            }
+            for (auto task = m_tasks.begin(); task != m_tasks.end();) {
+                if (!task->m_handle.done()) {
+                    ++task;
+                    continue;
+                }
+                const std::exception_ptr exception = task->m_handle.promise().m_exception;
+                task = m_tasks.erase(task);
+                if (exception) {
+                    std::rethrow_exception(exception);
+                }
+            }
+            if (m_tasks.empty()) {
+                break;
+            }
+
+            const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            while (!m_timers.empty() && m_timers.begin()->first <= now) {
+                schedule(m_timers.begin()->second);
+                m_timers.erase(m_timers.begin());
+            }
+            std::chrono::milliseconds timeout(100);
+            if (!m_ready.empty()) {
+                timeout = std::chrono::milliseconds(0);
+            } else if (!m_timers.empty()) {
+                timeout = std::chrono::ceil<std::chrono::milliseconds>(m_timers.begin()->first - now);
+            }
+            const size_t pending = Device::handleEvents(timeout);
+            if (pending == 0 && m_ready.empty()) {
+                if (m_timers.empty()) {
+                    throw "Every task waits, but no request or timer is pending.";
+                }
+                std::this_thread::sleep_until(m_timers.begin()->first);
+            }
+        }
+    }
+
+   private:
+    struct Sleep {
+        Executor &executor;
+        std::chrono::steady_clock::time_point deadline;
+
+        bool await_ready() const noexcept { return deadline <= std::chrono::steady_clock::now(); }
+        void await_suspend(std::coroutine_handle<> handle) { executor.m_timers.emplace(deadline, handle); }
+        void await_resume() noexcept {}
+    };
+
+    std::list<Task<void>> m_tasks;
+    std::deque<std::coroutine_handle<>> m_ready;
+    std::multimap<std::chrono::steady_clock::time_point, std::coroutine_handle<>> m_timers;
+};
+
+/**
+ * @brief Awaitable of an asynchronous request of Device, returning \a T.
+ *
+ * The request is made when it is awaited.  Awaiting it throws the error of
+ * the request, like the blocking call.
+ */
+template <typename T>
+class Request {
+   public:
+    using Start = std::function<void(T *result, Device::Completion completion)>;
+
+    Request(Executor &executor, Start start) : m_executor(executor), m_start(std::move(start)) {}
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle) {
+        m_start(&m_result, [this, handle](const std::string &error) {
+            m_error = error;
+            m_executor.schedule(handle);
+        });
+    }
+    T await_resume() {
+        if (!m_error.empty()) {
+            throw m_error;
+        }
+        return std::move(m_result);
+    }
+
+   private:
+    Executor &m_executor;
+    Start m_start;
+    T m_result{};
+    std::string m_error;
+};
+
+template <>
+class Request<void> {
+   public:
+    using Start = std::function<void(Device::Completion completion)>;
+
+    Request(Executor &executor, Start start) : m_executor(executor), m_start(std::move(start)) {}
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle) {
+        m_start([this, handle](const std::string &error) {
+            m_error = error;
+            m_executor.schedule(handle);
+        });
+    }
+    void await_resume() {
+        if (!m_error.empty()) {
+            throw m_error;
+        }
+    }
+
+   private:
+    Executor &m_executor;
+    Start m_start;
+    std::string m_error;
+};
+
+/**
+ * @brief Awaitable versions of the calls of a Device, for the coroutines of an Executor.
+ *
+ *     Task<> sweep(AsyncDevice &device) {
+ *         co_await device.setTarget(0, 4000);
+ *         while ((co_await device.getServoStatus())[0].position != 4000) {
+ *             co_await device.getExecutor().sleepFor(std::chrono::milliseconds(20));
+ *         }
+ *         co_await device.setTarget(0, 8000);
+ *     }
+ *
+ * The calls return awaitables rather than tasks: a request costs its USB
+ * transfers, and no coroutine frame.
+ */
+class AsyncDevice {
+   public:
+    AsyncDevice(Executor &executor, Device device) : m_executor(executor), m_device(std::move(device)) {}
+
+    Executor &getExecutor() { return m_executor; }
+    Device &getDevice() { return m_device; }
+
+    Request<void> setTarget(uint8_t channelNumber, uint16_t target) {
+        return request([=, this](Device::Completion completion) { m_device.setTargetAsync(channelNumber, target, std::move(completion)); });
+    }
+    Request<void> setTargets(uint8_t firstChannel, const std::vector<uint16_t> &targets) {
+        return request([=, this](Device::Completion completion) {
+            m_device.setTargetsAsync(firstChannel, targets.data(), targets.size(), std::move(completion));
+        });
+    }
+    Request<void> setSpeed(uint8_t channelNumber, uint16_t speed) {
+        return request([=, this](Device::Completion completion) { m_device.setSpeedAsync(channelNumber, speed, std::move(completion)); });
+    }
+    Request<void> setAcceleration(uint8_t channelNumber, uint16_t acceleration) {
+        return request(
+            [=, this](Device::Completion completion) { m_device.setAccelerationAsync(channelNumber, acceleration, std::move(completion)); });
+    }
+    Request<std::vector<Device::ServoStatus>> getServoStatus() {
+        return Request<std::vector<Device::ServoStatus>>(m_executor, [this](std::vector<Device::ServoStatus> *status, Device::Completion completion) {
+            status->resize(m_device.getNumChannels());
+            m_device.getServoStatusAsync(status->data(), std::move(completion));
+        });
+    }
+    Request<Device::ChannelSettings> getChannelSettings(uint8_t channel) {
+        return Request<Device::ChannelSettings>(m_executor, [=, this](Device::ChannelSettings *settings, Device::Completion completion) {
+            m_device.getChannelSettingsAsync(channel, settings, std::move(completion));
+        });
+    }
+    Request<void> setChannelSettings(uint8_t channel, const Device::ChannelSettings &settings) {
+        return request([=, this](Device::Completion completion) { m_device.setChannelSettingsAsync(channel, settings, std::move(completion)); });
+    }
+    Request<void> eraseScript() {
+        return request([this](Device::Completion completion) { m_device.eraseScriptAsync(std::move(completion)); });
+    }
+    Request<void> restartScript() {
+        return request([this](Device::Completion completion) { m_device.restartScriptAsync(std::move(completion)); });
+    }
+    Request<void> restartScriptAtSubroutine(uint8_t subroutineNumber) {
+        return request([=, this](Device::Completion completion) { m_device.restartScriptAtSubroutineAsync(subroutineNumber, std::move(completion)); });
+    }
+    Request<void> restartScriptAtSubroutineWithParameter(uint8_t subroutineNumber, uint16_t parameter) {
+        return request([=, this](Device::Completion completion) {
+            m_device.restartScriptAtSubroutineWithParameterAsync(subroutineNumber, parameter, std::move(completion));
+        });
+    }
+    Request<void> setScriptDone(uint8_t value) {
+        return request([=, this](Device::Completion completion) { m_device.setScriptDoneAsync(value, std::move(completion)); });
+    }
+    Request<void> clearErrors() {
+        return request([this](Device::Completion completion) { m_device.clearErrorsAsync(std::move(completion)); });
+    }
+    Request<void> writeScript(const std::vector<uint8_t> &bytecode) {
+        return request([=, this](Device::Completion completion) { m_device.writeScriptAsync(bytecode.data(), bytecode.size(), std::move(completion)); });
+    }
+    Request<uint16_t> getScriptCRC() {
+        return Request<uint16_t>(m_executor, [this](uint16_t *crc, Device::Completion completion) { m_device.getScriptCRCAsync(crc, std::move(completion)); });
+    }
+
+   private:
+    Request<void> request(Request<void>::Start start) { return Request<void>(m_executor, std::move(start)); }
+
+    Executor &m_executor;
+    Device m_device;
+};
+}  // namespace Maestro
@@ -2,9 +2,32 @@
 
 #include <libusb.h>
 
+#include "FlashImage.h"
+#include "UsbLocation.h"
+
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <random>
 #include <stdexcept>
 #include <string>
+#include <thread>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/usbdevice_fs.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
 
 // microsoft.....
 #ifdef IGNORE
@@ -264,57 +287,1247 @@ void requireArgumentRange(uint32_t argumentValue, uint32_t minimum, uint32_t max
     }
 }
 
+/// A vendor OUT control transfer, with at most 16 data bytes.
+struct OutTransfer {
+    uint16_t value;
+    uint16_t index;
+    uint16_t length;
+    std::array<uint8_t, 16> data;
+};
+
+/// Splits \a data into the 16-byte blocks written with REQUEST_WRITE_SCRIPT,
+/// numbered from \a firstBlock.  The last block is padded with 0xFF so that
+/// the flash is not changed needlessly.
+std::vector<OutTransfer> getScriptBlocks(const uint8_t* data, size_t size, uint16_t firstBlock) {
+    std::vector<OutTransfer> blocks((size + 15) / 16);
+    for (size_t i = 0; i < blocks.size(); i++) {
+        blocks[i].value = 0;
+        blocks[i].index = uint16_t(firstBlock + i);
+        blocks[i].length = 16;
+        blocks[i].data.fill(0xFF);
+        std::copy(data + 16 * i, data + std::min(size, 16 * i + 16), blocks[i].data.begin());
+    }
+    return blocks;
+}
+
+// Errors of the transfers, compared by address to tell them from the others.
+/// The device is gone from the bus.
+const char* const DEVICE_DISCONNECTED = "the device has been disconnected";
+const char* const TRANSFER_TIMED_OUT = "the transfer timed out";
+/// By usb_device::cancel().
+const char* const TRANSFER_CANCELLED = "the transfer was cancelled";
+/// The deadline of the call had passed before the transfer.
+const char* const DEADLINE_PASSED = "the deadline has passed";
+
+/// The error of a libusb transfer ending with \a status, or null if it completed.
+const char* getTransferError(libusb_transfer_status status) {
+    switch (status) {
+        case LIBUSB_TRANSFER_COMPLETED:
+            return nullptr;
+        case LIBUSB_TRANSFER_TIMED_OUT:
+            return TRANSFER_TIMED_OUT;
+        case LIBUSB_TRANSFER_STALL:
+            return "the control request was not supported by the device";
+        case LIBUSB_TRANSFER_NO_DEVICE:
+            return DEVICE_DISCONNECTED;
+        case LIBUSB_TRANSFER_CANCELLED:
+            return TRANSFER_CANCELLED;
+        default:
+            return "the transfer failed";
+    }
+}
+
+/// A control transfer of an asynchronous request.
+struct AsyncTransfer {
+    uint8_t requestType;
+    uint8_t request;
+    uint16_t value;
+    uint16_t index;
+    uint16_t length;
+    /// The data of an OUT transfer.
+    std::array<uint8_t, 16> data;
+    /// Receives the data of an IN transfer.
+    uint8_t* in;
+};
+
+AsyncTransfer vendorOut(uint8_t request, uint16_t value, uint16_t index) { return {0x40, request, value, index, 0, {}, nullptr}; }
+
+AsyncTransfer vendorIn(uint8_t request, uint16_t value, uint16_t index, uint8_t* in, uint16_t length) {
+    return {0xC0, request, value, index, length, {}, in};
+}
+
+AsyncTransfer getParameterTransfer(Device::Parameter parameter, uint8_t* in) {
+    return vendorIn(REQUEST_GET_PARAMETER, 0, parameter, in, getRange(parameter).bytes);
+}
+
+AsyncTransfer setParameterTransfer(Device::Parameter parameter, uint16_t value) {
+    return vendorOut(REQUEST_SET_PARAMETER, value, uint16_t((getRange(parameter).bytes << 8) + parameter));
+}
+
+/// Shared by every device: their libusb context, and the completions of their
+/// asynchronous requests waiting for Device::handleEvents().
+struct AsyncState {
+    std::mutex mutex;
+    std::weak_ptr<libusb_context> context;
+    /// Transfers submitted to libusb and not completed yet.
+    size_t submitted = 0;
+    std::deque<std::function<void()>> completions;
+    /// The transfers in flight, blocking or not, and their usb_device, for usb_device::cancel().
+    std::map<libusb_transfer*, const void*> inFlight;
+};
+
+AsyncState& getAsyncState() {
+    static AsyncState state;
+    return state;
+}
+
+void deferCompletion(std::function<void()> completion) {
+    AsyncState& state = getAsyncState();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    state.completions.push_back(std::move(completion));
+}
+
+/// Registers \a transfer of \a owner as in flight, until untrackTransfer().
+void trackTransfer(const void* owner, libusb_transfer* transfer) {
+    AsyncState& state = getAsyncState();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    state.inFlight[transfer] = owner;
+}
+
+/// Called before \a transfer is freed or submitted again.
+void untrackTransfer(libusb_transfer* transfer) {
+    AsyncState& state = getAsyncState();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    state.inFlight.erase(transfer);
+}
+
+/// Cancels the transfers in flight of \a owner.  They complete later, with the error TRANSFER_CANCELLED.
+void cancelTransfers(const void* owner) {
+    AsyncState& state = getAsyncState();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    for (const std::pair<libusb_transfer* const, const void*>& transfer : state.inFlight) {
+        if (transfer.second == owner) {
+            libusb_cancel_transfer(transfer.first);
+        }
+    }
+}
+
+bool hasTransfersInFlight(const void* owner) {
+    AsyncState& state = getAsyncState();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    for (const std::pair<libusb_transfer* const, const void*>& transfer : state.inFlight) {
+        if (transfer.second == owner) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// Cancels \a transfer if it is still in flight: an asynchronous transfer is freed by its completion.
+void cancelTransferInFlight(libusb_transfer* transfer) {
+    AsyncState& state = getAsyncState();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    if (state.inFlight.count(transfer) != 0) {
+        libusb_cancel_transfer(transfer);
+    }
+}
+
+/// A Device::Deadline living on the current thread.
+struct ThreadDeadline {
+    const Device::Deadline* owner;
+    const void* device;
+    std::chrono::steady_clock::time_point deadline;
+};
+
+/// The deadlines of each thread apply to its calls only.
+thread_local std::vector<ThreadDeadline> threadDeadlines;
+
+/// The earliest deadline set on the current thread for the calls of \a device.
+std::chrono::steady_clock::time_point getThreadDeadline(const void* device) {
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    for (const ThreadDeadline& entry : threadDeadlines) {
+        if (entry.device == device) {
+            deadline = std::min(deadline, entry.deadline);
+        }
+    }
+    return deadline;
+}
+
+/// A transfer submitted to libusb by usb_device::submitTransfer().
+struct PendingTransfer {
+    std::vector<uint8_t> buffer;
+    uint8_t* in;
+    std::function<void(const char* error)> completion;
+};
+
+void LIBUSB_CALL onAsyncTransferCompleted(libusb_transfer* transfer) {
+    PendingTransfer* pending = static_cast<PendingTransfer*>(transfer->user_data);
+    const char* error = getTransferError(transfer->status);
+    if (error == nullptr && pending->in != nullptr) {
+        if (size_t(transfer->actual_length) + LIBUSB_CONTROL_SETUP_SIZE < pending->buffer.size()) {
+            error = "the device sent less data than requested";
+        }
+        std::copy_n(libusb_control_transfer_get_data(transfer), transfer->actual_length, pending->in);
+    }
+    const std::function<void(const char*)> completion = pending->completion;
+    delete pending;
+
+    // Called later by Device::handleEvents(), outside of the libusb event handling.
+    AsyncState& state = getAsyncState();
+    {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.inFlight.erase(transfer);
+        state.submitted--;
+        state.completions.push_back([completion, error] { completion(error); });
+    }
+    libusb_free_transfer(transfer);
+}
+
+/// The parameter holding the modes of \a channel and of 3 channels next to it, on the Mini Maestro.
+Device::Parameter getChannelModesParameter(uint8_t channel) { return Device::Parameter(Device::PARAMETER_CHANNEL_MODES_0_3 + (channel >> 2)); }
+
+/// The parameters read by Device::getChannelSettings(), in the order decodeChannelSettings() expects them.
+std::vector<Device::Parameter> getChannelSettingsParameters(bool microMaestro, uint8_t channel) {
+    std::vector<Device::Parameter> parameters;
+    if (microMaestro) {
+        parameters.push_back(Device::PARAMETER_IO_MASK_C);
+        parameters.push_back(Device::PARAMETER_OUTPUT_MASK_C);
+    } else {
+        parameters.push_back(getChannelModesParameter(channel));
+    }
+    for (Device::Parameter parameter : {Device::PARAMETER_SERVO0_HOME, Device::PARAMETER_SERVO0_MIN, Device::PARAMETER_SERVO0_MAX, Device::PARAMETER_SERVO0_NEUTRAL,
+                                        Device::PARAMETER_SERVO0_RANGE, Device::PARAMETER_SERVO0_SPEED, Device::PARAMETER_SERVO0_ACCELERATION}) {
+        parameters.push_back(specifyServo(parameter, channel));
+    }
+    return parameters;
+}
+
+Device::ChannelSettings decodeChannelSettings(bool microMaestro, uint8_t channel, const uint16_t* values) {
+    Device::ChannelSettings settings;
+    if (microMaestro) {
+        uint8_t ioMask = (uint8_t)*values++;
+        uint8_t outputMask = (uint8_t)*values++;
+        uint8_t bitmask = uint8_t(1 << channelToPort(channel));
+        if ((ioMask & bitmask) == 0) {
+            settings.mode = Device::ChannelMode::SERVO;
+        } else if ((outputMask & bitmask) == 0) {
+            settings.mode = Device::ChannelMode::INPUT;
+        } else {
+            settings.mode = Device::ChannelMode::OUTPUT;
+        }
+    } else {
+        uint8_t channelModeBytes = (uint8_t)*values++;
+
+        settings.mode = Device::ChannelMode((channelModeBytes >> ((channel & 3) << 1)) & 3);
+    }
+
+    const uint16_t home = values[0];
+    if (home == 0) {
+        settings.homeMode = Device::HomeMode::OFF;
+        settings.home = 0;
+    } else if (home == 1) {
+        settings.homeMode = Device::HomeMode::IGNORE;
+        settings.home = 0;
+    } else {
+        settings.homeMode = Device::HomeMode::GOTO;
+        settings.home = home;
+    }
+
+    settings.minimum = 64 * values[1];
+    settings.maximum = 64 * values[2];
+    settings.neutral = values[3];
+    settings.range = 127 * values[4];
+    settings.speed = exponentialSpeedToNormalSpeed((uint8_t)values[5]);
+    settings.acceleration = (uint8_t)values[6];
+    return settings;
+}
+
+/// The parameters written by Device::setChannelSettings(), in order.  \a channelModeBytes is the
+/// current value of the channel modes parameter of \a channel, on the Mini Maestro.
+std::vector<std::pair<Device::Parameter, uint16_t>> encodeChannelSettings(bool microMaestro, uint8_t channel, const Device::ChannelSettings& settings,
+                                                                          uint8_t channelModeBytes) {
+    std::vector<std::pair<Device::Parameter, uint16_t>> parameters;
+    if (microMaestro) {
+        /*
+        if (settings.mode == ChannelMode::INPUT || settings.mode == ChannelMode::OUTPUT) {
+            ioMask |= (uint8_t)(1 << channelToPort(channel));
+        }
+
+        if (setting.mode == ChannelMode.Output) {
+            outputMask |= (uint8_t)(1 << channelToPort(channel));
+        }*/
+    } else {
+        channelModeBytes &= (uint8_t) ~(3 << ((channel & 3) << 1));
+        channelModeBytes |= uint8_t(uint8_t(settings.mode) << ((channel & 3) << 1));
+
+        parameters.emplace_back(getChannelModesParameter(channel), channelModeBytes);
+    }
+
+    // Make sure that HomeMode is "Ignore" for inputs.
+    Device::HomeMode correctedHomeMode = settings.homeMode;
+    if (settings.mode == Device::ChannelMode::INPUT) {
+        correctedHomeMode = Device::HomeMode::IGNORE;
+    }
+
+    parameters.emplace_back(specifyServo(Device::PARAMETER_SERVO0_HOME, channel), uint8_t(correctedHomeMode));
+
+    parameters.emplace_back(specifyServo(Device::PARAMETER_SERVO0_MIN, channel), settings.minimum / 64);
+    parameters.emplace_back(specifyServo(Device::PARAMETER_SERVO0_MAX, channel), settings.maximum / 64);
+    parameters.emplace_back(specifyServo(Device::PARAMETER_SERVO0_NEUTRAL, channel), settings.neutral);
+    parameters.emplace_back(specifyServo(Device::PARAMETER_SERVO0_RANGE, channel), settings.range / 127);
+    parameters.emplace_back(specifyServo(Device::PARAMETER_SERVO0_SPEED, channel), normalSpeedToExponentialSpeed(settings.speed));
+    parameters.emplace_back(specifyServo(Device::PARAMETER_SERVO0_ACCELERATION, channel), settings.acceleration);
+
+    if (microMaestro) { /*
+                           setRawParameter(PARAMETER_IO_MASK_C, ioMask);
+                           setRawParameter(PARAMETER_OUTPUT_MASK_C, outputMask);*/
+    } else {            /*
+                           for (uint8_t i = 0; i < 6; i++)
+                           {
+                               setRawParameter(PARAMETER_CHANNEL_MODES_0_3 + i, channelModeBytes[i]);
+                           }*/
+    }
+    return parameters;
+}
+
+std::string getDeviceLocation(libusb_device* device) {
+    std::string location = std::to_string(libusb_get_bus_number(device));
+    uint8_t ports[8];
+    const int count = libusb_get_port_numbers(device, ports, sizeof(ports));
+    for (int i = 0; i < count; i++) {
+        location += ((i == 0) ? "-" : ".") + std::to_string(ports[i]);
+    }
+    return location;
+}
+
+void LIBUSB_CALL onTransferCompleted(libusb_transfer* transfer) { *static_cast<int*>(transfer->user_data) = 1; }
+
+/// Nothing to do: the arrival of a device only has to wake up libusb_handle_events_timeout_completed().
+int LIBUSB_CALL onDeviceArrived(libusb_context*, libusb_device*, libusb_hotplug_event, void*) { return 0; }
+
+/// The serial number of the device opened as \a handle, or an empty string.
+std::string getSerialNumber(libusb_device* device, libusb_device_handle* handle) {
+    libusb_device_descriptor descriptor;
+    unsigned char serialNumber[64];
+    if (libusb_get_device_descriptor(device, &descriptor) != 0 || descriptor.iSerialNumber == 0) {
+        return "";
+    }
+    const int length = libusb_get_string_descriptor_ascii(handle, descriptor.iSerialNumber, serialNumber, sizeof(serialNumber));
+    return (length > 0) ? std::string(reinterpret_cast<char*>(serialNumber), size_t(length)) : "";
+}
+
+#ifdef __linux__
+/// The message of a usbfs transfer failing with \a error, like the libusb ones.
+const char* getUsbfsError(int error) {
+    switch (error) {
+        case ETIMEDOUT:
+            return TRANSFER_TIMED_OUT;
+        case EPIPE:
+            return "the control request was not supported by the device";
+        case ENODEV:
+        case ESHUTDOWN:
+            return DEVICE_DISCONNECTED;
+        // The status of a URB discarded by usb_device::cancel().
+        case ENOENT:
+        case ECONNRESET:
+            return TRANSFER_CANCELLED;
+        case EINVAL:
+            return "the transfer size is larger than the operating system and/or hardware can support";
+        default:
+            return "the transfer failed";
+    }
+}
+#endif
+
 class Device::usb_device {
    public:
-    usb_device(std::shared_ptr<libusb_context> context, libusb_device* device) : m_context(context), m_device(device) { libusb_ref_device(m_device); }
+    usb_device(std::shared_ptr<libusb_context> context, libusb_device* device, uint16_t productID)
+        : m_context(context), m_device(device), m_productID(productID) {
+        libusb_ref_device(m_device);
+    }
     ~usb_device() {
         close();
+        selectBackend(UsbBackend::LIBUSB);
         libusb_unref_device(m_device);
     }
-    void open() {
+    /// Returns the error of libusb_open(), or LIBUSB_SUCCESS.
+    int open() {
+        // The copies of a Device share this, and may be used from several threads.
+        std::lock_guard<std::mutex> lock(m_openMutex);
         if (!m_deviceHandle) {
-            libusb_open(m_device, &m_deviceHandle);
+            return libusb_open(m_device, &m_deviceHandle);
+        }
+        return LIBUSB_SUCCESS;
+    }
+    void close() {
+        if (m_deviceHandle != nullptr) {
+            libusb_close(m_deviceHandle);
+            m_deviceHandle = nullptr;
         }
     }
-    void close() { libusb_close(m_deviceHandle); }
 
+    std::string getLocation() const {
+        std::lock_guard<std::mutex> lock(m_openMutex);
+        return getDeviceLocation(m_device);
+    }
+
+    /// Waits for the transfers in flight on the current backend.
+    void setBackend(UsbBackend backend) {
+        ExclusiveHandleUse use(*this);
+        selectBackend(backend);
+    }
+
+    /// Makes a control transfer, again after each reconnection following a disconnection.
     uint32_t controlTransfer(uint8_t RequestType, uint8_t Request, uint16_t Value, uint16_t Index, uint8_t* data = nullptr, uint16_t length = 0) {
-        open();
-
-        const int ret = libusb_control_transfer(m_deviceHandle, RequestType, Request, Value, Index, data, length, 5000);
-        switch (ret) {
-            case LIBUSB_ERROR_TIMEOUT:
-                throw "the transfer timed out";
-            case LIBUSB_ERROR_PIPE:
-                throw "the control request was not supported by the device";
-            case LIBUSB_ERROR_NO_DEVICE:
-                throw "the device has been disconnected";
-            case LIBUSB_ERROR_BUSY:
-                throw "called from event handling context";
-            case LIBUSB_ERROR_INVALID_PARAM:
-                throw "the transfer size is larger than the operating system and/or hardware can support";
-            default:
-                break;
+        return controlTransferCall(m_cancelCount, RequestType, Request, Value, Index, data, length);
+    }
+
+    /// Same as controlTransfer(), for a read without side effect: made again
+    /// after a failure, as far as the retry policy allows.
+    uint32_t readTransfer(uint8_t Request, uint16_t Value, uint16_t Index, uint8_t* data, uint16_t length) {
+        const uint32_t cancelCount = m_cancelCount;
+        RetryPolicy retryPolicy;
+        {
+            std::lock_guard<std::mutex> lock(m_healthMutex);
+            retryPolicy = m_retryPolicy;
+        }
+        for (unsigned int attempt = 1;; attempt++) {
+            try {
+                return controlTransferCall(cancelCount, 0xC0, Request, Value, Index, data, length);
+            } catch (const char* error) {
+                // A device gone, a cancellation or a deadline passed are final.
+                if (attempt >= retryPolicy.attempts || error == DEVICE_DISCONNECTED || error == TRANSFER_CANCELLED || error == DEADLINE_PASSED ||
+                    m_cancelCount != cancelCount) {
+                    throw;
+                }
+                // Exponential backoff with full jitter: the delay is drawn below a
+                // limit doubled at each attempt, so that devices do not retry in step.
+                thread_local std::minstd_rand random(std::random_device{}());
+                const std::chrono::microseconds limit = retryPolicy.backoff * (1 << std::min(attempt - 1, 10u));
+                const std::chrono::microseconds delay(std::uniform_int_distribution<long long>(0, limit.count())(random));
+                if (std::chrono::steady_clock::now() + delay >= getDeadline()) {
+                    throw;
+                }
+                {
+                    std::lock_guard<std::mutex> lock(m_healthMutex);
+                    m_health.retries++;
+                }
+                std::this_thread::sleep_for(delay);
+            }
+        }
+    }
+
+    /// Sends \a transfers in order, keeping several of them queued so that
+    /// the device never waits for the host between two transfers.  Sends
+    /// them all again after a reconnection.
+    void writeTransfers(uint8_t Request, const std::vector<OutTransfer>& transfers) {
+        for (const OutTransfer& transfer : transfers) {
+            remember(Request, transfer.value, transfer.index);
+        }
+        const uint32_t cancelCount = m_cancelCount;
+        reconnecting(transfers.size(), cancelCount, [&]() { writeTransfersOnce(cancelCount, Request, transfers); });
+    }
+
+    /// Cancels the transfers in flight of the device.  Any thread.
+    ///
+    /// The calls check the count of cancellations before each transfer they
+    /// submit, and again after it, so that a transfer submitted while
+    /// cancel() runs is cancelled by its call.
+    void cancel() {
+        m_cancelCount++;
+        cancelTransfers(this);
+#ifdef __linux__
+        std::lock_guard<std::mutex> lock(m_usbfsMutex);
+        if (m_usbfs >= 0) {
+            // Discarding a URB not in flight fails harmlessly.
+            for (UsbfsSlot& slot : m_usbfsSlots) {
+                ioctl(m_usbfs, USBDEVFS_DISCARDURB, &slot.urb);
+            }
+        }
+#endif
+    }
+
+    void setTimeout(std::chrono::milliseconds timeout) { m_timeout.store(timeout.count(), std::memory_order_relaxed); }
+    /// The deadline of the calls of the current thread, see Device::Deadline.
+    std::chrono::steady_clock::time_point getDeadline() const { return getThreadDeadline(this); }
+    void setRetryPolicy(const RetryPolicy& policy) {
+        std::lock_guard<std::mutex> lock(m_healthMutex);
+        m_retryPolicy = policy;
+    }
+
+    Health getHealth() const {
+        std::lock_guard<std::mutex> lock(m_healthMutex);
+        return m_health;
+    }
+    void setSlowThreshold(std::chrono::microseconds threshold) {
+        std::lock_guard<std::mutex> lock(m_healthMutex);
+        m_slowThreshold = threshold;
+        m_health.slow = m_health.averageLatency > m_slowThreshold;
+    }
+
+    /**
+     * @brief Enables the reconnection after a disconnection, when \a timeout is not 0.
+     *
+     * The serial number, which identifies the device when it comes back, is
+     * read at once.
+     */
+    void setReconnectTimeout(std::chrono::milliseconds timeout) {
+        std::lock_guard<std::timed_mutex> lock(m_reconnectMutex);
+        if (timeout > std::chrono::milliseconds::zero() && m_location.empty()) {
+            m_location = getLocation();
+            try {
+                HandleUse use(*this);
+                m_serialNumber = getSerialNumber(m_device, openForTransfer());
+            } catch (const char*) {
+                // Without serial number, the device is found again by its location.
+            }
+        }
+        m_reconnectTimeout = timeout;
+    }
+
+    /// Submits \a transfer and returns at once.  \a completion is called by
+    /// Device::handleEvents() after the transfer.  It is not made again after
+    /// a reconnection, which would hold up the event handling.
+    void submitTransfer(const AsyncTransfer& transfer, std::function<void(const char* error)> completion) {
+        if (transfer.requestType == 0x40) {
+            remember(transfer.request, transfer.value, transfer.index);
+        }
+        const uint32_t cancelCount = m_cancelCount;
+#ifdef __linux__
+        bool usbfs;
+        {
+            HandleUse use(*this);
+            usbfs = m_usbfs >= 0;
+        }
+        if (usbfs) {
+            // A usbfs control transfer is short enough to be made at once: the
+            // request blocks, and only its completion is deferred.
+            const char* error = nullptr;
+            std::array<uint8_t, 16> data = transfer.data;
+            try {
+                const uint32_t length = controlTransferOnce(cancelCount, transfer.requestType, transfer.request, transfer.value, transfer.index,
+                                                            (transfer.in != nullptr) ? transfer.in : data.data(), transfer.length);
+                if (transfer.in != nullptr && length < transfer.length) {
+                    error = "the device sent less data than requested";
+                }
+            } catch (const char* e) {
+                error = e;
+            }
+            deferCompletion([completion, error] { completion(error); });
+            return;
+        }
+#endif
+        const unsigned int timeout = getTransferTimeout();
+        if (timeout == 0 || m_cancelCount != cancelCount) {
+            const char* error = (timeout == 0) ? DEADLINE_PASSED : TRANSFER_CANCELLED;
+            deferCompletion([completion, error] { completion(error); });
+            return;
+        }
+        // reopen() waits for the submission, then cancels the transfer before closing the handle.
+        HandleUse use(*this);
+        libusb_device_handle* handle;
+        try {
+            handle = openForTransfer();
+        } catch (const char* error) {
+            deferCompletion([completion, error] { completion(error); });
+            return;
+        }
+        libusb_transfer* usbTransfer = libusb_alloc_transfer(0);
+        if (usbTransfer == nullptr) {
+            deferCompletion([completion] { completion("the transfer could not be allocated"); });
+            return;
+        }
+        PendingTransfer* pending = new PendingTransfer{std::vector<uint8_t>(LIBUSB_CONTROL_SETUP_SIZE + transfer.length), transfer.in, completion};
+        libusb_fill_control_setup(pending->buffer.data(), transfer.requestType, transfer.request, transfer.value, transfer.index, transfer.length);
+        if (transfer.in == nullptr) {
+            std::copy_n(transfer.data.begin(), std::min<size_t>(transfer.length, transfer.data.size()), pending->buffer.begin() + LIBUSB_CONTROL_SETUP_SIZE);
+        }
+        libusb_fill_control_transfer(usbTransfer, handle, pending->buffer.data(), onAsyncTransferCompleted, pending, timeout);
+
+        AsyncState& state = getAsyncState();
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            state.submitted++;
+            state.inFlight[usbTransfer] = this;
+        }
+        const int result = libusb_submit_transfer(usbTransfer);
+        if (result != 0) {
+            {
+                std::lock_guard<std::mutex> lock(state.mutex);
+                state.submitted--;
+                state.inFlight.erase(usbTransfer);
+            }
+            delete pending;
+            libusb_free_transfer(usbTransfer);
+            const char* error = (result == LIBUSB_ERROR_NO_DEVICE) ? DEVICE_DISCONNECTED : "the transfer could not be submitted";
+            deferCompletion([completion, error] { completion(error); });
+        } else if (m_cancelCount != cancelCount) {
+            cancelTransferInFlight(usbTransfer);
         }
-        return ret;
     }
 
    private:
+    /// Same as controlTransfer(), failing if cancel() is called after m_cancelCount was \a cancelCount.
+    uint32_t controlTransferCall(uint32_t cancelCount, uint8_t RequestType, uint8_t Request, uint16_t Value, uint16_t Index, uint8_t* data,
+                                 uint16_t length) {
+        if (RequestType == 0x40) {
+            remember(Request, Value, Index);
+        }
+        return reconnecting(1, cancelCount, [&]() { return controlTransferOnce(cancelCount, RequestType, Request, Value, Index, data, length); });
+    }
+
+    uint32_t controlTransferOnce(uint32_t cancelCount, uint8_t RequestType, uint8_t Request, uint16_t Value, uint16_t Index, uint8_t* data,
+                                 uint16_t length) {
+        const unsigned int timeout = startTransfer(cancelCount);
+        HandleUse use(*this);
+#ifdef __linux__
+        if (m_usbfs >= 0) {
+            usbdevfs_ctrltransfer transfer = {RequestType, Request, Value, Index, length, timeout, data};
+            const int ret = ioctl(m_usbfs, USBDEVFS_CONTROL, &transfer);
+            if (ret < 0) {
+                throw getUsbfsError(errno);
+            }
+            return uint32_t(ret);
+        }
+#endif
+        libusb_device_handle* const handle = openForTransfer();
+
+        // Submitted rather than made by libusb_control_transfer(), so that cancel() can cancel it.
+        libusb_transfer* transfer = libusb_alloc_transfer(0);
+        if (transfer == nullptr) {
+            throw "the transfer could not be allocated";
+        }
+        std::vector<unsigned char> buffer(LIBUSB_CONTROL_SETUP_SIZE + length);
+        libusb_fill_control_setup(buffer.data(), RequestType, Request, Value, Index, length);
+        const bool in = (RequestType & 0x80) != 0;
+        if (!in && length > 0) {
+            std::copy_n(data, length, buffer.begin() + LIBUSB_CONTROL_SETUP_SIZE);
+        }
+        int completed = 0;
+        libusb_fill_control_transfer(transfer, handle, buffer.data(), onTransferCompleted, &completed, timeout);
+        trackTransfer(this, transfer);
+        const int result = libusb_submit_transfer(transfer);
+        if (result != 0) {
+            untrackTransfer(transfer);
+            libusb_free_transfer(transfer);
+            throw (result == LIBUSB_ERROR_NO_DEVICE) ? DEVICE_DISCONNECTED : "the transfer could not be submitted";
+        }
+        // A cancel() between startTransfer() and trackTransfer() did not see the transfer.
+        if (m_cancelCount != cancelCount) {
+            libusb_cancel_transfer(transfer);
+        }
+        while (!completed) {
+            timeval wait = {1, 0};
+            libusb_handle_events_timeout_completed(m_context.get(), &wait, &completed);
+        }
+        untrackTransfer(transfer);
+        const char* error = getTransferError(transfer->status);
+        const uint32_t received = uint32_t(transfer->actual_length);
+        if (error == nullptr && in) {
+            std::copy_n(libusb_control_transfer_get_data(transfer), received, data);
+        }
+        libusb_free_transfer(transfer);
+        if (error != nullptr) {
+            throw error;
+        }
+        return received;
+    }
+
+    /// Same as writeTransfers(), once.
+    void writeTransfersOnce(uint32_t cancelCount, uint8_t Request, const std::vector<OutTransfer>& transfers) {
+        startTransfer(cancelCount);
+        HandleUse use(*this);
+#ifdef __linux__
+        if (m_usbfs >= 0) {
+            writeTransfersUsbfs(cancelCount, Request, transfers);
+            return;
+        }
+#endif
+        libusb_device_handle* const handle = openForTransfer();
+
+        const size_t queueLength = 8;
+        struct Slot {
+            libusb_transfer* transfer;
+            bool pending;
+            int completed;
+            std::array<unsigned char, LIBUSB_CONTROL_SETUP_SIZE + 16> buffer;
+        };
+        std::vector<Slot> slots(std::min(queueLength, transfers.size()));
+        size_t next = 0;
+        size_t inFlight = 0;
+        const char* error = nullptr;
+        auto submit = [&](Slot& slot) {
+            if (m_cancelCount != cancelCount) {
+                error = TRANSFER_CANCELLED;
+                return;
+            }
+            const OutTransfer& transfer = transfers[next++];
+            libusb_fill_control_setup(slot.buffer.data(), 0x40, Request, transfer.value, transfer.index, transfer.length);
+            std::copy(transfer.data.begin(), transfer.data.begin() + transfer.length, slot.buffer.begin() + LIBUSB_CONTROL_SETUP_SIZE);
+            // The later transfers of the burst get what is left before the deadline.
+            libusb_fill_control_transfer(slot.transfer, handle, slot.buffer.data(), onTransferCompleted, &slot.completed,
+                                         std::max(1u, getTransferTimeout()));
+            slot.completed = 0;
+            trackTransfer(this, slot.transfer);
+            const int result = libusb_submit_transfer(slot.transfer);
+            if (result != 0) {
+                untrackTransfer(slot.transfer);
+                error = (result == LIBUSB_ERROR_NO_DEVICE) ? DEVICE_DISCONNECTED : "the transfer could not be submitted";
+                return;
+            }
+            slot.pending = true;
+            inFlight++;
+            if (m_cancelCount != cancelCount) {
+                libusb_cancel_transfer(slot.transfer);
+            }
+        };
+
+        for (Slot& slot : slots) {
+            slot.transfer = libusb_alloc_transfer(0);
+            slot.pending = false;
+            if (slot.transfer != nullptr && error == nullptr) {
+                submit(slot);
+            } else if (slot.transfer == nullptr) {
+                error = "the transfer could not be allocated";
+            }
+        }
+        while (inFlight > 0) {
+            timeval timeout = {1, 0};
+            libusb_handle_events_timeout_completed(m_context.get(), &timeout, nullptr);
+            for (Slot& slot : slots) {
+                if (!slot.pending || !slot.completed) {
+                    continue;
+                }
+                slot.pending = false;
+                inFlight--;
+                untrackTransfer(slot.transfer);
+                const char* slotError = getTransferError(slot.transfer->status);
+                if (slotError != nullptr && error == nullptr) {
+                    error = slotError;
+                }
+                // After an error, the transfers already queued are let finish.
+                if (error == nullptr && next < transfers.size()) {
+                    submit(slot);
+                }
+            }
+        }
+        for (Slot& slot : slots) {
+            libusb_free_transfer(slot.transfer);
+        }
+        if (error != nullptr) {
+            throw error;
+        }
+    }
+
+    /// Same as open(), returning the handle, or throwing if the device cannot
+    /// be opened.  The handle stays valid while a HandleUse lives.
+    libusb_device_handle* openForTransfer() {
+        const int result = open();
+        std::lock_guard<std::mutex> lock(m_openMutex);
+        if (m_deviceHandle == nullptr) {
+            throw (result == LIBUSB_ERROR_NO_DEVICE) ? DEVICE_DISCONNECTED : "the device could not be opened";
+        }
+        return m_deviceHandle;
+    }
+
+    /// Same as setBackend(), without waiting for the transfers.
+    void selectBackend(UsbBackend backend) {
+#ifdef __linux__
+        std::lock_guard<std::mutex> lock(m_usbfsMutex);
+        if (backend == UsbBackend::LIBUSB) {
+            if (m_usbfs >= 0) {
+                ::close(m_usbfs);
+                m_usbfs = -1;
+            }
+        } else if (m_usbfs < 0) {
+            char path[32];
+            snprintf(path, sizeof(path), "/dev/bus/usb/%03d/%03d", libusb_get_bus_number(m_device), libusb_get_device_address(m_device));
+            m_usbfs = ::open(path, O_RDWR | O_CLOEXEC);
+            if (m_usbfs < 0) {
+                throw std::string("Cannot open ") + path + ": " + strerror(errno) + ".";
+            }
+        }
+#else
+        if (backend == UsbBackend::USBFS) {
+            throw "The usbfs backend is only available on Linux.";
+        }
+#endif
+    }
+
+    /// Keeps the handle and the usbfs node of the device while it lives: the
+    /// copies of a Device share them, and reopen() or setBackend() replace
+    /// them.  Not nested in a thread, since an ExclusiveHandleUse waiting
+    /// holds up the new ones.
+    class HandleUse {
+       public:
+        explicit HandleUse(usb_device& device) : m_device(device) {
+            std::unique_lock<std::mutex> lock(device.m_handleMutex);
+            device.m_handleReleased.wait(lock, [&device]() { return !device.m_handleExclusive; });
+            device.m_handleUsers++;
+        }
+        ~HandleUse() {
+            std::lock_guard<std::mutex> lock(m_device.m_handleMutex);
+            if (--m_device.m_handleUsers == 0) {
+                m_device.m_handleReleased.notify_all();
+            }
+        }
+
+       private:
+        usb_device& m_device;
+    };
+
+    /// Gives the handle and the usbfs node to a single thread, once the blocking transfers using them are over.
+    class ExclusiveHandleUse {
+       public:
+        explicit ExclusiveHandleUse(usb_device& device) : m_device(device) {
+            std::unique_lock<std::mutex> lock(device.m_handleMutex);
+            device.m_handleReleased.wait(lock, [&device]() { return !device.m_handleExclusive; });
+            device.m_handleExclusive = true;
+            device.m_handleReleased.wait(lock, [&device]() { return device.m_handleUsers == 0; });
+        }
+        ~ExclusiveHandleUse() {
+            std::lock_guard<std::mutex> lock(m_device.m_handleMutex);
+            m_device.m_handleExclusive = false;
+            m_device.m_handleReleased.notify_all();
+        }
+
+       private:
+        usb_device& m_device;
+    };
+
+    /// The timeout of the next transfer in milliseconds: the timeout of the
+    /// device, shortened by the deadline.  0 once the deadline has passed.
+    unsigned int getTransferTimeout() const {
+        const std::chrono::steady_clock::time_point deadline = getDeadline();
+        const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (now >= deadline) {
+            return 0;
+        }
+        const std::chrono::milliseconds timeout(m_timeout.load(std::memory_order_relaxed));
+        if (deadline - now >= timeout) {
+            return unsigned(timeout.count());
+        }
+        // Rounded up, since a libusb timeout of 0 never expires.
+        return unsigned(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now + std::chrono::milliseconds(1) - std::chrono::nanoseconds(1)).count());
+    }
+
+    /// Returns the timeout of the first transfer of a call, or throws once
+    /// the deadline has passed or the call is cancelled.
+    unsigned int startTransfer(uint32_t cancelCount) const {
+        if (m_cancelCount != cancelCount) {
+            throw TRANSFER_CANCELLED;
+        }
+        const unsigned int timeout = getTransferTimeout();
+        if (timeout == 0) {
+            throw DEADLINE_PASSED;
+        }
+        return timeout;
+    }
+
+    /// Records a call of \a count transfers in the health of the device, when destroyed.
+    class Measurement {
+       public:
+        Measurement(usb_device& device, size_t count) : m_device(device), m_count(count), m_start(std::chrono::steady_clock::now()) {}
+        ~Measurement() {
+            const std::chrono::microseconds latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_start);
+            std::lock_guard<std::mutex> lock(m_device.m_healthMutex);
+            Health& health = m_device.m_health;
+            health.transfers += m_count;
+            if (m_error != nullptr) {
+                health.failures++;
+                health.timeouts += (m_error == TRANSFER_TIMED_OUT) ? 1 : 0;
+            }
+            // A moving average weighting the last call 1/16, so that a few slow calls do not mark the device slow.
+            health.averageLatency += (latency - health.averageLatency) / 16;
+            health.maximumLatency = std::max(health.maximumLatency, latency);
+            health.slow = health.averageLatency > m_device.m_slowThreshold;
+        }
+        void fail(const char* error) { m_error = error; }
+
+       private:
+        usb_device& m_device;
+        size_t m_count;
+        std::chrono::steady_clock::time_point m_start;
+        const char* m_error = nullptr;
+    };
+
+    /// Returns \a transfer(), a call of \a count transfers, called again after
+    /// each reconnection following a disconnection, unless it is cancelled.
+    template <typename Transfer>
+    auto reconnecting(size_t count, uint32_t cancelCount, Transfer transfer) -> decltype(transfer()) {
+        for (;;) {
+            const uint32_t reconnections = m_reconnections;
+            try {
+                Measurement measurement(*this, count);
+                try {
+                    return transfer();
+                } catch (const char* error) {
+                    measurement.fail(error);
+                    throw;
+                }
+            } catch (const char* error) {
+                if (error != DEVICE_DISCONNECTED || !reconnect(reconnections, cancelCount)) {
+                    throw;
+                }
+            }
+        }
+    }
+
+    /// Keeps the last targets, speeds and accelerations, which reconnect() sends again.
+    void remember(uint8_t request, uint16_t value, uint16_t index) {
+        const size_t channel = index & 0x7F;
+        if (channel >= m_channels.size()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(m_channelsMutex);
+        if (request == REQUEST_SET_TARGET) {
+            m_channels[channel].target = value;
+            m_channels[channel].hasTarget = true;
+        } else if (request == REQUEST_SET_SERVO_VARIABLE && (index & 0x80)) {
+            m_channels[channel].acceleration = value;
+            m_channels[channel].hasAcceleration = true;
+        } else if (request == REQUEST_SET_SERVO_VARIABLE) {
+            m_channels[channel].speed = value;
+            m_channels[channel].hasSpeed = true;
+        }
+    }
+
+    /**
+     * @brief Waits for the device to come back after a disconnection, and reopens it.
+     *
+     * The last speeds and accelerations, then the last targets, are sent in
+     * two pipelined bursts, so that the servos hold their positions again
+     * within a few milliseconds of the enumeration.
+     *
+     * A single thread reconnects at a time.  The other calls failing
+     * meanwhile wait for it, and are made again if it succeeds.
+     *
+     * @param reconnections The value of m_reconnections when the failed
+     * transfer started: a reconnection since then is not made again.
+     * @param cancelCount The value of m_cancelCount when the call started.
+     * @return false if the reconnection is disabled, or if the device has not
+     * come back before the timeout.
+     */
+    bool reconnect(uint32_t reconnections, uint32_t cancelCount) {
+        const std::chrono::steady_clock::time_point callDeadline = getDeadline();
+        std::unique_lock<std::timed_mutex> lock(m_reconnectMutex, std::defer_lock);
+        if (callDeadline == std::chrono::steady_clock::time_point::max()) {
+            lock.lock();
+        } else if (!lock.try_lock_until(callDeadline)) {
+            return false;
+        }
+        if (m_reconnections != reconnections) {
+            return true;
+        }
+        if (m_reconnectTimeout == std::chrono::milliseconds::zero()) {
+            return false;
+        }
+        // Not past the deadline of the call, nor after a cancellation.
+        const std::chrono::steady_clock::time_point deadline = std::min(std::chrono::steady_clock::now() + m_reconnectTimeout, callDeadline);
+        libusb_hotplug_callback_handle callback;
+        const bool hotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+                             libusb_hotplug_register_callback(m_context.get(), LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_NO_FLAGS, 0x1ffb,
+                                                              m_productID, LIBUSB_HOTPLUG_MATCH_ANY, onDeviceArrived, nullptr, &callback) == LIBUSB_SUCCESS;
+        bool reconnected = false;
+        const char* error = nullptr;
+        while (!reconnected && error == nullptr) {
+            if (reopen()) {
+                try {
+                    replay(cancelCount);
+                    reconnected = true;
+                    break;
+                } catch (const char* e) {
+                    if (e != DEVICE_DISCONNECTED) {
+                        error = e;
+                    }
+                }
+            }
+            const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if (now >= deadline || m_cancelCount != cancelCount) {
+                break;
+            }
+            // The arrival wakes up the event handling at once.  Without hotplug events, the device list is polled.
+            const std::chrono::steady_clock::duration slice = hotplug ? std::chrono::milliseconds(50) : std::chrono::milliseconds(10);
+            const long long wait = std::chrono::duration_cast<std::chrono::microseconds>(std::min(deadline - now, slice)).count();
+            if (hotplug) {
+                // The fields of timeval have other types on Windows.
+                timeval timeout;
+                timeout.tv_sec = decltype(timeout.tv_sec)(wait / 1000000);
+                timeout.tv_usec = decltype(timeout.tv_usec)(wait % 1000000);
+                libusb_handle_events_timeout_completed(m_context.get(), &timeout, nullptr);
+            } else {
+                std::this_thread::sleep_for(std::chrono::microseconds(wait));
+            }
+        }
+        if (hotplug) {
+            libusb_hotplug_deregister_callback(m_context.get(), callback);
+        }
+        if (reconnected) {
+            m_reconnections++;
+            std::lock_guard<std::mutex> healthLock(m_healthMutex);
+            m_health.reconnections++;
+        }
+        if (error != nullptr) {
+            throw error;
+        }
+        return reconnected;
+    }
+
+    /// Opens, in place of the device gone, the one with its serial number
+    /// (or at its location, without serial number).  Returns false if there is none.
+    bool reopen() {
+        libusb_device** list;
+        const ssize_t count = libusb_get_device_list(m_context.get(), &list);
+        if (count < 0) {
+            return false;
+        }
+        libusb_device* found = nullptr;
+        libusb_device_handle* handle = nullptr;
+        for (ssize_t i = 0; i < count && found == nullptr; i++) {
+            libusb_device_descriptor descriptor;
+            if (libusb_get_device_descriptor(list[i], &descriptor) != 0 || descriptor.idVendor != 0x1ffb || descriptor.idProduct != m_productID) {
+                continue;
+            }
+            if ((m_serialNumber.empty() && getDeviceLocation(list[i]) != m_location) || libusb_open(list[i], &handle) != 0) {
+                continue;
+            }
+            if (m_serialNumber.empty() || getSerialNumber(list[i], handle) == m_serialNumber) {
+                found = libusb_ref_device(list[i]);
+            } else {
+                libusb_close(handle);
+            }
+        }
+        libusb_free_device_list(list, 1);
+        if (found == nullptr) {
+            return false;
+        }
+
+        // The blocking transfers on the old handle are over first.  The
+        // asynchronous ones, which nothing waits for, are cancelled, and
+        // their completion handled, before the handle is closed.
+        ExclusiveHandleUse use(*this);
+        cancelTransfers(this);
+        while (hasTransfersInFlight(this)) {
+            timeval wait = {0, 100000};
+            libusb_handle_events_timeout_completed(m_context.get(), &wait, nullptr);
+        }
+#ifdef __linux__
+        const bool usbfs = m_usbfs >= 0;
+        selectBackend(UsbBackend::LIBUSB);
+#endif
+        {
+            std::lock_guard<std::mutex> lock(m_openMutex);
+            close();
+            libusb_unref_device(m_device);
+            m_device = found;
+            m_deviceHandle = handle;
+        }
+#ifdef __linux__
+        if (usbfs) {
+            try {
+                selectBackend(UsbBackend::USBFS);
+            } catch (const std::string&) {
+                // The node may not be accessible yet: the libusb handle is used meanwhile.
+            }
+        }
+#endif
+        return true;
+    }
+
+    /// Sends the state kept by remember() to the device reopened.
+    void replay(uint32_t cancelCount) {
+        std::array<ChannelState, 24> channels;
+        {
+            std::lock_guard<std::mutex> lock(m_channelsMutex);
+            channels = m_channels;
+        }
+        std::vector<OutTransfer> variables;
+        std::vector<OutTransfer> targets;
+        for (uint16_t channel = 0; channel < channels.size(); channel++) {
+            const ChannelState& state = channels[channel];
+            if (state.hasSpeed) {
+                variables.push_back(OutTransfer{state.speed, channel, 0, {}});
+            }
+            if (state.hasAcceleration) {
+                variables.push_back(OutTransfer{state.acceleration, uint16_t(channel | 0x80), 0, {}});
+            }
+            if (state.hasTarget) {
+                targets.push_back(OutTransfer{state.target, channel, 0, {}});
+            }
+        }
+        if (!variables.empty()) {
+            writeTransfersOnce(cancelCount, REQUEST_SET_SERVO_VARIABLE, variables);
+        }
+        if (!targets.empty()) {
+            writeTransfersOnce(cancelCount, REQUEST_SET_TARGET, targets);
+        }
+    }
+
+#ifdef __linux__
+    /// Same as writeTransfers(), with URBs submitted and reaped on the usbfs
+    /// node.  The URBs and their buffers are allocated once per device, so
+    /// the bursts of the device are made one at a time.
+    void writeTransfersUsbfs(uint32_t cancelCount, uint8_t Request, const std::vector<OutTransfer>& transfers) {
+        std::lock_guard<std::mutex> burst(m_usbfsBurstMutex);
+        size_t next = 0;
+        size_t inFlight = 0;
+        const char* error = nullptr;
+        // The slots are also read by cancel(), from any thread.
+        auto submit = [&](UsbfsSlot& slot) {
+            std::lock_guard<std::mutex> lock(m_usbfsMutex);
+            if (m_cancelCount != cancelCount) {
+                error = TRANSFER_CANCELLED;
+                return;
+            }
+            const OutTransfer& transfer = transfers[next++];
+            libusb_fill_control_setup(slot.buffer.data(), 0x40, Request, transfer.value, transfer.index, transfer.length);
+            std::copy(transfer.data.begin(), transfer.data.begin() + transfer.length, slot.buffer.begin() + LIBUSB_CONTROL_SETUP_SIZE);
+            memset(&slot.urb, 0, sizeof(slot.urb));
+            slot.urb.type = USBDEVFS_URB_TYPE_CONTROL;
+            slot.urb.endpoint = 0;
+            slot.urb.buffer = slot.buffer.data();
+            slot.urb.buffer_length = int(LIBUSB_CONTROL_SETUP_SIZE + transfer.length);
+            slot.urb.usercontext = &slot;
+            if (ioctl(m_usbfs, USBDEVFS_SUBMITURB, &slot.urb) != 0) {
+                error = getUsbfsError(errno);
+                return;
+            }
+            inFlight++;
+            // cancel() counts before it takes the lock: a later count is seen here.
+            if (m_cancelCount != cancelCount) {
+                ioctl(m_usbfs, USBDEVFS_DISCARDURB, &slot.urb);
+            }
+        };
+
+        for (size_t i = 0; i < std::min(m_usbfsSlots.size(), transfers.size()) && error == nullptr; i++) {
+            submit(m_usbfsSlots[i]);
+        }
+        bool discarded = false;
+        while (inFlight > 0) {
+            // URBs have no timeout: after the timeout of the device, or at the
+            // deadline, the ones still queued are cancelled.
+            pollfd descriptor = {m_usbfs, POLLOUT, 0};
+            const int ready = poll(&descriptor, 1, discarded ? 1000 : int(getTransferTimeout()));
+            if (ready < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ready <= 0) {
+                if (discarded) {
+                    throw TRANSFER_TIMED_OUT;
+                }
+                error = (error != nullptr) ? error : TRANSFER_TIMED_OUT;
+                std::lock_guard<std::mutex> lock(m_usbfsMutex);
+                for (UsbfsSlot& slot : m_usbfsSlots) {
+                    ioctl(m_usbfs, USBDEVFS_DISCARDURB, &slot.urb);
+                }
+                discarded = true;
+                continue;
+            }
+            usbdevfs_urb* urb = nullptr;
+            int reaped;
+            {
+                std::lock_guard<std::mutex> lock(m_usbfsMutex);
+                reaped = ioctl(m_usbfs, USBDEVFS_REAPURBNDELAY, &urb);
+            }
+            if (reaped != 0) {
+                if (errno == EAGAIN || errno == EINTR) {
+                    continue;
+                }
+                // The device is gone, and the kernel has dropped its URBs.
+                throw getUsbfsError(errno);
+            }
+            inFlight--;
+            if (urb->status != 0 && error == nullptr) {
+                error = getUsbfsError(-urb->status);
+            }
+            // After an error, the transfers already queued are let finish.
+            if (error == nullptr && next < transfers.size()) {
+                submit(*static_cast<UsbfsSlot*>(urb->usercontext));
+            }
+        }
+        if (error != nullptr) {
+            throw error;
+        }
+    }
+
+    struct UsbfsSlot {
+        std::array<unsigned char, LIBUSB_CONTROL_SETUP_SIZE + 16> buffer;
+        usbdevfs_urb urb;
+    };
+
+    int m_usbfs = -1;
+    std::array<UsbfsSlot, 8> m_usbfsSlots;
+    /// Guards m_usbfs and m_usbfsSlots against cancel().
+    std::mutex m_usbfsMutex;
+    /// Held for a whole burst: a reap returns the URBs of any burst, and a
+    /// burst must not refill the slots of another.
+    std::mutex m_usbfsBurstMutex;
+#endif
+
     std::shared_ptr<libusb_context> m_context = nullptr;
     libusb_device* m_device = nullptr;
     libusb_device_handle* m_deviceHandle = nullptr;
+    /// Guards m_device and m_deviceHandle.
+    mutable std::mutex m_openMutex;
+    /// The transfers using the handle or the usbfs node, see HandleUse.
+    std::mutex m_handleMutex;
+    std::condition_variable m_handleReleased;
+    size_t m_handleUsers = 0;
+    bool m_handleExclusive = false;
+    uint16_t m_productID;
+
+    /// The state sent again after a reconnection.
+    struct ChannelState {
+        uint16_t target;
+        uint16_t speed;
+        uint16_t acceleration;
+        bool hasTarget;
+        bool hasSpeed;
+        bool hasAcceleration;
+    };
+
+    std::array<ChannelState, 24> m_channels = {};
+    std::mutex m_channelsMutex;
+    /// Held while reconnecting, and guarding the settings of the reconnection.
+    std::timed_mutex m_reconnectMutex;
+    /// Incremented by each reconnection.
+    std::atomic<uint32_t> m_reconnections{0};
+    std::chrono::milliseconds m_reconnectTimeout = std::chrono::milliseconds::zero();
+    std::string m_serialNumber;
+    std::string m_location;
+
+    /// In milliseconds, read by the transfers of any thread.
+    std::atomic<std::chrono::milliseconds::rep> m_timeout{5000};
+    /// Incremented by cancel(), so that the retries stop.
+    std::atomic<uint32_t> m_cancelCount{0};
+    /// Guards the health, and the settings read by the transfers of any thread.
+    mutable std::mutex m_healthMutex;
+    RetryPolicy m_retryPolicy;
+    Health m_health;
+    std::chrono::microseconds m_slowThreshold = std::chrono::milliseconds(10);
 };
 
 std::vector<Device> Device::getConnectedDevices() {
     const uint16_t vendorID = 0x1ffb;
     const std::array<uint16_t, 4> productIDArray = {0x0089, 0x008a, 0x008b, 0x008c};
 
-    std::shared_ptr<libusb_context> sharedContext(nullptr, [=](libusb_context* ctx) { libusb_exit(ctx); });
+    std::vector<Device> list;
 
+    // The devices share a context, so that handleEvents() completes the
+    // requests of all of them.  It lives as long as the devices found in it.
+    std::shared_ptr<libusb_context> sharedContext;
+    {
+        AsyncState& state = getAsyncState();
+        std::lock_guard<std::mutex> lock(state.mutex);
+        sharedContext = state.context.lock();
+        if (!sharedContext) {
+            libusb_context* context = nullptr;
+            if (libusb_init(&context) != 0) return list;
+            sharedContext.reset(context, [](libusb_context* context) { libusb_exit(context); });
+            state.context = sharedContext;
+        }
+    }
     libusb_context* ctx = sharedContext.get();
-    libusb_init(&ctx);
-
-    std::vector<Device> list;
 
     libusb_device** devs;
     ssize_t cnt = libusb_get_device_list(ctx, &devs);
@@ -331,7 +1544,7 @@ std::vector<Device> Device::getConnectedDevices() {
         if (desc.idVendor == vendorID) {
             for (int productID : productIDArray) {
                 if (desc.idProduct == productID) {
-                    usb_device* device = new usb_device(sharedContext, devs[i]);
+                    usb_device* device = new usb_device(sharedContext, devs[i], desc.idProduct);
                     list.push_back(Device(device, desc.idProduct));
                 }
             }
@@ -367,6 +1580,46 @@ Device::Device(usb_device* device, uint16_t productId) : m_productID(productId),
 
 Device::~Device() {}
 
+std::string Device::getLocation() const { return m_dev->getLocation(); }
+
+void Device::setUsbBackend(UsbBackend backend) { m_dev->setBackend(backend); }
+
+void Device::setReconnectTimeout(std::chrono::milliseconds timeout) { m_dev->setReconnectTimeout(timeout); }
+
+void Device::setTimeout(std::chrono::milliseconds timeout) {
+    if (timeout <= std::chrono::milliseconds::zero()) {
+        throw "The timeout must be positive.";
+    }
+    m_dev->setTimeout(timeout);
+}
+
+void Device::cancel() { m_dev->cancel(); }
+
+void Device::setRetryPolicy(const RetryPolicy& policy) {
+    if (policy.attempts == 0) {
+        throw "A retry policy makes at least one attempt.";
+    }
+    m_dev->setRetryPolicy(policy);
+}
+
+Device::Health Device::getHealth() const { return m_dev->getHealth(); }
+
+void Device::setSlowThreshold(std::chrono::microseconds threshold) { m_dev->setSlowThreshold(threshold); }
+
+Device::Deadline::Deadline(Device& device, std::chrono::steady_clock::time_point deadline) : m_device(device.m_dev) {
+    threadDeadlines.push_back(ThreadDeadline{this, m_device.get(), deadline});
+}
+
+Device::Deadline::~Deadline() {
+    // Usually the last one, unless the deadlines of a thread are not nested.
+    for (auto entry = threadDeadlines.rbegin(); entry != threadDeadlines.rend(); ++entry) {
+        if (entry->owner == this) {
+            threadDeadlines.erase(std::next(entry).base());
+            break;
+        }
+    }
+}
+
 void Device::setTarget(uint8_t servo, uint16_t value) {
     try {
         m_dev->controlTransfer(0x40, REQUEST_SET_TARGET, value, servo);
@@ -375,6 +1628,26 @@ void Device::setTarget(uint8_t servo, uint16_t value) {
     }
 }
 
+void Device::setTargets(uint8_t firstChannel, const uint16_t* targets, size_t count) {
+    if (firstChannel + count > size_t(m_channelcnt)) {
+        throw "Cannot set " + std::to_string(count) + " targets from channel " + std::to_string(firstChannel) + " on a device with " +
+            std::to_string(m_channelcnt) + " channels.";
+    }
+    std::vector<OutTransfer> transfers(count);
+    for (size_t i = 0; i < count; i++) {
+        transfers[i].value = targets[i];
+        transfers[i].index = uint16_t(firstChannel + i);
+        transfers[i].length = 0;
+    }
+    try {
+        m_dev->writeTransfers(REQUEST_SET_TARGET, transfers);
+    } catch (const char* e) {
+        throw std::string("Failed to set the targets: ") + e + ".";
+    }
+}
+
+void Device::setTargets(uint8_t firstChannel, const std::vector<uint16_t>& targets) { setTargets(firstChannel, targets.data(), targets.size()); }
+
 void Device::setSpeed(uint8_t servo, uint16_t value) {
     try {
         m_dev->controlTransfer(0x40, REQUEST_SET_SERVO_VARIABLE, value, servo);
@@ -393,16 +1666,74 @@ void Device::setAcceleration(uint8_t servo, uint16_t value) {
 }
 
 std::vector<Device::ServoStatus> Device::getServoStatus() {
+    std::vector<ServoStatus> status(m_channelcnt);
+    getServoStatus(status.data());
+    return status;
+}
+
+void Device::getServoStatus(ServoStatus* status) {
     static_assert(sizeof(ServoStatus) == 7, "Sizeof ServoStatus expected to be 7");
 
     const uint32_t size = m_channelcnt * sizeof(ServoStatus);
-    std::vector<ServoStatus> status(m_channelcnt);
-
-    const uint32_t bytesRead = m_dev->controlTransfer(0xC0, REQUEST_GET_SERVO_SETTINGS, 0, 0, (uint8_t*)status.data(), size);
+    const uint32_t bytesRead = m_dev->readTransfer(REQUEST_GET_SERVO_SETTINGS, 0, 0, (uint8_t*)status, size);
 
     if (bytesRead != size) {
         throw "Short read: " + std::to_string(bytesRead) + " < " + std::to_string(size) + ".";
     }
+}
+
+Device::ScriptStatus Device::getScriptStatus(bool readDataStack) {
+    auto readWord = [](const uint8_t* data) { return uint16_t(data[0] | (data[1] << 8)); };
+
+    ScriptStatus status;
+    if (m_productID == 0x0089) {
+        // Micro Maestro variables: stack pointer, call stack pointer, errors,
+        // program counter, 3 reserved words, the stack (32 words), the call
+        // stack (10 words) and scriptDone, followed by the servo status.
+        uint8_t variables[98 + 6 * sizeof(ServoStatus)];
+        const uint32_t bytesRead = m_dev->readTransfer(REQUEST_GET_VARIABLES, 0, 0, variables, sizeof(variables));
+        if (bytesRead < 98) {
+            throw "Short read: " + std::to_string(bytesRead) + " < 98.";
+        }
+        status.errors = readWord(variables + 2);
+        status.programCounter = readWord(variables + 4);
+        status.scriptDone = variables[96] != 0;
+        if (readDataStack) {
+            for (uint8_t i = 0; i < std::min<uint8_t>(variables[0], 32); i++) {
+                status.stack.push_back(int16_t(readWord(variables + 12 + 2 * i)));
+            }
+        }
+        for (uint8_t i = 0; i < std::min<uint8_t>(variables[1], 10); i++) {
+            status.callStack.push_back(readWord(variables + 76 + 2 * i));
+        }
+        return status;
+    }
+
+    // Mini Maestro variables: stack pointer, call stack pointer, errors,
+    // program counter, scriptDone and performance flags.
+    uint8_t variables[8];
+    const uint32_t bytesRead = m_dev->readTransfer(REQUEST_GET_VARIABLES, 0, 0, variables, sizeof(variables));
+    if (bytesRead != sizeof(variables)) {
+        throw "Short read: " + std::to_string(bytesRead) + " < " + std::to_string(sizeof(variables)) + ".";
+    }
+    status.errors = readWord(variables + 2);
+    status.programCounter = readWord(variables + 4);
+    status.scriptDone = variables[6] != 0;
+    uint8_t words[2 * 126];
+    if (readDataStack && variables[0] > 0) {
+        const uint16_t size = uint16_t(2 * std::min<uint8_t>(variables[0], 126));
+        const uint32_t stackRead = m_dev->readTransfer(REQUEST_GET_STACK, 0, 0, words, size);
+        for (uint32_t i = 0; i + 1 < stackRead; i += 2) {
+            status.stack.push_back(int16_t(readWord(words + i)));
+        }
+    }
+    if (variables[1] > 0) {
+        const uint16_t size = uint16_t(2 * std::min<uint8_t>(variables[1], 126));
+        const uint32_t callStackRead = m_dev->readTransfer(REQUEST_GET_CALL_STACK, 0, 0, words, size);
+        for (uint32_t i = 0; i + 1 < callStackRead; i += 2) {
+            status.callStack.push_back(readWord(words + i));
+        }
+    }
     return status;
 }
 
@@ -479,88 +1810,18 @@ void Device::setDeviceSettings(const DeviceSettings& settings) {
 }
 
 Device::ChannelSettings Device::getChannelSettings(uint8_t channel) {
-    ChannelSettings settings;
-    if (m_channelcnt == 6) {
-        uint8_t ioMask = (uint8_t)getRawParameter(PARAMETER_IO_MASK_C);
-        uint8_t outputMask = (uint8_t)getRawParameter(PARAMETER_OUTPUT_MASK_C);
-        uint8_t bitmask = uint8_t(1 << channelToPort(channel));
-        if ((ioMask & bitmask) == 0) {
-            settings.mode = ChannelMode::SERVO;
-        } else if ((outputMask & bitmask) == 0) {
-            settings.mode = ChannelMode::INPUT;
-        } else {
-            settings.mode = ChannelMode::OUTPUT;
-        }
-    } else {
-        uint8_t channelModeBytes = (uint8_t)getRawParameter(Parameter(PARAMETER_CHANNEL_MODES_0_3 + (channel >> 2)));
-
-        settings.mode = ChannelMode((channelModeBytes >> ((channel & 3) << 1)) & 3);
-    }
-
-    const uint16_t home = getRawParameter(specifyServo(PARAMETER_SERVO0_HOME, channel));
-    if (home == 0) {
-        settings.homeMode = HomeMode::OFF;
-        settings.home = 0;
-    } else if (home == 1) {
-        settings.homeMode = HomeMode::IGNORE;
-        settings.home = 0;
-    } else {
-        settings.homeMode = HomeMode::GOTO;
-        settings.home = home;
+    const std::vector<Parameter> parameters = getChannelSettingsParameters(m_channelcnt == 6, channel);
+    std::vector<uint16_t> values;
+    for (Parameter parameter : parameters) {
+        values.push_back(getRawParameter(parameter));
     }
-
-    settings.minimum = 64 * getRawParameter(specifyServo(PARAMETER_SERVO0_MIN, channel));
-    settings.maximum = 64 * getRawParameter(specifyServo(PARAMETER_SERVO0_MAX, channel));
-    settings.neutral = getRawParameter(specifyServo(PARAMETER_SERVO0_NEUTRAL, channel));
-    settings.range = 127 * getRawParameter(specifyServo(PARAMETER_SERVO0_RANGE, channel));
-    settings.speed = exponentialSpeedToNormalSpeed((uint8_t)getRawParameter(specifyServo(PARAMETER_SERVO0_SPEED, channel)));
-    settings.acceleration = (uint8_t)getRawParameter(specifyServo(PARAMETER_SERVO0_ACCELERATION, channel));
-    return settings;
+    return decodeChannelSettings(m_channelcnt == 6, channel, values.data());
 }
 
 void Device::setChannelSettings(uint8_t channel, const ChannelSettings& settings) {
-    if (m_channelcnt == 6) {
-        /*
-        if (settings.mode == ChannelMode::INPUT || settings.mode == ChannelMode::OUTPUT) {
-            ioMask |= (uint8_t)(1 << channelToPort(channel));
-        }
-
-        if (setting.mode == ChannelMode.Output) {
-            outputMask |= (uint8_t)(1 << channelToPort(channel));
-        }*/
-    } else {
-        Parameter parameter = Parameter(PARAMETER_CHANNEL_MODES_0_3 + (channel >> 2));
-        uint8_t channelModeBytes = (uint8_t)getRawParameter(parameter);
-
-        channelModeBytes &= (uint8_t) ~(3 << ((channel & 3) << 1));
-        channelModeBytes |= uint8_t(uint8_t(settings.mode) << ((channel & 3) << 1));
-
-        setRawParameter(parameter, channelModeBytes);
-    }
-
-    // Make sure that HomeMode is "Ignore" for inputs.
-    HomeMode correctedHomeMode = settings.homeMode;
-    if (settings.mode == ChannelMode::INPUT) {
-        correctedHomeMode = HomeMode::IGNORE;
-    }
-
-    setRawParameter(specifyServo(PARAMETER_SERVO0_HOME, channel), uint8_t(correctedHomeMode));
-
-    setRawParameter(specifyServo(PARAMETER_SERVO0_MIN, channel), settings.minimum / 64);
-    setRawParameter(specifyServo(PARAMETER_SERVO0_MAX, channel), settings.maximum / 64);
-    setRawParameter(specifyServo(PARAMETER_SERVO0_NEUTRAL, channel), settings.neutral);
-    setRawParameter(specifyServo(PARAMETER_SERVO0_RANGE, channel), settings.range / 127);
-    setRawParameter(specifyServo(PARAMETER_SERVO0_SPEED, channel), normalSpeedToExponentialSpeed(settings.speed));
-    setRawParameter(specifyServo(PARAMETER_SERVO0_ACCELERATION, channel), settings.acceleration);
-
-    if (m_channelcnt == 6) { /*
-                                setRawParameter(PARAMETER_IO_MASK_C, ioMask);
-                                setRawParameter(PARAMETER_OUTPUT_MASK_C, outputMask);*/
-    } else {                 /*
-                                for (uint8_t i = 0; i < 6; i++)
-                                {
-                                    setRawParameter(PARAMETER_CHANNEL_MODES_0_3 + i, channelModeBytes[i]);
-                                }*/
+    const uint8_t channelModeBytes = (m_channelcnt == 6) ? 0 : (uint8_t)getRawParameter(getChannelModesParameter(channel));
+    for (const auto& parameter : encodeChannelSettings(m_channelcnt == 6, channel, settings, channelModeBytes)) {
+        setRawParameter(parameter.first, parameter.second);
     }
 }
 
@@ -629,24 +1890,46 @@ void Device::clearErrors() {
     }
 }
 
-void Device::writeScript(const std::vector<uint8_t>& bytecode) {
-    for (uint16_t block = 0; block < (bytecode.size() + 15) / 16; block++) {
-        // write each block in a separate request
-        uint8_t block_bytes[16];
+void Device::writeScript(const std::vector<uint8_t>& bytecode) { writeScript(bytecode.data(), bytecode.size()); }
 
-        for (uint16_t j = 0; j < 16; j++) {
-            if (block * 16 + j < bytecode.size())
-                block_bytes[j] = bytecode[block * 16 + j];
-            else
-                block_bytes[j] = (uint8_t)0xFF;  // don't change flash if it is not necessary
-        }
+void Device::writeScript(const uint8_t* bytecode, size_t size) { writeScriptBlocks(bytecode, size, 0); }
 
-        try {
-            m_dev->controlTransfer(0x40, REQUEST_WRITE_SCRIPT, 0, block, block_bytes);
-        } catch (std::exception& e) {
-            throw "There was an error writing script block " + std::to_string(block) + ".";
-        }
+bool Device::writeScript(const FlashImage& image) { return deployScript(image) > 0; }
+
+size_t Device::deployScript(const FlashImage& image) {
+    const uint16_t scriptCRC = getScriptCRC();
+    if (scriptCRC == image.getCRC() && scriptCRC != SCRIPT_CRC_INCOMPLETE) {
+        return 0;
     }
+
+    setScriptDone(1);
+    // Set before the flash is touched, so that an interrupted deploy does not
+    // look like the script loaded before it.
+    setRawParameter(PARAMETER_SCRIPT_CRC, SCRIPT_CRC_INCOMPLETE);
+    eraseScript();
+    size_t blockCount = writeScriptBlocks(image.getImage().data(), FlashImage::SUBROUTINE_TABLE_SIZE, getSubroutineTableBlock());
+    blockCount += writeScriptBlocks(image.getBytecode(), image.getBytecodeSize(), 0);
+    // Every block was acknowledged: the script is complete.
+    setRawParameter(PARAMETER_SCRIPT_CRC, image.getCRC());
+    if (getScriptCRC() != image.getCRC()) {
+        throw "There was an error writing the script CRC.";
+    }
+    return blockCount;
+}
+
+uint16_t Device::getScriptCRC() { return getRawParameter(PARAMETER_SCRIPT_CRC); }
+
+/// The subroutine table is stored in the 16 blocks that follow the script memory.
+uint16_t Device::getSubroutineTableBlock() const { return (m_productID == 0x0089) ? 64 : 512; }
+
+size_t Device::writeScriptBlocks(const uint8_t* data, size_t size, uint16_t firstBlock) {
+    const std::vector<OutTransfer> blocks = getScriptBlocks(data, size, firstBlock);
+    try {
+        m_dev->writeTransfers(REQUEST_WRITE_SCRIPT, blocks);
+    } catch (const char* e) {
+        throw std::string("There was an error writing the script: ") + e + ".";
+    }
+    return blocks.size();
 }
 
 void Device::setPWM(uint16_t dutyCycle, uint16_t period) { m_dev->controlTransfer(0x40, REQUEST_SET_PWM, dutyCycle, period); }
@@ -664,7 +1947,7 @@ uint16_t Device::getRawParameter(Parameter parameter) {
     uint16_t buffer;
 
     try {
-        m_dev->controlTransfer(0xC0, REQUEST_GET_PARAMETER, 0, parameter, (uint8_t*)&buffer, range.bytes);
+        m_dev->readTransfer(REQUEST_GET_PARAMETER, 0, parameter, (uint8_t*)&buffer, range.bytes);
     } catch (std::exception& e) {
         throw "There was an error getting parameter from the device.";
     }
@@ -696,4 +1979,242 @@ void Device::setRawParameterNoChecks(uint16_t parameter, uint16_t value, int byt
         throw "There was an error setting parameter on the device.";
     }
 }
+
+/// An asynchronous request: its transfers are submitted in order, with up to
+/// 8 of them queued like usb_device::writeTransfers(), and its completion is
+/// called after the last one.
+struct Device::AsyncBatch {
+    std::shared_ptr<usb_device> device;
+    std::vector<AsyncTransfer> transfers;
+    size_t next = 0;
+    size_t inFlight = 0;
+    const char* error = nullptr;
+    /// The start of the error message, e.g. "Failed to set target of servo 0 to 6000".
+    std::string failure;
+    Completion completion;
+};
+
+std::shared_ptr<Device::AsyncBatch> Device::createBatch(std::string failure, Completion completion) const {
+    std::shared_ptr<AsyncBatch> batch = std::make_shared<AsyncBatch>();
+    batch->device = m_dev;
+    batch->failure = std::move(failure);
+    batch->completion = std::move(completion);
+    return batch;
+}
+
+void Device::submitBatch(const std::shared_ptr<AsyncBatch>& batch) {
+    if (batch->transfers.empty()) {
+        deferCompletion([batch] { batch->completion(std::string()); });
+        return;
+    }
+    const size_t queueLength = 8;
+    while (batch->error == nullptr && batch->next < batch->transfers.size() && batch->inFlight < queueLength) {
+        batch->inFlight++;
+        batch->device->submitTransfer(batch->transfers[batch->next++], [batch](const char* error) {
+            batch->inFlight--;
+            if (batch->error == nullptr) {
+                batch->error = error;
+            }
+            // After an error, the transfers already queued are let finish.
+            if (batch->error == nullptr && batch->next < batch->transfers.size()) {
+                submitBatch(batch);
+            } else if (batch->inFlight == 0) {
+                batch->completion((batch->error == nullptr) ? std::string() : batch->failure + ": " + batch->error + ".");
+            }
+        });
+    }
+}
+
+void Device::setTargetAsync(uint8_t servo, uint16_t value, Completion completion) {
+    std::shared_ptr<AsyncBatch> batch =
+        createBatch("Failed to set target of servo " + std::to_string(servo) + " to " + std::to_string(value), std::move(completion));
+    batch->transfers.push_back(vendorOut(REQUEST_SET_TARGET, value, servo));
+    submitBatch(batch);
+}
+
+void Device::setTargetsAsync(uint8_t firstChannel, const uint16_t* targets, size_t count, Completion completion) {
+    if (firstChannel + count > size_t(m_channelcnt)) {
+        const std::string error = "Cannot set " + std::to_string(count) + " targets from channel " + std::to_string(firstChannel) + " on a device with " +
+                                  std::to_string(m_channelcnt) + " channels.";
+        deferCompletion([completion, error] { completion(error); });
+        return;
+    }
+    std::shared_ptr<AsyncBatch> batch = createBatch("Failed to set the targets", std::move(completion));
+    for (size_t i = 0; i < count; i++) {
+        batch->transfers.push_back(vendorOut(REQUEST_SET_TARGET, targets[i], uint16_t(firstChannel + i)));
+    }
+    submitBatch(batch);
+}
+
+void Device::setSpeedAsync(uint8_t servo, uint16_t value, Completion completion) {
+    std::shared_ptr<AsyncBatch> batch =
+        createBatch("Failed to set speed of servo " + std::to_string(servo) + " to " + std::to_string(value), std::move(completion));
+    batch->transfers.push_back(vendorOut(REQUEST_SET_SERVO_VARIABLE, value, servo));
+    submitBatch(batch);
+}
+
+void Device::setAccelerationAsync(uint8_t servo, uint16_t value, Completion completion) {
+    std::shared_ptr<AsyncBatch> batch =
+        createBatch("Failed to set acceleration of servo " + std::to_string(servo) + " to " + std::to_string(value), std::move(completion));
+    batch->transfers.push_back(vendorOut(REQUEST_SET_SERVO_VARIABLE, value, servo | 0x80));
+    submitBatch(batch);
+}
+
+void Device::getServoStatusAsync(ServoStatus* status, Completion completion) {
+    std::shared_ptr<AsyncBatch> batch = createBatch("Failed to read the servo status", std::move(completion));
+    batch->transfers.push_back(vendorIn(REQUEST_GET_SERVO_SETTINGS, 0, 0, (uint8_t*)status, uint16_t(m_channelcnt * sizeof(ServoStatus))));
+    submitBatch(batch);
+}
+
+void Device::getChannelSettingsAsync(uint8_t channel, ChannelSettings* settings, Completion completion) {
+    const bool microMaestro = m_channelcnt == 6;
+    const std::vector<Parameter> parameters = getChannelSettingsParameters(microMaestro, channel);
+    std::shared_ptr<std::vector<uint8_t>> data = std::make_shared<std::vector<uint8_t>>(2 * parameters.size(), 0);
+    std::shared_ptr<AsyncBatch> batch =
+        createBatch("Failed to read the settings of channel " + std::to_string(channel), [=](const std::string& error) {
+            std::string result = error;
+            if (result.empty()) {
+                std::vector<uint16_t> values(parameters.size());
+                for (size_t i = 0; i < values.size(); i++) {
+                    values[i] = uint16_t((*data)[2 * i] | (*data)[2 * i + 1] << 8);
+                }
+                try {
+                    *settings = decodeChannelSettings(microMaestro, channel, values.data());
+                } catch (const std::string& e) {
+                    result = e;
+                }
+            }
+            completion(result);
+        });
+    for (size_t i = 0; i < parameters.size(); i++) {
+        batch->transfers.push_back(getParameterTransfer(parameters[i], data->data() + 2 * i));
+    }
+    submitBatch(batch);
+}
+
+void Device::setChannelSettingsAsync(uint8_t channel, const ChannelSettings& settings, Completion completion) {
+    const bool microMaestro = m_channelcnt == 6;
+    const std::string failure = "Failed to set the settings of channel " + std::to_string(channel);
+    std::shared_ptr<AsyncBatch> write = createBatch(failure, std::move(completion));
+    if (microMaestro) {
+        for (const auto& parameter : encodeChannelSettings(microMaestro, channel, settings, 0)) {
+            write->transfers.push_back(setParameterTransfer(parameter.first, parameter.second));
+        }
+        submitBatch(write);
+        return;
+    }
+    // The mode of the channel is read first: it shares its parameter with 3 other channels.
+    std::shared_ptr<uint8_t> channelModeBytes = std::make_shared<uint8_t>(0);
+    std::shared_ptr<AsyncBatch> read = createBatch(failure, [=](const std::string& error) {
+        if (!error.empty()) {
+            write->completion(error);
+            return;
+        }
+        for (const auto& parameter : encodeChannelSettings(microMaestro, channel, settings, *channelModeBytes)) {
+            write->transfers.push_back(setParameterTransfer(parameter.first, parameter.second));
+        }
+        submitBatch(write);
+    });
+    read->transfers.push_back(getParameterTransfer(getChannelModesParameter(channel), channelModeBytes.get()));
+    submitBatch(read);
+}
+
+void Device::eraseScriptAsync(Completion completion) {
+    std::shared_ptr<AsyncBatch> batch = createBatch("There was an error erasing the script", std::move(completion));
+    batch->transfers.push_back(vendorOut(REQUEST_ERASE_SCRIPT, 0, 0));
+    submitBatch(batch);
+}
+
+void Device::restartScriptAsync(Completion completion) {
+    std::shared_ptr<AsyncBatch> batch = createBatch("There was an error restarting the script", std::move(completion));
+    batch->transfers.push_back(vendorOut(REQUEST_RESTART_SCRIPT, 0, 0));
+    submitBatch(batch);
+}
+
+void Device::restartScriptAtSubroutineAsync(uint8_t subroutine, Completion completion) {
+    std::shared_ptr<AsyncBatch> batch =
+        createBatch("There was an error restarting the script at subroutine " + std::to_string(subroutine), std::move(completion));
+    batch->transfers.push_back(vendorOut(REQUEST_RESTART_SCRIPT_AT_SUBROUTINE, 0, subroutine));
+    submitBatch(batch);
+}
+
+void Device::restartScriptAtSubroutineWithParameterAsync(uint8_t subroutine, uint16_t parameter, Completion completion) {
+    std::shared_ptr<AsyncBatch> batch = createBatch(
+        "There was an error restarting the script with a parameter at subroutine " + std::to_string(subroutine), std::move(completion));
+    batch->transfers.push_back(vendorOut(REQUEST_RESTART_SCRIPT_AT_SUBROUTINE_WITH_PARAMETER, parameter, subroutine));
+    submitBatch(batch);
+}
+
+void Device::setScriptDoneAsync(uint8_t value, Completion completion) {
+    std::shared_ptr<AsyncBatch> batch = createBatch("There was an error setting the script done", std::move(completion));
+    batch->transfers.push_back(vendorOut(REQUEST_SET_SCRIPT_DONE, value, 0));
+    submitBatch(batch);
+}
+
+void Device::clearErrorsAsync(Completion completion) {
+    std::shared_ptr<AsyncBatch> batch = createBatch("There was a USB communication error while clearing the servo errors", std::move(completion));
+    batch->transfers.push_back(vendorOut(REQUEST_CLEAR_ERRORS, 0, 0));
+    submitBatch(batch);
+}
+
+void Device::writeScriptAsync(const uint8_t* bytecode, size_t size, Completion completion) {
+    std::shared_ptr<AsyncBatch> batch = createBatch("There was an error writing the script", std::move(completion));
+    for (const OutTransfer& block : getScriptBlocks(bytecode, size, 0)) {
+        AsyncTransfer transfer = vendorOut(REQUEST_WRITE_SCRIPT, block.value, block.index);
+        transfer.length = block.length;
+        transfer.data = block.data;
+        batch->transfers.push_back(transfer);
+    }
+    submitBatch(batch);
+}
+
+void Device::getScriptCRCAsync(uint16_t* crc, Completion completion) {
+    std::shared_ptr<std::array<uint8_t, 2>> data = std::make_shared<std::array<uint8_t, 2>>();
+    std::shared_ptr<AsyncBatch> batch = createBatch("There was an error getting parameter from the device", [=](const std::string& error) {
+        if (error.empty()) {
+            *crc = uint16_t((*data)[0] | (*data)[1] << 8);
+        }
+        completion(error);
+    });
+    batch->transfers.push_back(getParameterTransfer(PARAMETER_SCRIPT_CRC, data->data()));
+    submitBatch(batch);
+}
+
+size_t Device::handleEvents(std::chrono::milliseconds timeout) {
+    AsyncState& state = getAsyncState();
+    std::shared_ptr<libusb_context> context;
+    {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        if (state.completions.empty() && state.submitted > 0) {
+            context = state.context.lock();
+        }
+    }
+    if (context) {
+        // The fields of timeval have other types on Windows and macOS.
+        timeval tv;
+        tv.tv_sec = decltype(tv.tv_sec)(timeout.count() / 1000);
+        tv.tv_usec = decltype(tv.tv_usec)(timeout.count() % 1000 * 1000);
+        libusb_handle_events_timeout_completed(context.get(), &tv, nullptr);
+    }
+
+    // Only the completions ready now are called, so that a request failing at
+    // once and made again by its completion does not loop here.
+    size_t count;
+    {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        count = state.completions.size();
+    }
+    for (; count > 0; count--) {
+        std::function<void()> completion;
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            completion = std::move(state.completions.front());
+            state.completions.pop_front();
+        }
+        completion();
+    }
+
+    std::lock_guard<std::mutex> lock(state.mutex);
+    return state.submitted + state.completions.size();
+}
 }  // namespace Maestro
@@ -8,12 +8,16 @@
  */
 #pragma once
 
+#include <chrono>
 #include <cstdint>
+#include <functional>
 #include <memory>
 #include <string>
 #include <vector>
 
 namespace Maestro {
+class FlashImage;
+
 class Device {
    public:
     enum Parameter : uint8_t;
@@ -211,10 +215,121 @@ class Device {
     };
 #pragma pack(pop)
 
+    /// How the transfers reach the device.
+    enum class UsbBackend {
+        /// Portable, through libusb.
+        LIBUSB,
+        /// Linux only: ioctls on the usbfs node of the device (/dev/bus/usb/...),
+        /// without the event handling and the per-call allocations of libusb.
+        /// The asynchronous requests, like setTargetAsync(), block on it.
+        USBFS
+    };
+
+    /// State of the script interpreter.
+    struct ScriptStatus {
+        /// Address of the next instruction to execute.
+        uint16_t programCounter;
+
+        /// The error flags, see clearErrors().
+        uint16_t errors;
+
+        /// True if the script is stopped.
+        bool scriptDone;
+
+        /// The data stack, from bottom to top.
+        std::vector<int16_t> stack;
+
+        /// The return addresses of the subroutine calls, from the outermost call.
+        std::vector<uint16_t> callStack;
+    };
+
+    /// How the reads without side effect (getServoStatus(), getScriptStatus()
+    /// and the parameters) are made again after a failure.
+    struct RetryPolicy {
+        /// Attempts at most, the first one included: 1 never retries.
+        unsigned int attempts = 1;
+
+        /// The limit of the delay before the first retry, doubled for each of
+        /// the next ones.  The delay is drawn at random below the limit, so that
+        /// the devices failing together do not retry in step.
+        std::chrono::milliseconds backoff = std::chrono::milliseconds(2);
+    };
+
+    /// Statistics of the blocking calls of a device, and its copies.
+    struct Health {
+        /// The transfers made, failed or not.
+        uint64_t transfers = 0;
+        /// The calls that failed, retries and reconnections included.
+        uint64_t failures = 0;
+        /// The calls that failed with a timeout.
+        uint64_t timeouts = 0;
+        uint64_t retries = 0;
+        uint64_t reconnections = 0;
+
+        /// Moving average of the duration of the calls, the last one weighted 1/16.
+        std::chrono::microseconds averageLatency{0};
+        std::chrono::microseconds maximumLatency{0};
+
+        /// Set while averageLatency is above the slow threshold: the device is
+        /// chronically slow, e.g. a hung controller timing out.
+        bool slow = false;
+    };
+
     ~Device();
 
     const std::string &getName() const { return m_name; }
     int getNumChannels() const { return m_channelcnt; }
+    uint16_t getProductID() const { return m_productID; }
+
+    /// Identifies the opened device: the same for a Device and its copies,
+    /// which share its transfers, and different for any other Device.
+    const void *getIdentity() const { return m_dev.get(); }
+
+    /// Selects how the transfers reach the device, for this Device and its copies.
+    void setUsbBackend(UsbBackend backend);
+
+    /**
+     * @brief Reconnects to the device after a disconnection, e.g. a brownout or a replug.
+     *
+     * A blocking call failing because the device is gone then waits at most
+     * \a timeout for the device with the same serial number to enumerate
+     * again, woken up by the hotplug events of libusb where it has them.  It
+     * reopens the device, sends it the last speeds, accelerations and targets
+     * set through this Device and its copies, and is made again.  A timeout
+     * of 0, the default, disables the reconnection.  A single thread
+     * reconnects: the calls of the copies failing meanwhile wait for it.  The
+     * asynchronous requests fail as before, those still in flight as
+     * cancelled, and their state is sent again by the next reconnection.
+     */
+    void setReconnectTimeout(std::chrono::milliseconds timeout);
+
+    /// The timeout of each transfer of the blocking calls, 5 s by default.
+    /// A hung controller stalls a call that long.
+    void setTimeout(std::chrono::milliseconds timeout);
+
+    class Deadline;
+
+    /**
+     * @brief Cancels the transfers in flight of this Device and its copies.
+     *
+     * Called from any thread: the blocking calls waiting for the transfers
+     * throw, without retry, and the asynchronous requests complete with the
+     * error "the transfer was cancelled".  The single transfers of the usbfs
+     * backend cannot be cancelled, and end at their timeout.
+     */
+    void cancel();
+
+    /// Applies to this Device and its copies.  Only one attempt by default.
+    void setRetryPolicy(const RetryPolicy &policy);
+
+    Health getHealth() const;
+
+    /// The average latency above which the device is marked slow, 10 ms by default.
+    void setSlowThreshold(std::chrono::microseconds threshold);
+
+    /// The USB port of the device, as "bus-port.port..." (e.g. "1-2.4").  It
+    /// stays the same when the device re-enumerates, e.g. in bootloader mode.
+    std::string getLocation() const;
 
     /**
      * @brief Sets the target of the servo on channelNumber.
@@ -232,6 +347,16 @@ class Device {
      */
     void setTarget(uint8_t channelNumber, uint16_t target);
 
+    /**
+     * @brief Sets the targets of \a count channels, from \a firstChannel.
+     *
+     * USB has no request setting several targets, so the requests are queued
+     * together instead of waiting for each one like setTarget().  They are
+     * applied in channel order, within a fraction of a millisecond.
+     */
+    void setTargets(uint8_t firstChannel, const uint16_t *targets, size_t count);
+    void setTargets(uint8_t firstChannel, const std::vector<uint16_t> &targets);
+
     /**
      * @brief Sets the \a speed limit of \a channelNumber.
      *
@@ -254,6 +379,22 @@ class Device {
 
     std::vector<ServoStatus> getServoStatus();
 
+    /// Reads the status of every channel into \a status, which must hold
+    /// getNumChannels() entries.  The transfer writes directly to it.
+    void getServoStatus(ServoStatus *status);
+
+    /**
+     * @brief Reads the program counter and the stacks of the script.
+     *
+     * The Micro Maestro sends them in one transfer.  The Mini Maestro needs one
+     * transfer for the program counter, then one per stack that is not empty,
+     * so the stacks can be a little more recent than the program counter.
+     *
+     * @param readDataStack Set to false to leave ScriptStatus::stack empty, and
+     *                      save a transfer on the Mini Maestro.
+     */
+    ScriptStatus getScriptStatus(bool readDataStack = true);
+
     void restoreDefaultConfiguration();
 
     DeviceSettings getDeviceSettings();
@@ -293,6 +434,41 @@ class Device {
     void clearErrors();
     void writeScript(const std::vector<uint8_t> &bytecode);
 
+    /// Same as above, for bytecode that is not in a vector, e.g. the
+    /// bytecode of a memory-mapped ScriptArtifact.
+    void writeScript(const uint8_t *bytecode, size_t size);
+
+    /**
+     * @brief Loads the subroutine table, bytecode and CRC of \a image, unless the device already has it.
+     *
+     * @return True if the script was written, false if it was already loaded.
+     */
+    bool writeScript(const FlashImage &image);
+
+    /**
+     * @brief Loads \a image like writeScript(), and returns the number of blocks written.
+     *
+     * Nothing is sent when the CRC stored by the device matches the CRC of
+     * \a image.  Otherwise the script is stopped, its CRC parameter is set to
+     * SCRIPT_CRC_INCOMPLETE, and it is erased, then written with several blocks
+     * queued at a time.  The CRC of \a image is only written once every block
+     * has been written, so an interrupted upload is written again by the next
+     * call.  The script is left stopped.
+     *
+     * Only the whole script can be erased, and flash cannot be rewritten
+     * without erasing it, so the script is always written whole.
+     *
+     * @return The number of blocks written, 0 if the script was already loaded.
+     */
+    size_t deployScript(const FlashImage &image);
+
+    /// The script CRC of the device while deployScript() writes the script.
+    /// A script whose CRC happens to be this value is written by every deploy.
+    static const uint16_t SCRIPT_CRC_INCOMPLETE = 0xFFFF;
+
+    /// Returns the CRC of the loaded script, stored in the device settings when the script is written.
+    uint16_t getScriptCRC();
+
     /**
      * @brief Sets the PWM specified by \a onTime and \a period in units of 1/48 microseconds.
      *
@@ -308,13 +484,68 @@ class Device {
     /// Enumerate the Maestro devices.
     static std::vector<Device> getConnectedDevices();
 
+    /// Completion of an asynchronous request: the error message, or an empty
+    /// string on success.
+    using Completion = std::function<void(const std::string &error)>;
+
+    /**
+     * @name Asynchronous requests
+     *
+     * Same as the calls above, for event loops and coroutines (see
+     * Coroutine.h).  They return at once, and their \a completion is called
+     * later by handleEvents(), on the thread calling it.  The results are
+     * written to the given pointers, which must stay valid until then.  Up
+     * to 8 transfers of a request are queued at once, so a long request like
+     * writeScriptAsync() can interleave with the requests made after it.
+     *
+     * With UsbBackend::USBFS, each transfer is made before the call returns,
+     * so the calls block like the synchronous ones; only the completion is
+     * still deferred to handleEvents().
+     */
+    ///@{
+    void setTargetAsync(uint8_t channelNumber, uint16_t target, Completion completion);
+    /// \a targets is copied.
+    void setTargetsAsync(uint8_t firstChannel, const uint16_t *targets, size_t count, Completion completion);
+    void setSpeedAsync(uint8_t channelNumber, uint16_t speed, Completion completion);
+    void setAccelerationAsync(uint8_t channelNumber, uint16_t acceleration, Completion completion);
+    /// \a status must hold getNumChannels() entries.
+    void getServoStatusAsync(ServoStatus *status, Completion completion);
+    void getChannelSettingsAsync(uint8_t channel, ChannelSettings *settings, Completion completion);
+    void setChannelSettingsAsync(uint8_t channel, const ChannelSettings &settings, Completion completion);
+    void eraseScriptAsync(Completion completion);
+    void restartScriptAsync(Completion completion);
+    void restartScriptAtSubroutineAsync(uint8_t subroutineNumber, Completion completion);
+    void restartScriptAtSubroutineWithParameterAsync(uint8_t subroutineNumber, uint16_t parameter, Completion completion);
+    void setScriptDoneAsync(uint8_t value, Completion completion);
+    void clearErrorsAsync(Completion completion);
+    /// \a bytecode is copied.
+    void writeScriptAsync(const uint8_t *bytecode, size_t size, Completion completion);
+    void getScriptCRCAsync(uint16_t *crc, Completion completion);
+    ///@}
+
+    /**
+     * @brief Calls the completions of the asynchronous requests of every device.
+     *
+     * Waits at most \a timeout for a transfer to complete when no completion
+     * is ready.  The completions can make new requests.
+     *
+     * @return The number of requests still pending.
+     */
+    static size_t handleEvents(std::chrono::milliseconds timeout);
+
    private:
     class usb_device;
+    struct AsyncBatch;
     Device(usb_device *device, uint16_t productID);
 
+    std::shared_ptr<AsyncBatch> createBatch(std::string failure, Completion completion) const;
+    static void submitBatch(const std::shared_ptr<AsyncBatch> &batch);
+
     uint16_t getRawParameter(Parameter parameter);
     void setRawParameter(Parameter parameter, uint16_t value);
     void setRawParameterNoChecks(uint16_t parameter, uint16_t value, int bytes);
+    uint16_t getSubroutineTableBlock() const;
+    size_t writeScriptBlocks(const uint8_t *data, size_t size, uint16_t firstBlock);
 
     const uint16_t m_vendorID = 0x1ffb;
     const uint16_t m_productID;
@@ -323,4 +554,30 @@ class Device {
 
     std::shared_ptr<usb_device> m_dev = nullptr;
 };
+
+/**
+ * @brief Makes the blocking calls of a Device fail once a deadline has passed, while it exists.
+ *
+ *     {
+ *         Maestro::Device::Deadline frame(device, std::chrono::steady_clock::now() + std::chrono::milliseconds(8));
+ *         device.setTargets(0, targets);  // sent within 8 ms, or throws
+ *     }
+ *
+ * Each transfer times out at the deadline at the latest, and the calls made
+ * after it throw at once, so that a late frame is dropped rather than
+ * delaying the next ones.  An inner deadline applies only if it is earlier.
+ * It applies to the calls made by the thread creating it, on the Device and
+ * its copies, and is destroyed by that thread.
+ */
+class Device::Deadline {
+   public:
+    Deadline(Device &device, std::chrono::steady_clock::time_point deadline);
+    ~Deadline();
+
+    Deadline(const Deadline &) = delete;
+    Deadline &operator=(const Deadline &) = delete;
+
+   private:
+    std::shared_ptr<usb_device> m_device;
+};
 }  // namespace Maestro
@@ -0,0 +1,273 @@
+#include "Disassembler.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+#include "Opcode.h"
+
+namespace Maestro {
+std::string toLower(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+    return s;
+}
+
+Disassembler::Disassembler(const std::vector<uint8_t>& bytecode, const std::array<uint16_t, 128>& subroutineTable)
+    : m_graph(bytecode, subroutineTable), m_subroutineTable(subroutineTable) {
+    decode(std::map<std::string, uint16_t>());
+}
+
+Disassembler::Disassembler(const Program& program)
+    : m_graph(program.getByteList(), program.getSubroutineTable()), m_subroutineTable(program.getSubroutineTable()) {
+    decode(program.getSubroutineAddresses());
+}
+
+std::string Disassembler::getLabelName(uint16_t address) {
+    std::ostringstream name;
+    name << "label_" << std::hex << std::setw(4) << std::setfill('0') << address;
+    return name.str();
+}
+
+std::string Disassembler::getSubroutineName(uint16_t address) const {
+    const auto subroutine = m_subroutines.find(address);
+    if (subroutine != m_subroutines.end()) {
+        return subroutine->second;
+    }
+    std::ostringstream name;
+    name << "SUB_" << std::uppercase << std::hex << std::setw(4) << std::setfill('0') << address;
+    return name.str();
+}
+
+void Disassembler::decode(const std::map<std::string, uint16_t>& subroutineNames) {
+    const std::vector<uint8_t>& bytecode = m_graph.getBytecode();
+    const std::vector<ControlFlowGraph::DecodedInstruction>& instructions = m_graph.getInstructions();
+    auto isValidTarget = [&](uint16_t address) { return address == bytecode.size() || m_graph.getInstructionAt(address) >= 0; };
+
+    const size_t decodedSize = instructions.empty() ? 0 : size_t(instructions.back().address) + instructions.back().length;
+    if (decodedSize < bytecode.size()) {
+        m_notes.push_back("The last " + std::to_string(bytecode.size() - decodedSize) + " bytes are a truncated instruction.");
+    }
+
+    // Subroutine numbers are given in definition order, so every entry up to
+    // the last one in use belongs to a defined subroutine.
+    std::set<int> calledNumbers;
+    for (const ControlFlowGraph::DecodedInstruction& instruction : instructions) {
+        if (instruction.opcode >= 128) {
+            calledNumbers.insert(instruction.opcode - 128);
+        }
+    }
+    for (int i = 127; i >= 0; i--) {
+        if (m_subroutineTable[i] != Program::UNUSED_SUBROUTINE || calledNumbers.count(i) != 0) {
+            m_subroutineCount = size_t(i + 1);
+            break;
+        }
+    }
+
+    std::map<uint16_t, std::string> names;
+    for (const auto& subroutine : subroutineNames) {
+        names.insert(std::make_pair(subroutine.second, subroutine.first));
+    }
+    auto addSubroutine = [&](uint16_t address) {
+        if (m_subroutines.find(address) == m_subroutines.end()) {
+            const auto name = names.find(address);
+            m_subroutines[address] = (name != names.end()) ? name->second : getSubroutineName(address);
+        }
+    };
+
+    std::vector<uint16_t> numbered;
+    for (size_t i = 0; i < m_subroutineCount; i++) {
+        const uint16_t address = m_subroutineTable[i];
+        if (!isValidTarget(address)) {
+            m_notes.push_back("Subroutine " + std::to_string(i) + " starts at " + std::to_string(address) + ", which is not an instruction.");
+            continue;
+        }
+        if (m_subroutines.find(address) != m_subroutines.end()) {
+            m_notes.push_back("Subroutine " + std::to_string(i) + " is a second entry for " + getSubroutineName(address) + ".");
+            continue;
+        }
+        addSubroutine(address);
+        numbered.push_back(address);
+    }
+    bool inDefinitionOrder = std::is_sorted(numbered.begin(), numbered.end());
+    for (const ControlFlowGraph::DecodedInstruction& instruction : instructions) {
+        const Opcode opcode = Opcode(instruction.opcode);
+        if (opcode == Opcode::CALL && isValidTarget(instruction.operand)) {
+            addSubroutine(instruction.operand);
+            // A subroutine defined before a numbered one would get a number.
+            if (!numbered.empty() && instruction.operand < numbered.back() &&
+                std::find(numbered.begin(), numbered.end(), instruction.operand) == numbered.end()) {
+                inDefinitionOrder = false;
+            }
+        } else if (opcode == Opcode::JUMP || opcode == Opcode::JUMP_Z) {
+            m_jumpTargets.insert(instruction.operand);
+        }
+    }
+    if (!inDefinitionOrder) {
+        m_notes.push_back("Subroutines are not numbered in definition order: compiling this source numbers them differently.");
+    }
+
+    // Forward conditional jumps become IF...ENDIF blocks, as long as the
+    // blocks nest.  IF and WHILE always produce such jumps.
+    std::vector<uint16_t> openBlocks;
+    for (const ControlFlowGraph::DecodedInstruction& instruction : instructions) {
+        if (Opcode(instruction.opcode) != Opcode::JUMP_Z || instruction.operand <= instruction.address || !isValidTarget(instruction.operand)) {
+            continue;
+        }
+        while (!openBlocks.empty() && openBlocks.back() <= instruction.address) {
+            openBlocks.pop_back();
+        }
+        if (!openBlocks.empty() && openBlocks.back() < instruction.operand) {
+            continue;
+        }
+        openBlocks.push_back(instruction.operand);
+        m_structuredJumps.insert(instruction.address);
+    }
+}
+
+std::string Disassembler::getLiteralValues(const ControlFlowGraph::DecodedInstruction& instruction) const {
+    const std::vector<uint8_t>& bytecode = m_graph.getBytecode();
+    const size_t address = instruction.address;
+    std::ostringstream values;
+    switch (getOpcodeInfo(instruction.opcode).operandType) {
+        case OperandType::BYTE:
+            values << int(bytecode[address + 1]);
+            break;
+        case OperandType::WORD:
+            values << int16_t(bytecode[address + 1] | (bytecode[address + 2] << 8));
+            break;
+        case OperandType::BYTE_LIST:
+            for (size_t i = 0; i < instruction.operand; i++) {
+                values << (i > 0 ? " " : "") << int(bytecode[address + 2 + i]);
+            }
+            break;
+        case OperandType::WORD_LIST:
+            for (size_t i = 0; i < instruction.operand; i++) {
+                values << (i > 0 ? " " : "") << int16_t(bytecode[address + 2 + 2 * i] | (bytecode[address + 3 + 2 * i] << 8));
+            }
+            break;
+        default:
+            break;
+    }
+    return values.str();
+}
+
+std::string Disassembler::toString() const {
+    std::ostringstream streamWriter;
+    const std::vector<uint8_t>& bytecode = m_graph.getBytecode();
+    for (const ControlFlowGraph::DecodedInstruction& instruction : m_graph.getInstructions()) {
+        const auto subroutine = m_subroutines.find(instruction.address);
+        if (subroutine != m_subroutines.end()) {
+            streamWriter << subroutine->second << ":" << std::endl;
+        }
+
+        streamWriter << std::uppercase << std::hex << std::setfill('0') << std::setw(4) << instruction.address << ": ";
+        int column_number = 0;
+        for (size_t i = 0; i < instruction.length; i++) {
+            streamWriter << std::setw(2) << int(bytecode[instruction.address + i]);
+            column_number += 2;
+        }
+        streamWriter << std::string(size_t(std::max(20 - column_number, 0)), ' ') << " " << std::dec << std::setfill(' ');
+
+        const OpcodeInfo info = getOpcodeInfo(instruction.opcode);
+        if (instruction.opcode >= 128) {
+            streamWriter << "SUB " << (instruction.opcode - 128) << " " << getSubroutineName(instruction.operand);
+        } else if (info.name == nullptr) {
+            streamWriter << "invalid opcode " << int(instruction.opcode);
+        } else if (info.operandType == OperandType::ADDRESS) {
+            streamWriter << info.name << " " << std::uppercase << std::hex << std::setfill('0') << std::setw(4) << instruction.operand << std::dec
+                         << std::setfill(' ');
+            if (Opcode(instruction.opcode) == Opcode::CALL) {
+                streamWriter << " " << getSubroutineName(instruction.operand);
+            }
+        } else if (info.operandType != OperandType::NONE) {
+            streamWriter << info.name << " " << getLiteralValues(instruction);
+        } else {
+            streamWriter << info.name;
+        }
+        streamWriter << std::endl;
+    }
+    return streamWriter.str();
+}
+
+std::string Disassembler::toSource() const {
+    std::ostringstream streamWriter;
+    for (const std::string& note : m_notes) {
+        streamWriter << "# " << note << std::endl;
+    }
+
+    std::map<uint16_t, int> blockEnds;
+    std::set<uint16_t> labels;
+    const ControlFlowGraph::DecodedInstruction* previous = nullptr;
+    for (const ControlFlowGraph::DecodedInstruction& instruction : m_graph.getInstructions()) {
+        const Opcode opcode = Opcode(instruction.opcode);
+        if (opcode == Opcode::JUMP_Z && m_structuredJumps.count(instruction.address) != 0) {
+            blockEnds[instruction.operand]++;
+        } else if (opcode == Opcode::JUMP || opcode == Opcode::JUMP_Z) {
+            labels.insert(instruction.operand);
+        }
+        // The compiler merges consecutive literals into one instruction,
+        // unless a label separates them.
+        if (previous != nullptr && ControlFlowGraph::isLiteral(*previous) && ControlFlowGraph::isLiteral(instruction)) {
+            labels.insert(instruction.address);
+        }
+        previous = &instruction;
+    }
+
+    int depth = 0;
+    auto indent = [&depth]() { return std::string(size_t(4 * depth), ' '); };
+    // ENDIF, SUB and labels generate no bytecode, so they all go right before
+    // the instruction at their address.
+    auto startAddress = [&](uint16_t address) {
+        const auto blockEnd = blockEnds.find(address);
+        if (blockEnd != blockEnds.end()) {
+            for (int i = 0; i < blockEnd->second; i++) {
+                depth--;
+                streamWriter << indent() << "endif" << std::endl;
+            }
+        }
+        const auto subroutine = m_subroutines.find(address);
+        if (subroutine != m_subroutines.end()) {
+            streamWriter << std::endl << indent() << "sub " << toLower(subroutine->second) << std::endl;
+        }
+        if (labels.count(address) != 0) {
+            streamWriter << indent() << getLabelName(address) << ":" << std::endl;
+        }
+    };
+
+    for (const ControlFlowGraph::DecodedInstruction& instruction : m_graph.getInstructions()) {
+        startAddress(instruction.address);
+
+        const OpcodeInfo info = getOpcodeInfo(instruction.opcode);
+        const Opcode opcode = Opcode(instruction.opcode);
+        if (instruction.opcode >= 128 || opcode == Opcode::CALL) {
+            streamWriter << indent() << toLower(getSubroutineName(instruction.operand)) << std::endl;
+        } else if (info.name == nullptr) {
+            streamWriter << indent() << "# invalid opcode " << int(instruction.opcode) << std::endl;
+        } else if (opcode == Opcode::JUMP) {
+            streamWriter << indent() << "goto " << getLabelName(instruction.operand) << std::endl;
+        } else if (opcode == Opcode::JUMP_Z && m_structuredJumps.count(instruction.address) != 0) {
+            streamWriter << indent() << "if" << std::endl;
+            depth++;
+        } else if (opcode == Opcode::JUMP_Z) {
+            streamWriter << indent() << "logical_not if goto " << getLabelName(instruction.operand) << " endif" << std::endl;
+        } else if (info.operandType != OperandType::NONE) {
+            streamWriter << indent() << getLiteralValues(instruction) << std::endl;
+        } else {
+            streamWriter << indent() << toLower(info.name) << std::endl;
+        }
+    }
+    startAddress(uint16_t(m_graph.getBytecode().size()));
+    return streamWriter.str();
+}
+
+bool Disassembler::roundTrips(bool isMiniMaestro) const {
+    try {
+        const Program program(toSource(), isMiniMaestro);
+        return program.getByteList() == m_graph.getBytecode() && program.getSubroutineTable() == m_subroutineTable;
+    } catch (const std::string&) {
+        return false;
+    } catch (const char*) {
+        return false;
+    }
+}
+}  // namespace Maestro
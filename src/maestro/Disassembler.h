@@ -0,0 +1,67 @@
+#pragma once
+
+#include <maestro/ControlFlowGraph.h>
+#include <maestro/Program.h>
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace Maestro {
+
+/// Decodes a compiled script back into instructions and script source.
+///
+/// The source produced by toSource() uses GOTO and labels for jumps, and
+/// IF...ENDIF for conditional jumps whenever they nest properly, which is
+/// always the case for bytecode produced by Program.  Compiling it gives the
+/// same bytecode and subroutine table as the original.  Images built by
+/// other tools are recompiled into equivalent code, but not always the same
+/// bytes (e.g. literals are re-encoded the way Program encodes them).
+class Disassembler {
+   public:
+    Disassembler(const std::vector<uint8_t>& bytecode, const std::array<uint16_t, 128>& subroutineTable);
+
+    /// Disassembles a compiled program, keeping its subroutine names.
+    explicit Disassembler(const Program& program);
+
+    const std::vector<ControlFlowGraph::DecodedInstruction>& getInstructions() const { return m_graph.getInstructions(); }
+
+    /// Subroutines found in the subroutine table and in CALL instructions, by
+    /// address.  Without the source they are named SUB_ followed by their
+    /// hexadecimal address.
+    const std::map<uint16_t, std::string>& getSubroutines() const { return m_subroutines; }
+
+    /// Number of the subroutine table entries in use.
+    size_t getSubroutineCount() const { return m_subroutineCount; }
+
+    /// Addresses that are the target of a JUMP or JUMP_Z instruction.
+    const std::set<uint16_t>& getJumpTargets() const { return m_jumpTargets; }
+
+    /// Listing with the address, bytes and decoded operands of each instruction.
+    std::string toString() const;
+
+    /// Script source that compiles back into this bytecode.
+    std::string toSource() const;
+
+    /// True if toSource() compiles into the same bytecode and subroutine table.
+    bool roundTrips(bool isMiniMaestro) const;
+
+   private:
+    void decode(const std::map<std::string, uint16_t>& subroutineNames);
+    std::string getLiteralValues(const ControlFlowGraph::DecodedInstruction& instruction) const;
+    std::string getSubroutineName(uint16_t address) const;
+    static std::string getLabelName(uint16_t address);
+
+    ControlFlowGraph m_graph;
+    std::array<uint16_t, 128> m_subroutineTable;
+    size_t m_subroutineCount = 0;
+    std::map<uint16_t, std::string> m_subroutines;
+    std::set<uint16_t> m_jumpTargets;
+    /// Conditional jumps written as IF...ENDIF; the others are written with GOTO.
+    std::set<uint16_t> m_structuredJumps;
+    std::vector<std::string> m_notes;
+};
+}  // namespace Maestro
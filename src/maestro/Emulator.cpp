@@ -0,0 +1,544 @@
+#include "Emulator.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include "Opcode.h"
+#include "Program.h"
+
+// GCC and Clang support computed gotos, which lets every instruction handler
+// jump straight to the next one instead of going back through a switch.
+#if defined(__GNUC__) || defined(__clang__)
+#define MAESTRO_THREADED_DISPATCH 1
+#endif
+
+namespace Maestro {
+const uint64_t SERVO_UPDATE_PERIOD = 10000000;  // speed limits apply every 10 ms (ns)
+
+Emulator::Emulator(const std::vector<uint8_t>& bytecode, const std::array<uint16_t, 128>& subroutineTable, bool isMiniMaestro, int channelCount)
+    : m_bytecode(bytecode),
+      m_subroutineTable(subroutineTable),
+      m_isMiniMaestro(isMiniMaestro),
+      m_stackSize(isMiniMaestro ? MINI_MAESTRO_STACK_SIZE : MICRO_MAESTRO_STACK_SIZE),
+      m_callStackSize(isMiniMaestro ? MINI_MAESTRO_CALL_STACK_SIZE : MICRO_MAESTRO_CALL_STACK_SIZE),
+      m_channels(channelCount) {
+    m_instructionTimes.fill(100000);
+    for (Channel& channel : m_channels) {
+        channel.state = ServoState{0, 0, 0, 0};
+        channel.time = 0;
+    }
+}
+
+Emulator::Emulator(const Program& program, bool isMiniMaestro, int channelCount)
+    : Emulator(program.getByteList(), program.getSubroutineTable(), isMiniMaestro, channelCount) {}
+
+void Emulator::setProfiling(bool profile) {
+    if (profile) {
+        m_profile.assign(m_bytecode.size(), 0);
+    } else {
+        m_profile.clear();
+    }
+}
+
+void Emulator::restart() {
+    m_status = Status::RUNNING;
+    m_pc = 0;
+    m_stackPointer = 0;
+    m_callStackPointer = 0;
+}
+
+void Emulator::restartAtSubroutine(uint8_t subroutineNumber) {
+    restart();
+    m_pc = m_subroutineTable[subroutineNumber & 0x7F];
+}
+
+void Emulator::restartAtSubroutineWithParameter(uint8_t subroutineNumber, int16_t parameter) {
+    restartAtSubroutine(subroutineNumber);
+    m_stack[m_stackPointer++] = parameter;
+}
+
+void Emulator::updateChannel(Channel& channel) const {
+    ServoState& state = channel.state;
+    if (state.position == state.target || state.speed == 0 || m_time <= channel.time) {
+        state.position = state.target;
+        channel.time = std::max(channel.time, m_time);
+        return;
+    }
+    const uint64_t updates = (m_time - channel.time) / SERVO_UPDATE_PERIOD;
+    channel.time += updates * SERVO_UPDATE_PERIOD;
+    const uint64_t distance = updates * state.speed;
+    if (state.position < state.target) {
+        state.position = uint16_t(std::min<uint64_t>(state.target, state.position + distance));
+    } else {
+        state.position = uint16_t(state.position - std::min<uint64_t>(state.position - state.target, distance));
+    }
+}
+
+Emulator::ServoState Emulator::getServoState(uint8_t channel) const {
+    if (channel >= m_channels.size()) {
+        return ServoState{0, 0, 0, 0};
+    }
+    Channel copy = m_channels[channel];
+    updateChannel(copy);
+    return copy.state;
+}
+
+uint16_t Emulator::getPosition(uint8_t channel) {
+    if (channel >= m_channels.size()) {
+        return 0;
+    }
+    updateChannel(m_channels[channel]);
+    return m_channels[channel].state.position;
+}
+
+bool Emulator::isMoving() {
+    for (Channel& channel : m_channels) {
+        updateChannel(channel);
+        if (channel.state.position != channel.state.target) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Emulator::record(uint8_t opcode, uint8_t channel, uint16_t value) {
+    if (m_recordEvents) {
+        m_events.push_back(Event{m_time / 1000, opcode, channel, value});
+    }
+}
+
+void Emulator::setTarget(uint8_t channel, uint16_t target) {
+    if (channel >= m_channels.size()) {
+        return;
+    }
+    Channel& c = m_channels[channel];
+    updateChannel(c);
+    // A channel that was not sending pulses jumps straight to its first target.
+    if (c.state.position == 0) {
+        c.state.position = target;
+    }
+    c.state.target = target;
+    c.time = m_time;
+}
+
+void Emulator::setSpeed(uint8_t channel, uint16_t speed) {
+    if (channel < m_channels.size()) {
+        updateChannel(m_channels[channel]);
+        m_channels[channel].state.speed = speed;
+    }
+}
+
+void Emulator::setAcceleration(uint8_t channel, uint16_t acceleration) {
+    if (channel < m_channels.size()) {
+        m_channels[channel].state.acceleration = uint8_t(acceleration);
+    }
+}
+
+Emulator::Status Emulator::run(uint64_t timeLimit, uint64_t instructionLimit) {
+    if (m_status != Status::RUNNING) {
+        return m_status;
+    }
+    const uint64_t timeLimitNs = (timeLimit > UINT64_MAX / 1000) ? UINT64_MAX : timeLimit * 1000;
+    const uint8_t* const code = m_bytecode.data();
+    const uint32_t codeSize = uint32_t(m_bytecode.size());
+    const uint32_t* const times = m_instructionTimes.data();
+    uint64_t* const profile = m_profile.empty() ? nullptr : m_profile.data();
+    int16_t* const stack = m_stack.data();
+    const int stackSize = m_stackSize;
+
+    uint32_t pc = m_pc;
+    int sp = m_stackPointer;
+    uint64_t executed = 0;
+    uint8_t op = 0;
+    Status status = Status::RUNNING;
+
+#define STACK_ERROR()                \
+    {                                \
+        status = Status::STACK_ERROR; \
+        goto stop;                   \
+    }
+#define NEED(n) \
+    if (sp < (n)) STACK_ERROR()
+#define ROOM(n) \
+    if (sp + (n) > stackSize) STACK_ERROR()
+#define OPERANDS(n)                              \
+    if (pc + (n) > codeSize) {                   \
+        status = Status::PROGRAM_COUNTER_ERROR; \
+        goto stop;                               \
+    }
+#define READ16(offset) int16_t(code[pc + (offset)] | (code[pc + (offset) + 1] << 8))
+#define TOP stack[sp - 1]
+#define SECOND stack[sp - 2]
+#define BINARY(expression)      \
+    {                           \
+        NEED(2);                \
+        const int a = SECOND;   \
+        const int b = TOP;      \
+        sp--;                   \
+        TOP = int16_t(expression); \
+    }
+#define UNARY(expression)    \
+    {                        \
+        NEED(1);             \
+        const int a = TOP;   \
+        TOP = int16_t(expression); \
+    }
+
+#ifdef MAESTRO_THREADED_DISPATCH
+    void* handlers[256];
+    for (int i = 0; i < 256; i++) {
+        handlers[i] = &&op_DEFAULT;
+    }
+#define HANDLER(name) \
+    handlers[int(Opcode::name)] = &&op_##name;
+    HANDLER(QUIT) HANDLER(LITERAL) HANDLER(LITERAL8) HANDLER(LITERAL_N) HANDLER(LITERAL8_N) HANDLER(RETURN) HANDLER(JUMP) HANDLER(JUMP_Z)
+    HANDLER(DELAY) HANDLER(GET_MS) HANDLER(DEPTH) HANDLER(DROP) HANDLER(DUP) HANDLER(OVER) HANDLER(PICK) HANDLER(SWAP) HANDLER(ROT) HANDLER(ROLL)
+    HANDLER(BITWISE_NOT) HANDLER(BITWISE_AND) HANDLER(BITWISE_OR) HANDLER(BITWISE_XOR) HANDLER(SHIFT_RIGHT) HANDLER(SHIFT_LEFT) HANDLER(LOGICAL_NOT)
+    HANDLER(LOGICAL_AND) HANDLER(LOGICAL_OR) HANDLER(NEGATE) HANDLER(PLUS) HANDLER(MINUS) HANDLER(TIMES) HANDLER(DIVIDE) HANDLER(MOD)
+    HANDLER(POSITIVE) HANDLER(NEGATIVE) HANDLER(NONZERO) HANDLER(EQUALS) HANDLER(NOT_EQUALS) HANDLER(MIN) HANDLER(MAX) HANDLER(LESS_THAN)
+    HANDLER(GREATER_THAN) HANDLER(SERVO) HANDLER(SERVO_8BIT) HANDLER(SPEED) HANDLER(ACCELERATION) HANDLER(GET_POSITION) HANDLER(GET_MOVING_STATE)
+    HANDLER(LED_ON) HANDLER(LED_OFF) HANDLER(CALL)
+    if (m_isMiniMaestro) {
+        HANDLER(PWM) HANDLER(PEEK) HANDLER(POKE) HANDLER(SERIAL_SEND_BYTE)
+    }
+#undef HANDLER
+#define CASE(name) op_##name:
+#define DEFAULT op_DEFAULT:
+#define NEXT()                                              \
+    {                                                       \
+        if (pc >= codeSize) {                               \
+            status = Status::PROGRAM_COUNTER_ERROR;         \
+            goto stop;                                      \
+        }                                                   \
+        if (m_time >= timeLimitNs || executed == instructionLimit) { \
+            goto stop;                                      \
+        }                                                   \
+        executed++;                                         \
+        if (profile) profile[pc]++;                         \
+        op = code[pc++];                                    \
+        m_time += times[op];                                \
+        goto* handlers[op];                                 \
+    }
+    NEXT();
+#else
+#define CASE(name) case uint8_t(Opcode::name):
+#define DEFAULT default:
+#define NEXT() continue
+    for (;;) {
+        if (pc >= codeSize) {
+            status = Status::PROGRAM_COUNTER_ERROR;
+            goto stop;
+        }
+        if (m_time >= timeLimitNs || executed == instructionLimit) {
+            goto stop;
+        }
+        executed++;
+        if (profile) profile[pc]++;
+        op = code[pc++];
+        m_time += times[op];
+        if (!m_isMiniMaestro && op >= uint8_t(Opcode::PWM) && op < 128) {
+            status = Status::INVALID_OPCODE;
+            goto stop;
+        }
+        switch (op) {
+#endif
+
+    CASE(QUIT) {
+        status = Status::QUIT;
+        goto stop;
+    }
+    CASE(LITERAL) {
+        OPERANDS(2);
+        ROOM(1);
+        stack[sp++] = READ16(0);
+        pc += 2;
+        NEXT();
+    }
+    CASE(LITERAL8) {
+        OPERANDS(1);
+        ROOM(1);
+        stack[sp++] = code[pc++];
+        NEXT();
+    }
+    CASE(LITERAL_N) {
+        OPERANDS(1);
+        const uint32_t bytes = code[pc++];
+        OPERANDS(bytes);
+        ROOM(int(bytes / 2));
+        for (uint32_t i = 0; i + 1 < bytes; i += 2) {
+            stack[sp++] = READ16(i);
+        }
+        pc += bytes;
+        NEXT();
+    }
+    CASE(LITERAL8_N) {
+        OPERANDS(1);
+        const uint32_t count = code[pc++];
+        OPERANDS(count);
+        ROOM(int(count));
+        for (uint32_t i = 0; i < count; i++) {
+            stack[sp++] = code[pc + i];
+        }
+        pc += count;
+        NEXT();
+    }
+    CASE(RETURN) {
+        if (m_callStackPointer == 0) {
+            status = Status::CALL_STACK_ERROR;
+            goto stop;
+        }
+        pc = m_callStack[--m_callStackPointer];
+        NEXT();
+    }
+    CASE(JUMP) {
+        OPERANDS(2);
+        pc = uint16_t(READ16(0));
+        NEXT();
+    }
+    CASE(JUMP_Z) {
+        OPERANDS(2);
+        NEED(1);
+        if (stack[--sp] == 0) {
+            pc = uint16_t(READ16(0));
+        } else {
+            pc += 2;
+        }
+        NEXT();
+    }
+    CASE(DELAY) {
+        NEED(1);
+        m_time += uint64_t(uint16_t(stack[--sp])) * 1000000;
+        NEXT();
+    }
+    CASE(GET_MS) {
+        ROOM(1);
+        stack[sp++] = int16_t(m_time / 1000000);
+        NEXT();
+    }
+    CASE(DEPTH) {
+        ROOM(1);
+        stack[sp] = int16_t(sp);
+        sp++;
+        NEXT();
+    }
+    CASE(DROP) {
+        NEED(1);
+        sp--;
+        NEXT();
+    }
+    CASE(DUP) {
+        NEED(1);
+        ROOM(1);
+        stack[sp] = stack[sp - 1];
+        sp++;
+        NEXT();
+    }
+    CASE(OVER) {
+        NEED(2);
+        ROOM(1);
+        stack[sp] = stack[sp - 2];
+        sp++;
+        NEXT();
+    }
+    CASE(PICK) {
+        NEED(1);
+        const int n = TOP;
+        if (n < 0 || n + 2 > sp) STACK_ERROR();
+        TOP = stack[sp - 2 - n];
+        NEXT();
+    }
+    CASE(SWAP) {
+        NEED(2);
+        std::swap(TOP, SECOND);
+        NEXT();
+    }
+    CASE(ROT) {
+        NEED(3);
+        std::rotate(stack + sp - 3, stack + sp - 2, stack + sp);
+        NEXT();
+    }
+    CASE(ROLL) {
+        NEED(1);
+        const int n = stack[--sp];
+        if (n < 0 || n + 1 > sp) STACK_ERROR();
+        std::rotate(stack + sp - 1 - n, stack + sp - n, stack + sp);
+        NEXT();
+    }
+    CASE(BITWISE_NOT) UNARY(~a) NEXT();
+    CASE(BITWISE_AND) BINARY(a & b) NEXT();
+    CASE(BITWISE_OR) BINARY(a | b) NEXT();
+    CASE(BITWISE_XOR) BINARY(a ^ b) NEXT();
+    CASE(SHIFT_RIGHT) BINARY((b < 0 || b > 15) ? (a < 0 ? -1 : 0) : (a >> b)) NEXT();
+    CASE(SHIFT_LEFT) BINARY((b < 0 || b > 15) ? 0 : (uint16_t(a) << b)) NEXT();
+    CASE(LOGICAL_NOT) UNARY(!a) NEXT();
+    CASE(LOGICAL_AND) BINARY(a && b) NEXT();
+    CASE(LOGICAL_OR) BINARY(a || b) NEXT();
+    CASE(NEGATE) UNARY(-a) NEXT();
+    CASE(PLUS) BINARY(a + b) NEXT();
+    CASE(MINUS) BINARY(a - b) NEXT();
+    CASE(TIMES) BINARY(a * b) NEXT();
+    // Division by zero is not specified by the firmware documentation; it yields 0 here.
+    CASE(DIVIDE) BINARY(b == 0 ? 0 : a / b) NEXT();
+    CASE(MOD) BINARY(b == 0 ? 0 : a % b) NEXT();
+    CASE(POSITIVE) UNARY(a > 0) NEXT();
+    CASE(NEGATIVE) UNARY(a < 0) NEXT();
+    CASE(NONZERO) UNARY(a != 0) NEXT();
+    CASE(EQUALS) BINARY(a == b) NEXT();
+    CASE(NOT_EQUALS) BINARY(a != b) NEXT();
+    CASE(MIN) BINARY(std::min(a, b)) NEXT();
+    CASE(MAX) BINARY(std::max(a, b)) NEXT();
+    CASE(LESS_THAN) BINARY(a < b) NEXT();
+    CASE(GREATER_THAN) BINARY(a > b) NEXT();
+    CASE(SERVO) {
+        NEED(2);
+        const uint8_t channel = uint8_t(stack[--sp]);
+        const uint16_t target = uint16_t(stack[--sp]);
+        setTarget(channel, target);
+        record(op, channel, target);
+        NEXT();
+    }
+    CASE(SERVO_8BIT) {
+        NEED(2);
+        const uint8_t channel = uint8_t(stack[--sp]);
+        const int value = uint8_t(stack[--sp]);
+        // Default neutral (1500 us) and range (476.25 us) of the channel settings.
+        const uint16_t target = uint16_t(6000 + (value - 127) * 1905 / 127);
+        setTarget(channel, target);
+        record(op, channel, uint16_t(value));
+        NEXT();
+    }
+    CASE(SPEED) {
+        NEED(2);
+        const uint8_t channel = uint8_t(stack[--sp]);
+        const uint16_t speed = uint16_t(stack[--sp]);
+        setSpeed(channel, speed);
+        record(op, channel, speed);
+        NEXT();
+    }
+    CASE(ACCELERATION) {
+        NEED(2);
+        const uint8_t channel = uint8_t(stack[--sp]);
+        const uint16_t acceleration = uint16_t(stack[--sp]);
+        setAcceleration(channel, acceleration);
+        record(op, channel, acceleration);
+        NEXT();
+    }
+    CASE(GET_POSITION) {
+        NEED(1);
+        TOP = int16_t(getPosition(uint8_t(TOP)));
+        NEXT();
+    }
+    CASE(GET_MOVING_STATE) {
+        ROOM(1);
+        stack[sp++] = isMoving() ? 1 : 0;
+        NEXT();
+    }
+    CASE(LED_ON) {
+        m_led = true;
+        NEXT();
+    }
+    CASE(LED_OFF) {
+        m_led = false;
+        NEXT();
+    }
+    CASE(PWM) {
+        NEED(2);
+        m_pwmPeriod = uint16_t(stack[--sp]);
+        m_pwmOnTime = uint16_t(stack[--sp]);
+        record(op, 0, m_pwmOnTime);
+        NEXT();
+    }
+    // PEEK and POKE access the stack by index, counting from the bottom.
+    CASE(PEEK) {
+        NEED(1);
+        const int index = TOP;
+        if (index < 0 || index >= sp) STACK_ERROR();
+        TOP = stack[index];
+        NEXT();
+    }
+    CASE(POKE) {
+        NEED(2);
+        const int index = stack[--sp];
+        const int16_t value = stack[--sp];
+        if (index < 0 || index >= sp) STACK_ERROR();
+        stack[index] = value;
+        NEXT();
+    }
+    CASE(SERIAL_SEND_BYTE) {
+        NEED(1);
+        m_serialOutput.push_back(uint8_t(stack[--sp]));
+        NEXT();
+    }
+    CASE(CALL) {
+        OPERANDS(2);
+        if (m_callStackPointer >= m_callStackSize) {
+            status = Status::CALL_STACK_ERROR;
+            goto stop;
+        }
+        m_callStack[m_callStackPointer++] = uint16_t(pc + 2);
+        pc = uint16_t(READ16(0));
+        NEXT();
+    }
+    DEFAULT {
+        if (op < 128) {
+            status = Status::INVALID_OPCODE;
+            goto stop;
+        }
+        if (m_callStackPointer >= m_callStackSize) {
+            status = Status::CALL_STACK_ERROR;
+            goto stop;
+        }
+        m_callStack[m_callStackPointer++] = uint16_t(pc);
+        pc = m_subroutineTable[op - 128];
+        NEXT();
+    }
+
+#ifndef MAESTRO_THREADED_DISPATCH
+        }
+    }
+#endif
+
+stop:
+    m_pc = uint16_t(pc);
+    m_stackPointer = sp;
+    m_instructionCount += executed;
+    m_status = status;
+    return status;
+
+#undef STACK_ERROR
+#undef NEED
+#undef ROOM
+#undef OPERANDS
+#undef READ16
+#undef TOP
+#undef SECOND
+#undef BINARY
+#undef UNARY
+#undef CASE
+#undef DEFAULT
+#undef NEXT
+}
+
+void Emulator::runAll(std::vector<Emulator>& emulators, uint64_t timeLimit, uint64_t instructionLimit, unsigned threadCount) {
+    if (threadCount == 0) {
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threadCount = unsigned(std::min<size_t>(threadCount, emulators.size()));
+
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i = next++; i < emulators.size(); i = next++) {
+            emulators[i].run(timeLimit, instructionLimit);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < threadCount; i++) {
+        threads.push_back(std::thread(worker));
+    }
+    worker();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+}  // namespace Maestro
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+namespace Maestro {
+class Program;
+
+/// Host-side virtual machine running a compiled Maestro script.
+///
+/// The data stack and the call stack have the depth of the emulated
+/// firmware. Time is virtual: every instruction advances the clock by its
+/// configured execution time and DELAY advances it by the requested amount,
+/// so a script runs as fast as the host allows. Each Emulator is fully
+/// independent, and many of them can be run in parallel with runAll().
+class Emulator {
+   public:
+    enum class Status {
+        /// The script is still running (a time or instruction limit was reached).
+        RUNNING,
+        /// The script executed QUIT.
+        QUIT,
+        /// The data stack overflowed or underflowed.
+        STACK_ERROR,
+        /// The call stack overflowed or RETURN was executed with an empty call stack.
+        CALL_STACK_ERROR,
+        /// The program counter left the bytecode.
+        PROGRAM_COUNTER_ERROR,
+        /// The byte at the program counter is not a valid opcode for this Maestro.
+        INVALID_OPCODE
+    };
+
+    /// State of one channel, in the units of Device::ServoStatus.
+    struct ServoState {
+        uint16_t position;
+        uint16_t target;
+        uint16_t speed;
+        uint8_t acceleration;
+    };
+
+    /// A servo command executed by the script, for regression testing.
+    struct Event {
+        /// Virtual time in microseconds.
+        uint64_t time;
+        /// One of Opcode::SERVO, SERVO_8BIT, SPEED, ACCELERATION or PWM.
+        uint8_t opcode;
+        uint8_t channel;
+        uint16_t value;
+    };
+
+    Emulator(const std::vector<uint8_t>& bytecode, const std::array<uint16_t, 128>& subroutineTable, bool isMiniMaestro, int channelCount);
+    Emulator(const Program& program, bool isMiniMaestro, int channelCount);
+
+    /// Execution time of each opcode in nanoseconds (subroutine opcodes are
+    /// indexed 128-255).  Defaults to 100 us for every instruction.
+    void setInstructionTimes(const std::array<uint32_t, 256>& nanoseconds) { m_instructionTimes = nanoseconds; }
+
+    /// Records every servo command in getEvents().  Off by default.
+    void setRecordEvents(bool record) { m_recordEvents = record; }
+
+    /// Counts how many times each bytecode address is executed.  Off by default.
+    void setProfiling(bool profile);
+
+    void restart();
+    void restartAtSubroutine(uint8_t subroutineNumber);
+    void restartAtSubroutineWithParameter(uint8_t subroutineNumber, int16_t parameter);
+
+    /**
+     * @brief Runs the script until it stops or a limit is reached.
+     *
+     * @param timeLimit Virtual time, in microseconds since the start, after which to pause.
+     *                  A DELAY in progress always completes before pausing.
+     * @param instructionLimit Maximum number of instructions to execute in this call.
+     * @return RUNNING when a limit was reached, otherwise the reason the script stopped.
+     */
+    Status run(uint64_t timeLimit = UINT64_MAX, uint64_t instructionLimit = UINT64_MAX);
+
+    /// Runs every emulator on \a threadCount threads (0 means one per core).
+    static void runAll(std::vector<Emulator>& emulators, uint64_t timeLimit, uint64_t instructionLimit = UINT64_MAX, unsigned threadCount = 0);
+
+    Status getStatus() const { return m_status; }
+    /// Virtual time in microseconds since the script was started.
+    uint64_t getTime() const { return m_time / 1000; }
+    uint64_t getInstructionCount() const { return m_instructionCount; }
+    uint16_t getProgramCounter() const { return m_pc; }
+    std::vector<int16_t> getStack() const { return std::vector<int16_t>(m_stack.begin(), m_stack.begin() + m_stackPointer); }
+    std::vector<uint16_t> getCallStack() const { return std::vector<uint16_t>(m_callStack.begin(), m_callStack.begin() + m_callStackPointer); }
+    const std::vector<Event>& getEvents() const { return m_events; }
+    const std::vector<uint64_t>& getProfile() const { return m_profile; }
+    const std::vector<uint8_t>& getSerialOutput() const { return m_serialOutput; }
+    bool isLedOn() const { return m_led; }
+
+    /// Current state of a channel, with its position moved toward the target
+    /// according to the speed limit for the time elapsed.
+    ServoState getServoState(uint8_t channel) const;
+
+    /// Host-side commands, like the ones of Device.
+    void setTarget(uint8_t channel, uint16_t target);
+    void setSpeed(uint8_t channel, uint16_t speed);
+    void setAcceleration(uint8_t channel, uint16_t acceleration);
+
+   private:
+    struct Channel {
+        ServoState state;
+        /// Virtual time (ns) up to which the position has been updated.
+        uint64_t time;
+    };
+
+    void updateChannel(Channel& channel) const;
+    uint16_t getPosition(uint8_t channel);
+    bool isMoving();
+    void record(uint8_t opcode, uint8_t channel, uint16_t value);
+
+    std::vector<uint8_t> m_bytecode;
+    std::array<uint16_t, 128> m_subroutineTable;
+    bool m_isMiniMaestro;
+    int m_stackSize;
+    int m_callStackSize;
+    std::array<uint32_t, 256> m_instructionTimes;
+
+    Status m_status = Status::RUNNING;
+    uint16_t m_pc = 0;
+    int m_stackPointer = 0;
+    int m_callStackPointer = 0;
+    std::array<int16_t, 126> m_stack;
+    std::array<uint16_t, 126> m_callStack;
+    /// Virtual time in nanoseconds.
+    uint64_t m_time = 0;
+    uint64_t m_instructionCount = 0;
+
+    std::vector<Channel> m_channels;
+    bool m_led = false;
+    uint16_t m_pwmOnTime = 0;
+    uint16_t m_pwmPeriod = 0;
+    std::vector<uint8_t> m_serialOutput;
+
+    bool m_recordEvents = false;
+    std::vector<Event> m_events;
+    std::vector<uint64_t> m_profile;
+};
+}  // namespace Maestro
@@ -0,0 +1,580 @@
+#include "Firmware.h"
+
+#include <libusb.h>
+
+#include "Device.h"
+#include "UsbLocation.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Maestro {
+const uint16_t POLOLU_VENDOR_ID = 0x1ffb;
+
+/// True for the product IDs of the Maestro firmware, false for the bootloaders.
+bool isMaestroApplication(uint16_t productID) { return productID >= 0x0089 && productID <= 0x008c; }
+
+/// Formats a BCD version, e.g. 0x0104 as "1.04".
+std::string formatVersion(uint16_t version) {
+    char text[8];
+    snprintf(text, sizeof(text), "%x.%02x", version >> 8, version & 0xFF);
+    return text;
+}
+
+int hexDigitValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+FirmwareImage::FirmwareImage(const std::string& path) : m_path(path) {
+#ifdef _WIN32
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        throw "Cannot open " + path + ".";
+    }
+    m_buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    m_data = m_buffer.data();
+    m_size = m_buffer.size();
+#else
+    const int file = open(path.c_str(), O_RDONLY);
+    if (file < 0) {
+        throw "Cannot open " + path + ".";
+    }
+    struct stat status;
+    if (fstat(file, &status) != 0) {
+        close(file);
+        throw "Cannot read " + path + ".";
+    }
+    m_size = size_t(status.st_size);
+    if (m_size > 0) {
+        void* data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, file, 0);
+        if (data == MAP_FAILED) {
+            close(file);
+            throw "Cannot map " + path + " in memory.";
+        }
+        m_data = static_cast<const char*>(data);
+    }
+    close(file);
+#endif
+    try {
+        parseName();
+        m_recordCount = checkRecords();
+    } catch (...) {
+        unmap();
+        throw;
+    }
+}
+
+FirmwareImage::~FirmwareImage() { unmap(); }
+
+void FirmwareImage::unmap() {
+#ifndef _WIN32
+    if (m_data != nullptr) {
+        munmap(const_cast<char*>(m_data), m_size);
+    }
+#endif
+    m_data = nullptr;
+}
+
+std::string FirmwareImage::getProduct(uint16_t productID) {
+    switch (productID) {
+        case 0x89:
+            return "usc02a";
+        case 0x8A:
+            return "usc03a";
+        case 0x8B:
+            return "usc03b";
+        case 0x8C:
+            return "usc03c";
+        default:
+            return "";
+    }
+}
+
+void FirmwareImage::parseName() {
+    const size_t separator = m_path.find_last_of("/\\");
+    const std::string name = m_path.substr((separator == std::string::npos) ? 0 : separator + 1);
+
+    // usc0xx_vX.YY.pgm
+    const size_t underscore = name.find("_v");
+    if (name.compare(0, 3, "usc") != 0 || underscore == std::string::npos) {
+        return;
+    }
+    m_product = name.substr(0, underscore);
+    const size_t dot = name.find('.', underscore);
+    if (dot == std::string::npos || dot + 3 > name.size()) {
+        return;
+    }
+    const std::string major = name.substr(underscore + 2, dot - underscore - 2);
+    const std::string minor = name.substr(dot + 1, 2);
+    if (major.empty() || major.size() > 2 || !std::all_of(major.begin(), major.end(), ::isdigit) || !std::all_of(minor.begin(), minor.end(), ::isdigit)) {
+        return;
+    }
+    // BCD, like the bcdDevice of the USB descriptor.
+    m_version = uint16_t(std::stoi(major, nullptr, 16) << 8 | std::stoi(minor, nullptr, 16));
+}
+
+size_t FirmwareImage::checkRecords() const {
+    size_t recordCount = 0;
+    bool ended = false;
+    int lineNumber = 0;
+    for (size_t position = 0; position < m_size;) {
+        size_t end = position;
+        while (end < m_size && m_data[end] != '\n') {
+            end++;
+        }
+        size_t lineEnd = end;
+        if (lineEnd > position && m_data[lineEnd - 1] == '\r') {
+            lineEnd--;
+        }
+        lineNumber++;
+
+        if (lineEnd > position) {
+            const std::string where = m_path + ":" + std::to_string(lineNumber) + ": ";
+            if (ended) {
+                throw where + "data after the end record.";
+            }
+            // ':', then the length, address (2 bytes), type, data and checksum.
+            const size_t digits = lineEnd - position - 1;
+            if (m_data[position] != ':' || digits % 2 != 0 || digits < 10) {
+                throw where + "malformed record.";
+            }
+            uint8_t sum = 0;
+            uint8_t length = 0;
+            uint8_t type = 0;
+            for (size_t i = 0; i < digits / 2; i++) {
+                const int high = hexDigitValue(m_data[position + 1 + 2 * i]);
+                const int low = hexDigitValue(m_data[position + 2 + 2 * i]);
+                if (high < 0 || low < 0) {
+                    throw where + "invalid hexadecimal digit.";
+                }
+                const uint8_t value = uint8_t(high << 4 | low);
+                if (i == 0) {
+                    length = value;
+                } else if (i == 3) {
+                    type = value;
+                }
+                sum = uint8_t(sum + value);
+            }
+            if (size_t(length) + 5 != digits / 2) {
+                throw where + "the record length does not match its data.";
+            }
+            if (sum != 0) {
+                throw where + "checksum error.";
+            }
+            if (type == 1) {
+                ended = true;
+            } else if (type != 0) {
+                throw where + "unexpected record type " + std::to_string(type) + ".";
+            }
+            recordCount++;
+        }
+        position = end + 1;
+    }
+    if (!ended) {
+        throw m_path + ": the end record is missing, the file is truncated.";
+    }
+    return recordCount;
+}
+
+/// Wakes up the threads waiting for a device to appear on the bus.
+class FirmwareUpdater::UsbWatcher {
+   public:
+    UsbWatcher() {
+        if (libusb_init(&m_context) != 0) {
+            throw "Cannot initialize libusb.";
+        }
+        if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+            libusb_hotplug_register_callback(m_context, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_NO_FLAGS, POLOLU_VENDOR_ID,
+                                             LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, onDeviceArrived, this, &m_callback) == LIBUSB_SUCCESS) {
+            m_hotplug = true;
+            m_eventThread = std::thread([this]() {
+                while (!m_stopping) {
+                    timeval timeout = {0, 100000};
+                    libusb_handle_events_timeout_completed(m_context, &timeout, nullptr);
+                }
+            });
+        }
+    }
+
+    ~UsbWatcher() {
+        if (m_hotplug) {
+            m_stopping = true;
+            libusb_hotplug_deregister_callback(m_context, m_callback);
+            m_eventThread.join();
+        }
+        libusb_exit(m_context);
+    }
+
+    UsbWatcher(const UsbWatcher&) = delete;
+    UsbWatcher& operator=(const UsbWatcher&) = delete;
+
+    libusb_context* getContext() const { return m_context; }
+
+    /// Returns the Pololu device at \a location, in bootloader or in
+    /// application mode, with a reference to release.  Returns null if it
+    /// has not appeared at \a deadline.
+    libusb_device* waitForDevice(const std::string& location, bool bootloader, std::chrono::steady_clock::time_point deadline) {
+        // Without hotplug events, the device list is polled.
+        const std::chrono::milliseconds pollInterval(m_hotplug ? 1000 : 100);
+        while (true) {
+            // Read before the device list, so that an arrival in between is not missed.
+            uint64_t arrivals;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                arrivals = m_arrivals;
+            }
+            libusb_device* device = findDevice(location, bootloader);
+            if (device != nullptr) {
+                return device;
+            }
+            const auto now = std::chrono::steady_clock::now();
+            if (now >= deadline) {
+                return nullptr;
+            }
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_arrived.wait_until(lock, std::min(deadline, now + pollInterval), [&]() { return m_arrivals != arrivals; });
+        }
+    }
+
+   private:
+    static int LIBUSB_CALL onDeviceArrived(libusb_context*, libusb_device*, libusb_hotplug_event, void* userData) {
+        UsbWatcher* watcher = static_cast<UsbWatcher*>(userData);
+        {
+            std::lock_guard<std::mutex> lock(watcher->m_mutex);
+            watcher->m_arrivals++;
+        }
+        watcher->m_arrived.notify_all();
+        return 0;
+    }
+
+    libusb_device* findDevice(const std::string& location, bool bootloader) {
+        libusb_device** list;
+        const ssize_t count = libusb_get_device_list(m_context, &list);
+        if (count < 0) {
+            return nullptr;
+        }
+        libusb_device* found = nullptr;
+        for (ssize_t i = 0; i < count && found == nullptr; i++) {
+            libusb_device_descriptor descriptor;
+            if (libusb_get_device_descriptor(list[i], &descriptor) != 0 || descriptor.idVendor != POLOLU_VENDOR_ID) {
+                continue;
+            }
+            if (isMaestroApplication(descriptor.idProduct) != bootloader && getDeviceLocation(list[i]) == location) {
+                found = libusb_ref_device(list[i]);
+            }
+        }
+        libusb_free_device_list(list, 1);
+        return found;
+    }
+
+    libusb_context* m_context = nullptr;
+    bool m_hotplug = false;
+    libusb_hotplug_callback_handle m_callback;
+    std::thread m_eventThread;
+    std::atomic<bool> m_stopping{false};
+
+    std::mutex m_mutex;
+    std::condition_variable m_arrived;
+    uint64_t m_arrivals = 0;
+};
+
+/// Serial connection to a Maestro in bootloader mode, through the bulk
+/// endpoints of the data interface of its USB CDC function.
+class BootloaderConnection {
+   public:
+    explicit BootloaderConnection(libusb_device* device) {
+        libusb_config_descriptor* config = nullptr;
+        if (libusb_get_active_config_descriptor(device, &config) != 0) {
+            throw "cannot read the USB configuration of the bootloader";
+        }
+        for (uint8_t i = 0; i < config->bNumInterfaces && m_interface < 0; i++) {
+            const libusb_interface_descriptor& interface = config->interface[i].altsetting[0];
+            if (interface.bInterfaceClass != LIBUSB_CLASS_DATA) {
+                continue;
+            }
+            for (uint8_t j = 0; j < interface.bNumEndpoints; j++) {
+                const libusb_endpoint_descriptor& endpoint = interface.endpoint[j];
+                if ((endpoint.bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) != LIBUSB_TRANSFER_TYPE_BULK) {
+                    continue;
+                }
+                if ((endpoint.bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN) {
+                    m_in = endpoint.bEndpointAddress;
+                } else {
+                    m_out = endpoint.bEndpointAddress;
+                }
+            }
+            m_interface = interface.bInterfaceNumber;
+        }
+        libusb_free_config_descriptor(config);
+        if (m_interface < 0 || m_in == 0 || m_out == 0) {
+            throw "the bootloader has no serial data interface";
+        }
+
+        int result = libusb_open(device, &m_handle);
+        if (result != 0) {
+            throw std::string("cannot open the bootloader: ") + libusb_error_name(result);
+        }
+        // Detaches the serial port driver of the system while the interface is claimed.
+        libusb_set_auto_detach_kernel_driver(m_handle, 1);
+        result = libusb_claim_interface(m_handle, m_interface);
+        if (result != 0) {
+            libusb_close(m_handle);
+            throw std::string("cannot claim the bootloader interface: ") + libusb_error_name(result);
+        }
+    }
+
+    ~BootloaderConnection() {
+        libusb_release_interface(m_handle, m_interface);
+        libusb_close(m_handle);
+    }
+
+    BootloaderConnection(const BootloaderConnection&) = delete;
+    BootloaderConnection& operator=(const BootloaderConnection&) = delete;
+
+    void write(const char* data, size_t size) {
+        while (size > 0) {
+            int transferred = 0;
+            const int result = libusb_bulk_transfer(m_handle, m_out, reinterpret_cast<unsigned char*>(const_cast<char*>(data)), int(size), &transferred, 5000);
+            if (result != 0) {
+                throw std::string("cannot write to the bootloader: ") + libusb_error_name(result);
+            }
+            data += transferred;
+            size -= size_t(transferred);
+        }
+    }
+
+    /// Returns the next \a size bytes received, or fewer if \a timeout expires.
+    std::string read(size_t size, std::chrono::milliseconds timeout) {
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (m_received.size() < size) {
+            const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            if (remaining.count() <= 0) {
+                break;
+            }
+            receive(remaining);
+        }
+        const std::string data = m_received.substr(0, size);
+        m_received.erase(0, data.size());
+        return data;
+    }
+
+    /// Returns the bytes received so far, waiting up to \a timeout if there are none.
+    std::string readAvailable(std::chrono::milliseconds timeout) {
+        if (m_received.empty()) {
+            receive(timeout);
+        }
+        while (receive(std::chrono::milliseconds(1))) {
+        }
+        std::string data;
+        data.swap(m_received);
+        return data;
+    }
+
+   private:
+    bool receive(std::chrono::milliseconds timeout) {
+        // A multiple of the packet size, so that a packet never overflows it.
+        unsigned char buffer[512];
+        int transferred = 0;
+        // A libusb timeout of 0 would wait forever.
+        const unsigned int milliseconds = unsigned(std::max<std::chrono::milliseconds::rep>(timeout.count(), 1));
+        const int result = libusb_bulk_transfer(m_handle, m_in, buffer, sizeof(buffer), &transferred, milliseconds);
+        if (result != 0 && result != LIBUSB_ERROR_TIMEOUT) {
+            throw std::string("cannot read from the bootloader: ") + libusb_error_name(result);
+        }
+        m_received.append(reinterpret_cast<const char*>(buffer), size_t(transferred));
+        return transferred > 0;
+    }
+
+    libusb_device_handle* m_handle = nullptr;
+    int m_interface = -1;
+    uint8_t m_in = 0;
+    uint8_t m_out = 0;
+    std::string m_received;
+};
+
+FirmwareUpdater::FirmwareUpdater() : m_watcher(new UsbWatcher()) {}
+
+FirmwareUpdater::~FirmwareUpdater() {}
+
+void FirmwareUpdater::add(const Device& device, const FirmwareImage& image) {
+    if (!image.getProduct().empty() && image.getProduct() != FirmwareImage::getProduct(device.getProductID())) {
+        throw image.getPath() + " is not a firmware of the " + device.getName() + ".";
+    }
+    m_targets.push_back(Target{std::make_shared<Device>(device), device.getLocation(), &image});
+}
+
+void FirmwareUpdater::addBootloader(const std::string& location, const FirmwareImage& image) { m_targets.push_back(Target{nullptr, location, &image}); }
+
+std::vector<std::string> FirmwareUpdater::getConnectedBootloaders() {
+    std::vector<std::string> locations;
+    libusb_device** list;
+    const ssize_t count = libusb_get_device_list(m_watcher->getContext(), &list);
+    if (count < 0) {
+        return locations;
+    }
+    for (ssize_t i = 0; i < count; i++) {
+        libusb_device_descriptor descriptor;
+        if (libusb_get_device_descriptor(list[i], &descriptor) != 0 || descriptor.idVendor != POLOLU_VENDOR_ID || isMaestroApplication(descriptor.idProduct)) {
+            continue;
+        }
+        // The product names the Python upgrade utility looked for in the serial ports.
+        libusb_device_handle* handle = nullptr;
+        if (libusb_open(list[i], &handle) != 0) {
+            continue;
+        }
+        unsigned char product[128] = {0};
+        const int length = libusb_get_string_descriptor_ascii(handle, descriptor.iProduct, product, sizeof(product) - 1);
+        libusb_close(handle);
+        const std::string name = (length > 0) ? std::string(reinterpret_cast<const char*>(product), size_t(length)) : "";
+        if (name.find("Bootloader") != std::string::npos) {
+            locations.push_back(getDeviceLocation(list[i]));
+        }
+    }
+    libusb_free_device_list(list, 1);
+    return locations;
+}
+
+std::vector<FirmwareUpdater::Progress> FirmwareUpdater::run(const ProgressCallback& callback) {
+    std::mutex callbackMutex;
+    auto report = [&](const Progress& progress) {
+        if (callback) {
+            std::lock_guard<std::mutex> lock(callbackMutex);
+            callback(progress);
+        }
+    };
+
+    std::vector<Progress> results(m_targets.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < m_targets.size(); i++) {
+        threads.emplace_back([&, i]() { results[i] = update(m_targets[i], report); });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    m_targets.clear();
+    return results;
+}
+
+FirmwareUpdater::Progress FirmwareUpdater::update(const Target& target, const std::function<void(const Progress&)>& report) {
+    const FirmwareImage& image = *target.image;
+    Progress progress{target.location, Stage::STARTING_BOOTLOADER, 0, image.getSize(), ""};
+    auto setStage = [&](Stage stage) {
+        progress.stage = stage;
+        report(progress);
+    };
+
+    try {
+        if (target.device) {
+            setStage(Stage::STARTING_BOOTLOADER);
+            try {
+                target.device->startBootloader();
+            } catch (...) {
+                // The device can leave the bus before it acknowledges the request.
+            }
+        }
+
+        setStage(Stage::CONNECTING);
+        const auto deadline = std::chrono::steady_clock::now() + m_timeout;
+        std::unique_ptr<BootloaderConnection> connection;
+        while (!connection) {
+            libusb_device* device = m_watcher->waitForDevice(target.location, true, deadline);
+            if (device == nullptr) {
+                throw "the device did not appear in bootloader mode";
+            }
+            try {
+                connection.reset(new BootloaderConnection(device));
+            } catch (...) {
+                // The device can appear before the system lets it be opened.
+                libusb_unref_device(device);
+                if (std::chrono::steady_clock::now() >= deadline) {
+                    throw;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                continue;
+            }
+            libusb_unref_device(device);
+        }
+
+        auto expect = [&](const std::string& answer, const std::string& step) {
+            const std::string received = connection->read(answer.size(), m_timeout);
+            if (received != answer) {
+                throw "the bootloader answered \"" + received + "\" instead of \"" + answer + "\" while " + step;
+            }
+        };
+        const std::string handshake = "fwbootload";
+        connection->write(handshake.data(), handshake.size());
+        expect("FWBOOTLOAD", "connecting");
+
+        setStage(Stage::ERASING);
+        connection->write("s", 1);
+        expect("S", "erasing the old firmware");
+
+        setStage(Stage::WRITING);
+        const size_t chunkSize = 1024;
+        std::string answers;
+        for (size_t position = 0; position < image.getSize(); position += chunkSize) {
+            const size_t size = std::min(chunkSize, image.getSize() - position);
+            connection->write(image.getData() + position, size);
+            // Keeps the answers flowing, as the serial driver would.
+            answers += connection->readAvailable(std::chrono::milliseconds(1));
+            progress.bytesWritten = position + size;
+            report(progress);
+        }
+        // The bootloader sends '|' once the last record is written.
+        const auto end = std::chrono::steady_clock::now() + m_timeout;
+        while ((answers.empty() || answers.back() != '|') && std::chrono::steady_clock::now() < end) {
+            answers += connection->readAvailable(std::chrono::milliseconds(100));
+        }
+        if (answers.empty() || answers.back() != '|') {
+            throw "the bootloader did not confirm the firmware (it sent \"" + answers.substr(answers.size() - std::min<size_t>(answers.size(), 16)) + "\")";
+        }
+
+        setStage(Stage::RESTARTING);
+        connection->write("*", 1);
+        connection.reset();
+        libusb_device* device = m_watcher->waitForDevice(target.location, false, std::chrono::steady_clock::now() + m_timeout);
+        if (device == nullptr) {
+            throw "the device did not restart after the upgrade";
+        }
+        libusb_device_descriptor descriptor;
+        const int result = libusb_get_device_descriptor(device, &descriptor);
+        libusb_unref_device(device);
+        if (result != 0) {
+            throw "cannot read the firmware version";
+        }
+        progress.message = formatVersion(descriptor.bcdDevice);
+        if (image.getVersion() != 0 && descriptor.bcdDevice != image.getVersion()) {
+            throw "the device runs firmware " + progress.message + " instead of " + formatVersion(image.getVersion());
+        }
+        setStage(Stage::DONE);
+    } catch (const std::string& e) {
+        progress.message = e;
+        setStage(Stage::FAILED);
+    } catch (const char* e) {
+        progress.message = e;
+        setStage(Stage::FAILED);
+    } catch (const std::exception& e) {
+        progress.message = e.what();
+        setStage(Stage::FAILED);
+    }
+    return progress;
+}
+}  // namespace Maestro
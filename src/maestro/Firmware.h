@@ -0,0 +1,119 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Maestro {
+class Device;
+
+/// A firmware file of the Maestro, e.g. firmwares/usc02a_v1.04.pgm.
+///
+/// The file is made of text records ":LLAAAATT<data>CC" checked like Intel
+/// HEX records; the data is encrypted, and only the bootloader decodes it.
+/// The file is memory-mapped and every record is checked once when it is
+/// opened, then the file is sent as is to any number of devices.
+class FirmwareImage {
+   public:
+    explicit FirmwareImage(const std::string& path);
+    ~FirmwareImage();
+
+    FirmwareImage(const FirmwareImage&) = delete;
+    FirmwareImage& operator=(const FirmwareImage&) = delete;
+
+    const std::string& getPath() const { return m_path; }
+    const char* getData() const { return m_data; }
+    size_t getSize() const { return m_size; }
+    size_t getRecordCount() const { return m_recordCount; }
+
+    /// The product in the file name, e.g. "usc02a", or "" if the name does
+    /// not follow the usc0xx_vX.YY.pgm pattern.
+    const std::string& getProduct() const { return m_product; }
+
+    /// The version in the file name as BCD, e.g. 0x0104 for v1.04, or 0.
+    uint16_t getVersion() const { return m_version; }
+
+    /// The product of the firmware of a device, e.g. "usc03c" for the Mini Maestro 24.
+    static std::string getProduct(uint16_t productID);
+
+   private:
+    void parseName();
+    size_t checkRecords() const;
+    void unmap();
+
+    std::string m_path;
+    const char* m_data = nullptr;
+    size_t m_size = 0;
+    /// Contents of the file where it cannot be memory-mapped.
+    std::vector<char> m_buffer;
+    size_t m_recordCount = 0;
+    std::string m_product;
+    uint16_t m_version = 0;
+};
+
+/// Upgrades the firmware of several Maestros at once.
+///
+/// Each device is restarted in bootloader mode, then found again at the same
+/// USB port (see Device::getLocation()) as soon as it re-enumerates: libusb
+/// hotplug events wake up the waiting threads, and the device list is polled
+/// on the platforms without hotplug support.  The firmware is sent to the
+/// bootloader through the bulk endpoints of its serial interface, then the
+/// device is restarted and its new firmware version is checked.  Every device
+/// has its own thread.
+class FirmwareUpdater {
+   public:
+    enum class Stage { STARTING_BOOTLOADER, CONNECTING, ERASING, WRITING, RESTARTING, DONE, FAILED };
+
+    struct Progress {
+        /// USB port of the device.
+        std::string location;
+        Stage stage;
+        size_t bytesWritten;
+        size_t totalBytes;
+        /// The error when FAILED, the new firmware version when DONE.
+        std::string message;
+    };
+
+    /// Called on the thread of the device, but never for two devices at once.
+    using ProgressCallback = std::function<void(const Progress&)>;
+
+    FirmwareUpdater();
+    ~FirmwareUpdater();
+
+    /// How long to wait for a device to re-enumerate, and for the bootloader to answer.
+    void setTimeout(std::chrono::milliseconds timeout) { m_timeout = timeout; }
+
+    /// Adds \a device, to be restarted in bootloader mode.  Throws if
+    /// \a image is the firmware of another product.
+    void add(const Device& device, const FirmwareImage& image);
+
+    /// Adds a device already in bootloader mode, at USB port \a location.
+    void addBootloader(const std::string& location, const FirmwareImage& image);
+
+    /// Returns the USB ports of the Maestros in bootloader mode.
+    std::vector<std::string> getConnectedBootloaders();
+
+    /// Updates every device added, and returns their final progress, DONE or
+    /// FAILED, in the order they were added.  The devices are then removed.
+    std::vector<Progress> run(const ProgressCallback& callback = nullptr);
+
+   private:
+    class UsbWatcher;
+
+    struct Target {
+        /// Null for a device already in bootloader mode.
+        std::shared_ptr<Device> device;
+        std::string location;
+        const FirmwareImage* image;
+    };
+
+    Progress update(const Target& target, const std::function<void(const Progress&)>& report);
+
+    std::unique_ptr<UsbWatcher> m_watcher;
+    std::vector<Target> m_targets;
+    std::chrono::milliseconds m_timeout = std::chrono::milliseconds(10000);
+};
+}  // namespace Maestro
@@ -0,0 +1,80 @@
+#include "FlashImage.h"
+
+#include "Program.h"
+
+namespace Maestro {
+/// Tables of the slicing-by-8 kernel: table[k][i] is the CRC of byte i
+/// followed by k zero bytes.
+struct Crc16Tables {
+    uint16_t table[8][256];
+
+    Crc16Tables() {
+        const uint16_t CRC16_POLY = 0xA001;
+        for (int i = 0; i < 256; i++) {
+            uint16_t crc = uint16_t(i);
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc & 1) ? uint16_t((crc >> 1) ^ CRC16_POLY) : uint16_t(crc >> 1);
+            }
+            table[0][i] = crc;
+        }
+        for (int k = 1; k < 8; k++) {
+            for (int i = 0; i < 256; i++) {
+                table[k][i] = uint16_t((table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xFF]);
+            }
+        }
+    }
+};
+
+const Crc16Tables& getCrc16Tables() {
+    static const Crc16Tables tables;
+    return tables;
+}
+
+void Crc16::update(uint8_t value) { m_crc = uint16_t((m_crc >> 8) ^ getCrc16Tables().table[0][(m_crc ^ value) & 0xFF]); }
+
+void Crc16::update(const uint8_t* data, size_t size) {
+    const uint16_t(*table)[256] = getCrc16Tables().table;
+    uint16_t crc = m_crc;
+    for (; size >= 8; data += 8, size -= 8) {
+        crc ^= uint16_t(data[0] | (data[1] << 8));
+        crc = uint16_t(table[7][crc & 0xFF] ^ table[6][crc >> 8] ^ table[5][data[2]] ^ table[4][data[3]] ^ table[3][data[4]] ^ table[2][data[5]] ^
+                       table[1][data[6]] ^ table[0][data[7]]);
+    }
+    for (; size > 0; data++, size--) {
+        crc = uint16_t((crc >> 8) ^ table[0][(crc ^ *data) & 0xFF]);
+    }
+    m_crc = crc;
+}
+
+FlashImage::FlashImage(const Program& program) {
+    appendSubroutineTable(program.getSubroutineTable());
+    program.appendByteList(m_image);
+    Crc16 crc;
+    crc.update(m_image.data(), m_image.size());
+    m_crc = crc.value();
+}
+
+FlashImage::FlashImage(const std::array<uint16_t, 128>& subroutineTable, const uint8_t* bytecode, size_t size) {
+    m_image.reserve(SUBROUTINE_TABLE_SIZE + size);
+    appendSubroutineTable(subroutineTable);
+    m_image.insert(m_image.end(), bytecode, bytecode + size);
+    Crc16 crc;
+    crc.update(m_image.data(), m_image.size());
+    m_crc = crc.value();
+}
+
+void FlashImage::appendSubroutineTable(const std::array<uint16_t, 128>& subroutineTable) {
+    for (uint16_t address : subroutineTable) {
+        m_image.push_back(uint8_t(address & 0xFF));
+        m_image.push_back(uint8_t(address >> 8));
+    }
+}
+
+std::array<uint16_t, 128> FlashImage::getSubroutineTable() const {
+    std::array<uint16_t, 128> table;
+    for (size_t i = 0; i < table.size(); i++) {
+        table[i] = uint16_t(m_image[2 * i] | (m_image[2 * i + 1] << 8));
+    }
+    return table;
+}
+}  // namespace Maestro
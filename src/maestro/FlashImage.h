@@ -0,0 +1,46 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace Maestro {
+class Program;
+
+/// The CRC-16 of Maestro scripts (reflected polynomial 0xA001, initial value
+/// 0), computed incrementally eight bytes at a time (slicing-by-8).
+class Crc16 {
+   public:
+    void update(uint8_t value);
+    void update(const uint8_t* data, size_t size);
+    uint16_t value() const { return m_crc; }
+
+   private:
+    uint16_t m_crc = 0;
+};
+
+/// The script as stored in the device flash: the subroutine table, 128
+/// little-endian addresses, followed by the bytecode.  The script CRC that
+/// the device stores in PARAMETER_SCRIPT_CRC is the CRC of this image, with
+/// unused table entries set to 0xFFFF like the erased flash.
+class FlashImage {
+   public:
+    static const size_t SUBROUTINE_TABLE_SIZE = 256;
+
+    explicit FlashImage(const Program& program);
+    FlashImage(const std::array<uint16_t, 128>& subroutineTable, const uint8_t* bytecode, size_t size);
+
+    const std::vector<uint8_t>& getImage() const { return m_image; }
+    std::array<uint16_t, 128> getSubroutineTable() const;
+    const uint8_t* getBytecode() const { return m_image.data() + SUBROUTINE_TABLE_SIZE; }
+    size_t getBytecodeSize() const { return m_image.size() - SUBROUTINE_TABLE_SIZE; }
+    uint16_t getCRC() const { return m_crc; }
+
+   private:
+    void appendSubroutineTable(const std::array<uint16_t, 128>& subroutineTable);
+
+    std::vector<uint8_t> m_image;
+    uint16_t m_crc;
+};
+}  // namespace Maestro
@@ -0,0 +1,212 @@
+#include "IncrementalCompiler.h"
+
+#include <map>
+#include <set>
+
+#include "ControlFlowGraph.h"
+#include "Opcode.h"
+
+namespace Maestro {
+IncrementalCompiler::IncrementalCompiler(bool isMiniMaestro) : IncrementalCompiler(isMiniMaestro, CompileOptions()) {}
+
+IncrementalCompiler::IncrementalCompiler(bool isMiniMaestro, const CompileOptions& options) : m_isMiniMaestro(isMiniMaestro), m_options(options) {
+    m_subroutineTable.fill(0);
+}
+
+const Program& IncrementalCompiler::getProgram() const {
+    if (!m_program) {
+        throw "No script has been compiled.";
+    }
+    return *m_program;
+}
+
+std::shared_ptr<const IncrementalCompiler::Tokens> IncrementalCompiler::getTokens(const std::string& line) {
+    std::shared_ptr<const Tokens>& tokens = m_tokenCache[line];
+    if (!tokens) {
+        tokens = std::make_shared<const Tokens>(Program::tokenizeLine(line));
+    }
+    return tokens;
+}
+
+std::vector<IncrementalCompiler::ByteRange> IncrementalCompiler::update(const std::string& script) {
+    const std::vector<std::string> lines = Program::splitLines(script);
+    if (m_program && lines == m_program->getSourceLines()) {
+        m_lastUpdate = Update::UNCHANGED;
+        m_subroutineTableChanged = false;
+        return {};
+    }
+
+    std::vector<std::shared_ptr<const Tokens>> tokens;
+    tokens.reserve(lines.size());
+    for (const std::string& line : lines) {
+        tokens.push_back(getTokens(line));
+    }
+
+    const std::vector<uint8_t> previousByteList = m_byteList;
+    // The diagnostics of a script with errors are only kept up to date by a full compile.
+    if (m_program && m_program->getDiagnostics().empty() && patchLiterals(lines, tokens)) {
+        m_lastUpdate = Update::PATCHED;
+        m_subroutineTableChanged = false;
+    } else {
+        std::unique_ptr<Program> program(new Program());
+        program->m_sourceLines = lines;
+        std::vector<const Tokens*> lineTokens;
+        for (const std::shared_ptr<const Tokens>& line : tokens) {
+            lineTokens.push_back(line.get());
+        }
+        program->compile(lineTokens, m_isMiniMaestro, m_options);
+
+        const std::array<uint16_t, 128> subroutineTable = program->getSubroutineTable();
+        m_subroutineTableChanged = (subroutineTable != m_subroutineTable);
+        m_subroutineTable = subroutineTable;
+        m_byteList = program->getByteList();
+        m_program = std::move(program);
+        m_lastUpdate = Update::REBUILT;
+    }
+    m_lineTokens = tokens;
+
+    // Only the lines of the current script are worth keeping.
+    for (auto cached = m_tokenCache.begin(); cached != m_tokenCache.end();) {
+        cached = (cached->second.use_count() == 1) ? m_tokenCache.erase(cached) : std::next(cached);
+    }
+
+    std::vector<ByteRange> changes;
+    for (size_t address = 0; address < m_byteList.size(); address++) {
+        if (address < previousByteList.size() && m_byteList[address] == previousByteList[address]) {
+            continue;
+        }
+        if (!changes.empty() && changes.back().address + changes.back().length == address) {
+            changes.back().length++;
+        } else {
+            changes.push_back(ByteRange{uint16_t(address), 1});
+        }
+    }
+    return changes;
+}
+
+bool IncrementalCompiler::patchLiterals(const std::vector<std::string>& lines, const std::vector<std::shared_ptr<const Tokens>>& tokens) {
+    // Outlining moves literals around, so their order no longer follows the source.
+    if (m_options.outlineRepeatedSequences || lines.size() != m_lineTokens.size()) {
+        return false;
+    }
+
+    // The n-th literal of the source is the n-th value pushed by a literal
+    // instruction.  The name after GOTO or SUB is never a literal.
+    std::map<size_t, int> values;
+    std::map<int, std::map<int, int>> movedColumns;
+    size_t literalCount = 0;
+    bool isName = false;
+    for (size_t line = 0; line < lines.size(); line++) {
+        const Tokens& before = *m_lineTokens[line];
+        const Tokens& after = *tokens[line];
+        if (before.size() != after.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < after.size(); i++) {
+            const bool isLiteral = !isName && Program::looksLikeLiteral(after[i].text);
+            if (before[i].text != after[i].text) {
+                if (!isLiteral || !Program::looksLikeLiteral(before[i].text)) {
+                    return false;
+                }
+                // An invalid literal is reported, with its location, by a full compile.
+                try {
+                    values[literalCount] = Program::parseLiteral(after[i].text);
+                } catch (const std::string&) {
+                    return false;
+                }
+            }
+            if (before[i].columnNumber != after[i].columnNumber) {
+                movedColumns[int(line)][before[i].columnNumber] = after[i].columnNumber;
+            }
+            literalCount += isLiteral ? 1 : 0;
+            isName = !isName && (after[i].text == "GOTO" || after[i].text == "SUB");
+        }
+    }
+
+    // Address and size of every literal value in the bytecode.
+    struct Slot {
+        size_t instruction;
+        size_t offset;
+        size_t size;
+    };
+    std::vector<Slot> slots;
+    std::vector<ControlFlowGraph::DecodedInstruction> literals;
+    size_t address = 0;
+    while (address < m_byteList.size()) {
+        ControlFlowGraph::DecodedInstruction instruction;
+        if (!ControlFlowGraph::decode(m_byteList, address, m_subroutineTable, instruction)) {
+            return false;
+        }
+        if (ControlFlowGraph::isLiteral(instruction)) {
+            const OperandType operandType = getOpcodeInfo(instruction.opcode).operandType;
+            const size_t size = (operandType == OperandType::WORD || operandType == OperandType::WORD_LIST) ? 2 : 1;
+            const size_t start = address + ((operandType == OperandType::BYTE || operandType == OperandType::WORD) ? 1 : 2);
+            for (size_t i = 0; i < instruction.operand; i++) {
+                slots.push_back(Slot{literals.size(), start + i * size, size});
+            }
+            literals.push_back(instruction);
+        }
+        address += instruction.length;
+    }
+    if (slots.size() != literalCount) {
+        return false;
+    }
+
+    // The new values must keep the encoding the compiler chose: 8-bit
+    // instructions only hold 0-255, and 16-bit ones need a value that does not.
+    std::vector<uint8_t> byteList = m_byteList;
+    std::set<size_t> wideInstructions;
+    for (const auto& value : values) {
+        const Slot& slot = slots[value.first];
+        const uint16_t word = uint16_t(value.second);
+        if (slot.size == 1) {
+            if (word > 255) {
+                return false;
+            }
+            byteList[slot.offset] = uint8_t(word);
+        } else {
+            byteList[slot.offset] = uint8_t(word % 256);
+            byteList[slot.offset + 1] = uint8_t(word / 256);
+            wideInstructions.insert(slot.instruction);
+        }
+    }
+    for (size_t instruction : wideInstructions) {
+        bool needsWide = false;
+        for (const Slot& slot : slots) {
+            if (slot.instruction == instruction && slot.size == 2) {
+                needsWide = needsWide || (byteList[slot.offset] | (byteList[slot.offset + 1] << 8)) > 255;
+            }
+        }
+        if (!needsWide) {
+            return false;
+        }
+    }
+
+    // Apply the same change to the program, so that it lists the new source.
+    size_t literal = 0;
+    for (Instruction& instruction : m_program->m_instructionList) {
+        switch (instruction.opcode()) {
+            case Opcode::LITERAL:
+            case Opcode::LITERAL8:
+            case Opcode::LITERAL_N:
+            case Opcode::LITERAL8_N:
+                for (size_t i = 0; i < instruction.literalCount(); i++, literal++) {
+                    const auto value = values.find(literal);
+                    if (value != values.end()) {
+                        m_program->m_literalPool[instruction.literalOffset() + i] = uint16_t(value->second);
+                    }
+                }
+                break;
+            default:
+                break;
+        }
+        const auto moved = movedColumns.find(instruction.lineNumer());
+        if (moved != movedColumns.end() && moved->second.count(instruction.columnNumber()) != 0) {
+            instruction.setColumnNumber(moved->second.at(instruction.columnNumber()));
+        }
+    }
+    m_program->m_sourceLines = lines;
+    m_byteList = byteList;
+    return true;
+}
+}  // namespace Maestro
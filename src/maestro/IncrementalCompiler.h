@@ -0,0 +1,72 @@
+#pragma once
+
+#include <maestro/Program.h>
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace Maestro {
+
+/// Recompiles a script after small edits, e.g. on every keystroke of an
+/// editor or every move of a slider bound to a literal.
+///
+/// Lines are tokenized once and cached by content, so only edited lines are
+/// tokenized again.  When the only edits are literal values that keep their
+/// encoding (8 or 16 bits), the previous bytecode is patched in place.
+/// Otherwise the program is rebuilt from the cached tokens, which relocates
+/// the jump and call addresses.  Each update returns the byte ranges that
+/// differ from the previous bytecode.
+class IncrementalCompiler {
+   public:
+    enum class Update { UNCHANGED, PATCHED, REBUILT };
+
+    struct ByteRange {
+        uint16_t address;
+        uint16_t length;
+    };
+
+    explicit IncrementalCompiler(bool isMiniMaestro);
+    IncrementalCompiler(bool isMiniMaestro, const CompileOptions& options);
+
+    /**
+     * @brief Compiles a new version of the script.
+     *
+     * Errors are thrown like in the Program constructor; the previous program
+     * is then kept.
+     *
+     * @return The ranges of bytecode that changed, sorted by address.  Bytes
+     * past the end of the previous bytecode count as changed.
+     */
+    std::vector<ByteRange> update(const std::string& script);
+
+    /// What the last call to update() had to do.
+    Update getLastUpdate() const { return m_lastUpdate; }
+
+    /// True if the last update changed the subroutine table.
+    bool subroutineTableChanged() const { return m_subroutineTableChanged; }
+
+    /// The current program.  Throws if no script compiled yet.
+    const Program& getProgram() const;
+    const std::vector<uint8_t>& getByteList() const { return m_byteList; }
+
+   private:
+    typedef std::vector<Program::Token> Tokens;
+
+    std::shared_ptr<const Tokens> getTokens(const std::string& line);
+    bool patchLiterals(const std::vector<std::string>& lines, const std::vector<std::shared_ptr<const Tokens>>& tokens);
+
+    bool m_isMiniMaestro;
+    CompileOptions m_options;
+    std::unordered_map<std::string, std::shared_ptr<const Tokens>> m_tokenCache;
+    std::vector<std::shared_ptr<const Tokens>> m_lineTokens;
+    std::unique_ptr<Program> m_program;
+    std::vector<uint8_t> m_byteList;
+    std::array<uint16_t, 128> m_subroutineTable;
+    Update m_lastUpdate = Update::UNCHANGED;
+    bool m_subroutineTableChanged = false;
+};
+}  // namespace Maestro
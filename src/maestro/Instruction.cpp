@@ -3,118 +3,162 @@
 #include "Opcode.h"
 
 namespace Maestro {
-Instruction::Instruction(Opcode op, const std::string& filename, int lineNumber, int columnNumber)
-    : m_opcode(op), m_filename(filename), m_lineNumber(lineNumber), m_columnNumber(columnNumber) {}
+static_assert(sizeof(Instruction) <= 16, "Instructions are meant to stay small values");
 
-void Instruction::addLiteralArgument(int value, bool isMiniMaestro) {
-    m_literalArguments.push_back(value);
-    if (!isMiniMaestro && m_literalArguments.size() > 32) {
+Instruction::Instruction(Opcode op, int lineNumber, int columnNumber)
+    : m_opcode(uint8_t(op)), m_location(((uint32_t(lineNumber) > LINE_MASK) ? LINE_MASK : uint32_t(lineNumber)) << COLUMN_BITS) {
+    setColumnNumber(columnNumber);
+}
+
+void Instruction::setColumnNumber(int columnNumber) {
+    m_location = (m_location & ~COLUMN_MASK) | ((uint32_t(columnNumber) > COLUMN_MASK) ? COLUMN_MASK : uint32_t(columnNumber));
+}
+
+void Instruction::addLiteralArgument(std::vector<uint16_t>& literalPool, int value, bool isMiniMaestro) {
+    if (m_literalCount == 0) {
+        m_literalOffset = uint32_t(literalPool.size());
+    } else if (m_literalOffset + m_literalCount != literalPool.size()) {
+        // Another run was added after this one: move this run to the end.
+        const std::vector<uint16_t> run(literalPool.begin() + m_literalOffset, literalPool.begin() + m_literalOffset + m_literalCount);
+        m_literalOffset = uint32_t(literalPool.size());
+        literalPool.insert(literalPool.end(), run.begin(), run.end());
+    }
+    literalPool.push_back(uint16_t(value));
+    m_literalCount++;
+    if (!isMiniMaestro && m_literalCount > 32) {
         throw "Too many literals (> 32) in a row: this will overflow the stack.";
     }
-    if (m_literalArguments.size() > 126) {
+    if (m_literalCount > 126) {
         throw "Too many literals (> 126) in a row: this will overflow the stack.";
     }
 }
 
 void Instruction::setOpcode(Opcode value) {
-    if (m_opcode != Opcode::QUIT) {
+    if (opcode() != Opcode::QUIT) {
         throw "The opcode has already been set.";
     }
-    m_opcode = value;
+    m_opcode = uint8_t(value);
 }
 
-std::vector<uint8_t> Instruction::toByteList() const {
-    std::vector<uint8_t> list;
-    if (m_isLabel || m_isSubroutine) {
-        return list;
+size_t Instruction::byteSize() const {
+    if (m_kind == Kind::LABEL || m_kind == Kind::SUBROUTINE) {
+        return 0;
+    }
+    switch (opcode()) {
+        case Opcode::LITERAL:
+        case Opcode::JUMP:
+        case Opcode::JUMP_Z:
+        case Opcode::CALL:
+            return 3;
+        case Opcode::LITERAL8:
+            return 2;
+        case Opcode::LITERAL_N:
+            return 2 + 2 * size_t(m_literalCount);
+        case Opcode::LITERAL8_N:
+            return 2 + size_t(m_literalCount);
+        default:
+            return 1;
     }
-    list.push_back((uint8_t)m_opcode);
-    if (m_opcode == Opcode::LITERAL || m_opcode == Opcode::JUMP || m_opcode == Opcode::JUMP_Z || m_opcode == Opcode::CALL) {
-        if (m_literalArguments.empty()) {
+}
+
+void Instruction::appendBytes(const std::vector<uint16_t>& literalPool, std::vector<uint8_t>& list) const {
+    if (m_kind == Kind::LABEL || m_kind == Kind::SUBROUTINE) {
+        return;
+    }
+    const uint16_t* literalArguments = literalPool.data() + m_literalOffset;
+    list.push_back(m_opcode);
+    const Opcode op = opcode();
+    if (op == Opcode::LITERAL || op == Opcode::JUMP || op == Opcode::JUMP_Z || op == Opcode::CALL) {
+        if (m_literalCount == 0) {
             list.push_back(0);
             list.push_back(0);
         } else {
-            list.push_back(uint8_t(m_literalArguments[0] % 256));
-            list.push_back(uint8_t(m_literalArguments[0] / 256));
+            list.push_back(uint8_t(literalArguments[0] % 256));
+            list.push_back(uint8_t(literalArguments[0] / 256));
         }
-    } else if (m_opcode == Opcode::LITERAL8) {
-        list.push_back(uint8_t(m_literalArguments[0]));
+    } else if (op == Opcode::LITERAL8) {
+        list.push_back(uint8_t(literalArguments[0]));
     } else {
-        if (m_opcode == Opcode::LITERAL_N) {
-            list.push_back(uint8_t(m_literalArguments.size() * 2));
-            for (uint16_t literalArgument : m_literalArguments) {
-                list.push_back(uint8_t(literalArgument % 256));
-                list.push_back(uint8_t(literalArgument / 256));
+        if (op == Opcode::LITERAL_N) {
+            list.push_back(uint8_t(m_literalCount * 2));
+            for (size_t i = 0; i < m_literalCount; i++) {
+                list.push_back(uint8_t(literalArguments[i] % 256));
+                list.push_back(uint8_t(literalArguments[i] / 256));
             }
         }
-        if (m_opcode == Opcode::LITERAL8_N) {
-            list.push_back(uint8_t(m_literalArguments.size()));
-            for (uint16_t literalArgument : m_literalArguments) {
-                list.push_back(uint8_t(literalArgument));
+        if (op == Opcode::LITERAL8_N) {
+            list.push_back(uint8_t(m_literalCount));
+            for (size_t i = 0; i < m_literalCount; i++) {
+                list.push_back(uint8_t(literalArguments[i]));
             }
         }
     }
+}
+
+std::vector<uint8_t> Instruction::toByteList(const std::vector<uint16_t>& literalPool) const {
+    std::vector<uint8_t> list;
+    appendBytes(literalPool, list);
     return list;
 }
 
-void Instruction::error(std::string msg) {
-    throw m_filename + ":" + std::to_string(m_lineNumber) + ":" + std::to_string(m_columnNumber) + ": " + msg;
+void Instruction::error(const std::string& msg) const {
+    throw "script:" + std::to_string(lineNumer()) + ":" + std::to_string(columnNumber()) + ": " + msg;
 }
 
-Instruction Instruction::newSubroutine(std::string name, std::string filename, int column_number, int line_number) {
-    Instruction bytecodeInstruction(Opcode::QUIT, filename, column_number, line_number);
-    bytecodeInstruction.m_isSubroutine = true;
-    bytecodeInstruction.m_labelName = name;
+Instruction Instruction::newSubroutine(uint32_t symbol, int lineNumber, int columnNumber) {
+    Instruction bytecodeInstruction(Opcode::QUIT, lineNumber, columnNumber);
+    bytecodeInstruction.m_kind = Kind::SUBROUTINE;
+    bytecodeInstruction.m_symbol = symbol;
     return bytecodeInstruction;
 }
 
-Instruction Instruction::newCall(std::string name, std::string filename, int column_number, int line_number) {
-    Instruction bytecodeInstruction(Opcode::QUIT, filename, column_number, line_number);
-    bytecodeInstruction.m_isCall = true;
-    bytecodeInstruction.m_labelName = name;
+Instruction Instruction::newCall(uint32_t symbol, int lineNumber, int columnNumber) {
+    Instruction bytecodeInstruction(Opcode::QUIT, lineNumber, columnNumber);
+    bytecodeInstruction.m_kind = Kind::CALL;
+    bytecodeInstruction.m_symbol = symbol;
     return bytecodeInstruction;
 }
 
-Instruction Instruction::newLabel(std::string name, std::string filename, int column_number, int line_number) {
-    Instruction bytecodeInstruction(Opcode::QUIT, filename, column_number, line_number);
-    bytecodeInstruction.m_isLabel = true;
-    bytecodeInstruction.m_labelName = name;
+Instruction Instruction::newLabel(uint32_t symbol, int lineNumber, int columnNumber) {
+    Instruction bytecodeInstruction(Opcode::QUIT, lineNumber, columnNumber);
+    bytecodeInstruction.m_kind = Kind::LABEL;
+    bytecodeInstruction.m_symbol = symbol;
     return bytecodeInstruction;
 }
 
-Instruction Instruction::newJumpToLabel(std::string name, std::string filename, int column_number, int line_number) {
-    Instruction bytecodeInstruction(Opcode::JUMP, filename, column_number, line_number);
-    bytecodeInstruction.m_isJumpToLabel = true;
-    bytecodeInstruction.m_labelName = name;
+Instruction Instruction::newJumpToLabel(uint32_t symbol, int lineNumber, int columnNumber) {
+    Instruction bytecodeInstruction(Opcode::JUMP, lineNumber, columnNumber);
+    bytecodeInstruction.m_kind = Kind::JUMP_TO_LABEL;
+    bytecodeInstruction.m_symbol = symbol;
     return bytecodeInstruction;
 }
 
-Instruction Instruction::newConditionalJumpToLabel(std::string name, std::string filename, int column_number, int line_number) {
-    Instruction bytecodeInstruction(Opcode::JUMP_Z, filename, column_number, line_number);
-    bytecodeInstruction.m_isJumpToLabel = true;
-    bytecodeInstruction.m_labelName = name;
+Instruction Instruction::newConditionalJumpToLabel(uint32_t symbol, int lineNumber, int columnNumber) {
+    Instruction bytecodeInstruction(Opcode::JUMP_Z, lineNumber, columnNumber);
+    bytecodeInstruction.m_kind = Kind::JUMP_TO_LABEL;
+    bytecodeInstruction.m_symbol = symbol;
     return bytecodeInstruction;
 }
 
-void Instruction::completeLiterals() {
-    if (m_opcode != Opcode::LITERAL) {
+void Instruction::completeLiterals(const std::vector<uint16_t>& literalPool) {
+    if (opcode() != Opcode::LITERAL) {
         return;
     }
     bool flag = false;
-    for (uint16_t literalArgument : m_literalArguments) {
-        if (literalArgument > 255 || literalArgument < 0) {
+    for (size_t i = 0; i < m_literalCount; i++) {
+        if (literalPool[m_literalOffset + i] > 255) {
             flag = true;
             break;
         }
     }
-    if (flag && m_literalArguments.size() > 1) {
-        m_opcode = Opcode::LITERAL_N;
-    } else if (flag && m_literalArguments.size() == 1) {
-        m_opcode = Opcode::LITERAL;
-    } else if (m_literalArguments.size() > 1) {
-        m_opcode = Opcode::LITERAL8_N;
+    if (flag && m_literalCount > 1) {
+        m_opcode = uint8_t(Opcode::LITERAL_N);
+    } else if (flag && m_literalCount == 1) {
+        m_opcode = uint8_t(Opcode::LITERAL);
+    } else if (m_literalCount > 1) {
+        m_opcode = uint8_t(Opcode::LITERAL8_N);
     } else {
-        m_opcode = Opcode::LITERAL8;
+        m_opcode = uint8_t(Opcode::LITERAL8);
     }
 }
 }  // namespace Maestro
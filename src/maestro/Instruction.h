@@ -7,37 +7,65 @@
 namespace Maestro {
 enum class Opcode;
 
+/// One instruction of a program being compiled.
+///
+/// Instructions are small values that own no memory: names are symbol IDs
+/// interned by the Program, the source location is packed into one integer,
+/// and literal arguments are a run in a pool owned by the Program.
 class Instruction {
    public:
-    Instruction(Opcode op, const std::string& filename, int lineNumber, int columnNumber);
-    void addLiteralArgument(int value, bool isMiniMaestro);
+    enum class Kind : uint8_t {
+        /// An opcode, with its literal arguments if any.
+        OPCODE,
+        /// A label or a subroutine definition, which generate no bytecode.
+        LABEL,
+        SUBROUTINE,
+        /// A call to the subroutine named by symbol(), resolved by the Program.
+        CALL,
+        /// A JUMP or JUMP_Z to the label named by symbol(), resolved by the Program.
+        JUMP_TO_LABEL
+    };
+
+    Instruction(Opcode op, int lineNumber, int columnNumber);
+    void addLiteralArgument(std::vector<uint16_t>& literalPool, int value, bool isMiniMaestro);
     void setOpcode(Opcode value);
-    Opcode opcode() const { return m_opcode; }
-    std::vector<uint8_t> toByteList() const;
-    void error(std::string msg);
-    int lineNumer() const { return m_lineNumber; }
-    bool isLabel() const { return m_isLabel; }
-    bool isJumpToLabel() const { return m_isJumpToLabel; }
-    const std::string& labelName() const { return m_labelName; }
-    bool isSubroutine() const { return m_isSubroutine; }
-    bool isCall() const { return m_isCall; }
-    static Instruction newSubroutine(std::string name, std::string filename, int column_number, int line_number);
-    static Instruction newCall(std::string name, std::string filename, int column_number, int line_number);
-    static Instruction newLabel(std::string name, std::string filename, int column_number, int line_number);
-    static Instruction newJumpToLabel(std::string name, std::string filename, int column_number, int line_number);
-    static Instruction newConditionalJumpToLabel(std::string name, std::string filename, int column_number, int line_number);
-    void completeLiterals();
+    Opcode opcode() const { return Opcode(m_opcode); }
+    Kind kind() const { return m_kind; }
+    /// Number of bytes of bytecode generated by this instruction.
+    size_t byteSize() const;
+    void appendBytes(const std::vector<uint16_t>& literalPool, std::vector<uint8_t>& bytes) const;
+    std::vector<uint8_t> toByteList(const std::vector<uint16_t>& literalPool) const;
+    void error(const std::string& msg) const;
+    int lineNumer() const { return int(m_location >> COLUMN_BITS); }
+    int columnNumber() const { return int(m_location & COLUMN_MASK); }
+    void setColumnNumber(int columnNumber);
+    bool isLabel() const { return m_kind == Kind::LABEL; }
+    bool isJumpToLabel() const { return m_kind == Kind::JUMP_TO_LABEL; }
+    bool isSubroutine() const { return m_kind == Kind::SUBROUTINE; }
+    bool isCall() const { return m_kind == Kind::CALL; }
+    /// Name of the label, subroutine or called subroutine.
+    uint32_t symbol() const { return m_symbol; }
+    /// Position of the literal arguments in the Program's literal pool.
+    size_t literalOffset() const { return m_literalOffset; }
+    size_t literalCount() const { return m_literalCount; }
+    static Instruction newSubroutine(uint32_t symbol, int lineNumber, int columnNumber);
+    static Instruction newCall(uint32_t symbol, int lineNumber, int columnNumber);
+    static Instruction newLabel(uint32_t symbol, int lineNumber, int columnNumber);
+    static Instruction newJumpToLabel(uint32_t symbol, int lineNumber, int columnNumber);
+    static Instruction newConditionalJumpToLabel(uint32_t symbol, int lineNumber, int columnNumber);
+    void completeLiterals(const std::vector<uint16_t>& literalPool);
 
    private:
-    Opcode m_opcode;
-    std::string m_filename;
-    int m_lineNumber;
-    int m_columnNumber;
-    std::string m_labelName;
-    bool m_isSubroutine = false;
-    bool m_isCall = false;
-    bool m_isLabel = false;
-    bool m_isJumpToLabel = false;
-    std::vector<uint16_t> m_literalArguments;
+    /// Lines and columns past these limits are saturated in error messages.
+    static const uint32_t COLUMN_BITS = 12;
+    static const uint32_t COLUMN_MASK = (1u << COLUMN_BITS) - 1;
+    static const uint32_t LINE_MASK = (1u << (32 - COLUMN_BITS)) - 1;
+
+    uint8_t m_opcode;
+    Kind m_kind = Kind::OPCODE;
+    uint16_t m_literalCount = 0;
+    uint32_t m_location;
+    uint32_t m_symbol = 0;
+    uint32_t m_literalOffset = 0;
 };
 }  // namespace Maestro
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdint>
+
 namespace Maestro {
 enum class Opcode {
     QUIT = 0,
@@ -58,4 +60,108 @@ enum class Opcode {
     SERIAL_SEND_BYTE,
     CALL
 };
+
+/// Depth of the data stack and of the subroutine call stack of the script
+/// interpreter, as implemented by the Micro and Mini Maestro firmwares.
+const int MICRO_MAESTRO_STACK_SIZE = 32;
+const int MINI_MAESTRO_STACK_SIZE = 126;
+const int MICRO_MAESTRO_CALL_STACK_SIZE = 10;
+const int MINI_MAESTRO_CALL_STACK_SIZE = 126;
+
+/// Layout of the bytes that follow an opcode in the bytecode.
+enum class OperandType : uint8_t {
+    /// No operand (this includes the one-byte subroutine calls, 128-255).
+    NONE,
+    /// One unsigned byte (LITERAL8).
+    BYTE,
+    /// One little-endian 16-bit value (LITERAL).
+    WORD,
+    /// A little-endian 16-bit bytecode address (JUMP, JUMP_Z, CALL).
+    ADDRESS,
+    /// A count byte followed by that many one-byte values (LITERAL8_N).
+    BYTE_LIST,
+    /// A length in bytes followed by that many bytes of 16-bit values (LITERAL_N).
+    WORD_LIST
+};
+
+struct OpcodeInfo {
+    /// Name of the command in the script language.
+    const char* name;
+    OperandType operandType;
+};
+
+/// Number of opcodes in Opcode, QUIT to CALL.
+const int OPCODE_COUNT = 55;
+static_assert(int(Opcode::CALL) + 1 == OPCODE_COUNT, "OPCODE_COUNT must match the Opcode enum");
+
+/// Name and operand layout of each opcode, indexed by opcode.
+constexpr OpcodeInfo OPCODE_INFO[OPCODE_COUNT] = {
+    {"QUIT", OperandType::NONE},
+    {"LITERAL", OperandType::WORD},
+    {"LITERAL8", OperandType::BYTE},
+    {"LITERAL_N", OperandType::WORD_LIST},
+    {"LITERAL8_N", OperandType::BYTE_LIST},
+    {"RETURN", OperandType::NONE},
+    {"JUMP", OperandType::ADDRESS},
+    {"JUMP_Z", OperandType::ADDRESS},
+    {"DELAY", OperandType::NONE},
+    {"GET_MS", OperandType::NONE},
+    {"DEPTH", OperandType::NONE},
+    {"DROP", OperandType::NONE},
+    {"DUP", OperandType::NONE},
+    {"OVER", OperandType::NONE},
+    {"PICK", OperandType::NONE},
+    {"SWAP", OperandType::NONE},
+    {"ROT", OperandType::NONE},
+    {"ROLL", OperandType::NONE},
+    {"BITWISE_NOT", OperandType::NONE},
+    {"BITWISE_AND", OperandType::NONE},
+    {"BITWISE_OR", OperandType::NONE},
+    {"BITWISE_XOR", OperandType::NONE},
+    {"SHIFT_RIGHT", OperandType::NONE},
+    {"SHIFT_LEFT", OperandType::NONE},
+    {"LOGICAL_NOT", OperandType::NONE},
+    {"LOGICAL_AND", OperandType::NONE},
+    {"LOGICAL_OR", OperandType::NONE},
+    {"NEGATE", OperandType::NONE},
+    {"PLUS", OperandType::NONE},
+    {"MINUS", OperandType::NONE},
+    {"TIMES", OperandType::NONE},
+    {"DIVIDE", OperandType::NONE},
+    {"MOD", OperandType::NONE},
+    {"POSITIVE", OperandType::NONE},
+    {"NEGATIVE", OperandType::NONE},
+    {"NONZERO", OperandType::NONE},
+    {"EQUALS", OperandType::NONE},
+    {"NOT_EQUALS", OperandType::NONE},
+    {"MIN", OperandType::NONE},
+    {"MAX", OperandType::NONE},
+    {"LESS_THAN", OperandType::NONE},
+    {"GREATER_THAN", OperandType::NONE},
+    {"SERVO", OperandType::NONE},
+    {"SERVO_8BIT", OperandType::NONE},
+    {"SPEED", OperandType::NONE},
+    {"ACCELERATION", OperandType::NONE},
+    {"GET_POSITION", OperandType::NONE},
+    {"GET_MOVING_STATE", OperandType::NONE},
+    {"LED_ON", OperandType::NONE},
+    {"LED_OFF", OperandType::NONE},
+    {"PWM", OperandType::NONE},
+    {"PEEK", OperandType::NONE},
+    {"POKE", OperandType::NONE},
+    {"SERIAL_SEND_BYTE", OperandType::NONE},
+    {"CALL", OperandType::ADDRESS},
+};
+
+/// Information about any byte found at the start of an instruction.  Bytes
+/// between CALL and 128 are not valid opcodes and have no name.
+constexpr OpcodeInfo getOpcodeInfo(uint8_t opcode) {
+    return (opcode < OPCODE_COUNT) ? OPCODE_INFO[opcode] : OpcodeInfo{nullptr, OperandType::NONE};
+}
+
+/// Number of bytes before the values of a list operand, or the whole size
+/// of an instruction with a fixed-size operand.
+constexpr int getFixedLength(OperandType operandType) {
+    return (operandType == OperandType::NONE) ? 1 : (operandType == OperandType::WORD || operandType == OperandType::ADDRESS) ? 3 : 2;
+}
 }  // namespace Maestro
@@ -0,0 +1,117 @@
+#include "Profiler.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <set>
+#include <sstream>
+#include <thread>
+
+namespace Maestro {
+const std::chrono::milliseconds Profiler::MINIMUM_INTERVAL(10);
+
+Profiler::Profiler(const Program& program) : m_program(program), m_sourceMap(program.getSourceMap()) {
+    m_subroutines[0] = "(main)";
+    for (const auto& subroutine : program.getSubroutineAddresses()) {
+        m_subroutines[subroutine.second] = subroutine.first;
+    }
+}
+
+bool Profiler::sample(Device& device) {
+    const Device::ScriptStatus status = device.getScriptStatus(false);
+    if (status.scriptDone) {
+        m_idleSampleCount++;
+        return false;
+    }
+    addSample(status.programCounter, status.callStack);
+    return true;
+}
+
+void Profiler::run(Device& device, std::chrono::milliseconds duration, std::chrono::milliseconds interval) {
+    interval = std::max(interval, MINIMUM_INTERVAL);
+    const auto end = std::chrono::steady_clock::now() + duration;
+    for (auto next = std::chrono::steady_clock::now(); next < end; next += interval) {
+        std::this_thread::sleep_until(next);
+        sample(device);
+        // After a slow transfer, skip the samples that are already late
+        // rather than sending them back to back.
+        const auto now = std::chrono::steady_clock::now();
+        if (next + interval < now) {
+            next += (now - next) / interval * interval;
+        }
+    }
+}
+
+void Profiler::addSample(uint16_t programCounter, const std::vector<uint16_t>& callStack) {
+    m_sampleCount++;
+    m_lineCounts[getLineNumber(programCounter)]++;
+
+    // A return address follows the call, so the caller is the subroutine of
+    // the byte before it.
+    std::string stack;
+    std::set<std::string> frames;
+    for (uint16_t returnAddress : callStack) {
+        const std::string& name = getSubroutineName(uint16_t(returnAddress - 1));
+        stack += name + ";";
+        frames.insert(name);
+    }
+    const std::string& name = getSubroutineName(programCounter);
+    stack += name;
+    frames.insert(name);
+
+    m_selfCounts[name]++;
+    for (const std::string& frame : frames) {
+        m_totalCounts[frame]++;
+    }
+    m_stackCounts[stack]++;
+}
+
+void Profiler::clear() {
+    m_sampleCount = 0;
+    m_idleSampleCount = 0;
+    m_lineCounts.clear();
+    m_selfCounts.clear();
+    m_totalCounts.clear();
+    m_stackCounts.clear();
+}
+
+int Profiler::getLineNumber(uint16_t address) const {
+    auto location = std::upper_bound(m_sourceMap.begin(), m_sourceMap.end(), address,
+                                     [](uint16_t a, const SourceLocation& l) { return a < l.address; });
+    if (location == m_sourceMap.begin()) {
+        return -1;
+    }
+    return (--location)->lineNumber;
+}
+
+const std::string& Profiler::getSubroutineName(uint16_t address) const { return (--m_subroutines.upper_bound(address))->second; }
+
+std::string Profiler::toFoldedStacks() const {
+    std::ostringstream text;
+    for (const auto& stack : m_stackCounts) {
+        text << stack.first << " " << stack.second << "\n";
+    }
+    return text.str();
+}
+
+std::string Profiler::toString() const {
+    std::map<int, std::string> annotations;
+    for (const auto& line : m_lineCounts) {
+        std::ostringstream text;
+        text << std::fixed << std::setprecision(1) << 100.0 * double(line.second) / double(m_sampleCount) << "% (" << line.second << " samples)";
+        annotations[line.first] = text.str();
+    }
+    std::ostringstream text;
+    text << m_program.toString(annotations) << "\n";
+    text << m_sampleCount << " samples, " << m_idleSampleCount << " while the script was stopped\n";
+
+    std::vector<std::pair<std::string, uint64_t>> subroutines(m_totalCounts.begin(), m_totalCounts.end());
+    std::stable_sort(subroutines.begin(), subroutines.end(),
+                     [](const std::pair<std::string, uint64_t>& a, const std::pair<std::string, uint64_t>& b) { return a.second > b.second; });
+    text << "   self   total  subroutine\n";
+    for (const auto& subroutine : subroutines) {
+        const auto self = m_selfCounts.find(subroutine.first);
+        text << std::setw(7) << ((self != m_selfCounts.end()) ? self->second : 0) << " " << std::setw(7) << subroutine.second << "  " << subroutine.first << "\n";
+    }
+    return text.str();
+}
+}  // namespace Maestro
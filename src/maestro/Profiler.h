@@ -0,0 +1,75 @@
+#pragma once
+
+#include <maestro/Device.h>
+#include <maestro/Program.h>
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace Maestro {
+
+/// Sampling profiler of a script running on the device.
+///
+/// Each sample reads the program counter and the call stack with
+/// Device::getScriptStatus(), and is attributed to the source line and the
+/// subroutines of the program loaded on the device.  Samples are spaced by
+/// at least MINIMUM_INTERVAL so that servo commands are not delayed.
+class Profiler {
+   public:
+    static const std::chrono::milliseconds MINIMUM_INTERVAL;
+
+    /// \a program must be the program loaded on the device.
+    explicit Profiler(const Program& program);
+
+    /// Reads one sample from \a device.  Returns false, and only counts an
+    /// idle sample, if the script is stopped.
+    bool sample(Device& device);
+
+    /// Samples \a device every \a interval (at least MINIMUM_INTERVAL) for \a duration.
+    void run(Device& device, std::chrono::milliseconds duration, std::chrono::milliseconds interval = std::chrono::milliseconds(20));
+
+    /// Adds a sample taken elsewhere, e.g. from an Emulator.  \a callStack
+    /// holds the return addresses, from the outermost call.
+    void addSample(uint16_t programCounter, const std::vector<uint16_t>& callStack);
+
+    void clear();
+
+    uint64_t getSampleCount() const { return m_sampleCount; }
+    uint64_t getIdleSampleCount() const { return m_idleSampleCount; }
+
+    /// Samples per source line (0-based), where the script was executing.
+    const std::map<int, uint64_t>& getLineCounts() const { return m_lineCounts; }
+
+    /// Samples per subroutine, counting the subroutine where the script was
+    /// executing (self) and every subroutine on the call stack (total).
+    /// Code outside of any subroutine is named "(main)".
+    const std::map<std::string, uint64_t>& getSelfCounts() const { return m_selfCounts; }
+    const std::map<std::string, uint64_t>& getTotalCounts() const { return m_totalCounts; }
+
+    /// One line per distinct call stack, "(main);SUB1;SUB2 count", from the
+    /// outermost frame.  This is the input format of flamegraph.pl.
+    std::string toFoldedStacks() const;
+
+    /// The program listing, with the share of samples of each line.
+    std::string toString() const;
+
+   private:
+    int getLineNumber(uint16_t address) const;
+    const std::string& getSubroutineName(uint16_t address) const;
+
+    const Program& m_program;
+    std::vector<SourceLocation> m_sourceMap;
+    /// Subroutine names by address.
+    std::map<uint16_t, std::string> m_subroutines;
+
+    uint64_t m_sampleCount = 0;
+    uint64_t m_idleSampleCount = 0;
+    std::map<int, uint64_t> m_lineCounts;
+    std::map<std::string, uint64_t> m_selfCounts;
+    std::map<std::string, uint64_t> m_totalCounts;
+    std::map<std::string, uint64_t> m_stackCounts;
+};
+}  // namespace Maestro
@@ -1,10 +1,15 @@
 #include "Program.h"
 
+#include <algorithm>
 #include <array>
+#include <cctype>
+#include <functional>
 #include <iomanip>
-#include <regex>
+#include <limits>
 #include <sstream>
+#include <unordered_map>
 
+#include "FlashImage.h"
 #include "Instruction.h"
 #include "Opcode.h"
 
@@ -65,60 +70,144 @@ const std::map<std::string, Opcode> dictionary = {{"QUIT", Opcode::QUIT},
                                                   {"SERIAL_SEND_BYTE", Opcode::SERIAL_SEND_BYTE},
                                                   {"CALL", Opcode::CALL}};
 
-Program::Program(const std::string& program, bool isMiniMaestro) {
-    const std::regex eol_re("\\n|\\r\\n");
-    for (std::sregex_token_iterator line_iter(program.begin(), program.end(), eol_re, -1); line_iter != std::sregex_token_iterator(); ++line_iter) {
-        std::string text_line = *line_iter;
-        m_sourceLines.push_back(text_line);
+static std::string toUpper(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(), ::toupper);
+    return s;
+}
+
+Program::Program(const std::string& program, bool isMiniMaestro) : Program(program, isMiniMaestro, CompileOptions()) {}
+
+Program::Program(const std::string& program, bool isMiniMaestro, const CompileOptions& options) {
+    m_sourceLines = splitLines(program);
+
+    std::vector<std::vector<Token>> tokens;
+    std::vector<const std::vector<Token>*> lineTokens;
+    tokens.reserve(m_sourceLines.size());
+    for (const std::string& text_line : m_sourceLines) {
+        tokens.push_back(tokenizeLine(text_line));
+        lineTokens.push_back(&tokens.back());
+    }
+    compile(lineTokens, isMiniMaestro, options);
+}
+
+std::vector<std::string> Program::splitLines(const std::string& program) {
+    // Lines end with \n or \r\n; a line break at the very end does not start
+    // another line.
+    std::vector<std::string> lines;
+    size_t start = 0;
+    while (true) {
+        const size_t end = program.find('\n', start);
+        if (end == std::string::npos) {
+            if (start < program.size() || lines.empty()) {
+                lines.push_back(program.substr(start));
+            }
+            return lines;
+        }
+        const size_t length = (end > start && program[end - 1] == '\r') ? end - 1 - start : end - start;
+        lines.push_back(program.substr(start, length));
+        start = end + 1;
     }
+}
 
+std::vector<Program::Token> Program::tokenizeLine(const std::string& line) {
+    std::vector<Token> tokens;
+    // remove comments
+    const size_t end = std::min(line.find('#'), line.size());
+    size_t start = 0;
+    while (start < end) {
+        if (std::isspace(static_cast<unsigned char>(line[start]))) {
+            start++;
+            continue;
+        }
+        size_t stop = start;
+        while (stop < end && !std::isspace(static_cast<unsigned char>(line[stop]))) {
+            stop++;
+        }
+        // To upper case
+        tokens.push_back(Token{toUpper(line.substr(start, stop - start)), int(start) + 1});
+        start = stop;
+    }
+    return tokens;
+}
+
+void Program::compile(const std::vector<const std::vector<Token>*>& lineTokens, bool isMiniMaestro, const CompileOptions& options) {
     Mode mode = Mode::NORMAL;
+    m_collectDiagnostics = options.collectDiagnostics;
 
     int line_number = 0;
-    int column_number = 0;
-    const std::regex ws_re("\\s|\\t");
-    for (auto text_line : m_sourceLines) {
-        column_number = 1;
-
-        // remove comments
-        text_line = std::regex_replace(text_line, std::regex("#.*"), "");
-
-        for (std::sregex_token_iterator token_iter(text_line.begin(), text_line.end(), ws_re, -1); token_iter != std::sregex_token_iterator();
-             ++token_iter) {
-            std::string token = *token_iter;
-            if (token.empty()) {
-                column_number++;
-                continue;
+    for (const std::vector<Token>* tokens : lineTokens) {
+        for (const Token& token : *tokens) {
+            // Errors are located at the word being parsed.  When they are
+            // collected, the rest of the line is skipped.
+            std::string error;
+            try {
+                if (mode == Mode::NORMAL) {
+                    parseString(token.text, line_number, token.columnNumber, isMiniMaestro, mode);
+                } else if (mode == Mode::GOTO) {
+                    parseGoto(token.text, line_number, token.columnNumber, mode);
+                } else if (mode == Mode::SUBROUTINE) {
+                    parseSubroutine(token.text, line_number, token.columnNumber, mode);
+                }
+            } catch (const std::string& message) {
+                error = message;
+            } catch (const char* message) {
+                error = message;
             }
-            // To upper case
-            std::transform(token.begin(), token.end(), token.begin(), ::toupper);
-
-            if (mode == Mode::NORMAL) {
-                parseString(token, "script", line_number, column_number, isMiniMaestro, mode);
-            } else if (mode == Mode::GOTO) {
-                parseGoto(token, "script", line_number, column_number, mode);
-            } else if (mode == Mode::SUBROUTINE) {
-                parseSubroutine(token, "script", line_number, column_number, mode);
+            if (!error.empty()) {
+                reportError(line_number, token.columnNumber, error);
+                mode = Mode::NORMAL;
+                break;
             }
-            column_number += token.size() + 1;
         }
         line_number++;
     }
-    if (!m_openBlocks.empty()) {
-        const std::string currentBlockStartLabel = getCurrentBlockStartLabel();
-        Instruction& bytecodeInstruction = findLabel(currentBlockStartLabel);
-        bytecodeInstruction.error("BEGIN block was never closed.");
+    while (!m_openBlocks.empty()) {
+        const Instruction& start = findLabel(getCurrentBlockStartLabel());
+        reportError(start.lineNumer(), start.columnNumber(),
+                    (getCurrentBlockType() == BlockType::BEGIN) ? "BEGIN block was never closed." : "IF block was never closed.");
+        closeBlock(line_number, 0);
     }
+    checkSymbols(isMiniMaestro);
     completeLiterals();
-    completeCalls(isMiniMaestro);
+    if (options.outlineRepeatedSequences) {
+        outlineRepeatedSequences(isMiniMaestro);
+    }
+    completeCalls(isMiniMaestro, options);
     completeJumps();
+    std::stable_sort(m_diagnostics.begin(), m_diagnostics.end(), [](const Diagnostic& a, const Diagnostic& b) {
+        return (a.lineNumber != b.lineNumber) ? a.lineNumber < b.lineNumber : a.columnNumber < b.columnNumber;
+    });
+}
+
+void Program::reportError(int lineNumber, int columnNumber, const std::string& message) {
+    if (!m_collectDiagnostics) {
+        throw "script:" + std::to_string(lineNumber) + ":" + std::to_string(columnNumber) + ": " + message;
+    }
+    m_diagnostics.push_back(Diagnostic{true, lineNumber, columnNumber, message});
 }
 
-std::string Program::toString() const {
+template <typename Predicate>
+void Program::removeInstructions(Predicate inError) {
+    size_t kept = 0;
+    for (size_t i = 0; i < m_instructionList.size(); i++) {
+        if (!inError(m_instructionList[i])) {
+            m_instructionList[kept++] = m_instructionList[i];
+        }
+    }
+    m_instructionList.erase(m_instructionList.begin() + kept, m_instructionList.end());
+}
+
+bool Program::hasErrors() const {
+    return std::any_of(m_diagnostics.begin(), m_diagnostics.end(), [](const Diagnostic& diagnostic) { return diagnostic.isError; });
+}
+
+std::string Program::toString() const { return toString(std::map<int, std::string>()); }
+
+std::string Program::toString(const std::map<int, std::string>& lineAnnotations) const {
     if (m_instructionList.empty()) return {};
 
     std::ostringstream streamWriter;
-    int num = 0;
+    size_t num = 0;
     int num2 = 0;
     Instruction bytecodeInstruction(m_instructionList[num]);
 
@@ -126,7 +215,7 @@ std::string Program::toString() const {
         int column_number = 0;
         streamWriter << std::uppercase << std::hex << std::setw(4) << std::setfill('0') << num2 << ": ";
         while (bytecodeInstruction.lineNumer() == line_number) {
-            for (uint8_t item : bytecodeInstruction.toByteList()) {
+            for (uint8_t item : bytecodeInstruction.toByteList(m_literalPool)) {
                 streamWriter << std::setw(2) << int(item);
                 num2++;
                 column_number += 2;
@@ -138,7 +227,27 @@ std::string Program::toString() const {
         for (int j = 0; j < 20 - column_number; j++) {
             streamWriter << " ";
         }
-        streamWriter << " -- " << m_sourceLines[line_number] << std::endl;
+        streamWriter << " -- " << m_sourceLines[line_number];
+        const auto annotation = lineAnnotations.find(int(line_number));
+        if (annotation != lineAnnotations.end()) {
+            streamWriter << "    # " << annotation->second;
+        }
+        streamWriter << std::endl;
+    }
+    // Outlined subroutines are generated by the compiler and have no source line.
+    for (; num < m_instructionList.size(); num++) {
+        const Instruction& instruction = m_instructionList[num];
+        int column_number = 0;
+        streamWriter << std::setw(4) << num2 << ": ";
+        for (uint8_t item : instruction.toByteList(m_literalPool)) {
+            streamWriter << std::setw(2) << int(item);
+            num2++;
+            column_number += 2;
+        }
+        for (int j = 0; j < 20 - column_number; j++) {
+            streamWriter << " ";
+        }
+        streamWriter << " -- " << (instruction.isSubroutine() ? "sub " + symbolName(instruction.symbol()) : std::string()) << std::endl;
     }
     streamWriter << std::endl;
     streamWriter << "Subroutines:" << std::endl;
@@ -168,23 +277,74 @@ std::string Program::toString() const {
     return streamWriter.str();
 }
 
-void Program::addLiteral(int literal, const std::string& filename, int lineNumber, int columnNumber, bool isMiniMaestro) {
+void Program::addLiteral(int literal, int lineNumber, int columnNumber, bool isMiniMaestro) {
     if (m_instructionList.empty() || m_instructionList.back().opcode() != Opcode::LITERAL) {
-        m_instructionList.push_back(Instruction(Opcode::LITERAL, filename, lineNumber, columnNumber));
+        m_instructionList.push_back(Instruction(Opcode::LITERAL, lineNumber, columnNumber));
+    }
+    m_instructionList.back().addLiteralArgument(m_literalPool, literal, isMiniMaestro);
+}
+
+uint32_t Program::intern(const std::string& name) {
+    const auto symbol = m_symbolIds.insert(std::make_pair(name, uint32_t(m_symbols.size())));
+    if (symbol.second) {
+        m_symbols.push_back(name);
     }
-    m_instructionList.back().addLiteralArgument(literal, isMiniMaestro);
+    return symbol.first->second;
 }
 
 std::vector<uint8_t> Program::getByteList() const {
     std::vector<uint8_t> list;
+    appendByteList(list);
+    return list;
+}
+
+void Program::appendByteList(std::vector<uint8_t>& list) const {
+    size_t size = list.size();
     for (const Instruction& instruction : m_instructionList) {
-        list.insert(list.end(), instruction.toByteList().begin(), instruction.toByteList().end());
+        size += instruction.byteSize();
     }
-    return list;
+    list.reserve(size);
+    for (const Instruction& instruction : m_instructionList) {
+        instruction.appendBytes(m_literalPool, list);
+    }
+}
+
+std::vector<SourceLocation> Program::getSourceMap() const {
+    std::vector<SourceLocation> sourceMap;
+    uint16_t address = 0;
+    for (const Instruction& instruction : m_instructionList) {
+        const size_t size = instruction.byteSize();
+        if (size > 0) {
+            sourceMap.push_back(SourceLocation{address, instruction.lineNumer(), instruction.columnNumber()});
+        }
+        address += uint16_t(size);
+    }
+    return sourceMap;
+}
+
+std::array<uint16_t, 128> Program::getSubroutineTable() const {
+    std::array<uint16_t, 128> table;
+    table.fill(UNUSED_SUBROUTINE);
+    for (const auto& subroutineCommand : m_subroutineCommands) {
+        if (subroutineCommand.second != Opcode::CALL) {
+            table[int(subroutineCommand.second) - 128] = m_subroutineAddresses.at(subroutineCommand.first);
+        }
+    }
+    return table;
 }
 
-void Program::openBlock(BlockType blocktype, const std::string& filename, int line_number, int column_number) {
-    m_instructionList.push_back(Instruction::newLabel("block_start_" + std::to_string(m_maxBlock), filename, line_number, column_number));
+std::map<std::string, uint8_t> Program::getSubroutineNumbers() const {
+    std::map<std::string, uint8_t> numbers;
+    for (const auto& subroutineCommand : m_subroutineCommands) {
+        if (subroutineCommand.second != Opcode::CALL) {
+            numbers[subroutineCommand.first] = uint8_t(int(subroutineCommand.second) - 128);
+        }
+    }
+    return numbers;
+}
+
+void Program::openBlock(BlockType blocktype, int line_number, int column_number) {
+    m_instructionList.push_back(Instruction::newLabel(intern("block_start_" + std::to_string(m_maxBlock)), line_number, column_number));
     m_openBlocks.push(m_maxBlock);
     m_openBlockTypes.push(blocktype);
     m_maxBlock++;
@@ -192,132 +352,391 @@ void Program::openBlock(BlockType blocktype, const std::string& filename, int li
 
 Program::BlockType Program::getCurrentBlockType() const { return m_openBlockTypes.top(); }
 
-std::string Program::getCurrentBlockStartLabel() const { return "block_start_" + std::to_string(m_openBlocks.top()); }
+uint32_t Program::getCurrentBlockStartLabel() { return intern("block_start_" + std::to_string(m_openBlocks.top())); }
 
-std::string Program::getCurrentBlockEndLabel() const { return "block_end_" + std::to_string(m_openBlocks.top()); }
+uint32_t Program::getCurrentBlockEndLabel() { return intern("block_end_" + std::to_string(m_openBlocks.top())); }
 
-std::string Program::getNextBlockEndLabel() const { return "block_end_" + std::to_string(m_maxBlock); }
+uint32_t Program::getNextBlockEndLabel() { return intern("block_end_" + std::to_string(m_maxBlock)); }
 
-Instruction& Program::findLabel(const std::string& name) {
+Instruction& Program::findLabel(uint32_t symbol) {
     for (auto& instruction : m_instructionList) {
-        if (instruction.isLabel() && instruction.labelName() == name) {
+        if (instruction.isLabel() && instruction.symbol() == symbol) {
             return instruction;
         }
     }
     throw "Label not found.";
 }
 
-void Program::closeBlock(const std::string& filename, int line_number, int column_number) {
-    m_instructionList.push_back(Instruction::newLabel("block_end_" + std::to_string(m_openBlocks.top()), filename, line_number, column_number));
+void Program::closeBlock(int line_number, int column_number) {
+    m_instructionList.push_back(Instruction::newLabel(intern("block_end_" + std::to_string(m_openBlocks.top())), line_number, column_number));
     m_openBlocks.pop();
     m_openBlockTypes.pop();
 }
 
+void Program::checkSymbols(bool isMiniMaestro) {
+    std::vector<bool> defined(m_symbols.size(), false);
+    std::vector<bool> labelDefined(m_symbols.size(), false);
+    size_t subroutineCount = 0;
+    removeInstructions([&](const Instruction& instruction) {
+        if (!instruction.isSubroutine()) {
+            return false;
+        }
+        if (defined[instruction.symbol()]) {
+            reportError(instruction.lineNumer(), instruction.columnNumber(),
+                        "The subroutine " + symbolName(instruction.symbol()) + " has already been defined.");
+            return true;
+        }
+        if (subroutineCount >= 128 && !isMiniMaestro) {
+            reportError(instruction.lineNumer(), instruction.columnNumber(), "Too many subroutines.  The limit for the Micro Maestro is 128.");
+        }
+        defined[instruction.symbol()] = true;
+        subroutineCount++;
+        return false;
+    });
+    removeInstructions([&](const Instruction& instruction) {
+        if (instruction.isCall() && !defined[instruction.symbol()]) {
+            reportError(instruction.lineNumer(), instruction.columnNumber(), "Did not understand '" + symbolName(instruction.symbol()) + "'");
+            return true;
+        }
+        return false;
+    });
+    removeInstructions([&](const Instruction& instruction) {
+        if (!instruction.isLabel()) {
+            return false;
+        }
+        if (labelDefined[instruction.symbol()]) {
+            reportError(instruction.lineNumer(), instruction.columnNumber(), "The label " + symbolName(instruction.symbol()) + " has already been used.");
+            return true;
+        }
+        labelDefined[instruction.symbol()] = true;
+        return false;
+    });
+    removeInstructions([&](const Instruction& instruction) {
+        if (instruction.isJumpToLabel() && !labelDefined[instruction.symbol()]) {
+            reportError(instruction.lineNumer(), instruction.columnNumber(), "The label " + symbolName(instruction.symbol()) + " was not found.");
+            return true;
+        }
+        return false;
+    });
+}
+
 void Program::completeJumps() {
-    std::map<std::string, int> dictionary;
+    // Address of each label, indexed by symbol.
+    std::vector<int> addresses(m_symbols.size(), -1);
     int num = 0;
     for (Instruction& instruction : m_instructionList) {
         if (instruction.isLabel()) {
-            if (dictionary.find(instruction.labelName()) != dictionary.end()) {
-                instruction.error("The label " + instruction.labelName() + " has already been used.");
-            }
-            dictionary[instruction.labelName()] = num;
+            addresses[instruction.symbol()] = num;
         }
-        num += instruction.toByteList().size();
+        num += instruction.byteSize();
     }
     for (Instruction& instruction : m_instructionList) {
-        try {
-            if (instruction.isJumpToLabel()) {
-                instruction.addLiteralArgument(dictionary.at(instruction.labelName()), false);
-            }
-        } catch (std::exception& e) {
-            instruction.error("The label " + instruction.labelName() + " was not found.");
+        if (instruction.isJumpToLabel()) {
+            instruction.addLiteralArgument(m_literalPool, addresses[instruction.symbol()], false);
         }
     }
 }
 
-void Program::completeCalls(bool isMiniMaestro) {
-    uint32_t num_subroutines = 128;
-    for (Instruction& instruction : m_instructionList) {
+void Program::completeCalls(bool isMiniMaestro, const CompileOptions& options) {
+    // Subroutine symbols in definition order, and the index of each symbol in
+    // that list.
+    std::vector<uint32_t> subroutines;
+    std::vector<int> definitions(m_symbols.size(), -1);
+    for (const Instruction& instruction : m_instructionList) {
         if (instruction.isSubroutine()) {
-            if (m_subroutineCommands.find(instruction.labelName()) != m_subroutineCommands.end()) {
-                instruction.error("The subroutine " + instruction.labelName() + " has already been defined.");
+            definitions[instruction.symbol()] = int(subroutines.size());
+            subroutines.push_back(instruction.symbol());
+        }
+    }
+    std::vector<uint32_t> callCounts(subroutines.size(), 0);
+    for (const Instruction& instruction : m_instructionList) {
+        if (instruction.isCall() && definitions[instruction.symbol()] >= 0) {
+            callCounts[size_t(definitions[instruction.symbol()])]++;
+        }
+    }
+    auto findSubroutine = [&](const std::string& name) {
+        const auto symbol = m_symbolIds.find(toUpper(name));
+        return (symbol == m_symbolIds.end()) ? -1 : definitions[symbol->second];
+    };
+
+    // A pinned subroutine keeps its number in definition order, which must
+    // have a one-byte opcode for restartScriptAtSubroutine() to start it.
+    std::vector<bool> pinned(subroutines.size(), false);
+    for (const std::string& name : options.pinnedSubroutines) {
+        const int subroutine = findSubroutine(name);
+        if (subroutine < 0) {
+            continue;
+        }
+        if (subroutine >= 128) {
+            for (const Instruction& instruction : m_instructionList) {
+                if (instruction.isSubroutine() && instruction.symbol() == subroutines[size_t(subroutine)]) {
+                    reportError(instruction.lineNumer(), instruction.columnNumber(),
+                                "The subroutine " + symbolName(instruction.symbol()) +
+                                    " cannot be pinned: only the first 128 subroutines defined have a number.");
+                }
+            }
+            continue;
+        }
+        pinned[size_t(subroutine)] = true;
+    }
+
+    // Subroutine numbers in definition order, which is what the 128 one-byte
+    // opcodes map to unless they are allocated by call count.
+    std::vector<int> numbers(subroutines.size(), -1);
+    if (!options.allocateSubroutinesByCallCount) {
+        for (size_t i = 0; i < subroutines.size() && i < 128; i++) {
+            numbers[i] = int(i);
+        }
+    } else {
+        std::vector<uint32_t> weights = callCounts;
+        for (const auto& profile : options.callProfile) {
+            const int subroutine = findSubroutine(profile.first);
+            if (subroutine >= 0) {
+                weights[size_t(subroutine)] = profile.second;
+            }
+        }
+
+        std::array<bool, 128> used;
+        used.fill(false);
+        std::vector<size_t> candidates;
+        for (size_t i = 0; i < subroutines.size(); i++) {
+            if (pinned[i]) {
+                numbers[i] = int(i);
+                used[i] = true;
+            } else {
+                candidates.push_back(i);
+            }
+        }
+        std::stable_sort(candidates.begin(), candidates.end(), [&](size_t a, size_t b) { return weights[a] > weights[b]; });
+
+        size_t slot = 0;
+        for (size_t candidate : candidates) {
+            while (slot < used.size() && used[slot]) {
+                slot++;
             }
-            m_subroutineCommands[instruction.labelName()] = (num_subroutines >= 256) ? Opcode::CALL : Opcode(num_subroutines);
-            num_subroutines++;
-            if (num_subroutines > 255 && !isMiniMaestro) {
-                instruction.error("Too many subroutines.  The limit for the Micro Maestro is 128.");
+            if (slot >= used.size()) {
+                break;
             }
+            numbers[candidate] = int(slot);
+            used[slot] = true;
         }
     }
+    std::vector<Opcode> commands(subroutines.size());
+    for (size_t i = 0; i < subroutines.size(); i++) {
+        commands[i] = (numbers[i] < 0) ? Opcode::CALL : Opcode(128 + numbers[i]);
+        m_subroutineCommands[symbolName(subroutines[i])] = commands[i];
+    }
+
     for (Instruction& instruction : m_instructionList) {
-        try {
-            if (instruction.isCall()) {
-                instruction.setOpcode(m_subroutineCommands[instruction.labelName()]);
-            }
-        } catch (std::exception& e) {
-            instruction.error("Did not understand '" + instruction.labelName() + "'");
+        if (instruction.isCall()) {
+            instruction.setOpcode(commands[size_t(definitions[instruction.symbol()])]);
         }
     }
+    std::vector<uint16_t> addresses(subroutines.size(), 0);
     uint16_t address = 0;
     for (const Instruction& instruction : m_instructionList) {
         if (instruction.isSubroutine()) {
-            m_subroutineAddresses[instruction.labelName()] = address;
+            addresses[size_t(definitions[instruction.symbol()])] = address;
+            m_subroutineAddresses[symbolName(instruction.symbol())] = address;
         }
-        address += instruction.toByteList().size();
+        address += instruction.byteSize();
     }
     for (Instruction& instruction : m_instructionList) {
         if (instruction.opcode() == Opcode::CALL) {
-            instruction.addLiteralArgument(m_subroutineAddresses[instruction.labelName()], isMiniMaestro);
+            instruction.addLiteralArgument(m_literalPool, addresses[size_t(definitions[instruction.symbol()])], isMiniMaestro);
         }
     }
 }
 
 void Program::completeLiterals() {
     for (Instruction& instruction : m_instructionList) {
-        instruction.completeLiterals();
+        instruction.completeLiterals(m_literalPool);
     }
 }
 
-uint16_t oneByteCRC(uint8_t v) {
-    const uint16_t CRC16_POLY = 40961;
-    uint16_t num = v;
-    for (int i = 0; i < 8; i++) {
-        num = (((num & 1) != 1) ? ((uint16_t)(num >> 1)) : ((uint16_t)((uint32_t)(num >> 1) ^ CRC16_POLY)));
+bool isOutlinable(const Instruction& instruction) {
+    if (instruction.isLabel() || instruction.isSubroutine() || instruction.isCall() || instruction.isJumpToLabel()) {
+        return false;
+    }
+    switch (instruction.opcode()) {
+        case Opcode::QUIT:
+        case Opcode::RETURN:
+        case Opcode::JUMP:
+        case Opcode::JUMP_Z:
+        case Opcode::CALL:
+            return false;
+        default:
+            return true;
     }
-    return num;
 }
 
-uint16_t CRC(const std::vector<uint8_t>& message) {
-    uint16_t num = 0;
-    for (uint16_t num2 = 0; num2 < message.size(); num2 = (uint16_t)(num2 + 1)) {
-        num = (uint16_t)((num >> 8) ^ oneByteCRC((uint8_t)((uint8_t)num ^ message[num2])));
+void Program::outlineRepeatedSequences(bool isMiniMaestro) {
+    const size_t maxSequenceLength = 32;
+    const int callStackSize = isMiniMaestro ? MINI_MAESTRO_CALL_STACK_SIZE : MICRO_MAESTRO_CALL_STACK_SIZE;
+
+    // Call graph between subroutine symbols, the main code having no symbol.
+    const uint32_t mainCode = std::numeric_limits<uint32_t>::max();
+    size_t subroutineCount = 0;
+    std::map<uint32_t, std::set<uint32_t>> callers;
+    uint32_t current = mainCode;
+    for (const Instruction& instruction : m_instructionList) {
+        if (instruction.isSubroutine()) {
+            current = instruction.symbol();
+            subroutineCount++;
+        } else if (instruction.isCall()) {
+            callers[instruction.symbol()].insert(current);
+        }
     }
-    return num;
-}
 
-uint16_t Program::getCRC() const {
-    std::vector<uint8_t> list;
-    std::array<uint16_t, 128> array;
-    for (const auto& keyValue : m_subroutineCommands) {
-        if (m_subroutineCommands.at(keyValue.first) != Opcode::CALL) {
-            array[uint8_t(m_subroutineCommands.at(keyValue.first)) - 128] = m_subroutineAddresses.at(keyValue.first);
+    // Number of return addresses on the call stack while a subroutine runs.
+    // The main code and subroutines started from the host run with an empty
+    // call stack; recursive subroutines are considered to have no room left.
+    std::map<uint32_t, int> depths;
+    std::set<uint32_t> visiting;
+    std::function<int(uint32_t)> depthOf = [&](uint32_t name) -> int {
+        const auto known = depths.find(name);
+        if (known != depths.end()) {
+            return known->second;
+        }
+        if (!visiting.insert(name).second) {
+            return callStackSize;
+        }
+        int depth = 0;
+        const auto calledBy = callers.find(name);
+        if (calledBy != callers.end()) {
+            for (uint32_t caller : calledBy->second) {
+                depth = std::max(depth, depthOf(caller) + 1);
+            }
+        }
+        visiting.erase(name);
+        depth = std::min(depth, callStackSize);
+        depths[name] = depth;
+        return depth;
+    };
+
+    std::vector<Instruction> outlined;
+    while (isMiniMaestro || subroutineCount < 128) {
+        const size_t count = m_instructionList.size();
+
+        // Identical instructions share a symbol; everything that cannot be
+        // moved into a subroutine gets a unique negative symbol.
+        std::vector<size_t> sizes(count);
+        std::vector<int64_t> symbols(count);
+        std::map<std::vector<uint8_t>, int64_t> ids;
+        std::vector<uint8_t> bytes;
+        current = mainCode;
+        for (size_t i = 0; i < count; i++) {
+            const Instruction& instruction = m_instructionList[i];
+            if (instruction.isSubroutine()) {
+                current = instruction.symbol();
+            }
+            bytes.clear();
+            instruction.appendBytes(m_literalPool, bytes);
+            sizes[i] = bytes.size();
+            if (isOutlinable(instruction) && depthOf(current) < callStackSize) {
+                symbols[i] = ids.insert(std::make_pair(bytes, int64_t(ids.size()))).first->second;
+            } else {
+                symbols[i] = -1 - int64_t(i);
+            }
         }
+
+        const size_t callSize = (subroutineCount < 128) ? 1 : 3;
+        const size_t overhead = 1 + (outlined.empty() ? 1 : 0);  // RETURN, and QUIT before the first one
+        size_t bestSaving = 0;
+        size_t bestLength = 0;
+        std::vector<size_t> bestPositions;
+
+        for (size_t length = 2; length <= maxSequenceLength && length <= count; length++) {
+            std::unordered_map<uint64_t, std::vector<size_t>> windows;
+            size_t run = 0;
+            for (size_t i = 0; i < count; i++) {
+                run = (symbols[i] < 0) ? 0 : run + 1;
+                if (run < length) {
+                    continue;
+                }
+                const size_t start = i + 1 - length;
+                uint64_t hash = 14695981039346656037ull;
+                for (size_t j = start; j <= i; j++) {
+                    hash = (hash ^ uint64_t(symbols[j])) * 1099511628211ull;
+                }
+                windows[hash].push_back(start);
+            }
+
+            for (const auto& window : windows) {
+                std::vector<size_t> positions = window.second;
+                while (positions.size() >= 2) {
+                    // Split hash collisions, then keep non-overlapping occurrences.
+                    const size_t first = positions.front();
+                    std::vector<size_t> same, others;
+                    for (size_t position : positions) {
+                        if (std::equal(symbols.begin() + first, symbols.begin() + first + length, symbols.begin() + position)) {
+                            if (same.empty() || position >= same.back() + length) {
+                                same.push_back(position);
+                            }
+                        } else {
+                            others.push_back(position);
+                        }
+                    }
+                    positions.swap(others);
+
+                    size_t sequenceSize = 0;
+                    for (size_t j = first; j < first + length; j++) {
+                        sequenceSize += sizes[j];
+                    }
+                    const size_t before = same.size() * sequenceSize;
+                    const size_t after = same.size() * callSize + sequenceSize + overhead;
+                    if (same.size() >= 2 && before > after && before - after > bestSaving) {
+                        bestSaving = before - after;
+                        bestLength = length;
+                        bestPositions = same;
+                    }
+                }
+            }
+        }
+        if (bestSaving == 0) {
+            break;
+        }
+
+        const uint32_t name = intern("outlined_" + std::to_string(subroutineCount));
+        const int endOfSource = int(m_sourceLines.size());
+        if (outlined.empty()) {
+            outlined.push_back(Instruction(Opcode::QUIT, endOfSource, 0));
+        }
+        outlined.push_back(Instruction::newSubroutine(name, endOfSource, 0));
+        outlined.insert(outlined.end(), m_instructionList.begin() + bestPositions.front(),
+                        m_instructionList.begin() + bestPositions.front() + bestLength);
+        outlined.push_back(Instruction(Opcode::RETURN, endOfSource, 0));
+        for (auto position = bestPositions.rbegin(); position != bestPositions.rend(); ++position) {
+            const Instruction& first = m_instructionList[*position];
+            const Instruction call = Instruction::newCall(name, first.lineNumer(), first.columnNumber());
+            m_instructionList.erase(m_instructionList.begin() + *position, m_instructionList.begin() + *position + bestLength);
+            m_instructionList.insert(m_instructionList.begin() + *position, call);
+        }
+        subroutineCount++;
     }
-    for (uint16_t num : array) {
-        list.push_back((uint8_t)(num & 0xFFu));
-        list.push_back((uint8_t)(num >> 8));
+    m_instructionList.insert(m_instructionList.end(), outlined.begin(), outlined.end());
+}
+
+uint16_t Program::computeCRC(const std::array<uint16_t, 128>& subroutineTable, const uint8_t* bytecode, size_t size) {
+    std::array<uint8_t, FlashImage::SUBROUTINE_TABLE_SIZE> table;
+    for (size_t i = 0; i < subroutineTable.size(); i++) {
+        table[2 * i] = uint8_t(subroutineTable[i] & 0xFF);
+        table[2 * i + 1] = uint8_t(subroutineTable[i] >> 8);
     }
-    list.insert(list.end(), getByteList().begin(), getByteList().end());
-    return CRC(list);
+    Crc16 crc;
+    crc.update(table.data(), table.size());
+    crc.update(bytecode, size);
+    return crc.value();
 }
 
-void Program::parseGoto(std::string s, std::string filename, int line_number, int column_number, Mode& mode) {
-    m_instructionList.push_back(Instruction::newJumpToLabel("USER_" + s, filename, line_number, column_number));
+uint16_t Program::getCRC() const { return FlashImage(*this).getCRC(); }
+
+void Program::parseGoto(const std::string& s, int line_number, int column_number, Mode& mode) {
+    m_instructionList.push_back(Instruction::newJumpToLabel(intern("USER_" + s), line_number, column_number));
     mode = Mode::NORMAL;
 }
 
-void Program::parseSubroutine(std::string s, std::string filename, int line_number, int column_number, Mode& mode) {
+void Program::parseSubroutine(const std::string& s, int line_number, int column_number, Mode& mode) {
     if (looksLikeLiteral(s)) {
         throw "The name " + s + " is not valid as a subroutine name (it looks like a number).";
     }
@@ -325,43 +744,62 @@ void Program::parseSubroutine(std::string s, std::string filename, int line_numb
         throw "The name " + s + " is not valid as a subroutine name (it is a built-in command).";
     }
     const std::vector<std::string> keywords = {"GOTO", "SUB", "BEGIN", "WHILE", "REPEAT", "IF", "ENDIF", "ELSE"};
-    for (std::string keyword : keywords) {
+    for (const std::string& keyword : keywords) {
         if (keyword == s) {
             throw "The name " + s + " is not valid as a subroutine name (it is a keyword).";
         }
     }
-    m_instructionList.push_back(Instruction::newSubroutine(s, filename, line_number, column_number));
+    m_instructionList.push_back(Instruction::newSubroutine(intern(s), line_number, column_number));
     mode = Mode::NORMAL;
 }
 
 bool Program::looksLikeLiteral(const std::string& s) {
-    return std::regex_match(s, std::regex("^-?[0-9.]+$")) || std::regex_match(s, std::regex("^0[xX][0-9a-fA-F.]+$"));
+    // Same as matching ^-?[0-9.]+$ or ^0[xX][0-9a-fA-F.]+$, without the cost
+    // of a regular expression for every word of the script.
+    auto allOf = [&s](size_t start, int (*isDigit)(int)) {
+        if (start >= s.size()) {
+            return false;
+        }
+        for (size_t i = start; i < s.size(); i++) {
+            if (s[i] != '.' && !isDigit(static_cast<unsigned char>(s[i]))) {
+                return false;
+            }
+        }
+        return true;
+    };
+    if (s.size() > 1 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X') && allOf(2, ::isxdigit)) {
+        return true;
+    }
+    return allOf((!s.empty() && s[0] == '-') ? 1 : 0, ::isdigit);
 }
 
-void Program::parseString(std::string s, std::string filename, int line_number, int column_number, bool isMiniMaestro, Mode& mode) {
+int Program::parseLiteral(const std::string& s) {
     try {
-        if (looksLikeLiteral(s)) {
-            int num;
-            if (s.rfind("0X", 0) == 0) {
-                num = std::stoi(s, nullptr, 16);
-                if (num > 65535 || num < 0) {
-                    throw "Value " + s + " is not in the allowed range of " + std::to_string(std::numeric_limits<uint16_t>::min()) + " to " +
-                        std::to_string(std::numeric_limits<uint16_t>::max()) + ".";
-                }
-            } else {
-                num = std::stoi(s);
-                if (num > 32767 || num < -32768) {
-                    throw "Value " + s + " is not in the allowed range of " + std::to_string(std::numeric_limits<int16_t>::min()) + " to " +
-                        std::to_string(std::numeric_limits<int16_t>::max()) + ".";
-                }
+        int num;
+        if (s.rfind("0X", 0) == 0) {
+            num = std::stoi(s, nullptr, 16);
+            if (num > 65535 || num < 0) {
+                throw "Value " + s + " is not in the allowed range of " + std::to_string(std::numeric_limits<uint16_t>::min()) + " to " +
+                    std::to_string(std::numeric_limits<uint16_t>::max()) + ".";
+            }
+        } else {
+            num = std::stoi(s);
+            if (num > 32767 || num < -32768) {
+                throw "Value " + s + " is not in the allowed range of " + std::to_string(std::numeric_limits<int16_t>::min()) + " to " +
+                    std::to_string(std::numeric_limits<int16_t>::max()) + ".";
             }
-            int literal = (int16_t)(long)(num % 65535);
-            addLiteral(literal, filename, line_number, column_number, isMiniMaestro);
-            return;
         }
+        return (int16_t)(long)(num % 65535);
     } catch (std::exception& ex) {
         throw "Error parsing " + s + ": " + ex.what();
     }
+}
+
+void Program::parseString(const std::string& s, int line_number, int column_number, bool isMiniMaestro, Mode& mode) {
+    if (looksLikeLiteral(s)) {
+        addLiteral(parseLiteral(s), line_number, column_number, isMiniMaestro);
+        return;
+    }
     if (s == "GOTO") {
         mode = Mode::GOTO;
         return;
@@ -370,62 +808,57 @@ void Program::parseString(std::string s, std::string filename, int line_number,
         mode = Mode::SUBROUTINE;
         return;
     }
-    std::smatch base_match;
-    const std::regex base_regex("(.*):$");
-    if (std::regex_match(s, base_match, base_regex)) {
-        m_instructionList.push_back(Instruction::newLabel("USER_" + base_match[1].str(), filename, line_number, column_number));
+    if (!s.empty() && s.back() == ':') {
+        m_instructionList.push_back(Instruction::newLabel(intern("USER_" + s.substr(0, s.size() - 1)), line_number, column_number));
         return;
     }
     if (s == "BEGIN") {
-        openBlock(BlockType::BEGIN, filename, line_number, column_number);
+        openBlock(BlockType::BEGIN, line_number, column_number);
         return;
     }
     if (s == "WHILE") {
-        if (getCurrentBlockType() != BlockType::BEGIN) {
-            throw "WHILE must be inside a BEGIN...REPEAT block";
+        if (m_openBlocks.empty() || getCurrentBlockType() != BlockType::BEGIN) {
+            throw "WHILE must be inside a BEGIN...REPEAT block.";
         }
-        m_instructionList.push_back(Instruction::newConditionalJumpToLabel(getCurrentBlockEndLabel(), filename, line_number, column_number));
+        m_instructionList.push_back(Instruction::newConditionalJumpToLabel(getCurrentBlockEndLabel(), line_number, column_number));
         return;
     }
     if (s == "REPEAT") {
-        try {
-            if (getCurrentBlockType() != BlockType::BEGIN) {
-                throw "REPEAT must end a BEGIN...REPEAT block";
-            }
-            m_instructionList.push_back(Instruction::newJumpToLabel(getCurrentBlockStartLabel(), filename, line_number, column_number));
-            closeBlock(filename, line_number, column_number);
-        } catch (std::exception& ex) {
-            throw filename + ":" + std::to_string(line_number) + ":" + std::to_string(column_number) + ": Found REPEAT without a corresponding BEGIN";
+        if (m_openBlocks.empty()) {
+            throw "Found REPEAT without a corresponding BEGIN.";
+        }
+        if (getCurrentBlockType() != BlockType::BEGIN) {
+            throw "REPEAT must end a BEGIN...REPEAT block.";
         }
+        m_instructionList.push_back(Instruction::newJumpToLabel(getCurrentBlockStartLabel(), line_number, column_number));
+        closeBlock(line_number, column_number);
         return;
     }
     if (s == "IF") {
-        openBlock(BlockType::IF, filename, line_number, column_number);
-        m_instructionList.push_back(Instruction::newConditionalJumpToLabel(getCurrentBlockEndLabel(), filename, line_number, column_number));
+        openBlock(BlockType::IF, line_number, column_number);
+        m_instructionList.push_back(Instruction::newConditionalJumpToLabel(getCurrentBlockEndLabel(), line_number, column_number));
         return;
     }
     if (s == "ENDIF") {
-        try {
-            if (getCurrentBlockType() != BlockType::IF && getCurrentBlockType() != BlockType::ELSE) {
-                throw "ENDIF must end an IF...ENDIF or an IF...ELSE...ENDIF block.";
-            }
-            closeBlock(filename, line_number, column_number);
-        } catch (std::exception& ex) {
-            throw filename + ":" + std::to_string(line_number) + ":" + std::to_string(column_number) + ": Found ENDIF without a corresponding IF";
+        if (m_openBlocks.empty()) {
+            throw "Found ENDIF without a corresponding IF.";
+        }
+        if (getCurrentBlockType() != BlockType::IF && getCurrentBlockType() != BlockType::ELSE) {
+            throw "ENDIF must end an IF...ENDIF or an IF...ELSE...ENDIF block.";
         }
+        closeBlock(line_number, column_number);
         return;
     }
     if (s == "ELSE") {
-        try {
-            if (getCurrentBlockType() != BlockType::IF) {
-                throw "ELSE must be part of an IF...ELSE...ENDIF block.";
-            }
-            m_instructionList.push_back(Instruction::newJumpToLabel(getNextBlockEndLabel(), filename, line_number, column_number));
-            closeBlock(filename, line_number, column_number);
-            openBlock(BlockType::ELSE, filename, line_number, column_number);
-        } catch (std::exception& ex) {
-            throw filename + ":" + std::to_string(line_number) + ":" + std::to_string(column_number) + ": Found ELSE without a corresponding IF";
+        if (m_openBlocks.empty()) {
+            throw "Found ELSE without a corresponding IF.";
+        }
+        if (getCurrentBlockType() != BlockType::IF) {
+            throw "ELSE must be part of an IF...ELSE...ENDIF block.";
         }
+        m_instructionList.push_back(Instruction::newJumpToLabel(getNextBlockEndLabel(), line_number, column_number));
+        closeBlock(line_number, column_number);
+        openBlock(BlockType::ELSE, line_number, column_number);
         return;
     }
     if (dictionary.find(s) != dictionary.end()) {
@@ -435,20 +868,17 @@ void Program::parseString(std::string s, std::string filename, int line_number,
             case Opcode::LITERAL8:
             case Opcode::LITERAL_N:
             case Opcode::LITERAL8_N:
-                throw filename + ":" + std::to_string(line_number) + ":" + std::to_string(column_number) +
-                    ": Literal commands may not be used directly in a program.  Integers should be entered directly.";
+                throw "Literal commands may not be used directly in a program.  Integers should be entered directly.";
             case Opcode::JUMP:
             case Opcode::JUMP_Z:
-                throw filename + ":" + std::to_string(line_number) + ":" + std::to_string(column_number) +
-                    ": Jumps may not be used directly in a program.";
+                throw "Jumps may not be used directly in a program.";
         }
         if (!isMiniMaestro && (uint8_t)opcode >= (uint8_t)Opcode::PWM) {
-            throw filename + ":" + std::to_string(line_number) + ":" + std::to_string(column_number) + ": " + s +
-                " is only available on the Mini Maestro 12, 18, and 24.";
+            throw s + " is only available on the Mini Maestro 12, 18, and 24.";
         }
-        m_instructionList.push_back(Instruction(opcode, filename, line_number, column_number));
+        m_instructionList.push_back(Instruction(opcode, line_number, column_number));
     } else {
-        m_instructionList.push_back(Instruction::newCall(s, filename, line_number, column_number));
+        m_instructionList.push_back(Instruction::newCall(intern(s), line_number, column_number));
     }
 }
 }  // namespace Maestro
@@ -2,52 +2,184 @@
 
 #include <maestro/Instruction.h>
 
+#include <array>
 #include <cstdint>
 #include <map>
+#include <set>
 #include <stack>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace Maestro {
 
+/// Optional settings controlling how a Program is compiled.
+struct CompileOptions {
+    /// By default subroutines are numbered in the order they are defined, and
+    /// only the first 128 get a one-byte call opcode.  When set, the one-byte
+    /// opcodes are instead given to the most frequently called subroutines and
+    /// the others are called through the 3-byte CALL instruction.
+    bool allocateSubroutinesByCallCount = false;
+
+    /// Optional weight per subroutine name (e.g. a measured call count) used
+    /// instead of the number of static call sites when allocating opcodes.
+    std::map<std::string, uint32_t> callProfile;
+
+    /// Subroutines started from the host with restartScriptAtSubroutine().
+    /// They keep the number they get in definition order so that their IDs
+    /// stay stable whatever the call counts are.
+    std::set<std::string> pinnedSubroutines;
+
+    /// Size optimization: repeated runs of instructions are moved into
+    /// compiler-generated subroutines and replaced by calls.  Outlined
+    /// subroutines never call other subroutines, so a call site only needs
+    /// one free level on the call stack.
+    bool outlineRepeatedSequences = false;
+
+    /// When set, errors in the script do not throw: they are collected in
+    /// Program::getDiagnostics(), and compiling resumes at the next line.
+    /// Instructions in error are left out, so the program can still be
+    /// listed and analyzed, but it should not be loaded on a device.
+    bool collectDiagnostics = false;
+};
+
+/// Position in the source of the instruction compiled at an address.
+struct SourceLocation {
+    uint16_t address;
+    int lineNumber;
+    int columnNumber;
+};
+
+/// A problem found in the script, at a 0-based line and 1-based column.
+struct Diagnostic {
+    bool isError;
+    int lineNumber;
+    int columnNumber;
+    std::string message;
+};
+
 class Program {
    public:
+    /// Changes whenever the bytecode generated for a script changes, so that
+    /// programs compiled by an older version are not taken from a cache.
+    static const uint32_t CODE_VERSION = 5;
+
+    /// The subroutine table entry of an unused subroutine number: erased flash.
+    static const uint16_t UNUSED_SUBROUTINE = 0xFFFF;
+
     Program(const std::string& script, bool isMiniMaestro);
+    Program(const std::string& script, bool isMiniMaestro, const CompileOptions& options);
 
     std::vector<uint8_t> getByteList() const;
+
+    /// Appends the bytecode to \a list, without building a temporary list.
+    void appendByteList(std::vector<uint8_t>& list) const;
     uint16_t getCRC() const;
+
+    /// CRC of a subroutine table followed by bytecode.  getCRC() is this CRC
+    /// for the table and bytecode of the program.
+    static uint16_t computeCRC(const std::array<uint16_t, 128>& subroutineTable, const uint8_t* bytecode, size_t size);
     std::string toString() const;
 
+    /// Same listing, with a comment appended to the source lines found in
+    /// \a lineAnnotations (indexed by 0-based line number).
+    std::string toString(const std::map<int, std::string>& lineAnnotations) const;
+
+    /// Returns the number (0-127) of each subroutine that can be started with
+    /// Device::restartScriptAtSubroutine().  Subroutines called through the
+    /// 3-byte CALL instruction have no number and are not listed.
+    std::map<std::string, uint8_t> getSubroutineNumbers() const;
+
+    /// Returns the address of each numbered subroutine, indexed by subroutine
+    /// number.  Unused entries are UNUSED_SUBROUTINE, as in the table written
+    /// by the Pololu tools.
+    std::array<uint16_t, 128> getSubroutineTable() const;
+
+    /// Returns the address of every subroutine, including the ones called
+    /// through the 3-byte CALL instruction.
+    const std::map<std::string, uint16_t>& getSubroutineAddresses() const { return m_subroutineAddresses; }
+
+    /// Returns the source location of each instruction that generates bytecode,
+    /// sorted by address.
+    std::vector<SourceLocation> getSourceMap() const;
+
+    const std::vector<std::string>& getSourceLines() const { return m_sourceLines; }
+
+    /// Problems found when compiling with CompileOptions::collectDiagnostics,
+    /// sorted by position.  Empty otherwise, since the first error throws.
+    const std::vector<Diagnostic>& getDiagnostics() const { return m_diagnostics; }
+
+    /// True if an error was collected in getDiagnostics().
+    bool hasErrors() const;
+
    private:
+    friend class IncrementalCompiler;
+
     enum class BlockType { BEGIN = 0, IF, ELSE };
     enum class Mode { NORMAL, GOTO, SUBROUTINE };
 
-    void addLiteral(int literal, const std::string& filename, int lineNumber, int columnNumber, bool isMiniMaestro);
+    /// A word of the source, upper-cased, with its 1-based column.
+    struct Token {
+        std::string text;
+        int columnNumber;
+    };
 
-    void openBlock(BlockType blocktype, const std::string& filename, int line_number, int column_number);
+    Program() = default;
+
+    static std::vector<std::string> splitLines(const std::string& program);
+    static std::vector<Token> tokenizeLine(const std::string& line);
+    void compile(const std::vector<const std::vector<Token>*>& lineTokens, bool isMiniMaestro, const CompileOptions& options);
+
+    void addLiteral(int literal, int lineNumber, int columnNumber, bool isMiniMaestro);
+
+    /// Throws "script:line:column: message", or adds it to the diagnostics
+    /// when they are collected.
+    void reportError(int lineNumber, int columnNumber, const std::string& message);
+
+    /// Removes the instructions for which \a inError returns true.
+    template <typename Predicate>
+    void removeInstructions(Predicate inError);
+
+    /// Returns the ID of a label or subroutine name, adding it if needed.
+    uint32_t intern(const std::string& name);
+    const std::string& symbolName(uint32_t symbol) const { return m_symbols[symbol]; }
+
+    void openBlock(BlockType blocktype, int line_number, int column_number);
     BlockType getCurrentBlockType() const;
-    std::string getCurrentBlockStartLabel() const;
-    std::string getCurrentBlockEndLabel() const;
-    std::string getNextBlockEndLabel() const;
+    uint32_t getCurrentBlockStartLabel();
+    uint32_t getCurrentBlockEndLabel();
+    uint32_t getNextBlockEndLabel();
+
+    void closeBlock(int line_number, int column_number);
 
-    void closeBlock(const std::string& filename, int line_number, int column_number);
+    /// Reports duplicate and undefined labels and subroutines.  Instructions
+    /// in error are removed when the diagnostics are collected.
+    void checkSymbols(bool isMiniMaestro);
     void completeJumps();
-    void completeCalls(bool isMiniMaestro);
+    void completeCalls(bool isMiniMaestro, const CompileOptions& options);
     void completeLiterals();
+    void outlineRepeatedSequences(bool isMiniMaestro);
 
-    void parseGoto(std::string s, std::string filename, int line_number, int column_number, Mode& mode);
-    void parseSubroutine(std::string s, std::string filename, int line_number, int column_number, Mode& mode);
-    bool looksLikeLiteral(const std::string& s);
-    void parseString(std::string s, std::string filename, int line_number, int column_number, bool isMiniMaestro, Mode& mode);
+    void parseGoto(const std::string& s, int line_number, int column_number, Mode& mode);
+    void parseSubroutine(const std::string& s, int line_number, int column_number, Mode& mode);
+    static bool looksLikeLiteral(const std::string& s);
+    static int parseLiteral(const std::string& s);
+    void parseString(const std::string& s, int line_number, int column_number, bool isMiniMaestro, Mode& mode);
 
-    Instruction& findLabel(const std::string& name);
+    Instruction& findLabel(uint32_t symbol);
 
     std::vector<std::string> m_sourceLines;
     std::vector<Instruction> m_instructionList;
+    /// Literal arguments of all instructions, see Instruction::literalOffset().
+    std::vector<uint16_t> m_literalPool;
+    std::vector<std::string> m_symbols;
+    std::unordered_map<std::string, uint32_t> m_symbolIds;
     std::map<std::string, uint16_t> m_subroutineAddresses;
     std::map<std::string, Opcode> m_subroutineCommands;
     int m_maxBlock = 0;
     std::stack<int> m_openBlocks;
     std::stack<BlockType> m_openBlockTypes;
+    bool m_collectDiagnostics = false;
+    std::vector<Diagnostic> m_diagnostics;
 };
 }  // namespace Maestro
@@ -0,0 +1,275 @@
+#include "ScriptArtifact.h"
+
+#include <cstring>
+#include <fstream>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Maestro {
+const char ARTIFACT_MAGIC[4] = {'M', 'S', 'C', 'A'};
+
+enum ArtifactFlags : uint16_t { MINI_MAESTRO = 1, SOURCE_MAP = 2, SYMBOLS = 4 };
+
+const size_t SOURCE_MAP_ENTRY_SIZE = 8;
+
+uint32_t readLittleEndian(const uint8_t* data, int size) {
+    uint32_t value = 0;
+    for (int i = 0; i < size; i++) {
+        value |= uint32_t(data[i]) << (8 * i);
+    }
+    return value;
+}
+
+void writeLittleEndian(uint8_t* data, uint32_t value, int size) {
+    for (int i = 0; i < size; i++) {
+        data[i] = uint8_t(value >> (8 * i));
+    }
+}
+
+void appendLittleEndian(std::vector<uint8_t>& data, uint32_t value, int size) {
+    data.resize(data.size() + size_t(size));
+    writeLittleEndian(&data[data.size() - size_t(size)], value, size);
+}
+
+std::vector<uint8_t> ScriptArtifact::serialize(const Program& program, bool isMiniMaestro, bool includeSourceMap, bool includeSymbols) {
+    const std::vector<uint8_t> bytecode = program.getByteList();
+    const std::array<uint16_t, 128> subroutineTable = program.getSubroutineTable();
+
+    std::vector<uint8_t> artifact(HEADER_SIZE, 0);
+    std::memcpy(&artifact[0], ARTIFACT_MAGIC, sizeof(ARTIFACT_MAGIC));
+    writeLittleEndian(&artifact[4], VERSION, 2);
+    writeLittleEndian(&artifact[8], Program::computeCRC(subroutineTable, bytecode.data(), bytecode.size()), 2);
+    writeLittleEndian(&artifact[12], uint32_t(bytecode.size()), 4);
+    for (size_t i = 0; i < subroutineTable.size(); i++) {
+        writeLittleEndian(&artifact[32 + 2 * i], subroutineTable[i], 2);
+    }
+    artifact.insert(artifact.end(), bytecode.begin(), bytecode.end());
+
+    uint16_t flags = isMiniMaestro ? MINI_MAESTRO : 0;
+    if (includeSourceMap) {
+        const std::vector<SourceLocation> sourceMap = program.getSourceMap();
+        artifact.resize((artifact.size() + 3) & ~size_t(3));
+        writeLittleEndian(&artifact[16], uint32_t(artifact.size()), 4);
+        writeLittleEndian(&artifact[20], uint32_t(sourceMap.size()), 4);
+        for (const SourceLocation& location : sourceMap) {
+            appendLittleEndian(artifact, location.address, 2);
+            appendLittleEndian(artifact, uint32_t(location.columnNumber), 2);
+            appendLittleEndian(artifact, uint32_t(location.lineNumber), 4);
+        }
+        flags |= SOURCE_MAP;
+    }
+    if (includeSymbols) {
+        const std::map<std::string, uint8_t> numbers = program.getSubroutineNumbers();
+        const size_t start = artifact.size();
+        for (const auto& subroutine : program.getSubroutineAddresses()) {
+            const auto number = numbers.find(subroutine.first);
+            appendLittleEndian(artifact, subroutine.second, 2);
+            appendLittleEndian(artifact, (number != numbers.end()) ? number->second : 0xFF, 1);
+            appendLittleEndian(artifact, uint32_t(subroutine.first.size()), 2);
+            artifact.insert(artifact.end(), subroutine.first.begin(), subroutine.first.end());
+        }
+        writeLittleEndian(&artifact[24], uint32_t(start), 4);
+        writeLittleEndian(&artifact[28], uint32_t(artifact.size() - start), 4);
+        flags |= SYMBOLS;
+    }
+    writeLittleEndian(&artifact[6], flags, 2);
+    return artifact;
+}
+
+void ScriptArtifact::write(const std::string& path, const Program& program, bool isMiniMaestro, bool includeSourceMap, bool includeSymbols) {
+    const std::vector<uint8_t> artifact = serialize(program, isMiniMaestro, includeSourceMap, includeSymbols);
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(artifact.data()), std::streamsize(artifact.size()));
+    if (!file.flush()) {
+        throw "Could not write " + path + ".";
+    }
+}
+
+ScriptArtifact::ScriptArtifact(const std::string& path) {
+#ifdef _WIN32
+    const HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        throw "Could not open " + path + ".";
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart < LONGLONG(HEADER_SIZE)) {
+        CloseHandle(file);
+        throw path + " is not a Maestro script artifact.";
+    }
+    const HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+    const void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    if (view == nullptr) {
+        if (mapping) {
+            CloseHandle(mapping);
+        }
+        throw "Could not map " + path + " into memory.";
+    }
+    m_mapping = mapping;
+    m_data = static_cast<const uint8_t*>(view);
+    m_size = size_t(size.QuadPart);
+#else
+    const int file = open(path.c_str(), O_RDONLY);
+    if (file < 0) {
+        throw "Could not open " + path + ".";
+    }
+    struct stat status;
+    if (fstat(file, &status) != 0 || status.st_size < off_t(HEADER_SIZE)) {
+        close(file);
+        throw path + " is not a Maestro script artifact.";
+    }
+    void* view = mmap(nullptr, size_t(status.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (view == MAP_FAILED) {
+        throw "Could not map " + path + " into memory.";
+    }
+    m_mapping = view;
+    m_data = static_cast<const uint8_t*>(view);
+    m_size = size_t(status.st_size);
+#endif
+    try {
+        validate();
+    } catch (...) {
+        unmap();
+        throw;
+    }
+}
+
+ScriptArtifact::ScriptArtifact(const uint8_t* data, size_t size) : m_data(data), m_size(size) { validate(); }
+
+ScriptArtifact::ScriptArtifact(ScriptArtifact&& other)
+    : m_data(other.m_data), m_size(other.m_size), m_bytecodeSize(other.m_bytecodeSize), m_mapping(other.m_mapping) {
+    other.m_mapping = nullptr;
+}
+
+ScriptArtifact& ScriptArtifact::operator=(ScriptArtifact&& other) {
+    if (this != &other) {
+        unmap();
+        m_data = other.m_data;
+        m_size = other.m_size;
+        m_bytecodeSize = other.m_bytecodeSize;
+        m_mapping = other.m_mapping;
+        other.m_mapping = nullptr;
+    }
+    return *this;
+}
+
+ScriptArtifact::~ScriptArtifact() { unmap(); }
+
+void ScriptArtifact::unmap() {
+    if (m_mapping == nullptr) {
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(m_data);
+    CloseHandle(m_mapping);
+#else
+    munmap(m_mapping, m_size);
+#endif
+    m_mapping = nullptr;
+}
+
+void ScriptArtifact::validate() {
+    if (m_size < HEADER_SIZE || std::memcmp(m_data, ARTIFACT_MAGIC, sizeof(ARTIFACT_MAGIC)) != 0) {
+        throw "This is not a Maestro script artifact.";
+    }
+    const uint32_t version = readLittleEndian(m_data + 4, 2);
+    if (version != VERSION) {
+        throw "Unsupported script artifact version " + std::to_string(version) + ".";
+    }
+    // Sections are checked in 64 bits so that no size can wrap around.
+    auto fits = [this](uint64_t offset, uint64_t size) { return offset >= HEADER_SIZE && offset + size <= m_size; };
+    m_bytecodeSize = readLittleEndian(m_data + 12, 4);
+    if (!fits(HEADER_SIZE, m_bytecodeSize)) {
+        throw "The script artifact is truncated.";
+    }
+    if (hasSourceMap() && !fits(readLittleEndian(m_data + 16, 4), uint64_t(readLittleEndian(m_data + 20, 4)) * SOURCE_MAP_ENTRY_SIZE)) {
+        throw "The source map of the script artifact is truncated.";
+    }
+    if (hasSymbols()) {
+        const uint32_t offset = readLittleEndian(m_data + 24, 4);
+        const uint32_t size = readLittleEndian(m_data + 28, 4);
+        if (!fits(offset, size)) {
+            throw "The symbols of the script artifact are truncated.";
+        }
+        for (size_t position = 0; position < size;) {
+            if (size - position < 5 || size - position - 5 < readLittleEndian(m_data + offset + position + 3, 2)) {
+                throw "The symbols of the script artifact are truncated.";
+            }
+            position += 5 + readLittleEndian(m_data + offset + position + 3, 2);
+        }
+    }
+    if (Program::computeCRC(getSubroutineTable(), getBytecode(), m_bytecodeSize) != getCRC()) {
+        throw "The CRC of the script artifact does not match its content.";
+    }
+}
+
+bool ScriptArtifact::isMiniMaestro() const { return (readLittleEndian(m_data + 6, 2) & MINI_MAESTRO) != 0; }
+
+bool ScriptArtifact::hasSourceMap() const { return (readLittleEndian(m_data + 6, 2) & SOURCE_MAP) != 0; }
+
+bool ScriptArtifact::hasSymbols() const { return (readLittleEndian(m_data + 6, 2) & SYMBOLS) != 0; }
+
+uint16_t ScriptArtifact::getCRC() const { return uint16_t(readLittleEndian(m_data + 8, 2)); }
+
+std::array<uint16_t, 128> ScriptArtifact::getSubroutineTable() const {
+    std::array<uint16_t, 128> table;
+    for (size_t i = 0; i < table.size(); i++) {
+        table[i] = uint16_t(readLittleEndian(m_data + 32 + 2 * i, 2));
+    }
+    return table;
+}
+
+std::vector<SourceLocation> ScriptArtifact::getSourceMap() const {
+    std::vector<SourceLocation> sourceMap;
+    if (!hasSourceMap()) {
+        return sourceMap;
+    }
+    const uint8_t* entry = m_data + readLittleEndian(m_data + 16, 4);
+    const uint32_t count = readLittleEndian(m_data + 20, 4);
+    for (uint32_t i = 0; i < count; i++, entry += SOURCE_MAP_ENTRY_SIZE) {
+        sourceMap.push_back(SourceLocation{uint16_t(readLittleEndian(entry, 2)), int(readLittleEndian(entry + 4, 4)), int(readLittleEndian(entry + 2, 2))});
+    }
+    return sourceMap;
+}
+
+std::map<std::string, uint16_t> ScriptArtifact::getSubroutineAddresses() const {
+    std::map<std::string, uint16_t> addresses;
+    if (!hasSymbols()) {
+        return addresses;
+    }
+    const uint8_t* symbols = m_data + readLittleEndian(m_data + 24, 4);
+    const uint32_t size = readLittleEndian(m_data + 28, 4);
+    for (size_t position = 0; position < size;) {
+        const uint32_t length = readLittleEndian(symbols + position + 3, 2);
+        addresses[std::string(reinterpret_cast<const char*>(symbols + position + 5), length)] = uint16_t(readLittleEndian(symbols + position, 2));
+        position += 5 + length;
+    }
+    return addresses;
+}
+
+std::map<std::string, uint8_t> ScriptArtifact::getSubroutineNumbers() const {
+    std::map<std::string, uint8_t> numbers;
+    if (!hasSymbols()) {
+        return numbers;
+    }
+    const uint8_t* symbols = m_data + readLittleEndian(m_data + 24, 4);
+    const uint32_t size = readLittleEndian(m_data + 28, 4);
+    for (size_t position = 0; position < size;) {
+        const uint32_t length = readLittleEndian(symbols + position + 3, 2);
+        if (symbols[position + 2] != 0xFF) {
+            numbers[std::string(reinterpret_cast<const char*>(symbols + position + 5), length)] = symbols[position + 2];
+        }
+        position += 5 + length;
+    }
+    return numbers;
+}
+}  // namespace Maestro
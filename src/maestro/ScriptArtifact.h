@@ -0,0 +1,88 @@
+#pragma once
+
+#include <maestro/Program.h>
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace Maestro {
+
+/// A compiled script stored in a binary file, so that it can be loaded
+/// without the source or the compiler.
+///
+/// The file is mapped into memory and the bytecode is used in place, e.g.
+/// with Device::writeScript(getBytecode(), getBytecodeSize()).  Layout, all
+/// integers little-endian:
+///
+///     offset  size  content
+///          0     4  magic "MSCA"
+///          4     2  format version
+///          6     2  flags: 1 = Mini Maestro, 2 = source map, 4 = symbols
+///          8     2  CRC, as computed by Program::getCRC()
+///         10     2  reserved (0)
+///         12     4  bytecode size
+///         16     4  source map offset
+///         20     4  number of source map entries
+///         24     4  symbols offset
+///         28     4  symbols size in bytes
+///         32   256  subroutine table, 128 addresses
+///        288     n  bytecode
+///
+/// A source map entry is 8 bytes: address (2), column (2) and line (4).  A
+/// symbol is the subroutine address (2), its number or 255 if it is called
+/// with CALL (1), the length of the name (2) and the name.
+class ScriptArtifact {
+   public:
+    static const uint16_t VERSION = 1;
+
+    /// Returns the artifact of a compiled program.
+    static std::vector<uint8_t> serialize(const Program& program, bool isMiniMaestro, bool includeSourceMap = true, bool includeSymbols = true);
+
+    /// Writes the artifact of a compiled program to a file.
+    static void write(const std::string& path, const Program& program, bool isMiniMaestro, bool includeSourceMap = true, bool includeSymbols = true);
+
+    /// Maps an artifact file into memory.  Throws if it is not a valid artifact.
+    explicit ScriptArtifact(const std::string& path);
+
+    /// Reads an artifact already in memory, which must outlive this object.
+    ScriptArtifact(const uint8_t* data, size_t size);
+
+    ScriptArtifact(ScriptArtifact&& other);
+    ScriptArtifact& operator=(ScriptArtifact&& other);
+    ScriptArtifact(const ScriptArtifact&) = delete;
+    ScriptArtifact& operator=(const ScriptArtifact&) = delete;
+    ~ScriptArtifact();
+
+    bool isMiniMaestro() const;
+    uint16_t getCRC() const;
+    std::array<uint16_t, 128> getSubroutineTable() const;
+
+    /// The bytecode, in the mapped file.
+    const uint8_t* getBytecode() const { return m_data + HEADER_SIZE; }
+    size_t getBytecodeSize() const { return m_bytecodeSize; }
+
+    bool hasSourceMap() const;
+    std::vector<SourceLocation> getSourceMap() const;
+
+    bool hasSymbols() const;
+    /// Same as Program::getSubroutineAddresses(); empty without symbols.
+    std::map<std::string, uint16_t> getSubroutineAddresses() const;
+    /// Same as Program::getSubroutineNumbers(); empty without symbols.
+    std::map<std::string, uint8_t> getSubroutineNumbers() const;
+
+   private:
+    static const size_t HEADER_SIZE = 288;
+
+    void validate();
+    void unmap();
+
+    const uint8_t* m_data = nullptr;
+    size_t m_size = 0;
+    size_t m_bytecodeSize = 0;
+    /// Platform handle of the mapping, null when the data is not mapped by this object.
+    void* m_mapping = nullptr;
+};
+}  // namespace Maestro
@@ -0,0 +1,150 @@
+#include "SequenceCompiler.h"
+
+#include <algorithm>
+#include <cctype>
+#include <map>
+#include <set>
+#include <sstream>
+
+#include "Opcode.h"
+
+namespace Maestro {
+/// Largest value of a script literal, and so of a single DELAY.
+const uint32_t MAX_LITERAL = 32767;
+
+void requireLiteralRange(int value, const std::string& what, const std::string& sequence) {
+    if (value < 0 || uint32_t(value) > MAX_LITERAL) {
+        throw "The " + what + " " + std::to_string(value) + " in sequence " + sequence + " is not in the allowed range of 0 to " +
+            std::to_string(MAX_LITERAL) + ".";
+    }
+}
+
+SequenceCompiler::SequenceCompiler(bool isMiniMaestro) : m_isMiniMaestro(isMiniMaestro) {}
+
+void SequenceCompiler::addSequence(const std::string& name, const std::vector<Keyframe>& frames, bool loop) {
+    if (name.empty() || std::isdigit(static_cast<unsigned char>(name[0])) ||
+        std::any_of(name.begin(), name.end(), [](char c) { return !std::isalnum(static_cast<unsigned char>(c)) && c != '_'; })) {
+        throw "Sequence name \"" + name + "\" must be made of letters, digits and underscores, and not start with a digit.";
+    }
+    std::string upperName = name;
+    std::transform(upperName.begin(), upperName.end(), upperName.begin(), ::toupper);
+    if (upperName.compare(0, 6, "FRAME_") == 0) {
+        throw "Sequence name \"" + name + "\" is reserved for the frame subroutines.";
+    }
+    for (const Sequence& sequence : m_sequences) {
+        std::string other = sequence.name;
+        std::transform(other.begin(), other.end(), other.begin(), ::toupper);
+        if (other == upperName) {
+            throw "Sequence " + name + " is already defined.";
+        }
+    }
+    if (frames.empty()) {
+        throw "Sequence " + name + " has no frames.";
+    }
+
+    const int channelCount = m_isMiniMaestro ? 24 : 6;
+    for (const Keyframe& frame : frames) {
+        std::set<uint8_t> channels;
+        for (const ChannelTarget& target : frame.targets) {
+            if (target.channel >= channelCount) {
+                throw "Channel " + std::to_string(target.channel) + " in sequence " + name + " does not exist on this Maestro.";
+            }
+            if (!channels.insert(target.channel).second) {
+                throw "Channel " + std::to_string(target.channel) + " has two targets in the same frame of sequence " + name + ".";
+            }
+            requireLiteralRange(target.target, "target", name);
+            if (target.speed >= 0) {
+                requireLiteralRange(target.speed, "speed", name);
+            }
+            if (target.acceleration >= 0) {
+                requireLiteralRange(target.acceleration, "acceleration", name);
+            }
+        }
+    }
+    m_sequences.push_back(Sequence{name, frames, loop});
+}
+
+std::string SequenceCompiler::getFrameSubroutineName(const std::vector<uint8_t>& channels) {
+    std::string name = "frame";
+    for (uint8_t channel : channels) {
+        name += "_" + std::to_string(channel);
+    }
+    return name;
+}
+
+std::string SequenceCompiler::toScript() const {
+    // The frame arguments, and the duration below them, must fit on the stack.
+    const size_t maxTargetsPerCall = size_t(m_isMiniMaestro ? MINI_MAESTRO_STACK_SIZE : MICRO_MAESTRO_STACK_SIZE) - 1;
+
+    std::ostringstream script;
+    std::ostringstream frameSubroutines;
+    std::set<std::string> definedFrames;
+    // The script does nothing until a sequence is started.
+    script << "quit\n";
+    for (const Sequence& sequence : m_sequences) {
+        script << "sub " << sequence.name << "\n";
+        if (sequence.loop) {
+            script << "  begin\n";
+        }
+        // Limits set by this sequence, so that unchanged ones are not repeated.
+        std::map<uint8_t, int> speeds;
+        std::map<uint8_t, int> accelerations;
+        for (size_t i = 0; i < sequence.frames.size(); i++) {
+            const Keyframe& frame = sequence.frames[i];
+            std::vector<ChannelTarget> targets = frame.targets;
+            std::sort(targets.begin(), targets.end(), [](const ChannelTarget& a, const ChannelTarget& b) { return a.channel < b.channel; });
+
+            script << "  # frame " << i << "\n";
+            for (const ChannelTarget& target : targets) {
+                if (target.speed >= 0 && (speeds.count(target.channel) == 0 || speeds[target.channel] != target.speed)) {
+                    script << "  " << target.speed << " " << int(target.channel) << " speed\n";
+                    speeds[target.channel] = target.speed;
+                }
+                if (target.acceleration >= 0 && (accelerations.count(target.channel) == 0 || accelerations[target.channel] != target.acceleration)) {
+                    script << "  " << target.acceleration << " " << int(target.channel) << " acceleration\n";
+                    accelerations[target.channel] = target.acceleration;
+                }
+            }
+
+            uint32_t duration = frame.duration;
+            script << "  " << std::min(duration, MAX_LITERAL);
+            duration -= std::min(duration, MAX_LITERAL);
+            for (size_t first = 0; first < targets.size(); first += maxTargetsPerCall) {
+                const size_t last = std::min(targets.size(), first + maxTargetsPerCall);
+                std::vector<uint8_t> channels;
+                for (size_t j = first; j < last; j++) {
+                    script << " " << targets[j].target;
+                    channels.push_back(targets[j].channel);
+                }
+                const std::string name = getFrameSubroutineName(channels);
+                script << " " << name << (last < targets.size() ? "\n " : "");
+                if (definedFrames.insert(name).second) {
+                    frameSubroutines << "sub " << name << "\n ";
+                    for (auto channel = channels.rbegin(); channel != channels.rend(); ++channel) {
+                        frameSubroutines << " " << int(*channel) << " servo";
+                    }
+                    frameSubroutines << "\n  return\n";
+                }
+            }
+            script << " delay\n";
+            for (; duration > 0; duration -= std::min(duration, MAX_LITERAL)) {
+                script << "  " << std::min(duration, MAX_LITERAL) << " delay\n";
+            }
+        }
+        script << (sequence.loop ? "  repeat\n" : "  quit\n");
+    }
+    script << frameSubroutines.str();
+    return script.str();
+}
+
+Program SequenceCompiler::compile() const {
+    // The one-byte call opcodes go to the frame subroutines, while the
+    // sequences keep numbers in definition order.
+    CompileOptions options;
+    options.allocateSubroutinesByCallCount = true;
+    for (const Sequence& sequence : m_sequences) {
+        options.pinnedSubroutines.insert(sequence.name);
+    }
+    return Program(toScript(), m_isMiniMaestro, options);
+}
+}  // namespace Maestro
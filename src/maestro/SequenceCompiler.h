@@ -0,0 +1,69 @@
+#pragma once
+
+#include <maestro/Program.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Maestro {
+
+/// Target of one channel in a keyframe.  \a speed and \a acceleration limit
+/// the move to the target; a negative value leaves the limit of the channel
+/// unchanged.
+struct ChannelTarget {
+    ChannelTarget(uint8_t channel, uint16_t target, int speed = -1, int acceleration = -1)
+        : channel(channel), target(target), speed(speed), acceleration(acceleration) {}
+
+    uint8_t channel;
+    uint16_t target;
+    int speed;
+    int acceleration;
+};
+
+/// The targets set at the start of a frame, then the time in milliseconds
+/// until the next frame starts.
+struct Keyframe {
+    std::vector<ChannelTarget> targets;
+    uint32_t duration;
+};
+
+/// Compiles keyframe sequences into a script, so that a motion is played by
+/// the device instead of being streamed with Device::setTarget().
+///
+/// Each sequence becomes a subroutine, started with
+/// Device::restartScriptAtSubroutine().  It ends with QUIT, or loops forever.
+/// The targets of a frame are pushed in one literal run and set by a
+/// subroutine shared by all the frames that move the same channels; a frame
+/// with more channels than fit on the stack is split in several calls.
+/// Speed and acceleration are only set when they change within a sequence.
+class SequenceCompiler {
+   public:
+    explicit SequenceCompiler(bool isMiniMaestro);
+
+    /// Adds a sequence named \a name.  When \a loop is set, the sequence is
+    /// repeated until the script is stopped.
+    void addSequence(const std::string& name, const std::vector<Keyframe>& frames, bool loop = false);
+
+    /// Returns the script source.  Its main code is a QUIT, so that the
+    /// script does nothing until a sequence is started.  It can follow other
+    /// code, as long as that code defines no subroutine.
+    std::string toScript() const;
+
+    /// Compiles the script.  Program::getSubroutineNumbers() gives the number
+    /// of each sequence.
+    Program compile() const;
+
+   private:
+    struct Sequence {
+        std::string name;
+        std::vector<Keyframe> frames;
+        bool loop;
+    };
+
+    static std::string getFrameSubroutineName(const std::vector<uint8_t>& channels);
+
+    bool m_isMiniMaestro;
+    std::vector<Sequence> m_sequences;
+};
+}  // namespace Maestro
@@ -0,0 +1,393 @@
+#include "SerialTransport.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#endif
+
+namespace Maestro {
+enum SerialCommand : uint8_t {
+    COMMAND_SET_TARGET = 0x84,
+    COMMAND_SET_SPEED = 0x87,
+    COMMAND_SET_ACCELERATION = 0x89,
+    COMMAND_SET_PWM = 0x8A,
+    COMMAND_GET_POSITION = 0x90,
+    COMMAND_GET_MOVING_STATE = 0x93,
+    COMMAND_SET_MULTIPLE_TARGETS = 0x9F,
+    COMMAND_GET_ERRORS = 0xA1,
+    COMMAND_GO_HOME = 0xA2,
+    COMMAND_STOP_SCRIPT = 0xA4,
+    COMMAND_RESTART_SCRIPT_AT_SUBROUTINE = 0xA7,
+    COMMAND_RESTART_SCRIPT_AT_SUBROUTINE_WITH_PARAMETER = 0xA8,
+    COMMAND_GET_SCRIPT_STATUS = 0xAE,
+};
+
+const uint8_t POLOLU_PROTOCOL_START = 0xAA;
+const uint8_t MINI_SSC_START = 0xFF;
+
+/// Table of the CRC-7: table[i] is the CRC register after shifting in the byte i.
+struct Crc7Table {
+    uint8_t table[256];
+
+    Crc7Table() {
+        const uint8_t CRC7_POLY = 0x91;
+        for (int i = 0; i < 256; i++) {
+            uint8_t crc = uint8_t(i);
+            for (int bit = 0; bit < 8; bit++) {
+                if (crc & 1) {
+                    crc ^= CRC7_POLY;
+                }
+                crc >>= 1;
+            }
+            table[i] = crc;
+        }
+    }
+};
+
+/// Writes the low and high 7 bits of \a value, as the data bytes of the protocol need.
+uint8_t* putWord(uint8_t* data, uint16_t value) {
+    data[0] = uint8_t(value & 0x7F);
+    data[1] = uint8_t((value >> 7) & 0x7F);
+    return data + 2;
+}
+
+/// A data byte has its high bit clear: a larger channel would be read as a command byte.
+void checkChannel(uint8_t channel) {
+    if (channel > 127) {
+        throw "The channel number " + std::to_string(channel) + " is not in the allowed range of 0 to 127.";
+    }
+}
+
+#ifndef _WIN32
+speed_t getBaudRateConstant(uint32_t baudRate) {
+    switch (baudRate) {
+        case 1200:
+            return B1200;
+        case 2400:
+            return B2400;
+        case 4800:
+            return B4800;
+        case 9600:
+            return B9600;
+        case 19200:
+            return B19200;
+        case 38400:
+            return B38400;
+        case 57600:
+            return B57600;
+        case 115200:
+            return B115200;
+#ifdef B230400
+        case 230400:
+            return B230400;
+#endif
+        default:
+            throw "Unsupported baud rate " + std::to_string(baudRate) + ".";
+    }
+}
+#endif
+
+uint8_t SerialTransport::computeCRC7(const uint8_t* data, size_t size) {
+    static const Crc7Table crc7;
+    uint8_t crc = 0;
+    for (size_t i = 0; i < size; i++) {
+        crc = crc7.table[crc ^ data[i]];
+    }
+    return crc;
+}
+
+#ifdef _WIN32
+SerialTransport::SerialTransport(const std::string& path, uint32_t baudRate) {
+    // COM10 and above are only reachable through the device namespace.
+    const std::string name = (path.compare(0, 4, "\\\\.\\") == 0) ? path : "\\\\.\\" + path;
+    m_handle = CreateFileA(name.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, 0, nullptr);
+    if (m_handle == INVALID_HANDLE_VALUE) {
+        throw "Cannot open " + path + ".";
+    }
+    DCB settings;
+    memset(&settings, 0, sizeof(settings));
+    settings.DCBlength = sizeof(settings);
+    GetCommState(m_handle, &settings);
+    settings.BaudRate = baudRate;
+    settings.ByteSize = 8;
+    settings.Parity = NOPARITY;
+    settings.StopBits = ONESTOPBIT;
+    settings.fBinary = TRUE;
+    settings.fOutxCtsFlow = FALSE;
+    settings.fOutxDsrFlow = FALSE;
+    settings.fDtrControl = DTR_CONTROL_ENABLE;
+    settings.fRtsControl = RTS_CONTROL_ENABLE;
+    settings.fOutX = FALSE;
+    settings.fInX = FALSE;
+    if (!SetCommState(m_handle, &settings)) {
+        CloseHandle(m_handle);
+        throw "Cannot configure " + path + ".";
+    }
+}
+
+SerialTransport::~SerialTransport() {
+    try {
+        flush();
+    } catch (...) {
+    }
+    CloseHandle(m_handle);
+}
+
+void SerialTransport::write(const uint8_t* data, size_t size) {
+    while (size > 0) {
+        DWORD written = 0;
+        if (!WriteFile(m_handle, data, DWORD(size), &written, nullptr)) {
+            throw std::string("Cannot write to the serial port.");
+        }
+        data += written;
+        size -= written;
+    }
+}
+
+void SerialTransport::read(uint8_t* data, size_t size) {
+    COMMTIMEOUTS timeouts = {0};
+    timeouts.ReadTotalTimeoutConstant = DWORD(m_timeout.count());
+    SetCommTimeouts(m_handle, &timeouts);
+    DWORD received = 0;
+    if (!ReadFile(m_handle, data, DWORD(size), &received, nullptr)) {
+        throw std::string("Cannot read from the serial port.");
+    }
+    if (received < size) {
+        throw std::string("The Maestro did not answer.");
+    }
+}
+#else
+SerialTransport::SerialTransport(const std::string& path, uint32_t baudRate) : m_ownsFileDescriptor(true) {
+    const speed_t speed = getBaudRateConstant(baudRate);
+    m_fileDescriptor = open(path.c_str(), O_RDWR | O_NOCTTY);
+    if (m_fileDescriptor < 0) {
+        throw "Cannot open " + path + ": " + strerror(errno) + ".";
+    }
+    termios settings;
+    if (tcgetattr(m_fileDescriptor, &settings) != 0) {
+        close(m_fileDescriptor);
+        throw path + " is not a serial port.";
+    }
+    cfmakeraw(&settings);
+    settings.c_cflag |= CLOCAL | CREAD;
+    settings.c_cflag &= ~CRTSCTS;
+    settings.c_cc[VMIN] = 0;
+    settings.c_cc[VTIME] = 0;
+    cfsetispeed(&settings, speed);
+    cfsetospeed(&settings, speed);
+    if (tcsetattr(m_fileDescriptor, TCSANOW, &settings) != 0) {
+        close(m_fileDescriptor);
+        throw "Cannot configure " + path + ".";
+    }
+}
+
+SerialTransport::SerialTransport(int fileDescriptor) : m_fileDescriptor(fileDescriptor), m_ownsFileDescriptor(false) {}
+
+SerialTransport::~SerialTransport() {
+    try {
+        flush();
+    } catch (...) {
+    }
+    if (m_ownsFileDescriptor) {
+        close(m_fileDescriptor);
+    }
+}
+
+void SerialTransport::write(const uint8_t* data, size_t size) {
+    while (size > 0) {
+        const ssize_t written = ::write(m_fileDescriptor, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::string("Cannot write to the serial port: ") + strerror(errno) + ".";
+        }
+        data += written;
+        size -= size_t(written);
+    }
+}
+
+void SerialTransport::read(uint8_t* data, size_t size) {
+    const auto deadline = std::chrono::steady_clock::now() + m_timeout;
+    while (size > 0) {
+        const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        pollfd descriptor = {m_fileDescriptor, POLLIN, 0};
+        const int ready = poll(&descriptor, 1, int(std::max<std::chrono::milliseconds::rep>(remaining.count(), 0)));
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready <= 0) {
+            throw std::string("The Maestro did not answer.");
+        }
+        const ssize_t received = ::read(m_fileDescriptor, data, size);
+        if (received < 0 && errno != EINTR && errno != EAGAIN) {
+            throw std::string("Cannot read from the serial port: ") + strerror(errno) + ".";
+        }
+        if (received > 0) {
+            data += received;
+            size -= size_t(received);
+        }
+    }
+}
+#endif
+
+void SerialTransport::setBuffered(bool buffered) {
+    m_buffered = buffered;
+    if (!buffered) {
+        flush();
+    }
+}
+
+void SerialTransport::flush() {
+    if (m_bufferSize > 0) {
+        // Emptied first, so that a failed write does not send the commands twice.
+        const size_t size = m_bufferSize;
+        m_bufferSize = 0;
+        write(m_buffer.data(), size);
+    }
+}
+
+void SerialTransport::send(uint8_t deviceNumber, uint8_t command, const uint8_t* data, size_t size) {
+    if (m_bufferSize + MAX_COMMAND_SIZE > m_buffer.size()) {
+        flush();
+    }
+    uint8_t* const start = m_buffer.data() + m_bufferSize;
+    uint8_t* end = start;
+    if (m_protocol == Protocol::POLOLU) {
+        if (deviceNumber > 127) {
+            throw "The device number " + std::to_string(deviceNumber) + " is not in the allowed range of 0 to 127.";
+        }
+        *end++ = POLOLU_PROTOCOL_START;
+        *end++ = deviceNumber;
+        // The Pololu protocol sends the command byte without its high bit.
+        *end++ = uint8_t(command & 0x7F);
+    } else {
+        *end++ = command;
+    }
+    end = std::copy(data, data + size, end);
+    if (m_crcEnabled) {
+        *end = computeCRC7(start, size_t(end - start));
+        end++;
+    }
+    m_bufferSize += size_t(end - start);
+    if (!m_buffered) {
+        flush();
+    }
+}
+
+void SerialTransport::query(uint8_t deviceNumber, uint8_t command, const uint8_t* data, size_t size, uint8_t* answer, size_t answerSize) {
+#ifdef _WIN32
+    PurgeComm(m_handle, PURGE_RXCLEAR);
+#else
+    // Drops the late answer of a query that timed out.
+    tcflush(m_fileDescriptor, TCIFLUSH);
+#endif
+    send(deviceNumber, command, data, size);
+    flush();
+    read(answer, answerSize);
+}
+
+void SerialTransport::setTarget(uint8_t deviceNumber, uint8_t channel, uint16_t target) {
+    checkChannel(channel);
+    uint8_t data[3] = {channel};
+    putWord(data + 1, target);
+    send(deviceNumber, COMMAND_SET_TARGET, data, sizeof(data));
+}
+
+void SerialTransport::setTargets(uint8_t deviceNumber, uint8_t firstChannel, const uint16_t* targets, size_t count) {
+    if (count == 0 || count > 24 || firstChannel + count > 24) {
+        throw "Cannot set " + std::to_string(count) + " targets from channel " + std::to_string(firstChannel) + ": a Maestro has at most 24 channels.";
+    }
+    uint8_t data[2 + 2 * 24] = {uint8_t(count), firstChannel};
+    uint8_t* end = data + 2;
+    for (size_t i = 0; i < count; i++) {
+        end = putWord(end, targets[i]);
+    }
+    send(deviceNumber, COMMAND_SET_MULTIPLE_TARGETS, data, size_t(end - data));
+}
+
+void SerialTransport::setSpeed(uint8_t deviceNumber, uint8_t channel, uint16_t speed) {
+    checkChannel(channel);
+    uint8_t data[3] = {channel};
+    putWord(data + 1, speed);
+    send(deviceNumber, COMMAND_SET_SPEED, data, sizeof(data));
+}
+
+void SerialTransport::setAcceleration(uint8_t deviceNumber, uint8_t channel, uint16_t acceleration) {
+    checkChannel(channel);
+    uint8_t data[3] = {channel};
+    putWord(data + 1, acceleration);
+    send(deviceNumber, COMMAND_SET_ACCELERATION, data, sizeof(data));
+}
+
+void SerialTransport::setPWM(uint8_t deviceNumber, uint16_t onTime, uint16_t period) {
+    uint8_t data[4];
+    putWord(putWord(data, onTime), period);
+    send(deviceNumber, COMMAND_SET_PWM, data, sizeof(data));
+}
+
+void SerialTransport::goHome(uint8_t deviceNumber) { send(deviceNumber, COMMAND_GO_HOME, nullptr, 0); }
+
+void SerialTransport::stopScript(uint8_t deviceNumber) { send(deviceNumber, COMMAND_STOP_SCRIPT, nullptr, 0); }
+
+void SerialTransport::restartScriptAtSubroutine(uint8_t deviceNumber, uint8_t subroutineNumber) {
+    const uint8_t data[1] = {uint8_t(subroutineNumber & 0x7F)};
+    send(deviceNumber, COMMAND_RESTART_SCRIPT_AT_SUBROUTINE, data, sizeof(data));
+}
+
+void SerialTransport::restartScriptAtSubroutineWithParameter(uint8_t deviceNumber, uint8_t subroutineNumber, uint16_t parameter) {
+    uint8_t data[3] = {uint8_t(subroutineNumber & 0x7F)};
+    putWord(data + 1, parameter);
+    send(deviceNumber, COMMAND_RESTART_SCRIPT_AT_SUBROUTINE_WITH_PARAMETER, data, sizeof(data));
+}
+
+uint16_t SerialTransport::getPosition(uint8_t deviceNumber, uint8_t channel) {
+    checkChannel(channel);
+    const uint8_t data[1] = {channel};
+    uint8_t answer[2];
+    query(deviceNumber, COMMAND_GET_POSITION, data, sizeof(data), answer, sizeof(answer));
+    return uint16_t(answer[0] | (answer[1] << 8));
+}
+
+bool SerialTransport::getMovingState(uint8_t deviceNumber) {
+    uint8_t answer;
+    query(deviceNumber, COMMAND_GET_MOVING_STATE, nullptr, 0, &answer, 1);
+    return answer != 0;
+}
+
+uint16_t SerialTransport::getErrors(uint8_t deviceNumber) {
+    uint8_t answer[2];
+    query(deviceNumber, COMMAND_GET_ERRORS, nullptr, 0, answer, sizeof(answer));
+    return uint16_t(answer[0] | (answer[1] << 8));
+}
+
+bool SerialTransport::isScriptRunning(uint8_t deviceNumber) {
+    uint8_t answer;
+    query(deviceNumber, COMMAND_GET_SCRIPT_STATUS, nullptr, 0, &answer, 1);
+    // The Maestro answers 0 while the script is running.
+    return answer == 0;
+}
+
+void SerialTransport::setMiniSscTarget(uint8_t servo, uint8_t position) {
+    if (servo == MINI_SSC_START || position == MINI_SSC_START) {
+        throw std::string("Mini SSC servo numbers and positions must be between 0 and 254.");
+    }
+    if (m_bufferSize + 3 > m_buffer.size()) {
+        flush();
+    }
+    m_buffer[m_bufferSize++] = MINI_SSC_START;
+    m_buffer[m_bufferSize++] = servo;
+    m_buffer[m_bufferSize++] = position;
+    if (!m_buffered) {
+        flush();
+    }
+}
+}  // namespace Maestro
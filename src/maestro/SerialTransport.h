@@ -0,0 +1,120 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace Maestro {
+
+/// Commands to Maestros through a serial port: the USB command port of a
+/// Maestro, or a UART wired to the RX line of one or several Maestros.
+///
+/// With the Pololu protocol, each command carries the serial device number
+/// of its Maestro (DeviceSettings::serialDeviceNumber), so a single port
+/// drives a daisy chain of Maestros whose serial mode is
+/// SERIAL_MODE_USB_CHAINED or one of the UART modes.  The compact protocol
+/// leaves the device number out and is obeyed by every Maestro on the line.
+/// Each command can end with the CRC-7 expected by the Maestros set with
+/// DeviceSettings::enableCrc.
+///
+/// Commands are encoded in place in a fixed output buffer.  When buffering is
+/// enabled they are sent together by flush(), by the next query, or when the
+/// buffer is full, so that a command for every device of a chain costs a
+/// single write.
+class SerialTransport {
+   public:
+    enum class Protocol { COMPACT, POLOLU };
+
+    /// The serial device number of a new Maestro.
+    static const uint8_t DEFAULT_DEVICE_NUMBER = 12;
+
+    /// Opens the serial port \a path, e.g. "/dev/ttyACM0" or "COM3".  The baud
+    /// rate only matters on a UART: the USB command port ignores it.
+    explicit SerialTransport(const std::string& path, uint32_t baudRate = 115200);
+#ifndef _WIN32
+    /// Uses the open file descriptor \a fileDescriptor, e.g. a pty, without
+    /// changing its settings.  It is not closed by the destructor.
+    explicit SerialTransport(int fileDescriptor);
+#endif
+    ~SerialTransport();
+
+    SerialTransport(const SerialTransport&) = delete;
+    SerialTransport& operator=(const SerialTransport&) = delete;
+
+    void setProtocol(Protocol protocol) { m_protocol = protocol; }
+    Protocol getProtocol() const { return m_protocol; }
+    void setCrcEnabled(bool enabled) { m_crcEnabled = enabled; }
+    bool isCrcEnabled() const { return m_crcEnabled; }
+    void setBuffered(bool buffered);
+    bool isBuffered() const { return m_buffered; }
+
+    /// How long a query waits for the answer of the Maestro.
+    void setTimeout(std::chrono::milliseconds timeout) { m_timeout = timeout; }
+
+    /// Sends the buffered commands.
+    void flush();
+
+    /// \a target is in quarter-microseconds, like Device::setTarget().
+    void setTarget(uint8_t deviceNumber, uint8_t channel, uint16_t target);
+
+    /// Sets the targets of \a count channels from \a firstChannel in a single
+    /// command.  Only the Mini Maestro supports it.
+    void setTargets(uint8_t deviceNumber, uint8_t firstChannel, const uint16_t* targets, size_t count);
+
+    void setSpeed(uint8_t deviceNumber, uint8_t channel, uint16_t speed);
+    void setAcceleration(uint8_t deviceNumber, uint8_t channel, uint16_t acceleration);
+
+    /// Only the Mini Maestro supports it.
+    void setPWM(uint8_t deviceNumber, uint16_t onTime, uint16_t period);
+    void goHome(uint8_t deviceNumber);
+    void stopScript(uint8_t deviceNumber);
+    void restartScriptAtSubroutine(uint8_t deviceNumber, uint8_t subroutineNumber);
+    void restartScriptAtSubroutineWithParameter(uint8_t deviceNumber, uint8_t subroutineNumber, uint16_t parameter);
+
+    /// The position of \a channel in quarter-microseconds.
+    uint16_t getPosition(uint8_t deviceNumber, uint8_t channel);
+
+    /// True if a servo of the Maestro is still moving to its target.
+    bool getMovingState(uint8_t deviceNumber);
+
+    /// The error flags, which are cleared by this query.
+    uint16_t getErrors(uint8_t deviceNumber);
+
+    /// True if the script is running.
+    bool isScriptRunning(uint8_t deviceNumber);
+
+    /// Mini SSC protocol: moves servo \a servo (the channel plus the
+    /// DeviceSettings::miniSscOffset of its Maestro) to \a position, from 0
+    /// to 254, relative to the neutral and range of the channel.  It has no
+    /// device number and no CRC.
+    void setMiniSscTarget(uint8_t servo, uint8_t position);
+
+    /// The CRC-7 of the serial protocol (polynomial 0x91, LSB first).
+    static uint8_t computeCRC7(const uint8_t* data, size_t size);
+
+   private:
+    /// Maximum size of a command: Set Multiple Targets for 24 channels, with
+    /// the Pololu header and the CRC.
+    static const size_t MAX_COMMAND_SIZE = 3 + 2 + 2 * 24 + 1;
+
+    void send(uint8_t deviceNumber, uint8_t command, const uint8_t* data, size_t size);
+    void query(uint8_t deviceNumber, uint8_t command, const uint8_t* data, size_t size, uint8_t* answer, size_t answerSize);
+    void write(const uint8_t* data, size_t size);
+    void read(uint8_t* data, size_t size);
+
+#ifdef _WIN32
+    void* m_handle;
+#else
+    int m_fileDescriptor;
+    bool m_ownsFileDescriptor;
+#endif
+    Protocol m_protocol = Protocol::POLOLU;
+    bool m_crcEnabled = false;
+    bool m_buffered = false;
+    std::chrono::milliseconds m_timeout = std::chrono::milliseconds(500);
+    std::array<uint8_t, 1024> m_buffer;
+    size_t m_bufferSize = 0;
+};
+}  // namespace Maestro
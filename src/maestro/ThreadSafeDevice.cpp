@@ -0,0 +1,168 @@
+#include "ThreadSafeDevice.h"
+
+#include "CommandQueue.h"
+
+#include <algorithm>
+
+namespace Maestro {
+struct ThreadSafeDevice::Queue {
+    /// A command, or a request when \a request is set.
+    struct Entry {
+        Command command;
+        Request* request;
+    };
+
+    MpscRing<Entry, QUEUE_SIZE> ring;
+};
+
+ThreadSafeDevice::ThreadSafeDevice(const Device& device)
+    : m_device(device), m_queue(new Queue()), m_stopCount(0), m_stopPosition(0), m_errorCount(0), m_waiting(false), m_closing(false) {
+    m_thread = std::thread(&ThreadSafeDevice::serve, this);
+}
+
+ThreadSafeDevice::~ThreadSafeDevice() {
+    m_closing = true;
+    wake();
+    m_thread.join();
+}
+
+void ThreadSafeDevice::send(uint8_t type, uint8_t channel, const uint16_t* values, size_t count) {
+    Queue::Entry entry = {{type, channel, uint8_t(count), {}}, nullptr};
+    std::copy(values, values + count, entry.command.values);
+    if (!m_queue->ring.push(entry)) {
+        throw "The command queue of " + m_device.getLocation() + " is full.";
+    }
+    wake();
+}
+
+void ThreadSafeDevice::submit(std::unique_ptr<Request> request) {
+    Queue::Entry entry = {{}, request.get()};
+    if (!m_queue->ring.push(entry)) {
+        throw "The command queue of " + m_device.getLocation() + " is full.";
+    }
+    request.release();
+    wake();
+}
+
+void ThreadSafeDevice::wake() {
+    // Pairs with the fence of serve(): either the thread of the device sees
+    // the call queued, or this sees it waiting.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_waiting.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_wakeUp.notify_one();
+    }
+}
+
+void ThreadSafeDevice::setTarget(uint8_t servo, uint16_t value) { send(COMMAND_SET_TARGET, servo, &value, 1); }
+
+void ThreadSafeDevice::setTargets(uint8_t firstChannel, const uint16_t* targets, size_t count) {
+    if (firstChannel + count > size_t(getNumChannels())) {
+        throw "Cannot set " + std::to_string(count) + " targets from channel " + std::to_string(firstChannel) + " on a device with " +
+            std::to_string(getNumChannels()) + " channels.";
+    }
+    send(COMMAND_SET_TARGETS, firstChannel, targets, count);
+}
+
+void ThreadSafeDevice::setTargets(uint8_t firstChannel, const std::vector<uint16_t>& targets) { setTargets(firstChannel, targets.data(), targets.size()); }
+
+void ThreadSafeDevice::setSpeed(uint8_t servo, uint16_t value) { send(COMMAND_SET_SPEED, servo, &value, 1); }
+
+void ThreadSafeDevice::setAcceleration(uint8_t servo, uint16_t value) { send(COMMAND_SET_ACCELERATION, servo, &value, 1); }
+
+void ThreadSafeDevice::clearErrors() { send(COMMAND_CLEAR_ERRORS, 0, nullptr, 0); }
+
+void ThreadSafeDevice::restartScript() { send(COMMAND_RESTART_SCRIPT, 0, nullptr, 0); }
+
+void ThreadSafeDevice::restartScriptAtSubroutine(uint8_t subroutine) { send(COMMAND_RESTART_SCRIPT_AT_SUBROUTINE, subroutine, nullptr, 0); }
+
+void ThreadSafeDevice::restartScriptAtSubroutineWithParameter(uint8_t subroutine, uint16_t parameter) {
+    send(COMMAND_RESTART_SCRIPT_AT_SUBROUTINE_WITH_PARAMETER, subroutine, &parameter, 1);
+}
+
+void ThreadSafeDevice::setScriptDone(uint8_t value) {
+    const uint16_t done = value;
+    send(COMMAND_SET_SCRIPT_DONE, 0, &done, 1);
+}
+
+void ThreadSafeDevice::setPWM(uint16_t dutyCycle, uint16_t period) {
+    const uint16_t values[2] = {dutyCycle, period};
+    send(COMMAND_SET_PWM, 0, values, 2);
+}
+
+void ThreadSafeDevice::emergencyStop() {
+    // The transfer in flight fails at once instead of delaying the stop,
+    // possibly until its timeout on a hung controller.  Cancelled before the
+    // stop is published, so that it cannot cancel the stop itself.
+    try {
+        m_device.cancel();
+    } catch (...) {
+    }
+    // Of two concurrent stops, either position may stay: the calls queued
+    // between them are concurrent with the stops anyway.
+    m_stopPosition.store(m_queue->ring.getEnqueuePosition(), std::memory_order_relaxed);
+    m_stopCount.fetch_add(1, std::memory_order_release);
+    wake();
+}
+
+void ThreadSafeDevice::serve() {
+    Queue::Entry entry;
+    uint32_t stopsMade = 0;
+    // The calls queued before the last emergency stop are dropped until the position dropUntil.
+    bool dropping = false;
+    uint32_t dropUntil = 0;
+    for (;;) {
+        const uint32_t stopCount = m_stopCount.load(std::memory_order_acquire);
+        if (stopCount != stopsMade) {
+            stopsMade = stopCount;
+            dropping = true;
+            dropUntil = m_stopPosition.load(std::memory_order_relaxed);
+            const std::vector<uint16_t> targets(getNumChannels(), 0);
+            try {
+                m_device.setTargets(0, targets);
+            } catch (const std::string&) {
+                m_errorCount++;
+            } catch (const char*) {
+                m_errorCount++;
+            }
+        }
+
+        const uint32_t position = m_queue->ring.getDequeuePosition();
+        if (m_queue->ring.pop(entry)) {
+            std::unique_ptr<Request> request(entry.request);
+            if (dropping && int32_t(position - dropUntil) < 0) {
+                if (request) {
+                    request->cancel("The call was dropped by an emergency stop.");
+                }
+                continue;
+            }
+            dropping = false;
+            if (request) {
+                request->run(m_device);
+                continue;
+            }
+            try {
+                execute(m_device, entry.command);
+            } catch (const std::string&) {
+                m_errorCount++;
+            } catch (const char*) {
+                m_errorCount++;
+            }
+            continue;
+        }
+        if (m_closing) {
+            break;
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_waiting.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        // A call being written by its producer is not waited for.
+        const bool idle = m_queue->ring.getEnqueuePosition() == m_queue->ring.getDequeuePosition();
+        if (idle && m_stopCount.load(std::memory_order_relaxed) == stopsMade && !m_closing) {
+            m_wakeUp.wait(lock);
+        }
+        m_waiting.store(false, std::memory_order_relaxed);
+    }
+}
+}  // namespace Maestro
@@ -0,0 +1,163 @@
+#pragma once
+
+#include "Device.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace Maestro {
+/**
+ * @brief A Device usable from any number of threads.
+ *
+ * A thread of its own owns the device, and makes every USB transfer.  The
+ * other threads queue their calls in a lock-free multi-producer queue: the
+ * commands return at once, and the queries wait for the answer of the thread
+ * of the device.  The calls of a thread are made in order.
+ *
+ * emergencyStop() has a lane of its own: it cancels the transfer in flight
+ * (see Device::cancel()), is made before anything still queued, and the
+ * commands queued before it are dropped, so that they do not move the servos
+ * again.  The stop is then sent after a round trip of the cancellation,
+ * except with the usbfs backend, whose single control transfers cannot be
+ * cancelled: there, a stop behind a hung transfer waits for its timeout
+ * (Device::setTimeout(), 5 s by default) at worst.
+ *
+ * Once given to a ThreadSafeDevice, a Device and its copies are only used
+ * through it.
+ */
+class ThreadSafeDevice {
+   public:
+    /// Calls queued at most.  Queuing more throws.
+    static const uint32_t QUEUE_SIZE = 1024;
+
+    /// Starts the thread owning \a device.
+    explicit ThreadSafeDevice(const Device& device);
+    /// Makes the calls still queued, and stops the thread of the device.
+    ~ThreadSafeDevice();
+
+    ThreadSafeDevice(const ThreadSafeDevice&) = delete;
+    ThreadSafeDevice& operator=(const ThreadSafeDevice&) = delete;
+
+    const std::string& getName() const { return m_device.getName(); }
+    int getNumChannels() const { return m_device.getNumChannels(); }
+    uint16_t getProductID() const { return m_device.getProductID(); }
+
+    void setTarget(uint8_t channelNumber, uint16_t target);
+    void setTargets(uint8_t firstChannel, const uint16_t* targets, size_t count);
+    void setTargets(uint8_t firstChannel, const std::vector<uint16_t>& targets);
+    void setSpeed(uint8_t channelNumber, uint16_t speed);
+    void setAcceleration(uint8_t channelNumber, uint16_t acceleration);
+    void clearErrors();
+    void restartScript();
+    void restartScriptAtSubroutine(uint8_t subroutineNumber);
+    void restartScriptAtSubroutineWithParameter(uint8_t subroutineNumber, uint16_t parameter);
+    void setScriptDone(uint8_t value);
+    void setPWM(uint16_t dutyCycle, uint16_t period);
+
+    /// Sets the target of every channel to 0, which stops its pulses, ahead
+    /// of the queued calls.  The call in flight fails as cancelled.  Never
+    /// throws, and never waits for a transfer.
+    void emergencyStop();
+
+    std::vector<Device::ServoStatus> getServoStatus() {
+        return call([](Device& device) { return device.getServoStatus(); });
+    }
+    Device::ChannelSettings getChannelSettings(uint8_t channel) {
+        return call([channel](Device& device) { return device.getChannelSettings(channel); });
+    }
+    Device::ScriptStatus getScriptStatus() {
+        return call([](Device& device) { return device.getScriptStatus(); });
+    }
+    uint16_t getScriptCRC() {
+        return call([](Device& device) { return device.getScriptCRC(); });
+    }
+
+    /**
+     * @brief Calls \a function with the device on its thread, and returns its result.
+     *
+     * Any call of Device can be made this way.  An exception escaping \a
+     * function is thrown by call(), and a call dropped by emergencyStop()
+     * throws a std::string.
+     */
+    template <typename Function>
+    auto call(Function function) -> decltype(function(std::declval<Device&>())) {
+        using Result = decltype(function(std::declval<Device&>()));
+        std::unique_ptr<Call<Result>> request(new Call<Result>(std::move(function)));
+        std::future<Result> result = request->promise.get_future();
+        submit(std::move(request));
+        return result.get();
+    }
+
+    /// Waits until the calls queued before are made.
+    void flush() {
+        call([](Device&) {});
+    }
+
+    /// The number of commands that failed.  Their errors are not thrown, since their caller did not wait.
+    uint32_t getErrorCount() const { return m_errorCount.load(std::memory_order_relaxed); }
+
+   private:
+    /// A call waiting for its result.
+    struct Request {
+        virtual ~Request() {}
+        virtual void run(Device& device) = 0;
+        virtual void cancel(const std::string& error) = 0;
+    };
+
+    template <typename Result>
+    static void fulfil(std::promise<Result>& promise, std::function<Result(Device&)>& function, Device& device) {
+        promise.set_value(function(device));
+    }
+    static void fulfil(std::promise<void>& promise, std::function<void(Device&)>& function, Device& device) {
+        function(device);
+        promise.set_value();
+    }
+
+    template <typename Result>
+    struct Call : Request {
+        explicit Call(std::function<Result(Device&)> function) : function(std::move(function)) {}
+        void run(Device& device) override {
+            try {
+                fulfil(promise, function, device);
+            } catch (...) {
+                promise.set_exception(std::current_exception());
+            }
+        }
+        void cancel(const std::string& error) override { promise.set_exception(std::make_exception_ptr(error)); }
+
+        std::function<Result(Device&)> function;
+        std::promise<Result> promise;
+    };
+
+    struct Queue;
+
+    void send(uint8_t type, uint8_t channel, const uint16_t* values, size_t count);
+    void submit(std::unique_ptr<Request> request);
+    void wake();
+    void serve();
+
+    Device m_device;
+    std::unique_ptr<Queue> m_queue;
+    /// Incremented by emergencyStop().
+    std::atomic<uint32_t> m_stopCount;
+    /// The enqueue position of the queue at the last emergency stop: the calls before it are dropped.
+    std::atomic<uint32_t> m_stopPosition;
+    std::atomic<uint32_t> m_errorCount;
+    /// Set while the thread of the device waits for calls.
+    std::atomic<bool> m_waiting;
+    std::atomic<bool> m_closing;
+    std::mutex m_mutex;
+    std::condition_variable m_wakeUp;
+    std::thread m_thread;
+};
+}  // namespace Maestro
@@ -0,0 +1,343 @@
+#include "TimingAnalysis.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+#include "Opcode.h"
+
+namespace Maestro {
+/// Both firmwares run on 48 MHz PIC18 cores, which execute one instruction
+/// cycle every 4 clock cycles.
+const uint32_t NANOSECONDS_PER_1000_CYCLES = 83333;
+/// Cycles spent fetching and dispatching any script instruction, estimated too.
+const uint32_t DISPATCH_CYCLES = 40;
+
+std::array<uint32_t, 256> TimingAnalysis::getEstimatedInstructionTimes(bool isMiniMaestro) {
+    // Cycles spent in the handler of each opcode, after dispatch.  Estimated
+    // from the work each opcode does (stack accesses, loops over the bits or
+    // the channels), since the firmware source and its timings are not public.
+    std::array<uint32_t, 256> cycles;
+    cycles.fill(0);
+    auto set = [&cycles](Opcode opcode, uint32_t count) { cycles[size_t(opcode)] = count; };
+    set(Opcode::LITERAL, 20);
+    set(Opcode::LITERAL8, 12);
+    set(Opcode::LITERAL_N, 60);
+    set(Opcode::LITERAL8_N, 40);
+    set(Opcode::RETURN, 25);
+    set(Opcode::JUMP, 15);
+    set(Opcode::JUMP_Z, 25);
+    set(Opcode::DELAY, 20);
+    set(Opcode::GET_MS, 20);
+    set(Opcode::DEPTH, 8);
+    set(Opcode::DROP, 4);
+    set(Opcode::DUP, 12);
+    set(Opcode::OVER, 14);
+    set(Opcode::PICK, 25);
+    set(Opcode::SWAP, 18);
+    set(Opcode::ROT, 30);
+    set(Opcode::ROLL, 60);
+    for (Opcode opcode : {Opcode::BITWISE_NOT, Opcode::BITWISE_AND, Opcode::BITWISE_OR, Opcode::BITWISE_XOR, Opcode::LOGICAL_NOT, Opcode::LOGICAL_AND,
+                          Opcode::LOGICAL_OR, Opcode::PLUS, Opcode::MINUS}) {
+        set(opcode, 20);
+    }
+    // Shifts loop once per bit.
+    set(Opcode::SHIFT_RIGHT, 60);
+    set(Opcode::SHIFT_LEFT, 60);
+    for (Opcode opcode : {Opcode::NEGATE, Opcode::POSITIVE, Opcode::NEGATIVE, Opcode::NONZERO}) {
+        set(opcode, 15);
+    }
+    set(Opcode::TIMES, 60);
+    set(Opcode::DIVIDE, 400);
+    set(Opcode::MOD, 400);
+    for (Opcode opcode : {Opcode::EQUALS, Opcode::NOT_EQUALS, Opcode::MIN, Opcode::MAX, Opcode::LESS_THAN, Opcode::GREATER_THAN}) {
+        set(opcode, 30);
+    }
+    set(Opcode::SERVO, 120);
+    set(Opcode::SERVO_8BIT, 200);
+    set(Opcode::SPEED, 80);
+    set(Opcode::ACCELERATION, 80);
+    set(Opcode::GET_POSITION, 60);
+    // Scans every channel: 6 on the Micro Maestro, up to 24 on the Mini.
+    set(Opcode::GET_MOVING_STATE, isMiniMaestro ? 720 : 180);
+    set(Opcode::LED_ON, 10);
+    set(Opcode::LED_OFF, 10);
+    set(Opcode::PWM, 150);
+    set(Opcode::PEEK, 30);
+    set(Opcode::POKE, 30);
+    set(Opcode::SERIAL_SEND_BYTE, 50);
+    set(Opcode::CALL, 40);
+    // One-byte calls also look up the subroutine table.
+    for (size_t opcode = 128; opcode < 256; opcode++) {
+        cycles[opcode] = 45;
+    }
+
+    std::array<uint32_t, 256> times;
+    for (size_t opcode = 0; opcode < 256; opcode++) {
+        times[opcode] = (DISPATCH_CYCLES + cycles[opcode]) * NANOSECONDS_PER_1000_CYCLES / 1000;
+    }
+    return times;
+}
+
+/// Value pushed last by a literal instruction.
+int16_t getLastLiteral(const std::vector<uint8_t>& bytecode, const ControlFlowGraph::DecodedInstruction& instruction) {
+    const size_t end = size_t(instruction.address) + instruction.length;
+    switch (Opcode(instruction.opcode)) {
+        case Opcode::LITERAL:
+        case Opcode::LITERAL_N:
+            return int16_t(bytecode[end - 2] | (bytecode[end - 1] << 8));
+        default:
+            return int16_t(bytecode[end - 1]);
+    }
+}
+
+std::string formatTime(uint64_t nanoseconds) {
+    std::ostringstream str;
+    str << std::fixed << std::setprecision(1) << double(nanoseconds) / 1000 << " us";
+    return str.str();
+}
+
+std::string formatCost(const TimingAnalysis::Cost& cost) {
+    std::string text = formatTime(cost.computeTime);
+    if (cost.delayTime > 0) {
+        text += " + " + std::to_string(cost.delayTime / 1000000) + " ms delay";
+    }
+    if (!cost.known) {
+        text += " (unknown)";
+    }
+    return text;
+}
+
+TimingAnalysis::TimingAnalysis(const Program& program, bool isMiniMaestro) : TimingAnalysis(program, getEstimatedInstructionTimes(isMiniMaestro)) {}
+
+TimingAnalysis::TimingAnalysis(const Program& program, const std::array<uint32_t, 256>& instructionTimes)
+    : m_program(program),
+      m_instructionTimes(instructionTimes),
+      m_graph(program.getByteList(), program.getSubroutineTable()),
+      m_sourceMap(program.getSourceMap()) {
+    analyze();
+}
+
+int TimingAnalysis::getLineNumber(uint16_t address) const {
+    auto location = std::upper_bound(m_sourceMap.begin(), m_sourceMap.end(), address,
+                                     [](uint16_t a, const SourceLocation& l) { return a < l.address; });
+    if (location == m_sourceMap.begin()) {
+        return -1;
+    }
+    return (--location)->lineNumber;
+}
+
+TimingAnalysis::Cost TimingAnalysis::getInstructionCost(size_t index, size_t blockBegin) {
+    const ControlFlowGraph::DecodedInstruction& instruction = m_graph.getInstructions()[index];
+    Cost cost{m_instructionTimes[instruction.opcode], 0, true};
+    if (ControlFlowGraph::isCall(instruction)) {
+        if (m_graph.getInstructionAt(instruction.operand) < 0) {
+            cost.known = false;
+            return cost;
+        }
+        const Cost& callee = getSubroutineCost(instruction.operand);
+        cost.computeTime += callee.computeTime;
+        cost.delayTime += callee.delayTime;
+        cost.known = callee.known;
+    } else if (Opcode(instruction.opcode) == Opcode::DELAY) {
+        // The delay is known when its argument was pushed just before.
+        const ControlFlowGraph::DecodedInstruction* previous = (index > blockBegin) ? &m_graph.getInstructions()[index - 1] : nullptr;
+        if (previous != nullptr && ControlFlowGraph::isLiteral(*previous)) {
+            cost.delayTime = uint64_t(uint16_t(getLastLiteral(m_graph.getBytecode(), *previous))) * 1000000;
+        } else {
+            cost.known = false;
+        }
+    }
+    return cost;
+}
+
+const TimingAnalysis::Cost& TimingAnalysis::getBlockCost(size_t block) {
+    if (!m_blockCostKnown[block]) {
+        const ControlFlowGraph::BasicBlock& basicBlock = m_graph.getBlocks()[block];
+        Cost cost{0, 0, true};
+        for (size_t i = basicBlock.begin; i < basicBlock.end; i++) {
+            const Cost instructionCost = getInstructionCost(i, basicBlock.begin);
+            cost.computeTime += instructionCost.computeTime;
+            cost.delayTime += instructionCost.delayTime;
+            cost.known = cost.known && instructionCost.known;
+        }
+        m_blockCosts[block] = cost;
+        m_blockCostKnown[block] = true;
+    }
+    return m_blockCosts[block];
+}
+
+bool TimingAnalysis::isReturn(size_t block, size_t) const {
+    const ControlFlowGraph::BasicBlock& basicBlock = m_graph.getBlocks()[block];
+    const Opcode opcode = Opcode(m_graph.getInstructions()[basicBlock.end - 1].opcode);
+    return opcode == Opcode::RETURN || opcode == Opcode::QUIT;
+}
+
+bool TimingAnalysis::isJumpBackTo(size_t block, size_t header) const {
+    const ControlFlowGraph::BasicBlock& basicBlock = m_graph.getBlocks()[block];
+    const ControlFlowGraph::DecodedInstruction& last = m_graph.getInstructions()[basicBlock.end - 1];
+    return Opcode(last.opcode) == Opcode::JUMP && last.operand == m_graph.getBlocks()[header].address;
+}
+
+bool TimingAnalysis::getLongestPath(size_t first, size_t last, bool (TimingAnalysis::*isExit)(size_t, size_t) const, size_t exitArgument,
+                                    Cost& path) {
+    const std::vector<ControlFlowGraph::BasicBlock>& blocks = m_graph.getBlocks();
+
+    // Blocks reachable from the first one without leaving the range.
+    std::vector<bool> reachable(last - first + 1, false);
+    reachable[0] = true;
+    bool known = true;
+    for (size_t b = first; b <= last; b++) {
+        if (!reachable[b - first] || (this->*isExit)(b, exitArgument)) {
+            continue;
+        }
+        for (size_t successor : blocks[b].successors) {
+            if (successor <= b) {
+                known = false;  // an inner loop
+            } else if (successor <= last) {
+                reachable[successor - first] = true;
+            }
+        }
+    }
+
+    // Blocks are sorted by address and only forward edges are followed, so
+    // the longest path to an exit can be computed from the last block back.
+    std::vector<Cost> longest(last - first + 1, Cost{0, 0, true});
+    std::vector<bool> reachesExit(last - first + 1, false);
+    for (size_t b = last + 1; b-- > first;) {
+        if (!reachable[b - first]) {
+            continue;
+        }
+        const Cost& cost = getBlockCost(b);
+        if ((this->*isExit)(b, exitArgument)) {
+            longest[b - first] = cost;
+            reachesExit[b - first] = true;
+            continue;
+        }
+        for (size_t successor : blocks[b].successors) {
+            if (successor <= b || successor > last || !reachesExit[successor - first]) {
+                continue;
+            }
+            const Cost& tail = longest[successor - first];
+            const Cost candidate{cost.computeTime + tail.computeTime, cost.delayTime + tail.delayTime, cost.known && tail.known};
+            if (!reachesExit[b - first] || candidate.totalTime() > longest[b - first].totalTime()) {
+                const bool wasKnown = !reachesExit[b - first] || longest[b - first].known;
+                longest[b - first] = candidate;
+                longest[b - first].known = candidate.known && wasKnown;
+            } else {
+                longest[b - first].known = longest[b - first].known && candidate.known;
+            }
+            reachesExit[b - first] = true;
+        }
+    }
+
+    path = longest[0];
+    path.known = path.known && known;
+    return reachesExit[0];
+}
+
+const TimingAnalysis::Cost& TimingAnalysis::getSubroutineCost(uint16_t address) {
+    const auto known = m_subroutineCosts.find(address);
+    if (known != m_subroutineCosts.end()) {
+        return known->second;
+    }
+    if (m_subroutineInProgress[address]) {
+        // A recursive call: nothing bounds the number of calls.
+        static const Cost recursive{0, 0, false};
+        return recursive;
+    }
+    m_subroutineInProgress[address] = true;
+
+    Cost cost{0, 0, false};
+    const int entry = m_graph.getBlockAt(address);
+    if (entry >= 0 && !getLongestPath(size_t(entry), m_graph.getBlocks().size() - 1, &TimingAnalysis::isReturn, 0, cost)) {
+        cost.known = false;  // never returns
+    }
+    m_subroutineInProgress[address] = false;
+    return m_subroutineCosts[address] = cost;
+}
+
+void TimingAnalysis::analyze() {
+    const std::vector<ControlFlowGraph::BasicBlock>& blocks = m_graph.getBlocks();
+    m_blockCosts.assign(blocks.size(), Cost{0, 0, true});
+    m_blockCostKnown.assign(blocks.size(), false);
+
+    for (size_t b = 0; b < blocks.size(); b++) {
+        const ControlFlowGraph::BasicBlock& block = blocks[b];
+        m_blocks.push_back(BlockReport{block.address, getLineNumber(block.address), getBlockCost(b)});
+
+        for (size_t i = block.begin; i < block.end; i++) {
+            const uint16_t address = m_graph.getInstructions()[i].address;
+            const Cost instructionCost = getInstructionCost(i, block.begin);
+            auto inserted = m_lineCosts.insert(std::make_pair(getLineNumber(address), Cost{0, 0, true}));
+            Cost& lineCost = inserted.first->second;
+            lineCost.computeTime += instructionCost.computeTime;
+            lineCost.delayTime += instructionCost.delayTime;
+            lineCost.known = lineCost.known && instructionCost.known;
+        }
+
+        // REPEAT (or a GOTO to an earlier label) closes a loop.
+        const ControlFlowGraph::DecodedInstruction& last = m_graph.getInstructions()[block.end - 1];
+        const int header = m_graph.getBlockAt(last.operand);
+        if (Opcode(last.opcode) == Opcode::JUMP && last.operand <= last.address && header >= 0) {
+            LoopReport loop{last.operand, last.address, getLineNumber(last.operand), getLineNumber(last.address), Cost{0, 0, true}};
+            getLongestPath(size_t(header), b, &TimingAnalysis::isJumpBackTo, size_t(header), loop.iteration);
+            m_loops.push_back(loop);
+        }
+    }
+
+    for (const auto& subroutine : m_program.getSubroutineAddresses()) {
+        m_subroutines.push_back(
+            SubroutineReport{subroutine.first, subroutine.second, getLineNumber(subroutine.second), getSubroutineCost(subroutine.second)});
+    }
+}
+
+std::vector<TimingAnalysis::LoopReport> TimingAnalysis::getLoopsExceeding(uint32_t periodMicroseconds) const {
+    std::vector<LoopReport> loops;
+    for (const LoopReport& loop : m_loops) {
+        if (!loop.iteration.known || loop.iteration.totalTime() > uint64_t(periodMicroseconds) * 1000) {
+            loops.push_back(loop);
+        }
+    }
+    return loops;
+}
+
+std::string TimingAnalysis::toString(uint32_t periodMicroseconds) const {
+    const std::vector<LoopReport> exceeding = getLoopsExceeding(periodMicroseconds);
+    auto isExceeding = [&exceeding](const LoopReport& loop) {
+        return std::any_of(exceeding.begin(), exceeding.end(), [&loop](const LoopReport& l) { return l.address == loop.address; });
+    };
+
+    std::map<int, std::string> annotations;
+    for (const auto& lineCost : m_lineCosts) {
+        if (lineCost.first >= 0) {
+            annotations[lineCost.first] = formatCost(lineCost.second);
+        }
+    }
+    for (const LoopReport& loop : m_loops) {
+        std::string& annotation = annotations[loop.endLineNumber];
+        annotation += "; loop from line " + std::to_string(loop.lineNumber) + ": " + formatCost(loop.iteration) + " per iteration";
+        if (isExceeding(loop)) {
+            annotation += " MAY EXCEED " + std::to_string(periodMicroseconds) + " us";
+        }
+    }
+
+    std::ostringstream streamWriter;
+    streamWriter << m_program.toString(annotations);
+    streamWriter << std::endl;
+    streamWriter << "Loops (period " << periodMicroseconds << " us):" << std::endl;
+    streamWriter << "Lines      Estimated time per iteration" << std::endl;
+    for (const LoopReport& loop : m_loops) {
+        streamWriter << std::setw(4) << loop.lineNumber << "-" << std::left << std::setw(4) << loop.endLineNumber << std::right << "   "
+                     << formatCost(loop.iteration) << (isExceeding(loop) ? "  MAY EXCEED PERIOD" : "") << std::endl;
+    }
+    streamWriter << std::endl;
+    streamWriter << "Subroutines:" << std::endl;
+    streamWriter << "Line Estimated time     Name" << std::endl;
+    for (const SubroutineReport& subroutine : m_subroutines) {
+        streamWriter << std::setw(4) << subroutine.lineNumber << " " << std::left << std::setw(18) << formatCost(subroutine.cost) << std::right << " "
+                     << subroutine.name << std::endl;
+    }
+    return streamWriter.str();
+}
+}  // namespace Maestro
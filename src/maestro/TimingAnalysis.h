@@ -0,0 +1,119 @@
+#pragma once
+
+#include <maestro/ControlFlowGraph.h>
+#include <maestro/Program.h>
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace Maestro {
+
+/// Static estimate of the execution time of a compiled script.
+///
+/// Every instruction is given a cost from a per-opcode table, and the
+/// longest path is computed through each basic block, each loop body (one
+/// iteration, from the loop start to the jump back) and each subroutine.
+/// Time spent in DELAY is counted separately from the time spent computing,
+/// and is only known when the delay is a literal.
+///
+/// Pololu publishes no timing of the script interpreter, so the default
+/// costs are estimates, not measurements: the results rank lines and loops
+/// and flag the ones likely too slow, but are not guaranteed bounds.  Costs
+/// measured on a device (e.g. with the Profiler) can be given instead.
+class TimingAnalysis {
+   public:
+    struct Cost {
+        /// Time spent executing instructions, in nanoseconds.
+        uint64_t computeTime;
+        /// Time spent in DELAY instructions, in nanoseconds.
+        uint64_t delayTime;
+        /// False if the time cannot be estimated statically: the path contains
+        /// a delay that is not a literal, an inner loop or a recursive call.
+        bool known;
+
+        uint64_t totalTime() const { return computeTime + delayTime; }
+    };
+
+    struct BlockReport {
+        uint16_t address;
+        int lineNumber;
+        Cost cost;
+    };
+
+    /// One iteration of a loop, e.g. the body of BEGIN ... REPEAT.
+    struct LoopReport {
+        /// Address of the first instruction of the body and of the jump back.
+        uint16_t address;
+        uint16_t endAddress;
+        int lineNumber;
+        int endLineNumber;
+        Cost iteration;
+    };
+
+    struct SubroutineReport {
+        std::string name;
+        uint16_t address;
+        int lineNumber;
+        /// Longest path from the call to the RETURN (or QUIT).
+        Cost cost;
+    };
+
+    /// Uses getEstimatedInstructionTimes().
+    TimingAnalysis(const Program& program, bool isMiniMaestro);
+    TimingAnalysis(const Program& program, const std::array<uint32_t, 256>& instructionTimes);
+
+    /// Estimated execution time of each opcode in nanoseconds, not counting
+    /// the DELAY itself.  The subroutine opcodes (128-255) hold the cost of
+    /// the call.  The two firmwares only differ by GET_MOVING_STATE, which
+    /// scans every channel.  The table can also be given to
+    /// Emulator::setInstructionTimes().
+    static std::array<uint32_t, 256> getEstimatedInstructionTimes(bool isMiniMaestro);
+
+    const std::vector<BlockReport>& getBlocks() const { return m_blocks; }
+    const std::vector<LoopReport>& getLoops() const { return m_loops; }
+    const std::vector<SubroutineReport>& getSubroutines() const { return m_subroutines; }
+
+    /// Time of all the instructions compiled from each source line, called
+    /// subroutines included, indexed by 0-based line number.  When a line
+    /// holds both branches of an IF, both are counted.
+    const std::map<int, Cost>& getLineCosts() const { return m_lineCosts; }
+
+    /// Loops whose iteration may take longer than \a periodMicroseconds.
+    std::vector<LoopReport> getLoopsExceeding(uint32_t periodMicroseconds) const;
+
+    /// Program listing annotated with the time of each line and loop,
+    /// followed by the loop and subroutine tables.  Loops that may take
+    /// longer than \a periodMicroseconds per iteration are marked.
+    std::string toString(uint32_t periodMicroseconds = 20000) const;
+
+   private:
+    void analyze();
+    Cost getInstructionCost(size_t index, size_t blockBegin);
+    const Cost& getBlockCost(size_t block);
+    const Cost& getSubroutineCost(uint16_t address);
+    /// Longest path from \a first to a block for which \a isExit is true,
+    /// through blocks in [first, last] only.  Jumps back are not followed.
+    bool getLongestPath(size_t first, size_t last, bool (TimingAnalysis::*isExit)(size_t, size_t) const, size_t exitArgument, Cost& path);
+    bool isReturn(size_t block, size_t unused) const;
+    bool isJumpBackTo(size_t block, size_t header) const;
+    int getLineNumber(uint16_t address) const;
+
+    Program m_program;
+    std::array<uint32_t, 256> m_instructionTimes;
+    ControlFlowGraph m_graph;
+    std::vector<SourceLocation> m_sourceMap;
+
+    std::vector<Cost> m_blockCosts;
+    std::vector<bool> m_blockCostKnown;
+    std::map<uint16_t, Cost> m_subroutineCosts;
+    std::map<uint16_t, bool> m_subroutineInProgress;
+
+    std::vector<BlockReport> m_blocks;
+    std::vector<LoopReport> m_loops;
+    std::vector<SubroutineReport> m_subroutines;
+    std::map<int, Cost> m_lineCosts;
+};
+}  // namespace Maestro
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <libusb.h>
+
+#include <string>
+
+namespace Maestro {
+/// The USB port of \a device, e.g. "1-4.2": its bus number, then the port
+/// numbers from the root hub.  Stable across re-enumerations, unlike the
+/// device address.  Defined in Device.cpp.
+std::string getDeviceLocation(libusb_device* device);
+}  // namespace Maestro
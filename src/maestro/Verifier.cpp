@@ -0,0 +1,343 @@
+#include "Verifier.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+#include "Opcode.h"
+
+namespace Maestro {
+struct StackEffect {
+    int pops;
+    int pushes;
+};
+
+/// Values taken from and pushed on the stack by an instruction.  PICK, ROLL
+/// and PEEK also read values below the ones they pop, which cannot be known
+/// without the value of their argument.
+StackEffect getStackEffect(const ControlFlowGraph::DecodedInstruction& instruction) {
+    switch (Opcode(instruction.opcode)) {
+        case Opcode::LITERAL:
+        case Opcode::LITERAL8:
+        case Opcode::LITERAL_N:
+        case Opcode::LITERAL8_N:
+            return {0, instruction.operand};
+        case Opcode::GET_MS:
+        case Opcode::DEPTH:
+        case Opcode::GET_MOVING_STATE:
+            return {0, 1};
+        case Opcode::JUMP_Z:
+        case Opcode::DELAY:
+        case Opcode::DROP:
+        case Opcode::ROLL:
+        case Opcode::SERIAL_SEND_BYTE:
+            return {1, 0};
+        case Opcode::DUP:
+            return {1, 2};
+        case Opcode::OVER:
+            return {2, 3};
+        case Opcode::SWAP:
+            return {2, 2};
+        case Opcode::ROT:
+            return {3, 3};
+        case Opcode::PICK:
+        case Opcode::BITWISE_NOT:
+        case Opcode::LOGICAL_NOT:
+        case Opcode::NEGATE:
+        case Opcode::POSITIVE:
+        case Opcode::NEGATIVE:
+        case Opcode::NONZERO:
+        case Opcode::GET_POSITION:
+        case Opcode::PEEK:
+            return {1, 1};
+        case Opcode::BITWISE_AND:
+        case Opcode::BITWISE_OR:
+        case Opcode::BITWISE_XOR:
+        case Opcode::SHIFT_RIGHT:
+        case Opcode::SHIFT_LEFT:
+        case Opcode::LOGICAL_AND:
+        case Opcode::LOGICAL_OR:
+        case Opcode::PLUS:
+        case Opcode::MINUS:
+        case Opcode::TIMES:
+        case Opcode::DIVIDE:
+        case Opcode::MOD:
+        case Opcode::EQUALS:
+        case Opcode::NOT_EQUALS:
+        case Opcode::MIN:
+        case Opcode::MAX:
+        case Opcode::LESS_THAN:
+        case Opcode::GREATER_THAN:
+            return {2, 1};
+        case Opcode::SERVO:
+        case Opcode::SERVO_8BIT:
+        case Opcode::SPEED:
+        case Opcode::ACCELERATION:
+        case Opcode::PWM:
+        case Opcode::POKE:
+            return {2, 0};
+        default:
+            return {0, 0};
+    }
+}
+
+Verifier::Verifier(const Program& program, bool isMiniMaestro)
+    : m_graph(program.getByteList(), program.getSubroutineTable()),
+      m_subroutineTable(program.getSubroutineTable()),
+      m_isMiniMaestro(isMiniMaestro),
+      m_sourceMap(program.getSourceMap()) {
+    std::set<uint8_t> definedNumbers;
+    for (const auto& subroutineNumber : program.getSubroutineNumbers()) {
+        definedNumbers.insert(subroutineNumber.second);
+    }
+    verify(program.getSubroutineAddresses(), definedNumbers);
+}
+
+Verifier::Verifier(const std::vector<uint8_t>& bytecode, const std::array<uint16_t, 128>& subroutineTable, bool isMiniMaestro)
+    : m_graph(bytecode, subroutineTable), m_subroutineTable(subroutineTable), m_isMiniMaestro(isMiniMaestro) {
+    // Without the source, every subroutine number is assumed to be defined
+    // and subroutines are named after their address.
+    std::map<std::string, uint16_t> subroutines;
+    std::set<uint8_t> definedNumbers;
+    for (const ControlFlowGraph::DecodedInstruction& instruction : m_graph.getInstructions()) {
+        if (ControlFlowGraph::isCall(instruction)) {
+            std::ostringstream name;
+            name << "SUB_" << std::uppercase << std::hex << std::setw(4) << std::setfill('0') << instruction.operand;
+            subroutines[name.str()] = instruction.operand;
+        }
+    }
+    for (int i = 0; i < 128; i++) {
+        definedNumbers.insert(uint8_t(i));
+    }
+    verify(subroutines, definedNumbers);
+}
+
+bool Verifier::isValid() const {
+    for (const Problem& problem : m_problems) {
+        if (problem.isError) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void Verifier::addProblem(bool isError, uint16_t address, const std::string& message) {
+    if (!m_reported.insert(std::make_pair(address, message)).second) {
+        return;
+    }
+    Problem problem{isError, address, -1, -1, message};
+    auto location = std::upper_bound(m_sourceMap.begin(), m_sourceMap.end(), address,
+                                     [](uint16_t a, const SourceLocation& l) { return a < l.address; });
+    if (location != m_sourceMap.begin()) {
+        --location;
+        problem.lineNumber = location->lineNumber;
+        problem.columnNumber = location->columnNumber;
+    }
+    m_problems.push_back(problem);
+}
+
+const Verifier::Summary& Verifier::analyze(uint16_t entry) {
+    const auto known = m_summaries.find(entry);
+    if (known != m_summaries.end()) {
+        return known->second;
+    }
+    Summary& summary = m_summaries[entry];
+    summary.inProgress = true;
+
+    const std::vector<ControlFlowGraph::BasicBlock>& blocks = m_graph.getBlocks();
+    const std::vector<ControlFlowGraph::DecodedInstruction>& instructions = m_graph.getInstructions();
+    const int entryBlock = m_graph.getBlockAt(entry);
+    if (entryBlock < 0) {
+        addProblem(true, entry, "No instruction starts at subroutine address " + std::to_string(entry) + ".");
+        summary.inProgress = false;
+        return summary;
+    }
+
+    std::map<size_t, int> depths;
+    std::vector<std::pair<size_t, int>> work;
+    bool returnSeen = false;
+    auto enter = [&](uint16_t from, size_t block, int depth) {
+        const auto seen = depths.find(block);
+        if (seen == depths.end()) {
+            depths[block] = depth;
+            work.push_back(std::make_pair(block, depth));
+        } else if (seen->second != depth) {
+            if (blocks[block].address <= from) {
+                addProblem(true, from, "The stack depth changes by " + std::to_string(depth - seen->second) + " on every iteration of this loop.");
+            } else {
+                addProblem(false, blocks[block].address,
+                           "Paths reaching this point leave different numbers of values on the stack (" + std::to_string(seen->second) + " and " +
+                               std::to_string(depth) + ").");
+                if (depth > seen->second) {
+                    seen->second = depth;
+                    work.push_back(std::make_pair(block, depth));
+                }
+            }
+        }
+    };
+    enter(entry, size_t(entryBlock), 0);
+
+    while (!work.empty()) {
+        const size_t block = work.back().first;
+        int depth = work.back().second;
+        work.pop_back();
+
+        bool flowContinues = true;
+        for (size_t i = blocks[block].begin; i < blocks[block].end && flowContinues; i++) {
+            const ControlFlowGraph::DecodedInstruction& instruction = instructions[i];
+            if (ControlFlowGraph::isCall(instruction)) {
+                if (m_graph.getInstructionAt(instruction.operand) < 0) {
+                    continue;  // already reported as an invalid target
+                }
+                const Summary& callee = analyze(instruction.operand);
+                if (callee.inProgress) {
+                    summary.recursive = true;
+                    continue;
+                }
+                if (depth + callee.minDepth < summary.minDepth) {
+                    summary.minDepth = depth + callee.minDepth;
+                    summary.minAddress = instruction.address;
+                }
+                if (depth + callee.maxDepth > summary.maxDepth) {
+                    summary.maxDepth = depth + callee.maxDepth;
+                    summary.maxAddress = instruction.address;
+                }
+                summary.recursive = summary.recursive || callee.recursive;
+                summary.callDepth = std::max(summary.callDepth, callee.callDepth + 1);
+                if (!callee.returns) {
+                    flowContinues = false;
+                }
+                depth += callee.stackEffect;
+                continue;
+            }
+
+            const StackEffect effect = getStackEffect(instruction);
+            if (depth - effect.pops < summary.minDepth) {
+                summary.minDepth = depth - effect.pops;
+                summary.minAddress = instruction.address;
+            }
+            depth += effect.pushes - effect.pops;
+            if (depth > summary.maxDepth) {
+                summary.maxDepth = depth;
+                summary.maxAddress = instruction.address;
+            }
+
+            const Opcode opcode = Opcode(instruction.opcode);
+            if (opcode == Opcode::RETURN) {
+                if (returnSeen && summary.stackEffect != depth) {
+                    addProblem(false, instruction.address,
+                               "This subroutine returns with different stack depths (" + std::to_string(summary.stackEffect) + " and " +
+                                   std::to_string(depth) + ").");
+                }
+                summary.stackEffect = returnSeen ? std::max(summary.stackEffect, depth) : depth;
+                returnSeen = true;
+            } else if (opcode >= Opcode::PWM && opcode <= Opcode::SERIAL_SEND_BYTE && !m_isMiniMaestro) {
+                addProblem(true, instruction.address, "This instruction is only available on the Mini Maestro 12, 18, and 24.");
+            } else if (opcode > Opcode::CALL && instruction.opcode < 128) {
+                addProblem(true, instruction.address, "Invalid opcode " + std::to_string(instruction.opcode) + ".");
+                flowContinues = false;
+            }
+        }
+        if (!flowContinues) {
+            continue;
+        }
+
+        const ControlFlowGraph::DecodedInstruction& last = instructions[blocks[block].end - 1];
+        for (size_t successor : blocks[block].successors) {
+            enter(last.address, successor, depth);
+        }
+        if (!ControlFlowGraph::endsFlow(last) && block + 1 == blocks.size()) {
+            addProblem(false, last.address, "Execution can continue past the end of the script.");
+        }
+    }
+
+    summary.returns = returnSeen;
+    if (summary.recursive) {
+        summary.callDepth = -1;
+    }
+    summary.inProgress = false;
+    return summary;
+}
+
+void Verifier::verify(const std::map<std::string, uint16_t>& subroutines, const std::set<uint8_t>& definedNumbers) {
+    for (const auto& problem : m_graph.getProblems()) {
+        addProblem(true, problem.first, problem.second);
+    }
+    for (const ControlFlowGraph::DecodedInstruction& instruction : m_graph.getInstructions()) {
+        if (instruction.opcode >= 128 && definedNumbers.count(uint8_t(instruction.opcode - 128)) == 0) {
+            addProblem(true, instruction.address, "Call to undefined subroutine number " + std::to_string(instruction.opcode - 128) + ".");
+        }
+    }
+
+    const int stackSize = m_isMiniMaestro ? MINI_MAESTRO_STACK_SIZE : MICRO_MAESTRO_STACK_SIZE;
+    const int callStackSize = m_isMiniMaestro ? MINI_MAESTRO_CALL_STACK_SIZE : MICRO_MAESTRO_CALL_STACK_SIZE;
+
+    std::vector<std::pair<std::string, uint16_t>> entries;
+    if (!m_graph.getInstructions().empty()) {
+        entries.push_back(std::make_pair(std::string("(main)"), uint16_t(0)));
+    }
+    for (const auto& subroutine : subroutines) {
+        entries.push_back(subroutine);
+    }
+
+    for (const auto& entry : entries) {
+        const bool isMain = (entry.first == "(main)");
+        const Summary& summary = analyze(entry.second);
+
+        if (isMain && summary.minDepth < 0) {
+            addProblem(true, summary.minAddress, "Stack underflow: this needs " + std::to_string(-summary.minDepth) + " more value(s) on the stack.");
+        }
+        if (summary.maxDepth > stackSize) {
+            addProblem(true, summary.maxAddress,
+                       "Stack overflow: up to " + std::to_string(summary.maxDepth) + " values are on the stack here, the limit is " +
+                           std::to_string(stackSize) + ".");
+        }
+        if (summary.callDepth < 0) {
+            addProblem(false, entry.second, "Subroutine calls from " + entry.first + " are recursive: the call depth cannot be checked.");
+        } else if (summary.callDepth > callStackSize) {
+            addProblem(true, entry.second,
+                       "Subroutine calls from " + entry.first + " nest " + std::to_string(summary.callDepth) + " levels deep, the limit is " +
+                           std::to_string(callStackSize) + ".");
+        }
+
+        SubroutineReport report;
+        report.name = entry.first;
+        report.address = entry.second;
+        report.lineNumber = -1;
+        for (const SourceLocation& location : m_sourceMap) {
+            if (location.address == entry.second) {
+                report.lineNumber = location.lineNumber;
+                break;
+            }
+        }
+        report.maxStackDepth = summary.maxDepth;
+        report.arguments = -summary.minDepth;
+        report.returns = summary.returns;
+        report.stackEffect = summary.stackEffect;
+        report.maxCallDepth = summary.callDepth;
+        m_subroutines.push_back(report);
+    }
+}
+
+std::string Verifier::toString() const {
+    std::ostringstream streamWriter;
+    for (const Problem& problem : m_problems) {
+        streamWriter << "script:";
+        if (problem.lineNumber >= 0) {
+            streamWriter << problem.lineNumber << ":" << problem.columnNumber << ":";
+        } else {
+            streamWriter << std::uppercase << std::hex << std::setw(4) << std::setfill('0') << problem.address << std::dec << ":";
+        }
+        streamWriter << (problem.isError ? " error: " : " warning: ") << problem.message << std::endl;
+    }
+    streamWriter << std::endl;
+    streamWriter << "Address Line  Stack Args Effect Calls Name" << std::endl;
+    for (const SubroutineReport& report : m_subroutines) {
+        streamWriter << std::uppercase << std::hex << std::setw(4) << std::setfill('0') << report.address << std::dec << std::setfill(' ') << "    "
+                     << std::setw(4) << report.lineNumber << "  " << std::setw(5) << report.maxStackDepth << " " << std::setw(4) << report.arguments
+                     << " " << std::setw(6) << (report.returns ? std::to_string(report.stackEffect) : std::string("-")) << " " << std::setw(5)
+                     << (report.maxCallDepth < 0 ? std::string("inf") : std::to_string(report.maxCallDepth)) << " " << report.name << std::endl;
+    }
+    return streamWriter.str();
+}
+}  // namespace Maestro
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <maestro/ControlFlowGraph.h>
+#include <maestro/Program.h>
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace Maestro {
+
+/// Static checks of a compiled script, run before uploading it.
+///
+/// The verifier follows every path through the control flow graph and
+/// tracks the depth of the data stack, using the stack effect of each
+/// opcode and of each called subroutine.  It reports stack overflows and
+/// underflows, loops that grow or shrink the stack, invalid jump and call
+/// targets, and call nesting deeper than the firmware call stack.
+class Verifier {
+   public:
+    struct Problem {
+        bool isError;
+        uint16_t address;
+        /// Source location, or -1 when verifying a raw image.
+        int lineNumber;
+        int columnNumber;
+        std::string message;
+    };
+
+    struct SubroutineReport {
+        /// Subroutine name; the main code is named "(main)".
+        std::string name;
+        uint16_t address;
+        int lineNumber;
+        /// Largest number of values the code pushes above its entry depth.
+        int maxStackDepth;
+        /// Number of values it takes from the caller's stack.
+        int arguments;
+        /// False if the subroutine never returns.
+        bool returns;
+        /// Change of the stack depth seen by the caller.
+        int stackEffect;
+        /// Deepest nesting of calls, or -1 if unbounded (recursion).
+        int maxCallDepth;
+    };
+
+    Verifier(const Program& program, bool isMiniMaestro);
+    Verifier(const std::vector<uint8_t>& bytecode, const std::array<uint16_t, 128>& subroutineTable, bool isMiniMaestro);
+
+    /// True if no error was found (warnings are allowed).
+    bool isValid() const;
+    const std::vector<Problem>& getProblems() const { return m_problems; }
+    const std::vector<SubroutineReport>& getSubroutines() const { return m_subroutines; }
+
+    /// Human readable report of the problems and of the subroutine table.
+    std::string toString() const;
+
+   private:
+    struct Summary {
+        bool inProgress = false;
+        bool recursive = false;
+        int minDepth = 0;
+        int maxDepth = 0;
+        uint16_t minAddress = 0;
+        uint16_t maxAddress = 0;
+        bool returns = false;
+        int stackEffect = 0;
+        int callDepth = 0;
+    };
+
+    void verify(const std::map<std::string, uint16_t>& subroutines, const std::set<uint8_t>& definedNumbers);
+    const Summary& analyze(uint16_t entry);
+    void addProblem(bool isError, uint16_t address, const std::string& message);
+
+    ControlFlowGraph m_graph;
+    std::array<uint16_t, 128> m_subroutineTable;
+    bool m_isMiniMaestro;
+    std::vector<SourceLocation> m_sourceMap;
+    std::map<uint16_t, Summary> m_summaries;
+    std::set<std::pair<uint16_t, std::string>> m_reported;
+    std::vector<Problem> m_problems;
+    std::vector<SubroutineReport> m_subroutines;
+};
+}  // namespace Maestro
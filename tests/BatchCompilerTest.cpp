@@ -0,0 +1,126 @@
+#include <maestro/BatchCompiler.h>
+#include <maestro/Program.h>
+
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#include "Check.h"
+
+using namespace Maestro;
+
+static const std::string CACHE_DIRECTORY = "BatchCompilerTest.cache";
+
+/// The cache file of \a script, named as by BatchCompiler.
+static std::string cachePath(const std::string& script, bool isMiniMaestro) {
+    std::ostringstream path;
+    path << CACHE_DIRECTORY << "/" << std::hex << std::setw(16) << std::setfill('0') << BatchCompiler::hash(script, isMiniMaestro) << ".msc";
+    return path.str();
+}
+
+static std::string readFile(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+static void writeFile(const std::string& path, const std::string& contents) {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file << contents;
+}
+
+/// True if \a result holds the program compiled from \a script.
+static bool matchesProgram(const BatchCompiler::Result& result, const std::string& script, bool isMiniMaestro) {
+    const Program program(script, isMiniMaestro);
+    return result.error.empty() && result.byteList == program.getByteList() && result.subroutineTable == program.getSubroutineTable() &&
+           result.crc == program.getCRC();
+}
+
+int main() {
+#ifdef _WIN32
+    _mkdir(CACHE_DIRECTORY.c_str());
+#else
+    mkdir(CACHE_DIRECTORY.c_str(), 0755);
+#endif
+    const std::string wave = "begin\n100 0 servo 50 delay\n2000 0 servo 50 delay\nrepeat";
+    const std::string blink = "begin 1 1 servo 100 delay 0 1 servo 100 delay repeat\nsub unused return";
+    const std::string broken = "1 2 bogus";
+    const std::vector<std::string> scripts = {wave, blink, wave, broken};
+    // Files left by an earlier run would turn the first misses into hits.
+    for (const std::string& script : scripts) {
+        std::remove(cachePath(script, true).c_str());
+    }
+    std::remove(cachePath(wave, false).c_str());
+
+    // The first batch compiles each distinct script once; its duplicate is marked cached.
+    BatchCompiler compiler(CACHE_DIRECTORY, 2);
+    std::vector<BatchCompiler::Result> results = compiler.compile(scripts, true);
+    CHECK_EQUAL(4u, results.size());
+    CHECK_EQUAL(0u, compiler.getCacheHits());
+    CHECK_EQUAL(3u, compiler.getCacheMisses());
+    CHECK(matchesProgram(results[0], wave, true) && !results[0].cached);
+    CHECK(matchesProgram(results[1], blink, true) && !results[1].cached);
+    CHECK(matchesProgram(results[2], wave, true) && results[2].cached);
+    // Compile errors are results too.
+    CHECK(results[3].error.find("BOGUS") != std::string::npos);
+    CHECK(results[3].byteList.empty());
+
+    // The second batch comes from memory, errors included.
+    results = compiler.compile(scripts, true);
+    CHECK_EQUAL(3u, compiler.getCacheHits());
+    CHECK_EQUAL(3u, compiler.getCacheMisses());
+    CHECK(results[0].cached && results[1].cached && results[3].cached);
+    CHECK(matchesProgram(results[1], blink, true));
+    CHECK(results[3].error.find("BOGUS") != std::string::npos);
+
+    // The target is part of the key.
+    CHECK(!compiler.compile(wave, false).cached);
+    CHECK_EQUAL(4u, compiler.getCacheMisses());
+
+    // Without the memory cache, and in another compiler, the files are read back.
+    compiler.clearMemoryCache();
+    CHECK(compiler.compile(wave, true).cached);
+    BatchCompiler other(CACHE_DIRECTORY, 1);
+    results = other.compile(scripts, true);
+    CHECK_EQUAL(3u, other.getCacheHits());
+    CHECK_EQUAL(0u, other.getCacheMisses());
+    CHECK(matchesProgram(results[0], wave, true) && results[0].cached);
+    CHECK(results[3].error.find("BOGUS") != std::string::npos && results[3].cached);
+
+    // A damaged file fails its CRC, and a truncated one its length: both are
+    // misses, compiled again and rewritten.
+    const std::string blinkPath = cachePath(blink, true);
+    std::string contents = readFile(blinkPath);
+    // The bytecode follows the 279-byte header and the script.
+    const size_t bytecodeOffset = 279 + blink.size();
+    CHECK(contents.size() > bytecodeOffset);
+    contents[bytecodeOffset] = char(contents[bytecodeOffset] ^ 0x01);
+    writeFile(blinkPath, contents);
+    writeFile(cachePath(wave, true), readFile(cachePath(wave, true)).substr(0, 100));
+    BatchCompiler damaged(CACHE_DIRECTORY, 1);
+    results = damaged.compile(scripts, true);
+    CHECK_EQUAL(1u, damaged.getCacheHits());
+    CHECK_EQUAL(2u, damaged.getCacheMisses());
+    CHECK(matchesProgram(results[0], wave, true) && !results[0].cached);
+    CHECK(matchesProgram(results[1], blink, true) && !results[1].cached);
+    BatchCompiler repaired(CACHE_DIRECTORY, 1);
+    repaired.compile(scripts, true);
+    CHECK_EQUAL(3u, repaired.getCacheHits());
+
+    // Without a directory, only the memory cache is used.
+    BatchCompiler memoryOnly;
+    CHECK(!memoryOnly.compile(wave, true).cached);
+    CHECK(memoryOnly.compile(wave, true).cached);
+    memoryOnly.clearMemoryCache();
+    CHECK(!memoryOnly.compile(wave, true).cached);
+    return CHECK_RESULT();
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+
+/// Minimal checks for the tests: a failed check is printed and counted, and
+/// the test returns a failure from main() with CHECK_RESULT().
+namespace Check {
+inline int& failures() {
+    static int count = 0;
+    return count;
+}
+
+inline void fail(const char* file, int line, const std::string& message) {
+    std::fprintf(stderr, "%s:%d: %s\n", file, line, message.c_str());
+    failures()++;
+}
+}  // namespace Check
+
+#define CHECK(condition)                                                \
+    do {                                                                \
+        if (!(condition)) {                                             \
+            Check::fail(__FILE__, __LINE__, "CHECK(" #condition ")"); \
+        }                                                               \
+    } while (0)
+
+#define CHECK_EQUAL(expected, actual)                                                                                          \
+    do {                                                                                                                       \
+        const auto checkExpected = (expected);                                                                                 \
+        const auto checkActual = (actual);                                                                                     \
+        if (!(checkExpected == checkActual)) {                                                                                 \
+            Check::fail(__FILE__, __LINE__,                                                                                    \
+                        "CHECK_EQUAL(" #expected ", " #actual "): " + std::to_string(checkExpected) + " != " + std::to_string(checkActual)); \
+        }                                                                                                                      \
+    } while (0)
+
+/// Runs \a statement, and fails if it does not throw.
+#define CHECK_THROWS(statement)                                                      \
+    do {                                                                             \
+        bool checkThrown = false;                                                    \
+        try {                                                                        \
+            statement;                                                               \
+        } catch (...) {                                                              \
+            checkThrown = true;                                                      \
+        }                                                                            \
+        if (!checkThrown) {                                                          \
+            Check::fail(__FILE__, __LINE__, "CHECK_THROWS(" #statement "): no exception"); \
+        }                                                                            \
+    } while (0)
+
+#define CHECK_RESULT() (Check::failures() == 0 ? 0 : 1)
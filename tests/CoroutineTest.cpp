@@ -0,0 +1,83 @@
+#include <maestro/Coroutine.h>
+#include <maestro/Device.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "Check.h"
+#include "FakeLibusb.h"
+
+using namespace Maestro;
+
+/// A task returning a value to the task awaiting it.
+static Task<uint16_t> readCRC(AsyncDevice& device) { co_return co_await device.getScriptCRC(); }
+
+/// Moves the servo of \a channel to \a target, then reads it back.
+static Task<> moveServo(AsyncDevice& device, uint8_t channel, uint16_t target, std::vector<uint16_t>& positions) {
+    co_await device.setTarget(channel, target);
+    co_await device.getExecutor().sleepFor(std::chrono::milliseconds(5));
+    const std::vector<Device::ServoStatus> status = co_await device.getServoStatus();
+    positions.push_back(status.at(channel).position);
+}
+
+static Task<> sequence(AsyncDevice& device, std::vector<std::string>& steps) {
+    const std::vector<uint16_t> targets = {4000, 5000, 6000};
+    co_await device.setTargets(0, targets);
+    steps.push_back("targets");
+    maestro.parameters[22] = 0xBEEF;
+    steps.push_back((co_await readCRC(device) == 0xBEEF) ? "crc" : "wrong crc");
+    // The error of a request is thrown by its co_await.
+    maestro.stalled.insert(0xA2);
+    try {
+        co_await device.setScriptDone(1);
+        steps.push_back("no error");
+    } catch (const std::string& error) {
+        steps.push_back("error");
+    }
+    maestro.stalled.clear();
+    co_await device.setScriptDone(1);
+    steps.push_back("done");
+}
+
+static Task<> failing(AsyncDevice& device) {
+    maestro.stalled.insert(0x85);
+    co_await device.setTarget(0, 4000);
+}
+
+int main() {
+    std::vector<Device> devices = Device::getConnectedDevices();
+    CHECK_EQUAL(1u, devices.size());
+    if (devices.size() != 1) {
+        return CHECK_RESULT();
+    }
+    Executor executor;
+    AsyncDevice device(executor, devices[0]);
+
+    // The requests of a task follow each other, completed by Device::handleEvents().
+    std::vector<std::string> steps;
+    executor.spawn(sequence(device, steps));
+    executor.run();
+    CHECK(steps == std::vector<std::string>({"targets", "crc", "error", "done"}));
+    CHECK(maestro.positions[0] == 4000 && maestro.positions[1] == 5000 && maestro.positions[2] == 6000);
+
+    // Tasks interleave on the thread of run().
+    std::vector<uint16_t> first, second;
+    executor.spawn(moveServo(device, 3, 7000, first));
+    executor.spawn(moveServo(device, 4, 8000, second));
+    maestro.requests.clear();
+    executor.run();
+    CHECK(first == std::vector<uint16_t>({7000}));
+    CHECK(second == std::vector<uint16_t>({8000}));
+    // Both targets are set before either task sleeps.
+    CHECK_EQUAL(4u, maestro.requests.size());
+    if (maestro.requests.size() == 4) {
+        CHECK(maestro.requests[0].request == 0x85 && maestro.requests[1].request == 0x85);
+    }
+
+    // An error escaping a spawned task is thrown by run().
+    executor.spawn(failing(device));
+    CHECK_THROWS(executor.run());
+    maestro.stalled.clear();
+    return CHECK_RESULT();
+}
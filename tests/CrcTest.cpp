@@ -0,0 +1,70 @@
+#include <maestro/FlashImage.h>
+#include <maestro/Program.h>
+
+#include <array>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "Check.h"
+
+using namespace Maestro;
+
+/// The CRC of the Maestro, one bit at a time.
+static uint16_t referenceCrc(const uint8_t* data, size_t size) {
+    uint16_t crc = 0;
+    for (size_t i = 0; i < size; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? uint16_t((crc >> 1) ^ 0xA001) : uint16_t(crc >> 1);
+        }
+    }
+    return crc;
+}
+
+int main() {
+    // The check value of CRC-16/ARC, which the Maestro CRC is.
+    const uint8_t check[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+    Crc16 crc;
+    crc.update(check, sizeof(check));
+    CHECK_EQUAL(0xBB3D, crc.value());
+
+    // Slicing-by-8 against the bitwise CRC, for every alignment of the tail,
+    // and fed in pieces of every size.
+    std::mt19937 random(1);
+    std::vector<uint8_t> data(300);
+    for (uint8_t& byte : data) {
+        byte = uint8_t(random());
+    }
+    for (size_t size = 0; size <= data.size(); size += 7) {
+        Crc16 whole;
+        whole.update(data.data(), size);
+        CHECK_EQUAL(referenceCrc(data.data(), size), whole.value());
+    }
+    for (size_t piece = 1; piece <= 17; piece++) {
+        Crc16 pieces;
+        for (size_t offset = 0; offset < data.size(); offset += piece) {
+            pieces.update(data.data() + offset, std::min(piece, data.size() - offset));
+        }
+        CHECK_EQUAL(referenceCrc(data.data(), data.size()), pieces.value());
+    }
+
+    // The script CRC covers the subroutine table, then the bytecode.
+    const Program program("sub a 1 2 plus drop return\nsub b a return\nbegin b repeat", true);
+    const std::vector<uint8_t> bytecode = program.getByteList();
+    const std::array<uint16_t, 128> table = program.getSubroutineTable();
+    // Unused entries are erased flash, as in the table written by the Pololu tools.
+    CHECK_EQUAL(Program::UNUSED_SUBROUTINE, table[2]);
+    CHECK_EQUAL(Program::UNUSED_SUBROUTINE, table[127]);
+    std::vector<uint8_t> image;
+    for (uint16_t address : table) {
+        image.push_back(uint8_t(address & 0xFF));
+        image.push_back(uint8_t(address >> 8));
+    }
+    image.insert(image.end(), bytecode.begin(), bytecode.end());
+    CHECK_EQUAL(referenceCrc(image.data(), image.size()), program.getCRC());
+    CHECK_EQUAL(program.getCRC(), Program::computeCRC(table, bytecode.data(), bytecode.size()));
+    CHECK_EQUAL(program.getCRC(), FlashImage(program).getCRC());
+    CHECK(FlashImage(program).getImage() == image);
+    return CHECK_RESULT();
+}
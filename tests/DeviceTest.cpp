@@ -0,0 +1,84 @@
+#include <maestro/Device.h>
+#include <maestro/FlashImage.h>
+#include <maestro/Program.h>
+
+#include <string>
+#include <vector>
+
+#include "Check.h"
+#include "FakeLibusb.h"
+
+using namespace Maestro;
+
+/// True if \a request is \a expected.
+static bool isRequest(const ControlRequest& request, uint8_t expected, uint16_t value, uint16_t index) {
+    return request.request == expected && request.value == value && request.index == index;
+}
+
+int main() {
+    std::vector<Device> devices = Device::getConnectedDevices();
+    CHECK_EQUAL(1u, devices.size());
+    if (devices.size() != 1) {
+        return CHECK_RESULT();
+    }
+    Device& device = devices[0];
+
+    const Program program("begin\n100 0 servo 50 delay\n2000 0 servo 50 delay\nrepeat\nsub wave 1 return", false);
+    const FlashImage image(program);
+    const size_t bytecodeBlocks = (image.getBytecodeSize() + 15) / 16;
+
+    // A different script: the table then the bytecode are written between the
+    // erase and the CRC, which is incomplete meanwhile.
+    maestro.parameters[22] = 0x1234;
+    CHECK_EQUAL(16 + bytecodeBlocks, device.deployScript(image));
+    const std::vector<ControlRequest>& requests = maestro.requests;
+    CHECK_EQUAL(1 + 3 + 16 + bytecodeBlocks + 2, requests.size());
+    if (requests.size() == 1 + 3 + 16 + bytecodeBlocks + 2) {
+        CHECK(isRequest(requests[0], 0x81, 0, 22));
+        CHECK(isRequest(requests[1], 0xA2, 1, 0));
+        CHECK(isRequest(requests[2], 0x82, Device::SCRIPT_CRC_INCOMPLETE, (2 << 8) + 22));
+        CHECK(isRequest(requests[3], 0xA0, 0, 0));
+        for (size_t i = 0; i < 16; i++) {
+            CHECK(isRequest(requests[4 + i], 0xA1, 0, uint16_t(64 + i)));
+        }
+        for (size_t i = 0; i < bytecodeBlocks; i++) {
+            CHECK(isRequest(requests[20 + i], 0xA1, 0, uint16_t(i)));
+        }
+        CHECK(isRequest(requests[20 + bytecodeBlocks], 0x82, image.getCRC(), (2 << 8) + 22));
+        CHECK(isRequest(requests[21 + bytecodeBlocks], 0x81, 0, 22));
+    }
+    CHECK_EQUAL(image.getCRC(), maestro.parameters[22]);
+
+    // The flash holds the image, the last block padded with erased bytes.
+    std::vector<uint8_t> table, bytecode;
+    for (uint16_t block = 64; block < 80; block++) {
+        table.insert(table.end(), maestro.flash[block].begin(), maestro.flash[block].end());
+    }
+    for (uint16_t block = 0; block < bytecodeBlocks; block++) {
+        bytecode.insert(bytecode.end(), maestro.flash[block].begin(), maestro.flash[block].end());
+    }
+    CHECK(std::vector<uint8_t>(image.getImage().begin(), image.getImage().begin() + FlashImage::SUBROUTINE_TABLE_SIZE) == table);
+    std::vector<uint8_t> padded(image.getBytecode(), image.getBytecode() + image.getBytecodeSize());
+    padded.resize(16 * bytecodeBlocks, 0xFF);
+    CHECK(padded == bytecode);
+
+    // The same script is only checked.
+    maestro.requests.clear();
+    CHECK_EQUAL(0u, device.deployScript(image));
+    CHECK_EQUAL(1u, maestro.requests.size());
+
+    // A deploy failing in the flash leaves the CRC incomplete, so the next one writes again.
+    maestro.parameters[22] = 0x1234;
+    maestro.stalled.insert(0xA1);
+    CHECK_THROWS(device.deployScript(image));
+    CHECK_EQUAL(Device::SCRIPT_CRC_INCOMPLETE, maestro.parameters[22]);
+    maestro.stalled.clear();
+    CHECK_EQUAL(16 + bytecodeBlocks, device.deployScript(image));
+    CHECK_EQUAL(image.getCRC(), maestro.parameters[22]);
+
+    // A CRC that does not read back is an error.
+    maestro.parameters[22] = 0x1234;
+    maestro.ignoreCRC = true;
+    CHECK_THROWS(device.deployScript(image));
+    return CHECK_RESULT();
+}
@@ -0,0 +1,39 @@
+#include <maestro/Disassembler.h>
+#include <maestro/Program.h>
+
+#include "Check.h"
+
+using namespace Maestro;
+
+static const char* const SCRIPT =
+    "# Sweeps servo 0, and blinks the LED while a channel moves.\n"
+    "begin\n"
+    "    4000 0 servo 8000 1000 -300 0 get_position\n"
+    "    1 less_than if led_on else led_off endif\n"
+    "    wait_moving\n"
+    "    drop drop drop\n"
+    "repeat\n"
+    "sub wait_moving\n"
+    "    begin get_moving_state while 10 delay repeat\n"
+    "    return\n"
+    "sub unused goto done done: quit\n";
+
+int main() {
+    for (bool isMiniMaestro : {false, true}) {
+        const Program program(SCRIPT, isMiniMaestro);
+
+        // From the program, with its subroutine names.
+        const Disassembler named(program);
+        CHECK(named.roundTrips(isMiniMaestro));
+        CHECK_EQUAL(2u, named.getSubroutineCount());
+
+        // From the raw image, as read back from a device.
+        const Disassembler raw(program.getByteList(), program.getSubroutineTable());
+        CHECK(raw.roundTrips(isMiniMaestro));
+        const Program recompiled(raw.toSource(), isMiniMaestro);
+        CHECK(recompiled.getByteList() == program.getByteList());
+        CHECK(recompiled.getSubroutineTable() == program.getSubroutineTable());
+        CHECK_EQUAL(program.getCRC(), recompiled.getCRC());
+    }
+    return CHECK_RESULT();
+}
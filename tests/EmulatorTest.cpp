@@ -0,0 +1,94 @@
+#include <maestro/Emulator.h>
+#include <maestro/Opcode.h>
+#include <maestro/Profiler.h>
+#include <maestro/Program.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "Check.h"
+
+using namespace Maestro;
+
+static Emulator run(const std::string& script, bool isMiniMaestro = true) {
+    Emulator emulator(Program(script, isMiniMaestro), isMiniMaestro, 6);
+    emulator.setRecordEvents(true);
+    emulator.run(10000000);
+    return emulator;
+}
+
+int main() {
+    // Arithmetic and stack words.
+    Emulator arithmetic = run("10 20 plus 7 minus 3 times dup 2 swap quit");
+    CHECK(arithmetic.getStatus() == Emulator::Status::QUIT);
+    CHECK(arithmetic.getStack() == std::vector<int16_t>({69, 2, 69}));
+
+    // Control flow and subroutines.
+    Emulator control = run("0 begin dup 5 less_than while 1 plus repeat\n"
+                           "if 100 else 200 endif double quit\n"
+                           "sub double 2 times return");
+    CHECK(control.getStatus() == Emulator::Status::QUIT);
+    CHECK(control.getStack() == std::vector<int16_t>({200}));
+
+    // Servo commands are recorded at their virtual time: each instruction
+    // takes 100 us, and DELAY takes its argument in milliseconds.
+    Emulator servos = run("4000 0 servo 50 delay 8000 1 servo quit");
+    CHECK(servos.getStatus() == Emulator::Status::QUIT);
+    const std::vector<Emulator::Event>& events = servos.getEvents();
+    CHECK_EQUAL(2u, events.size());
+    if (events.size() == 2) {
+        CHECK_EQUAL(uint8_t(Opcode::SERVO), events[0].opcode);
+        CHECK_EQUAL(0, events[0].channel);
+        CHECK_EQUAL(4000, events[0].value);
+        CHECK_EQUAL(1, events[1].channel);
+        CHECK_EQUAL(8000, events[1].value);
+        CHECK(events[1].time >= events[0].time + 50000);
+    }
+    CHECK_EQUAL(8000, servos.getServoState(1).target);
+
+    // Errors of the firmware.
+    CHECK(run("drop quit").getStatus() == Emulator::Status::STACK_ERROR);
+    CHECK(run("return").getStatus() == Emulator::Status::CALL_STACK_ERROR);
+    CHECK(run("sub forever forever return\nforever").getStatus() == Emulator::Status::CALL_STACK_ERROR);
+
+    // A time limit pauses an endless script.
+    Emulator endless = run("begin 10 delay repeat");
+    CHECK(endless.getStatus() == Emulator::Status::RUNNING);
+    CHECK(endless.getTime() >= 10000000);
+
+    // Profiling from the emulator: one sample before each instruction.
+    const Program profiled("begin\nwork\nrepeat\nsub work\n1 2 plus drop\nleaf\nreturn\nsub leaf\n3 4 plus drop\nreturn", true);
+    Emulator stepped(profiled, true, 6);
+    Profiler profiler(profiled);
+    for (int i = 0; i < 1000; i++) {
+        profiler.addSample(stepped.getProgramCounter(), stepped.getCallStack());
+        stepped.run(UINT64_MAX, 1);
+    }
+    CHECK_EQUAL(1000u, profiler.getSampleCount());
+    CHECK_EQUAL(0u, profiler.getIdleSampleCount());
+    const std::map<std::string, uint64_t>& self = profiler.getSelfCounts();
+    const std::map<std::string, uint64_t>& total = profiler.getTotalCounts();
+    CHECK(self.count("(main)") == 1 && self.count("WORK") == 1 && self.count("LEAF") == 1);
+    if (self.size() == 3 && total.size() == 3) {
+        CHECK_EQUAL(1000u, self.at("(main)") + self.at("WORK") + self.at("LEAF"));
+        // Every sample is under the main loop, and LEAF is only called by WORK.
+        CHECK_EQUAL(1000u, total.at("(main)"));
+        CHECK_EQUAL(self.at("WORK") + self.at("LEAF"), total.at("WORK"));
+        CHECK_EQUAL(self.at("LEAF"), total.at("LEAF"));
+        // The lines of LEAF are where it executes.
+        uint64_t leafLines = 0;
+        for (const auto& line : profiler.getLineCounts()) {
+            leafLines += (line.first >= 7) ? line.second : 0;
+        }
+        CHECK_EQUAL(self.at("LEAF"), leafLines);
+        const std::string folded = profiler.toFoldedStacks();
+        CHECK(folded.find("(main);WORK;LEAF " + std::to_string(self.at("LEAF")) + "\n") != std::string::npos);
+        CHECK(folded.find("(main) " + std::to_string(self.at("(main)")) + "\n") != std::string::npos);
+    }
+    CHECK(profiler.toString().find("1000 samples, 0 while the script was stopped") != std::string::npos);
+    profiler.clear();
+    CHECK_EQUAL(0u, profiler.getSampleCount());
+    CHECK(profiler.getSelfCounts().empty());
+    return CHECK_RESULT();
+}
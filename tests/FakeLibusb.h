@@ -0,0 +1,194 @@
+#pragma once
+
+#include <libusb.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// The libusb functions used by Device, defined in place of the shared
+// library's by the test including this once: a Micro Maestro is played by
+// the test, which records the control requests it receives.  Only on Linux,
+// where the definitions of the executable take precedence.
+
+/// A control request received by the fake Maestro.
+struct ControlRequest {
+    uint8_t request;
+    uint16_t value;
+    uint16_t index;
+};
+
+struct FakeMaestro {
+    std::map<uint8_t, uint16_t> parameters;
+    std::map<uint16_t, std::array<uint8_t, 16>> flash;
+    /// The servos reach their targets at once.
+    std::array<uint16_t, 6> positions{};
+    std::vector<ControlRequest> requests;
+    /// The requests stalled, e.g. REQUEST_WRITE_SCRIPT as if the flash failed.
+    std::set<uint8_t> stalled;
+    /// The requests left pending until they are cancelled, as by a hung controller.
+    std::set<uint8_t> hung;
+    /// The requests completed only after their delay, as by a busy controller.
+    std::map<uint8_t, std::chrono::milliseconds> slow;
+    /// Ignores the writes of the script CRC.
+    bool ignoreCRC = false;
+    /// The transfers not completed yet, with the time they complete at.
+    std::deque<std::pair<libusb_transfer*, std::chrono::steady_clock::time_point>> pending;
+    std::deque<libusb_transfer*> completed;
+    /// Guards the fake against the threads cancelling transfers.  Held by
+    /// the test while it looks at the fake from another thread.
+    std::mutex mutex;
+
+    /// Handles the request in \a setup, with its data after it; returns the length transferred, or -1 for a stall.
+    int handle(unsigned char* setup) {
+        const uint8_t request = setup[1];
+        const uint16_t value = uint16_t(setup[2] | setup[3] << 8);
+        const uint16_t index = uint16_t(setup[4] | setup[5] << 8);
+        const uint16_t length = uint16_t(setup[6] | setup[7] << 8);
+        unsigned char* data = setup + LIBUSB_CONTROL_SETUP_SIZE;
+        requests.push_back({request, value, index});
+        if (stalled.count(request) != 0) {
+            return -1;
+        }
+        switch (request) {
+            case 0x81:  // REQUEST_GET_PARAMETER
+                data[0] = uint8_t(parameters[uint8_t(index)]);
+                data[1] = uint8_t(parameters[uint8_t(index)] >> 8);
+                return length;
+            case 0x82:  // REQUEST_SET_PARAMETER
+                if (!(ignoreCRC && uint8_t(index) == 22)) {
+                    parameters[uint8_t(index)] = value;
+                }
+                return 0;
+            case 0x85:  // REQUEST_SET_TARGET
+                positions.at(index) = value;
+                return 0;
+            case 0x87:  // REQUEST_GET_SERVO_SETTINGS
+                std::memset(data, 0, length);
+                for (size_t channel = 0; channel < positions.size() && 7 * channel + 4 <= length; channel++) {
+                    for (int i = 0; i < 4; i++) {
+                        data[7 * channel + i] = uint8_t(positions[channel] >> (8 * (i % 2)));
+                    }
+                }
+                return length;
+            case 0xA0:  // REQUEST_ERASE_SCRIPT
+                flash.clear();
+                return 0;
+            case 0xA1:  // REQUEST_WRITE_SCRIPT
+                std::copy_n(data, 16, flash[index].begin());
+                return length;
+            default:
+                return 0;
+        }
+    }
+};
+
+static FakeMaestro maestro;
+static char fakeContext, fakeDevice, fakeHandle;
+
+int libusb_init(libusb_context** context) {
+    *context = reinterpret_cast<libusb_context*>(&fakeContext);
+    return 0;
+}
+void libusb_exit(libusb_context*) {}
+ssize_t libusb_get_device_list(libusb_context*, libusb_device*** list) {
+    static libusb_device* devices[] = {reinterpret_cast<libusb_device*>(&fakeDevice), nullptr};
+    *list = devices;
+    return 1;
+}
+void libusb_free_device_list(libusb_device**, int) {}
+int libusb_get_device_descriptor(libusb_device*, libusb_device_descriptor* descriptor) {
+    std::memset(descriptor, 0, sizeof(*descriptor));
+    descriptor->idVendor = 0x1ffb;
+    descriptor->idProduct = 0x0089;
+    return 0;
+}
+libusb_device* libusb_ref_device(libusb_device* device) { return device; }
+void libusb_unref_device(libusb_device*) {}
+uint8_t libusb_get_bus_number(libusb_device*) { return 1; }
+uint8_t libusb_get_device_address(libusb_device*) { return 2; }
+int libusb_get_port_numbers(libusb_device*, uint8_t* ports, int) {
+    ports[0] = 3;
+    return 1;
+}
+int libusb_open(libusb_device*, libusb_device_handle** handle) {
+    *handle = reinterpret_cast<libusb_device_handle*>(&fakeHandle);
+    return 0;
+}
+void libusb_close(libusb_device_handle*) {}
+int libusb_get_string_descriptor_ascii(libusb_device_handle*, uint8_t, unsigned char*, int) { return 0; }
+int libusb_control_transfer(libusb_device_handle*, uint8_t, uint8_t, uint16_t, uint16_t, unsigned char*, uint16_t, unsigned int) {
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+int libusb_has_capability(uint32_t) { return 0; }
+int libusb_hotplug_register_callback(libusb_context*, libusb_hotplug_event, libusb_hotplug_flag, int, int, int, libusb_hotplug_callback_fn, void*,
+                                     libusb_hotplug_callback_handle*) {
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+void libusb_hotplug_deregister_callback(libusb_context*, libusb_hotplug_callback_handle) {}
+libusb_transfer* libusb_alloc_transfer(int) { return static_cast<libusb_transfer*>(std::calloc(1, sizeof(libusb_transfer))); }
+void libusb_free_transfer(libusb_transfer* transfer) { std::free(transfer); }
+/// The requests are handled at once, and completed by the next event handling.
+int libusb_submit_transfer(libusb_transfer* transfer) {
+    std::lock_guard<std::mutex> lock(maestro.mutex);
+    const int length = maestro.handle(transfer->buffer);
+    transfer->status = (length < 0) ? LIBUSB_TRANSFER_STALL : LIBUSB_TRANSFER_COMPLETED;
+    transfer->actual_length = (length < 0) ? 0 : length;
+    const uint8_t request = transfer->buffer[1];
+    if (maestro.hung.count(request) != 0) {
+        maestro.pending.push_back(std::make_pair(transfer, std::chrono::steady_clock::time_point::max()));
+    } else if (maestro.slow.count(request) != 0) {
+        maestro.pending.push_back(std::make_pair(transfer, std::chrono::steady_clock::now() + maestro.slow[request]));
+    } else {
+        maestro.completed.push_back(transfer);
+    }
+    return 0;
+}
+int libusb_cancel_transfer(libusb_transfer* transfer) {
+    std::lock_guard<std::mutex> lock(maestro.mutex);
+    const auto pending = std::find_if(maestro.pending.begin(), maestro.pending.end(),
+                                      [transfer](const std::pair<libusb_transfer*, std::chrono::steady_clock::time_point>& entry) {
+                                          return entry.first == transfer;
+                                      });
+    if (pending == maestro.pending.end()) {
+        return LIBUSB_ERROR_NOT_FOUND;
+    }
+    maestro.pending.erase(pending);
+    transfer->status = LIBUSB_TRANSFER_CANCELLED;
+    transfer->actual_length = 0;
+    maestro.completed.push_back(transfer);
+    return 0;
+}
+/// Completes the transfers outside of the lock, since their callbacks may submit others.
+int libusb_handle_events_timeout_completed(libusb_context*, timeval*, int*) {
+    std::deque<libusb_transfer*> completed;
+    {
+        std::lock_guard<std::mutex> lock(maestro.mutex);
+        const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        for (auto entry = maestro.pending.begin(); entry != maestro.pending.end();) {
+            if (entry->second <= now) {
+                maestro.completed.push_back(entry->first);
+                entry = maestro.pending.erase(entry);
+            } else {
+                ++entry;
+            }
+        }
+        completed.swap(maestro.completed);
+    }
+    if (completed.empty()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    for (libusb_transfer* transfer : completed) {
+        transfer->callback(transfer);
+    }
+    return 0;
+}
@@ -0,0 +1,74 @@
+#include <maestro/IncrementalCompiler.h>
+#include <maestro/Program.h>
+
+#include <string>
+#include <vector>
+
+#include "Check.h"
+
+using namespace Maestro;
+
+/// True if \a compiler holds the same program as a full compile of \a script.
+static bool matchesFullCompile(const IncrementalCompiler& compiler, const std::string& script) {
+    const Program program(script, true);
+    const std::vector<SourceLocation> expected = program.getSourceMap();
+    const std::vector<SourceLocation> actual = compiler.getProgram().getSourceMap();
+    bool sameMap = expected.size() == actual.size();
+    for (size_t i = 0; sameMap && i < expected.size(); i++) {
+        sameMap = expected[i].address == actual[i].address && expected[i].lineNumber == actual[i].lineNumber &&
+                  expected[i].columnNumber == actual[i].columnNumber;
+    }
+    return sameMap && compiler.getByteList() == program.getByteList() && compiler.getProgram().getSubroutineTable() == program.getSubroutineTable();
+}
+
+int main() {
+    IncrementalCompiler compiler(true);
+    CHECK_THROWS(compiler.getProgram());
+
+    // The first script is compiled in full, and all of it has changed.
+    const std::string script = "begin\n100 0 servo 50 delay\n2000 0 servo 50 delay\nrepeat\nsub wave 1 return";
+    std::vector<IncrementalCompiler::ByteRange> changes = compiler.update(script);
+    CHECK(compiler.getLastUpdate() == IncrementalCompiler::Update::REBUILT);
+    CHECK(compiler.subroutineTableChanged());
+    CHECK(matchesFullCompile(compiler, script));
+    CHECK_EQUAL(1u, changes.size());
+    if (changes.size() == 1) {
+        CHECK_EQUAL(0, changes[0].address);
+        CHECK_EQUAL(compiler.getByteList().size(), size_t(changes[0].length));
+    }
+
+    CHECK(compiler.update(script).empty());
+    CHECK(compiler.getLastUpdate() == IncrementalCompiler::Update::UNCHANGED);
+
+    // A literal keeping its 8-bit encoding is patched in place: one byte changes.
+    const std::string patched = "begin\n200 0 servo 50 delay\n2000 0 servo 50 delay\nrepeat\nsub wave 1 return";
+    changes = compiler.update(patched);
+    CHECK(compiler.getLastUpdate() == IncrementalCompiler::Update::PATCHED);
+    CHECK(!compiler.subroutineTableChanged());
+    CHECK(matchesFullCompile(compiler, patched));
+    CHECK_EQUAL(1u, changes.size());
+    if (changes.size() == 1) {
+        CHECK_EQUAL(1, changes[0].length);
+    }
+
+    // So is a 16-bit literal, and the columns that moved follow.
+    const std::string moved = "begin\n200 0 servo 50 delay\n1500   0 servo 50 delay\nrepeat\nsub wave 1 return";
+    compiler.update(moved);
+    CHECK(compiler.getLastUpdate() == IncrementalCompiler::Update::PATCHED);
+    CHECK(matchesFullCompile(compiler, moved));
+
+    // A literal needing 16 bits relocates what follows, and a new subroutine changes the table.
+    const std::string rebuilt = "begin\n1000 0 servo 50 delay\n1500   0 servo 50 delay\nrepeat\nsub first 0 return\nsub wave 1 return";
+    compiler.update(rebuilt);
+    CHECK(compiler.getLastUpdate() == IncrementalCompiler::Update::REBUILT);
+    CHECK(compiler.subroutineTableChanged());
+    CHECK(matchesFullCompile(compiler, rebuilt));
+
+    // A script with errors throws, and the previous program is kept.
+    CHECK_THROWS(compiler.update("begin\n1000 0 servo\nbogus"));
+    CHECK(matchesFullCompile(compiler, rebuilt));
+    // An out-of-range literal too, although it would be patched.
+    CHECK_THROWS(compiler.update("begin\n99999 0 servo 50 delay\n1500   0 servo 50 delay\nrepeat\nsub first 0 return\nsub wave 1 return"));
+    CHECK(matchesFullCompile(compiler, rebuilt));
+    return CHECK_RESULT();
+}
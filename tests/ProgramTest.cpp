@@ -0,0 +1,151 @@
+#include <maestro/Emulator.h>
+#include <maestro/Opcode.h>
+#include <maestro/Program.h>
+
+#include <string>
+#include <vector>
+
+#include "Check.h"
+
+using namespace Maestro;
+
+/// The stack left by \a program when it quits.
+static std::vector<int16_t> run(const Program& program, bool isMiniMaestro = true) {
+    Emulator emulator(program, isMiniMaestro, 6);
+    emulator.run(10000000);
+    CHECK(emulator.getStatus() == Emulator::Status::QUIT);
+    return emulator.getStack();
+}
+
+/// The number of subroutines generated by outlining.
+static size_t countOutlined(const Program& program) {
+    size_t count = 0;
+    for (const auto& subroutine : program.getSubroutineAddresses()) {
+        count += (subroutine.first.compare(0, 9, "outlined_") == 0) ? 1 : 0;
+    }
+    return count;
+}
+
+int main() {
+    // Subroutine numbers: 130 subroutines, of which only the last and the first are called.
+    std::string script = "0 s129 s129 s129 s129 s129 s0 quit\n";
+    for (int i = 0; i < 130; i++) {
+        script += "sub s" + std::to_string(i) + " " + std::to_string(i + 1) + " plus return\n";
+    }
+    const Program defined(script, true);
+    CHECK_EQUAL(128u, defined.getSubroutineNumbers().size());
+    CHECK_EQUAL(0, defined.getSubroutineNumbers().at("S0"));
+    CHECK(defined.getSubroutineNumbers().count("S129") == 0);
+
+    // By call count, the one-byte opcodes go to the most called subroutines first.
+    CompileOptions byCallCount;
+    byCallCount.allocateSubroutinesByCallCount = true;
+    const Program allocated(script, true, byCallCount);
+    CHECK_EQUAL(128u, allocated.getSubroutineNumbers().size());
+    CHECK_EQUAL(0, allocated.getSubroutineNumbers().at("S129"));
+    CHECK_EQUAL(1, allocated.getSubroutineNumbers().at("S0"));
+    CHECK(allocated.getSubroutineNumbers().count("S127") == 0);
+    // The five calls of S129 take one byte instead of three.
+    CHECK_EQUAL(defined.getByteList().size() - 10, allocated.getByteList().size());
+    CHECK(run(defined) == std::vector<int16_t>({651}));
+    CHECK(run(allocated) == run(defined));
+
+    // A pinned subroutine keeps its number, and a profile overrides the static counts.
+    CompileOptions pinned = byCallCount;
+    pinned.pinnedSubroutines = {"s5"};
+    pinned.callProfile = {{"s128", 100}};
+    const Program profiled(script, true, pinned);
+    CHECK_EQUAL(5, profiled.getSubroutineNumbers().at("S5"));
+    CHECK_EQUAL(0, profiled.getSubroutineNumbers().at("S128"));
+    CHECK_EQUAL(1, profiled.getSubroutineNumbers().at("S129"));
+    CHECK(run(profiled) == run(defined));
+
+    // Only the first 128 subroutines have a number to pin, and the Micro Maestro has no CALL.
+    CompileOptions pinnedTooFar = byCallCount;
+    pinnedTooFar.pinnedSubroutines = {"s128"};
+    CHECK_THROWS(Program(script, true, pinnedTooFar));
+    CHECK_THROWS(Program(script, false, byCallCount));
+
+    // Outlining: a repeated run moves to a generated subroutine, called from each copy.
+    const std::string repeated = "1 2 3 4 5 plus plus plus plus\n";
+    const std::string copies = repeated + repeated + repeated + "quit";
+    CompileOptions outline;
+    outline.outlineRepeatedSequences = true;
+    const Program plain(copies, true);
+    const Program outlined(copies, true, outline);
+    CHECK_EQUAL(1u, countOutlined(outlined));
+    CHECK(outlined.getByteList().size() < plain.getByteList().size());
+    CHECK(outlined.toString().find("sub outlined_") != std::string::npos);
+    CHECK(run(plain) == std::vector<int16_t>({15, 15, 15}));
+    CHECK(run(outlined) == run(plain));
+
+    // The call of an outlined run needs a free level on the call stack, of
+    // which the Micro Maestro has 10: none is left in the 10th nested subroutine.
+    for (int levels = 9; levels <= 10; levels++) {
+        std::string nested = "d1 quit\n";
+        for (int i = 1; i < levels; i++) {
+            nested += "sub d" + std::to_string(i) + " d" + std::to_string(i + 1) + " return\n";
+        }
+        nested += "sub d" + std::to_string(levels) + " " + repeated + repeated + repeated + "return\n";
+        const Program nestedOutlined(nested, false, outline);
+        CHECK_EQUAL(levels < 10 ? 1u : 0u, countOutlined(nestedOutlined));
+        CHECK(run(nestedOutlined, false) == std::vector<int16_t>({15, 15, 15}));
+    }
+
+    // The compact instructions: 16 bytes each, literals in a pool, names interned without case.
+    CHECK_EQUAL(16u, sizeof(Instruction));
+    CHECK(Program("100 0 servo", true).getByteList() ==
+          std::vector<uint8_t>({uint8_t(Opcode::LITERAL8_N), 2, 100, 0, uint8_t(Opcode::SERVO)}));
+    CHECK(Program("1000 -1 quit", true).getByteList() ==
+          std::vector<uint8_t>({uint8_t(Opcode::LITERAL_N), 4, 0xE8, 0x03, 0xFF, 0xFF, uint8_t(Opcode::QUIT)}));
+    CHECK(Program("sub Foo 1 return\nfoo FOO", true).getByteList() ==
+          std::vector<uint8_t>({uint8_t(Opcode::LITERAL8), 1, uint8_t(Opcode::RETURN), 128, 128}));
+
+    // The line takes 20 bits of the packed location and the column 12, saturated.
+    const Program lastLine(std::string(5000, '\n') + std::string(5000, ' ') + "quit", true);
+    CHECK_EQUAL(1u, lastLine.getSourceMap().size());
+    if (lastLine.getSourceMap().size() == 1) {
+        CHECK_EQUAL(5000, lastLine.getSourceMap()[0].lineNumber);
+        CHECK_EQUAL(4095, lastLine.getSourceMap()[0].columnNumber);
+    }
+
+    // Diagnostics: every error is reported at its word, and the rest still compiles.
+    const std::string errors = "1 2 bogus\ngoto nowhere\n3 4 plus\nsub x return\nsub x return\nrepeat\nbegin";
+    CompileOptions collect;
+    collect.collectDiagnostics = true;
+    const Program diagnosed(errors, true, collect);
+    CHECK(diagnosed.hasErrors());
+    const std::vector<Diagnostic>& diagnostics = diagnosed.getDiagnostics();
+    CHECK_EQUAL(5u, diagnostics.size());
+    if (diagnostics.size() == 5) {
+        CHECK_EQUAL(0, diagnostics[0].lineNumber);
+        CHECK_EQUAL(5, diagnostics[0].columnNumber);
+        CHECK(diagnostics[0].message == "Did not understand 'BOGUS'");
+        CHECK_EQUAL(1, diagnostics[1].lineNumber);
+        CHECK_EQUAL(4, diagnostics[2].lineNumber);
+        CHECK(diagnostics[3].message == "Found REPEAT without a corresponding BEGIN.");
+        CHECK(diagnostics[4].message == "BEGIN block was never closed.");
+    }
+    CHECK(diagnosed.getSubroutineAddresses().count("X") == 1);
+    CHECK(diagnosed.toString().find("3 4 plus") != std::string::npos);
+    CHECK(!Program("1 2 plus", true, collect).hasErrors());
+
+    // Without them, the first error found throws with its location.  Unknown
+    // words are taken for calls, which are only resolved after parsing.
+    std::string firstError;
+    try {
+        Program program(errors, true);
+    } catch (const std::string& e) {
+        firstError = e;
+    }
+    CHECK(firstError == "script:5:1: Found REPEAT without a corresponding BEGIN.");
+    try {
+        Program program("1 2 bogus\n3", true);
+    } catch (const std::string& e) {
+        firstError = e;
+    }
+    CHECK(firstError == "script:0:5: Did not understand 'BOGUS'");
+    CHECK_THROWS(Program("repeat", true));
+    CHECK_THROWS(Program("1 else", true));
+    return CHECK_RESULT();
+}
@@ -0,0 +1,84 @@
+#include <maestro/Program.h>
+#include <maestro/ScriptArtifact.h>
+
+#include <cstdio>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Check.h"
+
+using namespace Maestro;
+
+/// True if \a artifact holds \a program, with its source map and symbols.
+static bool matchesProgram(const ScriptArtifact& artifact, const Program& program) {
+    const std::vector<SourceLocation> expected = program.getSourceMap();
+    const std::vector<SourceLocation> actual = artifact.getSourceMap();
+    bool sameMap = expected.size() == actual.size();
+    for (size_t i = 0; sameMap && i < expected.size(); i++) {
+        sameMap = expected[i].address == actual[i].address && expected[i].lineNumber == actual[i].lineNumber &&
+                  expected[i].columnNumber == actual[i].columnNumber;
+    }
+    const std::vector<uint8_t> bytecode(artifact.getBytecode(), artifact.getBytecode() + artifact.getBytecodeSize());
+    return sameMap && bytecode == program.getByteList() && artifact.getSubroutineTable() == program.getSubroutineTable() &&
+           artifact.getCRC() == program.getCRC() && artifact.getSubroutineAddresses() == program.getSubroutineAddresses() &&
+           artifact.getSubroutineNumbers() == program.getSubroutineNumbers();
+}
+
+int main() {
+    const Program program("begin\n100 0 servo wave\n2000 0 servo wave\nrepeat\nsub wave 50 delay return\nsub unused return", true);
+    const std::vector<uint8_t> data = ScriptArtifact::serialize(program, true);
+
+    // In memory.
+    const ScriptArtifact inMemory(data.data(), data.size());
+    CHECK(inMemory.isMiniMaestro());
+    CHECK(inMemory.hasSourceMap());
+    CHECK(inMemory.hasSymbols());
+    CHECK(inMemory.getBytecode() == data.data() + 288);
+    CHECK(matchesProgram(inMemory, program));
+
+    // Mapped from a file, and moved.
+    const std::string path = "ScriptArtifactTest.msa";
+    ScriptArtifact::write(path, program, true);
+    {
+        ScriptArtifact mapped(path);
+        CHECK(matchesProgram(mapped, program));
+        ScriptArtifact moved(std::move(mapped));
+        CHECK(matchesProgram(moved, program));
+    }
+    std::remove(path.c_str());
+    CHECK_THROWS(ScriptArtifact{path});
+
+    // The optional sections can be left out.
+    const std::vector<uint8_t> bare = ScriptArtifact::serialize(program, false, false, false);
+    const ScriptArtifact bareArtifact(bare.data(), bare.size());
+    CHECK(!bareArtifact.isMiniMaestro());
+    CHECK(!bareArtifact.hasSourceMap() && bareArtifact.getSourceMap().empty());
+    CHECK(!bareArtifact.hasSymbols() && bareArtifact.getSubroutineAddresses().empty());
+    CHECK_EQUAL(program.getCRC(), bareArtifact.getCRC());
+    CHECK_EQUAL(288 + program.getByteList().size(), bare.size());
+
+    // Every truncation is rejected, whichever section it cuts.
+    for (size_t size = 0; size < data.size(); size++) {
+        CHECK_THROWS(ScriptArtifact(data.data(), size));
+    }
+
+    // So are a wrong magic or version, and a changed byte of the bytecode or of the table.
+    std::vector<uint8_t> corrupted = data;
+    corrupted[0] = 'X';
+    CHECK_THROWS(ScriptArtifact(corrupted.data(), corrupted.size()));
+    corrupted = data;
+    corrupted[4] = ScriptArtifact::VERSION + 1;
+    CHECK_THROWS(ScriptArtifact(corrupted.data(), corrupted.size()));
+    corrupted = data;
+    corrupted[288] ^= 0x01;
+    CHECK_THROWS(ScriptArtifact(corrupted.data(), corrupted.size()));
+    corrupted = data;
+    corrupted[32] ^= 0x01;
+    CHECK_THROWS(ScriptArtifact(corrupted.data(), corrupted.size()));
+    // A section claimed past the end.
+    corrupted = data;
+    corrupted[23] = 0x10;
+    CHECK_THROWS(ScriptArtifact(corrupted.data(), corrupted.size()));
+    return CHECK_RESULT();
+}
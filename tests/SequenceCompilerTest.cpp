@@ -0,0 +1,54 @@
+#include <maestro/Emulator.h>
+#include <maestro/Opcode.h>
+#include <maestro/SequenceCompiler.h>
+
+#include "Check.h"
+
+using namespace Maestro;
+
+int main() {
+    SequenceCompiler compiler(true);
+    compiler.addSequence("wave", {{{ChannelTarget(0, 4000, 20), ChannelTarget(1, 5000)}, 100},
+                                  {{ChannelTarget(0, 8000), ChannelTarget(1, 7000)}, 200},
+                                  {{ChannelTarget(2, 6000, -1, 4)}, 50}});
+    compiler.addSequence("nod", {{{ChannelTarget(3, 6000)}, 10}}, true);
+    const Program program = compiler.compile();
+    const std::map<std::string, uint8_t> numbers = program.getSubroutineNumbers();
+    CHECK(numbers.count("WAVE") == 1 && numbers.count("NOD") == 1);
+
+    // The main code does nothing.
+    Emulator idle(program, true, 6);
+    CHECK(idle.run() == Emulator::Status::QUIT);
+
+    Emulator wave(program, true, 6);
+    wave.setRecordEvents(true);
+    wave.restartAtSubroutine(numbers.at("WAVE"));
+    CHECK(wave.run(1000000) == Emulator::Status::QUIT);
+    std::vector<Emulator::Event> targets;
+    std::vector<Emulator::Event> limits;
+    for (const Emulator::Event& event : wave.getEvents()) {
+        (event.opcode == uint8_t(Opcode::SERVO) ? targets : limits).push_back(event);
+    }
+    // The targets of a frame are set together, in any order.
+    CHECK_EQUAL(5u, targets.size());
+    if (targets.size() == 5) {
+        CHECK_EQUAL(4000 + 5000, targets[0].value + targets[1].value);
+        CHECK(targets[1].time - targets[0].time < 1000);
+        CHECK_EQUAL(8000 + 7000, targets[2].value + targets[3].value);
+        CHECK_EQUAL(2, targets[4].channel);
+        CHECK_EQUAL(6000, targets[4].value);
+        // The frames start after the durations of the previous ones.
+        CHECK(targets[2].time >= targets[0].time + 100000);
+        CHECK(targets[4].time >= targets[2].time + 200000);
+    }
+    CHECK_EQUAL(8000, wave.getServoState(0).target);
+    CHECK_EQUAL(7000, wave.getServoState(1).target);
+    // A speed for channel 0 and an acceleration for channel 2, set once.
+    CHECK_EQUAL(2u, limits.size());
+
+    // A looping sequence never ends.
+    Emulator nod(program, true, 6);
+    nod.restartAtSubroutine(numbers.at("NOD"));
+    CHECK(nod.run(1000000) == Emulator::Status::RUNNING);
+    return CHECK_RESULT();
+}
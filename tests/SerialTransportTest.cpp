@@ -0,0 +1,206 @@
+#include <maestro/SerialTransport.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Check.h"
+
+using namespace Maestro;
+
+/// A pseudo-terminal: the transport writes to the slave side and the test
+/// plays the Maestro on the master side.
+struct Pty {
+    int master = -1;
+    int slave = -1;
+
+    Pty() {
+        master = posix_openpt(O_RDWR | O_NOCTTY);
+        if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+            throw std::string("Cannot create a pty.");
+        }
+        slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+        termios settings;
+        if (slave < 0 || tcgetattr(slave, &settings) != 0) {
+            throw std::string("Cannot open the pty.");
+        }
+        // No translation of the bytes by the line discipline, e.g. of 0x0A.
+        cfmakeraw(&settings);
+        tcsetattr(slave, TCSANOW, &settings);
+    }
+
+    ~Pty() {
+        close(slave);
+        close(master);
+    }
+
+    /// The bytes received from the transport within \a timeoutMs.
+    std::vector<uint8_t> read(int timeoutMs = 100) const {
+        std::vector<uint8_t> bytes;
+        pollfd descriptor = {master, POLLIN, 0};
+        while (poll(&descriptor, 1, timeoutMs) > 0) {
+            uint8_t buffer[256];
+            const ssize_t size = ::read(master, buffer, sizeof(buffer));
+            if (size <= 0) {
+                break;
+            }
+            bytes.insert(bytes.end(), buffer, buffer + size);
+            timeoutMs = 10;
+        }
+        return bytes;
+    }
+
+    void write(const std::vector<uint8_t>& bytes) const {
+        CHECK(::write(master, bytes.data(), bytes.size()) == ssize_t(bytes.size()));
+    }
+};
+
+/// The CRC-7 of the Maestro documentation, one bit at a time.
+static uint8_t referenceCrc7(const std::vector<uint8_t>& data) {
+    uint8_t crc = 0;
+    for (uint8_t byte : data) {
+        crc ^= byte;
+        for (int bit = 0; bit < 8; bit++) {
+            if (crc & 1) {
+                crc ^= 0x91;
+            }
+            crc >>= 1;
+        }
+    }
+    return crc;
+}
+
+/// Answers the next query of the transport with \a answer, once its \a commandSize bytes are received.
+static std::thread answer(const Pty& pty, size_t commandSize, std::vector<uint8_t> answer, std::vector<uint8_t>& command) {
+    return std::thread([&pty, commandSize, answer, &command]() {
+        while (command.size() < commandSize) {
+            const std::vector<uint8_t> bytes = pty.read(1000);
+            if (bytes.empty()) {
+                return;
+            }
+            command.insert(command.end(), bytes.begin(), bytes.end());
+        }
+        pty.write(answer);
+    });
+}
+
+int main() {
+    // Values from the serial command examples of the Maestro user's guide.
+    const std::vector<uint8_t> crcExample = {0x83, 0x01};
+    CHECK_EQUAL(0x17, SerialTransport::computeCRC7(crcExample.data(), crcExample.size()));
+    for (int length = 0; length < 64; length++) {
+        std::vector<uint8_t> data;
+        for (int i = 0; i < length; i++) {
+            data.push_back(uint8_t(i * 37 + length));
+        }
+        CHECK_EQUAL(referenceCrc7(data), SerialTransport::computeCRC7(data.data(), data.size()));
+    }
+
+    Pty pty;
+    SerialTransport transport(pty.slave);
+
+    // Compact protocol: the command byte, then 7-bit data bytes.
+    transport.setProtocol(SerialTransport::Protocol::COMPACT);
+    transport.setTarget(12, 0, 6000);
+    CHECK(pty.read() == std::vector<uint8_t>({0x84, 0x00, 0x70, 0x2E}));
+    transport.setSpeed(12, 1, 140);
+    CHECK(pty.read() == std::vector<uint8_t>({0x87, 0x01, 0x0C, 0x01}));
+    transport.setAcceleration(12, 5, 4);
+    CHECK(pty.read() == std::vector<uint8_t>({0x89, 0x05, 0x04, 0x00}));
+    const uint16_t targets[] = {1500 * 4, 1000 * 4};
+    transport.setTargets(12, 3, targets, 2);
+    CHECK(pty.read() == std::vector<uint8_t>({0x9F, 0x02, 0x03, 0x70, 0x2E, 0x20, 0x1F}));
+    transport.goHome(12);
+    CHECK(pty.read() == std::vector<uint8_t>({0xA2}));
+
+    // Pololu protocol: 0xAA, the device number, then the command without its high bit.
+    transport.setProtocol(SerialTransport::Protocol::POLOLU);
+    transport.setTarget(SerialTransport::DEFAULT_DEVICE_NUMBER, 0, 6000);
+    CHECK(pty.read() == std::vector<uint8_t>({0xAA, 0x0C, 0x04, 0x00, 0x70, 0x2E}));
+    transport.restartScriptAtSubroutineWithParameter(1, 2, 300);
+    CHECK(pty.read() == std::vector<uint8_t>({0xAA, 0x01, 0x28, 0x02, 0x2C, 0x02}));
+
+    // The CRC-7 ends each command and covers all of it.
+    transport.setCrcEnabled(true);
+    transport.setTarget(SerialTransport::DEFAULT_DEVICE_NUMBER, 0, 6000);
+    const std::vector<uint8_t> pololuTarget = {0xAA, 0x0C, 0x04, 0x00, 0x70, 0x2E};
+    std::vector<uint8_t> expected = pololuTarget;
+    expected.push_back(referenceCrc7(pololuTarget));
+    CHECK(pty.read() == expected);
+    transport.setProtocol(SerialTransport::Protocol::COMPACT);
+    transport.stopScript(0);
+    CHECK(pty.read() == std::vector<uint8_t>({0xA4, referenceCrc7({0xA4})}));
+    transport.setCrcEnabled(false);
+
+    // Buffered commands are written together by flush().
+    transport.setBuffered(true);
+    transport.setTarget(0, 1, 4000);
+    transport.setTarget(0, 2, 8000);
+    CHECK(pty.read(20).empty());
+    transport.flush();
+    CHECK(pty.read() == std::vector<uint8_t>({0x84, 0x01, 0x20, 0x1F, 0x84, 0x02, 0x40, 0x3E}));
+    transport.setBuffered(false);
+
+    // Mini SSC: no device number and no CRC.
+    transport.setMiniSscTarget(3, 127);
+    CHECK(pty.read() == std::vector<uint8_t>({0xFF, 0x03, 0x7F}));
+
+    // Invalid arguments throw before anything is sent.
+    CHECK_THROWS(transport.setTarget(0, 128, 6000));
+    CHECK_THROWS(transport.setSpeed(0, 200, 0));
+    CHECK_THROWS(transport.setAcceleration(0, 255, 0));
+    CHECK_THROWS(transport.getPosition(0, 128));
+    CHECK_THROWS(transport.setTargets(0, 20, targets, 5));
+    CHECK_THROWS(transport.setMiniSscTarget(0xFF, 0));
+    transport.setProtocol(SerialTransport::Protocol::POLOLU);
+    CHECK_THROWS(transport.setTarget(128, 0, 6000));
+    CHECK(pty.read(20).empty());
+
+    // Replies: words are little-endian, and a script status of 0 means running.
+    transport.setTimeout(std::chrono::milliseconds(2000));
+    std::vector<uint8_t> command;
+    std::thread maestro = answer(pty, 4, {0x70, 0x17}, command);
+    CHECK_EQUAL(6000, transport.getPosition(7, 5));
+    maestro.join();
+    CHECK(command == std::vector<uint8_t>({0xAA, 0x07, 0x10, 0x05}));
+
+    command.clear();
+    maestro = answer(pty, 3, {0x00}, command);
+    CHECK(transport.isScriptRunning(7));
+    maestro.join();
+    CHECK(command == std::vector<uint8_t>({0xAA, 0x07, 0x2E}));
+
+    command.clear();
+    maestro = answer(pty, 3, {0x01}, command);
+    CHECK(transport.getMovingState(7));
+    maestro.join();
+
+    command.clear();
+    maestro = answer(pty, 3, {0x10, 0x01}, command);
+    CHECK_EQUAL(0x0110, transport.getErrors(7));
+    maestro.join();
+
+    // No reply within the timeout.
+    transport.setTimeout(std::chrono::milliseconds(50));
+    CHECK_THROWS(transport.getErrors(7));
+    pty.read();
+
+    // A late reply of a timed out query is dropped by the next query.
+    pty.write({0x55});
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    command.clear();
+    transport.setTimeout(std::chrono::milliseconds(2000));
+    maestro = answer(pty, 3, {0x00, 0x00}, command);
+    CHECK_EQUAL(0, transport.getErrors(7));
+    maestro.join();
+
+    return CHECK_RESULT();
+}
@@ -0,0 +1,111 @@
+#include <maestro/Device.h>
+#include <maestro/ThreadSafeDevice.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Check.h"
+#include "FakeLibusb.h"
+
+using namespace Maestro;
+
+/// The number of requests \a request received by the fake Maestro.
+static size_t countRequests(uint8_t request) {
+    std::lock_guard<std::mutex> lock(maestro.mutex);
+    size_t count = 0;
+    for (const ControlRequest& received : maestro.requests) {
+        count += (received.request == request) ? 1 : 0;
+    }
+    return count;
+}
+
+int main() {
+    std::vector<Device> devices = Device::getConnectedDevices();
+    CHECK_EQUAL(1u, devices.size());
+    if (devices.size() != 1) {
+        return CHECK_RESULT();
+    }
+    ThreadSafeDevice device(devices[0]);
+
+    // Commands and queries of several threads are made in order by the thread of the device.
+    device.setTarget(0, 4000);
+    device.setTarget(1, 5000);
+    const std::vector<Device::ServoStatus> status = device.getServoStatus();
+    CHECK_EQUAL(4000, status.at(0).position);
+    CHECK_EQUAL(5000, status.at(1).position);
+    std::vector<std::thread> threads;
+    for (uint8_t channel = 2; channel < 6; channel++) {
+        threads.push_back(std::thread([&device, channel] { device.setTarget(channel, uint16_t(6000 + channel)); }));
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    device.flush();
+    CHECK_EQUAL(6005, device.getServoStatus().at(5).position);
+
+    // An emergency stop during a hung query: the query fails as cancelled, the
+    // command queued behind it is dropped, and every target is set to 0.
+    {
+        std::lock_guard<std::mutex> lock(maestro.mutex);
+        maestro.hung.insert(0x87);
+    }
+    const size_t readsBefore = countRequests(0x87);
+    std::string error;
+    std::thread reader([&device, &error] {
+        try {
+            device.getServoStatus();
+        } catch (const std::string& e) {
+            error = e;
+        } catch (const char* e) {
+            error = e;
+        }
+    });
+    while (countRequests(0x87) == readsBefore) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    device.setTarget(0, 7000);
+    device.emergencyStop();
+    reader.join();
+    CHECK(!error.empty());
+    {
+        std::lock_guard<std::mutex> lock(maestro.mutex);
+        maestro.hung.clear();
+    }
+    device.flush();
+    CHECK_EQUAL(0u, device.getErrorCount());
+    {
+        std::lock_guard<std::mutex> lock(maestro.mutex);
+        CHECK(maestro.positions == (std::array<uint16_t, 6>{}));
+        for (const ControlRequest& received : maestro.requests) {
+            CHECK(!(received.request == 0x85 && received.value == 7000));
+        }
+    }
+
+    // An emergency stop during a slow command: the command fails as
+    // cancelled, and the stop that follows it is not cancelled with it.
+    const uint32_t errorsBefore = device.getErrorCount();
+    {
+        std::lock_guard<std::mutex> lock(maestro.mutex);
+        maestro.slow[0x85] = std::chrono::milliseconds(50);
+    }
+    const size_t targetsBefore = countRequests(0x85);
+    device.setTarget(0, 7000);
+    while (countRequests(0x85) == targetsBefore) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    device.emergencyStop();
+    device.flush();
+    CHECK_EQUAL(errorsBefore + 1, device.getErrorCount());
+    {
+        std::lock_guard<std::mutex> lock(maestro.mutex);
+        CHECK(maestro.positions == (std::array<uint16_t, 6>{}));
+        maestro.slow.clear();
+    }
+
+    // The calls queued after the stop are made.
+    device.setTarget(0, 4000);
+    CHECK_EQUAL(4000, device.getServoStatus().at(0).position);
+    return CHECK_RESULT();
+}
@@ -0,0 +1,44 @@
+#include <maestro/Program.h>
+#include <maestro/Verifier.h>
+
+#include "Check.h"
+
+using namespace Maestro;
+
+static const Verifier::SubroutineReport* findSubroutine(const Verifier& verifier, const std::string& name) {
+    for (const Verifier::SubroutineReport& subroutine : verifier.getSubroutines()) {
+        if (subroutine.name == name) {
+            return &subroutine;
+        }
+    }
+    return nullptr;
+}
+
+int main() {
+    const Verifier valid(Program("begin 1 2 add3 drop repeat\nsub add3 plus 3 plus return", true), true);
+    CHECK(valid.isValid());
+    const Verifier::SubroutineReport* add3 = findSubroutine(valid, "ADD3");
+    CHECK(add3 != nullptr);
+    if (add3 != nullptr) {
+        CHECK_EQUAL(2, add3->arguments);
+        CHECK_EQUAL(-1, add3->stackEffect);
+        CHECK(add3->returns);
+        CHECK_EQUAL(0, add3->maxCallDepth);
+    }
+
+    // A loop pushing a value at each iteration overflows the stack.
+    CHECK(!Verifier(Program("begin 1 repeat", true), true).isValid());
+    // Underflow.
+    CHECK(!Verifier(Program("drop quit", true), true).isValid());
+    // Recursion has no bounded call depth.
+    const Verifier recursive(Program("sub forever forever return\nforever", true), true);
+    const Verifier::SubroutineReport* forever = findSubroutine(recursive, "FOREVER");
+    CHECK(forever != nullptr && forever->maxCallDepth == -1);
+
+    // A raw image with a jump out of the bytecode.
+    const Program program("begin repeat", true);
+    std::vector<uint8_t> bytecode = program.getByteList();
+    bytecode[1] = 0xFF;
+    CHECK(!Verifier(bytecode, program.getSubroutineTable(), true).isValid());
+    return CHECK_RESULT();
+}
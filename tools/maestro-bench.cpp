@@ -0,0 +1,121 @@
+// Measures the latency of the USB calls of a Maestro with each USB backend.
+//
+//   maestro-bench [--iterations N] [--location LOCATION]
+//
+// Every call is timed alone, and the mean, median and 99th percentile are
+// printed for libusb and, on Linux, for the usbfs backend side by side.  The
+// targets sent are the current ones, so the servos do not move.
+#include <maestro/Device.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <vector>
+
+using namespace Maestro;
+
+struct Statistics {
+    double mean;
+    double median;
+    double p99;
+};
+
+/// Runs \a call \a iterations times, after a few untimed calls, and returns its latencies in microseconds.
+Statistics measure(int iterations, const std::function<void()>& call) {
+    for (int i = 0; i < 10; i++) {
+        call();
+    }
+    std::vector<double> latencies(iterations);
+    for (double& latency : latencies) {
+        const auto start = std::chrono::steady_clock::now();
+        call();
+        latency = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    }
+    std::sort(latencies.begin(), latencies.end());
+    double sum = 0;
+    for (double latency : latencies) {
+        sum += latency;
+    }
+    return {sum / iterations, latencies[iterations / 2], latencies[std::min<size_t>(iterations - 1, iterations * 99 / 100)]};
+}
+
+int usage(const char* program) {
+    fprintf(stderr, "Usage: %s [--iterations N] [--location LOCATION]\n", program);
+    return 2;
+}
+
+int main(int argc, char* argv[]) {
+    int iterations = 1000;
+    std::string location;
+    for (int i = 1; i < argc; i++) {
+        const std::string argument = argv[i];
+        if (argument == "--iterations" && i + 1 < argc) {
+            iterations = atoi(argv[++i]);
+        } else if (argument == "--location" && i + 1 < argc) {
+            location = argv[++i];
+        } else {
+            return usage(argv[0]);
+        }
+    }
+    if (iterations <= 0) {
+        return usage(argv[0]);
+    }
+
+    try {
+        std::vector<Device> devices = Device::getConnectedDevices();
+        auto device = std::find_if(devices.begin(), devices.end(), [&](const Device& d) { return location.empty() || d.getLocation() == location; });
+        if (device == devices.end()) {
+            throw std::string("No Maestro found.");
+        }
+        printf("%s at %s, %d calls per test\n", device->getName().c_str(), device->getLocation().c_str(), iterations);
+
+        std::vector<uint16_t> targets;
+        for (const Device::ServoStatus& status : device->getServoStatus()) {
+            targets.push_back(status.target);
+        }
+        std::vector<Device::ServoStatus> status(device->getNumChannels());
+
+        struct Test {
+            const char* name;
+            std::function<void()> call;
+        };
+        const std::vector<Test> tests = {
+            {"setTarget", [&] { device->setTarget(0, targets[0]); }},
+            {"setTargets (all channels)", [&] { device->setTargets(0, targets.data(), targets.size()); }},
+            {"getServoStatus", [&] { device->getServoStatus(status.data()); }},
+        };
+        struct Backend {
+            const char* name;
+            Device::UsbBackend backend;
+        };
+        std::vector<Backend> backends = {{"libusb", Device::UsbBackend::LIBUSB}};
+#ifdef __linux__
+        backends.push_back({"usbfs", Device::UsbBackend::USBFS});
+#endif
+
+        printf("%-26s", "latency (us)");
+        for (const Backend& backend : backends) {
+            printf("  %8s mean %8s p50 %8s p99", backend.name, backend.name, backend.name);
+        }
+        printf("\n");
+        for (const Test& test : tests) {
+            printf("%-26s", test.name);
+            for (const Backend& backend : backends) {
+                device->setUsbBackend(backend.backend);
+                const Statistics statistics = measure(iterations, test.call);
+                printf("  %13.1f %12.1f %12.1f", statistics.mean, statistics.median, statistics.p99);
+            }
+            printf("\n");
+        }
+        device->setUsbBackend(Device::UsbBackend::LIBUSB);
+        return 0;
+    } catch (const std::string& e) {
+        fprintf(stderr, "%s\n", e.c_str());
+    } catch (const char* e) {
+        fprintf(stderr, "%s\n", e);
+    }
+    return 1;
+}
@@ -0,0 +1,175 @@
+// Upgrades the firmware of every connected Maestro at once.
+//
+//   maestro-flash [--list] [--force] [--timeout SECONDS] [--bootloader LOCATION=FILE]... FIRMWARE.pgm...
+//
+// Each connected Maestro gets the firmware file of its product, e.g.
+// usc03c_v1.03.pgm for a Mini Maestro 24, unless it already runs that
+// version.  A device already in bootloader mode has no product ID, so its
+// firmware is given with --bootloader.
+#include <maestro/Device.h>
+#include <maestro/Firmware.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace Maestro;
+
+const char* getStageName(FirmwareUpdater::Stage stage) {
+    switch (stage) {
+        case FirmwareUpdater::Stage::STARTING_BOOTLOADER:
+            return "starting the bootloader";
+        case FirmwareUpdater::Stage::CONNECTING:
+            return "connecting to the bootloader";
+        case FirmwareUpdater::Stage::ERASING:
+            return "erasing";
+        case FirmwareUpdater::Stage::WRITING:
+            return "writing";
+        case FirmwareUpdater::Stage::RESTARTING:
+            return "restarting";
+        case FirmwareUpdater::Stage::DONE:
+            return "done, firmware";
+        case FirmwareUpdater::Stage::FAILED:
+            return "failed:";
+    }
+    return "";
+}
+
+int usage(const char* program) {
+    fprintf(stderr, "Usage: %s [--list] [--force] [--timeout SECONDS] [--bootloader LOCATION=FILE]... FIRMWARE.pgm...\n", program);
+    return 2;
+}
+
+int main(int argc, char* argv[]) {
+    bool list = false;
+    bool force = false;
+    int timeout = 10;
+    std::vector<std::string> firmwarePaths;
+    std::map<std::string, std::string> bootloaders;
+    for (int i = 1; i < argc; i++) {
+        const std::string argument = argv[i];
+        if (argument == "--list") {
+            list = true;
+        } else if (argument == "--force") {
+            force = true;
+        } else if (argument == "--timeout" && i + 1 < argc) {
+            timeout = atoi(argv[++i]);
+        } else if (argument == "--bootloader" && i + 1 < argc) {
+            const std::string value = argv[++i];
+            const size_t separator = value.find('=');
+            if (separator == std::string::npos) {
+                return usage(argv[0]);
+            }
+            bootloaders[value.substr(0, separator)] = value.substr(separator + 1);
+        } else if (argument.compare(0, 2, "--") == 0) {
+            return usage(argv[0]);
+        } else {
+            firmwarePaths.push_back(argument);
+        }
+    }
+
+    try {
+        std::vector<Device> devices = Device::getConnectedDevices();
+        FirmwareUpdater updater;
+        updater.setTimeout(std::chrono::seconds(timeout));
+
+        if (list) {
+            for (Device& device : devices) {
+                const Device::DeviceSettings settings = device.getDeviceSettings();
+                printf("%-10s %s, firmware %d.%02d\n", device.getLocation().c_str(), device.getName().c_str(), settings.firmwareVersionMajor,
+                       settings.firmwareVersionMinor);
+            }
+            for (const std::string& location : updater.getConnectedBootloaders()) {
+                printf("%-10s bootloader\n", location.c_str());
+            }
+            return 0;
+        }
+        if (firmwarePaths.empty() && bootloaders.empty()) {
+            return usage(argv[0]);
+        }
+
+        // Every file is read and checked once, whatever the number of devices.
+        std::map<std::string, std::unique_ptr<FirmwareImage>> images;
+        std::map<std::string, const FirmwareImage*> imagesByProduct;
+        auto load = [&](const std::string& path) -> const FirmwareImage& {
+            std::unique_ptr<FirmwareImage>& image = images[path];
+            if (!image) {
+                image.reset(new FirmwareImage(path));
+            }
+            return *image;
+        };
+        for (const std::string& path : firmwarePaths) {
+            const FirmwareImage& image = load(path);
+            if (image.getProduct().empty()) {
+                throw path + " is not named like a Maestro firmware (usc0xx_vX.YY.pgm).";
+            }
+            const FirmwareImage*& latest = imagesByProduct[image.getProduct()];
+            if (latest == nullptr || image.getVersion() > latest->getVersion()) {
+                latest = &image;
+            }
+        }
+
+        size_t count = 0;
+        for (Device& device : devices) {
+            const auto image = imagesByProduct.find(FirmwareImage::getProduct(device.getProductID()));
+            if (image == imagesByProduct.end()) {
+                printf("%-10s %s: no firmware given, skipped\n", device.getLocation().c_str(), device.getName().c_str());
+                continue;
+            }
+            const Device::DeviceSettings settings = device.getDeviceSettings();
+            const int version = (settings.firmwareVersionMajor / 10) << 12 | (settings.firmwareVersionMajor % 10) << 8 |
+                                (settings.firmwareVersionMinor / 10) << 4 | (settings.firmwareVersionMinor % 10);
+            if (!force && version == image->second->getVersion()) {
+                printf("%-10s %s: firmware %d.%02d is up to date\n", device.getLocation().c_str(), device.getName().c_str(), settings.firmwareVersionMajor,
+                       settings.firmwareVersionMinor);
+                continue;
+            }
+            printf("%-10s %s: %s\n", device.getLocation().c_str(), device.getName().c_str(), image->second->getPath().c_str());
+            updater.add(device, *image->second);
+            count++;
+        }
+        for (const auto& bootloader : bootloaders) {
+            const FirmwareImage& image = load(bootloader.second);
+            printf("%-10s bootloader: %s\n", bootloader.first.c_str(), image.getPath().c_str());
+            updater.addBootloader(bootloader.first, image);
+            count++;
+        }
+        if (count == 0) {
+            return 0;
+        }
+
+        // Writing is reported every quarter, the other stages once.
+        std::map<std::string, size_t> quarters;
+        const std::vector<FirmwareUpdater::Progress> results = updater.run([&](const FirmwareUpdater::Progress& progress) {
+            if (progress.stage == FirmwareUpdater::Stage::WRITING) {
+                const size_t quarter = 4 * progress.bytesWritten / progress.totalBytes;
+                if (progress.bytesWritten > 0 && quarter == quarters[progress.location]) {
+                    return;
+                }
+                quarters[progress.location] = quarter;
+                printf("%-10s writing %3d%%\n", progress.location.c_str(), int(100 * progress.bytesWritten / progress.totalBytes));
+            } else {
+                printf("%-10s %s %s\n", progress.location.c_str(), getStageName(progress.stage), progress.message.c_str());
+            }
+            fflush(stdout);
+        });
+
+        size_t failures = 0;
+        for (const FirmwareUpdater::Progress& result : results) {
+            if (result.stage == FirmwareUpdater::Stage::FAILED) {
+                failures++;
+            }
+        }
+        printf("%zu of %zu devices upgraded.\n", results.size() - failures, results.size());
+        return (failures == 0) ? 0 : 1;
+    } catch (const std::string& e) {
+        fprintf(stderr, "%s\n", e.c_str());
+    } catch (const char* e) {
+        fprintf(stderr, "%s\n", e);
+    }
+    return 1;
+}
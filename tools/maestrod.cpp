@@ -0,0 +1,72 @@
+// Shares the connected Maestros with the other processes of the machine.
+//
+//   maestrod [--socket PATH] [--shared-memory NAME] [--interval MILLISECONDS]
+//
+// The other processes of the same user use the devices through
+// Maestro::RemoteDevice (maestro/Broker.h).  The socket is by default in
+// $XDG_RUNTIME_DIR/maestrod.  The daemon stops on SIGINT and SIGTERM.
+#include <maestro/Broker.h>
+#include <maestro/Device.h>
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+using namespace Maestro;
+
+Broker* broker = nullptr;
+
+void onSignal(int) { broker->stop(); }
+
+int usage(const char* program) {
+    fprintf(stderr, "Usage: %s [--socket PATH] [--shared-memory NAME] [--interval MILLISECONDS]\n", program);
+    return 2;
+}
+
+int main(int argc, char* argv[]) {
+    std::string socketPath = Broker::getDefaultSocketPath();
+    std::string sharedMemoryName = Broker::getDefaultSharedMemoryName();
+    int interval = 10;
+    for (int i = 1; i < argc; i++) {
+        const std::string argument = argv[i];
+        if (argument == "--socket" && i + 1 < argc) {
+            socketPath = argv[++i];
+        } else if (argument == "--shared-memory" && i + 1 < argc) {
+            sharedMemoryName = argv[++i];
+        } else if (argument == "--interval" && i + 1 < argc) {
+            interval = atoi(argv[++i]);
+        } else {
+            return usage(argv[0]);
+        }
+    }
+    if (interval <= 0) {
+        return usage(argv[0]);
+    }
+
+    try {
+        const std::vector<Device> devices = Device::getConnectedDevices();
+        Broker server(devices, sharedMemoryName, socketPath);
+        server.setPollInterval(std::chrono::milliseconds(interval));
+        for (const Device& device : devices) {
+            printf("%-10s %s\n", device.getLocation().c_str(), device.getName().c_str());
+        }
+        printf("Serving %zu devices on %s\n", devices.size(), socketPath.c_str());
+        fflush(stdout);
+
+        broker = &server;
+        signal(SIGINT, onSignal);
+        signal(SIGTERM, onSignal);
+        server.run();
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        broker = nullptr;
+        return 0;
+    } catch (const std::string& e) {
+        fprintf(stderr, "%s\n", e.c_str());
+    } catch (const char* e) {
+        fprintf(stderr, "%s\n", e);
+    }
+    return 1;
+}